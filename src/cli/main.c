@@ -35,17 +35,411 @@
 #include "common/imageio.h"
 #include "common/imageio_module.h"
 #include "common/exif.h"
+#include "common/file_location.h"
 #include "common/history.h"
+#include "common/styles.h"
 
 #include <sys/time.h>
+#include <sys/socket.h>
+#include <sys/un.h>
 #include <unistd.h>
 #include <inttypes.h>
 #include <libintl.h>
+#include <errno.h>
+#include <signal.h>
+
+/** one export request, either from the command line or a line of a batch stream. */
+typedef struct dt_cli_job_t
+{
+  gchar *image_filename;
+  gchar *xmp_filename;
+  gchar *output_filename;
+  gchar *format;          // extension of the output format, taken from the output filename if NULL
+  gchar *style;
+  int width, height;
+  gboolean high_quality;
+}
+dt_cli_job_t;
+
+// set by SIGINT/SIGTERM in batch mode, to stop taking new jobs and shut down cleanly
+static volatile sig_atomic_t batch_quit = 0;
 
 static void
 usage(const char* progname)
 {
-  fprintf(stderr, "usage: %s <input file> [<xmp file>] <output file> [--width <max width>,--height <max height>,--bpp <bpp>,--hq <0|1|true|false>,--verbose] [--core <darktable options>]\n", progname);
+  fprintf(stderr, "usage: %s <input file> [<xmp file>] <output file> [--width <max width>,--height <max height>,--bpp <bpp>,--hq <0|1|true|false>,--style <style name>,--verbose] [--core <darktable options>]\n", progname);
+  fprintf(stderr, "       %s --batch [--socket <path>] [--width <max width>,--height <max height>,--hq <0|1|true|false>,--style <style name>,--verbose] [--core <darktable options>]\n", progname);
+  fprintf(stderr, "in batch mode, jobs are read line by line from stdin (or clients of the unix socket) as tab separated key=value pairs:\n");
+  fprintf(stderr, "  input=<file> output=<file> [xmp=<file>] [format=<ext>] [width=<max width>] [height=<max height>] [hq=<0|1>] [style=<style name>]\n");
+  fprintf(stderr, "every job is answered with a line `ok <output file>' or `error <message>'.\n");
+}
+
+static int
+parse_bool(const char *value, gboolean *result)
+{
+  gchar *str = g_ascii_strup(value, -1);
+  int res = 0;
+  if(!g_strcmp0(str, "0") || !g_strcmp0(str, "FALSE"))
+    *result = FALSE;
+  else if(!g_strcmp0(str, "1") || !g_strcmp0(str, "TRUE"))
+    *result = TRUE;
+  else
+    res = 1;
+  g_free(str);
+  return res;
+}
+
+static void
+job_clear(dt_cli_job_t *job)
+{
+  g_free(job->image_filename);
+  g_free(job->xmp_filename);
+  g_free(job->output_filename);
+  g_free(job->format);
+  g_free(job->style);
+  memset(job, 0, sizeof(dt_cli_job_t));
+}
+
+/** parses one line of the batch protocol into job, starting from the defaults. returns an error message or NULL. */
+static const char *
+job_parse(char *line, const dt_cli_job_t *defaults, dt_cli_job_t *job)
+{
+  memset(job, 0, sizeof(dt_cli_job_t));
+  job->width = defaults->width;
+  job->height = defaults->height;
+  job->high_quality = defaults->high_quality;
+  job->style = g_strdup(defaults->style);
+
+  gchar **fields = g_strsplit(g_strstrip(line), "\t", -1);
+  const char *error = NULL;
+  for(gchar **f = fields; *f && !error; f++)
+  {
+    if(!**f) continue;
+    char *value = strchr(*f, '=');
+    if(!value)
+    {
+      error = "field without `='";
+      break;
+    }
+    *value++ = '\0';
+    if(!strcmp(*f, "input"))
+    {
+      g_free(job->image_filename);
+      job->image_filename = g_strdup(value);
+    }
+    else if(!strcmp(*f, "xmp"))
+    {
+      g_free(job->xmp_filename);
+      job->xmp_filename = g_strdup(value);
+    }
+    else if(!strcmp(*f, "output"))
+    {
+      g_free(job->output_filename);
+      job->output_filename = g_strdup(value);
+    }
+    else if(!strcmp(*f, "format"))
+    {
+      g_free(job->format);
+      job->format = g_strdup(value);
+    }
+    else if(!strcmp(*f, "style"))
+    {
+      g_free(job->style);
+      job->style = g_strdup(value);
+    }
+    else if(!strcmp(*f, "width"))
+      job->width = MAX(atoi(value), 0);
+    else if(!strcmp(*f, "height"))
+      job->height = MAX(atoi(value), 0);
+    else if(!strcmp(*f, "hq"))
+    {
+      if(parse_bool(value, &job->high_quality)) error = "unknown value for hq";
+    }
+    else
+      error = "unknown key";
+  }
+  g_strfreev(fields);
+  if(!error && (!job->image_filename || !job->output_filename))
+    error = "input and output are mandatory";
+  return error;
+}
+
+/** the library is in memory unless --library is given, so styles not found there are
+    loaded from the style files of the user. */
+static void
+style_load(const char *name)
+{
+  if(!name || !name[0] || dt_styles_exists(name)) return;
+  char filename[PATH_MAX];
+  dt_loc_get_user_config_dir(filename, sizeof(filename));
+  g_strlcat(filename, "/styles/", sizeof(filename));
+  g_strlcat(filename, name, sizeof(filename));
+  g_strlcat(filename, ".dtstyle", sizeof(filename));
+  if(g_file_test(filename, G_FILE_TEST_IS_REGULAR))
+    dt_styles_import_from_file(filename);
+}
+
+/** imports the image of the job (or finds it from an earlier job) and sets up its history.
+    seen holds the images of earlier jobs in batch mode, NULL otherwise. returns the image id or 0. */
+static int
+job_import(const dt_cli_job_t *job, GHashTable *seen, const gboolean verbose)
+{
+  dt_film_t film;
+  gchar *directory = g_path_get_dirname(job->image_filename);
+  const int filmid = dt_film_new(&film, directory);
+  g_free(directory);
+  const int id = dt_image_import(filmid, job->image_filename, TRUE);
+  if(!id) return 0;
+
+  const dt_image_t *cimg = dt_image_cache_read_get(darktable.image_cache, id);
+  dt_image_t *image = dt_image_cache_write_get(darktable.image_cache, cimg);
+
+  if(seen && g_hash_table_lookup(seen, GINT_TO_POINTER(id)))
+  {
+    // an earlier job of this batch already stacked its xmp on top of the history of this image.
+    // start over from the sidecar of the image (or an empty history), but keep the cached pixels.
+    sqlite3_stmt *stmt;
+    DT_DEBUG_SQLITE3_PREPARE_V2(dt_database_get(darktable.db), "delete from history where imgid = ?1", -1, &stmt, NULL);
+    DT_DEBUG_SQLITE3_BIND_INT(stmt, 1, id);
+    sqlite3_step(stmt);
+    sqlite3_finalize(stmt);
+    DT_DEBUG_SQLITE3_PREPARE_V2(dt_database_get(darktable.db), "delete from mask where imgid = ?1", -1, &stmt, NULL);
+    DT_DEBUG_SQLITE3_BIND_INT(stmt, 1, id);
+    sqlite3_step(stmt);
+    sqlite3_finalize(stmt);
+
+    char sidecar[PATH_MAX];
+    g_strlcpy(sidecar, job->image_filename, sizeof(sidecar));
+    dt_image_path_append_version(id, sidecar, sizeof(sidecar));
+    g_strlcat(sidecar, ".xmp", sizeof(sidecar));
+    if(g_file_test(sidecar, G_FILE_TEST_EXISTS))
+      dt_exif_xmp_read(image, sidecar, 1);
+  }
+  if(seen) g_hash_table_insert(seen, GINT_TO_POINTER(id), GINT_TO_POINTER(id));
+
+  // attach xmp, if requested:
+  if(job->xmp_filename)
+    dt_exif_xmp_read(image, job->xmp_filename, 1);
+  // don't write new xmp:
+  dt_image_cache_write_release(darktable.image_cache, image, DT_IMAGE_CACHE_RELAXED);
+  dt_image_cache_read_release(darktable.image_cache, image);
+
+  // print the history stack
+  if(verbose)
+  {
+    gchar *history = dt_history_get_items_as_string(id);
+    if(history)
+      printf("%s\n", history);
+    else
+      printf("[%s]\n", _("empty history stack"));
+    g_free(history);
+  }
+  return id;
+}
+
+/** exports one image through the disk storage. returns an error message or NULL. */
+static const char *
+job_export(const dt_cli_job_t *job, GHashTable *seen, const gboolean verbose)
+{
+  // the output file already exists, so there will be a sequence number added
+  if(g_file_test(job->output_filename, G_FILE_TEST_EXISTS))
+  {
+    fprintf(stderr, "%s\n", _("output file already exists, it will get renamed"));
+  }
+
+  style_load(job->style);
+  if(job->style && job->style[0] && !dt_styles_exists(job->style))
+    return _("unknown style");
+
+  const int id = job_import(job, seen, verbose);
+  if(!id) return _("can't open file");
+
+  // try to find out the export format from the output_filename
+  gchar *output_filename = g_strdup(job->output_filename);
+  char *ext = output_filename + strlen(output_filename);
+  while(ext > output_filename && *ext != '.') ext--;
+  if(*ext == '.')
+  {
+    *ext = '\0';
+    ext++;
+  }
+  if(job->format) ext = job->format;
+
+  if(!strcmp(ext, "jpg"))
+    ext = "jpeg";
+
+  if(!strcmp(ext, "tif"))
+    ext = "tiff";
+
+  // init the export data structures
+  dt_imageio_module_format_t *format;
+  dt_imageio_module_storage_t *storage;
+  dt_imageio_module_data_t *sdata, *fdata;
+  const char *error = NULL;
+
+  storage = dt_imageio_get_storage_by_name("disk"); // only exporting to disk makes sense
+  if(storage == NULL)
+  {
+    error = _("cannot find disk storage module. please check your installation, something seems to be broken.");
+    goto end;
+  }
+
+  format = dt_imageio_get_format_by_name(ext);
+  if(format == NULL)
+  {
+    error = _("unknown extension");
+    goto end;
+  }
+
+  sdata = storage->get_params(storage);
+  if(sdata == NULL)
+  {
+    error = _("failed to get parameters from storage module, aborting export ...");
+    goto end;
+  }
+
+  // and now for the really ugly hacks. don't tell your children about this one or they won't sleep at night any longer ...
+  g_strlcpy((char*)sdata, output_filename, 1024);
+  // all is good now, the last line didn't happen.
+
+  fdata = format->get_params(format);
+  if(fdata == NULL)
+  {
+    storage->free_params(storage, sdata);
+    error = _("failed to get parameters from format module, aborting export ...");
+    goto end;
+  }
+
+  uint32_t w,h,fw,fh,sw,sh;
+  fw=fh=sw=sh=0;
+  storage->dimension(storage, &sw, &sh);
+  format->dimension(format, &fw, &fh);
+
+  if( sw==0 || fw==0) w=sw>fw?sw:fw;
+  else w=sw<fw?sw:fw;
+
+  if( sh==0 || fh==0) h=sh>fh?sh:fh;
+  else h=sh<fh?sh:fh;
+
+  fdata->max_width  = job->width;
+  fdata->max_height = job->height;
+  fdata->max_width = (w!=0 && fdata->max_width >w)?w:fdata->max_width;
+  fdata->max_height = (h!=0 && fdata->max_height >h)?h:fdata->max_height;
+  g_strlcpy(fdata->style, job->style ? job->style : "", sizeof(fdata->style));
+
+  if(storage->initialize_store) {
+    GList *single_image= g_list_append(NULL,GINT_TO_POINTER(id));
+    storage->initialize_store(storage, sdata,format,fdata,&single_image, job->high_quality);
+    g_list_free(single_image);
+  }
+  //TODO: add a callback to set the bpp without going through the config
+
+  if(storage->store(storage, sdata, id, format, fdata, 1, 1, job->high_quality))
+    error = _("export failed");
+
+  // cleanup time
+  if(storage->finalize_store) storage->finalize_store(storage, sdata);
+  storage->free_params(storage, sdata);
+  format->free_params(format, fdata);
+
+end:
+  g_free(output_filename);
+  return error;
+}
+
+static void
+batch_quit_handler(int sig)
+{
+  batch_quit = 1;
+}
+
+/** a client hanging up must not kill us, and SIGINT/SIGTERM interrupt the blocking reads
+    (no SA_RESTART) so the main loop can return and clean up. */
+static void
+batch_signals_init()
+{
+  signal(SIGPIPE, SIG_IGN);
+  struct sigaction action;
+  memset(&action, 0, sizeof(action));
+  action.sa_handler = batch_quit_handler;
+  sigemptyset(&action.sa_mask);
+  sigaction(SIGINT, &action, NULL);
+  sigaction(SIGTERM, &action, NULL);
+}
+
+/** runs all jobs coming in on in, and answers each on out, until in is closed, out can't
+    be written to any longer or we are asked to quit. */
+static void
+batch_stream(FILE *in, FILE *out, const dt_cli_job_t *defaults, GHashTable *seen, const gboolean verbose)
+{
+  char *line = NULL;
+  size_t line_size = 0;
+  while(!batch_quit && getline(&line, &line_size, in) != -1)
+  {
+    if(line[0] == '#' || line[0] == '\n') continue;
+    dt_cli_job_t job;
+    const char *error = job_parse(line, defaults, &job);
+    if(!error) error = job_export(&job, seen, verbose);
+    int written;
+    if(error)
+      written = fprintf(out, "error %s\n", error);
+    else
+      written = fprintf(out, "ok %s\n", job.output_filename);
+    job_clear(&job);
+    if(written < 0 || fflush(out)) break; // the client went away
+  }
+  free(line);
+}
+
+/** serves clients of a unix socket, one at a time. every client may send any number of jobs. */
+static int
+batch_socket(const char *path, const dt_cli_job_t *defaults, GHashTable *seen, const gboolean verbose)
+{
+  struct sockaddr_un addr;
+  memset(&addr, 0, sizeof(addr));
+  addr.sun_family = AF_UNIX;
+  if(strlen(path) >= sizeof(addr.sun_path))
+  {
+    fprintf(stderr, "%s: %s\n", _("socket path too long"), path);
+    return 1;
+  }
+  g_strlcpy(addr.sun_path, path, sizeof(addr.sun_path));
+
+  const int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+  if(fd < 0)
+  {
+    fprintf(stderr, "%s: %s\n", _("can't create socket"), g_strerror(errno));
+    return 1;
+  }
+  unlink(path);
+  if(bind(fd, (struct sockaddr *)&addr, sizeof(addr)) || listen(fd, 8))
+  {
+    fprintf(stderr, "%s %s: %s\n", _("can't listen on"), path, g_strerror(errno));
+    close(fd);
+    return 1;
+  }
+
+  int res = 0;
+  while(!batch_quit)
+  {
+    const int client = accept(fd, NULL, NULL);
+    if(client < 0)
+    {
+      if(errno == EINTR) continue;
+      fprintf(stderr, "%s %s: %s\n", _("can't accept connections on"), path, g_strerror(errno));
+      res = 1;
+      break;
+    }
+    FILE *in = fdopen(client, "r");
+    FILE *out = fdopen(dup(client), "w");
+    if(in && out) batch_stream(in, out, defaults, seen, verbose);
+    if(in) fclose(in);
+    else close(client);
+    if(out) fclose(out);
+  }
+  close(fd);
+  unlink(path);
+  return res;
 }
 
 int main(int argc, char *arg[])
@@ -57,12 +451,13 @@ int main(int argc, char *arg[])
   gtk_init (&argc, &arg);
 
   // parse command line arguments
-  char *image_filename = NULL;
-  char *xmp_filename = NULL;
-  char *output_filename = NULL;
+  dt_cli_job_t job;
+  memset(&job, 0, sizeof(job));
+  job.high_quality = TRUE;
+  char *socket_path = NULL;
   int file_counter = 0;
-  int width = 0, height = 0, bpp = 0;
-  gboolean verbose = FALSE, high_quality = TRUE;
+  int bpp = 0;
+  gboolean verbose = FALSE, batch = FALSE;
 
   int k;
   for(k=1; k<argc; k++)
@@ -82,12 +477,12 @@ int main(int argc, char *arg[])
       else if(!strcmp(arg[k], "--width"))
       {
         k++;
-        width = MAX(atoi(arg[k]), 0);
+        job.width = MAX(atoi(arg[k]), 0);
       }
       else if(!strcmp(arg[k], "--height"))
       {
         k++;
-        height = MAX(atoi(arg[k]), 0);
+        job.height = MAX(atoi(arg[k]), 0);
       }
       else if(!strcmp(arg[k], "--bpp"))
       {
@@ -98,18 +493,26 @@ int main(int argc, char *arg[])
       else if(!strcmp(arg[k], "--hq"))
       {
         k++;
-        gchar *str = g_ascii_strup(arg[k], -1);
-        if(!g_strcmp0(str, "0") || !g_strcmp0(str, "FALSE"))
-          high_quality = FALSE;
-        else if(!g_strcmp0(str, "1") || !g_strcmp0(str, "TRUE"))
-          high_quality = TRUE;
-        else
+        if(parse_bool(arg[k], &job.high_quality))
         {
           fprintf(stderr, "%s: %s\n", _("Unknown option for --hq"), arg[k]);
           usage(arg[0]);
           exit(1);
         }
-        g_free(str);
+      }
+      else if(!strcmp(arg[k], "--style"))
+      {
+        k++;
+        job.style = g_strdup(arg[k]);
+      }
+      else if(!strcmp(arg[k], "--batch"))
+      {
+        batch = TRUE;
+      }
+      else if(!strcmp(arg[k], "--socket"))
+      {
+        k++;
+        socket_path = arg[k];
       }
       else if(!strcmp(arg[k], "-v") || !strcmp(arg[k], "--verbose"))
       {
@@ -126,11 +529,11 @@ int main(int argc, char *arg[])
     else
     {
       if(file_counter == 0)
-        image_filename = arg[k];
+        job.image_filename = g_strdup(arg[k]);
       else if(file_counter == 1)
-        xmp_filename = arg[k];
+        job.xmp_filename = g_strdup(arg[k]);
       else if(file_counter == 2)
-        output_filename = arg[k];
+        job.output_filename = g_strdup(arg[k]);
       file_counter++;
     }
   }
@@ -143,7 +546,15 @@ int main(int argc, char *arg[])
   for(; k < argc; k++) m_arg[m_argc++] = arg[k];
   m_arg[m_argc] = NULL;
 
-  if(file_counter < 2 || file_counter > 3)
+  if(batch || socket_path)
+  {
+    if(file_counter)
+    {
+      usage(arg[0]);
+      exit(1);
+    }
+  }
+  else if(file_counter < 2 || file_counter > 3)
   {
     usage(arg[0]);
     exit(1);
@@ -151,137 +562,39 @@ int main(int argc, char *arg[])
   else if(file_counter == 2)
   {
     // no xmp file given
-    output_filename = xmp_filename;
-    xmp_filename = NULL;
+    job.output_filename = job.xmp_filename;
+    job.xmp_filename = NULL;
   }
 
-  // the output file already exists, so there will be a sequence number added
-  if(g_file_test(output_filename, G_FILE_TEST_EXISTS))
-  {
-    fprintf(stderr, "%s\n", _("output file already exists, it will get renamed"));
-  }
-
-  // init dt without gui:
+  // init dt without gui. in batch mode this happens only once, so database, modules,
+  // opencl and the mipmap cache stay warm for all the jobs:
   if(dt_init(m_argc, m_arg, 0,NULL)) exit(1);
 
-  dt_film_t film;
-  int id = 0;
-  int filmid = 0;
-
-  gchar *directory = g_path_get_dirname(image_filename);
-  filmid = dt_film_new(&film, directory);
-  id = dt_image_import(filmid, image_filename, TRUE);
-  if(!id)
+  int res = 0;
+  if(batch || socket_path)
   {
-    fprintf(stderr, _("error: can't open file %s"), image_filename);
-    fprintf(stderr, "\n");
-    exit(1);
-  }
-  g_free(directory);
-
-  // attach xmp, if requested:
-  if(xmp_filename)
-  {
-    const dt_image_t *cimg = dt_image_cache_read_get(darktable.image_cache, id);
-    dt_image_t *image = dt_image_cache_write_get(darktable.image_cache, cimg);
-    dt_exif_xmp_read(image, xmp_filename, 1);
-    // don't write new xmp:
-    dt_image_cache_write_release(darktable.image_cache, image, DT_IMAGE_CACHE_RELAXED);
-    dt_image_cache_read_release(darktable.image_cache, image);
-  }
-
-  // print the history stack
-  if(verbose)
-  {
-    gchar *history = dt_history_get_items_as_string(id);
-    if(history)
-      printf("%s\n", history);
+    GHashTable *seen = g_hash_table_new(NULL, NULL);
+    batch_signals_init();
+    if(socket_path)
+      res = batch_socket(socket_path, &job, seen, verbose);
     else
-      printf("[%s]\n", _("empty history stack"));
+      batch_stream(stdin, stdout, &job, seen, verbose);
+    g_hash_table_destroy(seen);
   }
-
-  // try to find out the export format from the output_filename
-  char *ext = output_filename + strlen(output_filename);
-  while(ext > output_filename && *ext != '.') ext--;
-  *ext = '\0';
-  ext++;
-
-  if(!strcmp(ext, "jpg"))
-    ext = "jpeg";
-
-  if(!strcmp(ext, "tif"))
-    ext = "tiff";
-
-  // init the export data structures
-  dt_imageio_module_format_t *format;
-  dt_imageio_module_storage_t *storage;
-  dt_imageio_module_data_t *sdata, *fdata;
-
-  storage = dt_imageio_get_storage_by_name("disk"); // only exporting to disk makes sense
-  if(storage == NULL)
-  {
-    fprintf(stderr, "%s\n", _("cannot find disk storage module. please check your installation, something seems to be broken."));
-    exit(1);
-  }
-
-  sdata = storage->get_params(storage);
-  if(sdata == NULL)
-  {
-    fprintf(stderr, "%s\n", _("failed to get parameters from storage module, aborting export ..."));
-    exit(1);
-  }
-
-  // and now for the really ugly hacks. don't tell your children about this one or they won't sleep at night any longer ...
-  g_strlcpy((char*)sdata, output_filename, 1024);
-  // all is good now, the last line didn't happen.
-
-  format = dt_imageio_get_format_by_name(ext);
-  if(format == NULL)
-  {
-    fprintf(stderr, _("unknown extension '.%s'"), ext);
-    fprintf(stderr, "\n");
-    exit(1);
-  }
-
-  fdata = format->get_params(format);
-  if(fdata == NULL)
+  else
   {
-    fprintf(stderr, "%s\n", _("failed to get parameters from format module, aborting export ..."));
-    exit(1);
-  }
-
-  uint32_t w,h,fw,fh,sw,sh;
-  fw=fh=sw=sh=0;
-  storage->dimension(storage, &sw, &sh);
-  format->dimension(format, &fw, &fh);
-
-  if( sw==0 || fw==0) w=sw>fw?sw:fw;
-  else w=sw<fw?sw:fw;
-
-  if( sh==0 || fh==0) h=sh>fh?sh:fh;
-  else h=sh<fh?sh:fh;
-
-  fdata->max_width  = width;
-  fdata->max_height = height;
-  fdata->max_width = (w!=0 && fdata->max_width >w)?w:fdata->max_width;
-  fdata->max_height = (h!=0 && fdata->max_height >h)?h:fdata->max_height;
-  fdata->style[0] = '\0';
-
-  if(storage->initialize_store) {
-    GList *single_image= g_list_append(NULL,GINT_TO_POINTER(id));
-    storage->initialize_store(storage, sdata,format,fdata,&single_image, high_quality);
-    g_list_free(single_image);
+    const char *error = job_export(&job, NULL, verbose);
+    if(error)
+    {
+      fprintf(stderr, _("error: %s: %s"), error, job.image_filename);
+      fprintf(stderr, "\n");
+      res = 1;
+    }
   }
-  //TODO: add a callback to set the bpp without going through the config
-
-  storage->store(storage, sdata, id, format, fdata, 1, 1, high_quality);
-
-  // cleanup time
-  if(storage->finalize_store) storage->finalize_store(storage, sdata);
-  storage->free_params(storage, sdata);
-  format->free_params(format, fdata);
+  job_clear(&job);
 
   dt_cleanup();
+  return res;
 }
 
 // modelines: These editor modelines have been set for all relevant files by tools/update_modelines.sh
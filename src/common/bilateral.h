@@ -19,12 +19,8 @@
 #ifndef DT_COMMON_BILATERAL_H
 #define DT_COMMON_BILATERAL_H
 
-// these clamp away insane memory requirements.
-// they should reasonably faithfully represent the
-// full precision though, so tiling will help reducing memory footprint
-// and export will look the same as darkroom mode (only 1mpix there).
-#define DT_COMMON_BILATERAL_MAX_RES_S 6000
-#define DT_COMMON_BILATERAL_MAX_RES_R 50
+#include "common/bilateral_size.h"
+#include <xmmintrin.h>
 
 #ifdef HAVE_OPENCL
 // function definition on opencl path takes precedence
@@ -37,14 +33,10 @@ dt_bilateral_memory_use(
   const float sigma_s,   // spatial sigma (blur pixel coords)
   const float sigma_r)   // range sigma (blur luma values)
 {
-  float _x = roundf(width/sigma_s);
-  float _y = roundf(height/sigma_s);
-  float _z = roundf(100.0f/sigma_r);
-  size_t size_x = CLAMPS((int)_x, 4, DT_COMMON_BILATERAL_MAX_RES_S) + 1;
-  size_t size_y = CLAMPS((int)_y, 4, DT_COMMON_BILATERAL_MAX_RES_S) + 1;
-  size_t size_z = CLAMPS((int)_z, 4, DT_COMMON_BILATERAL_MAX_RES_R) + 1;
-
-  return size_x*size_y*size_z*sizeof(float);
+  size_t size_x, size_y, size_z;
+  dt_bilateral_grid_size(width, height, sigma_s, sigma_r, &size_x, &size_y, &size_z);
+
+  return size_x*size_y*((size_z+3)&~(size_t)3)*sizeof(float);
 }
 
 
@@ -55,21 +47,22 @@ dt_bilateral_singlebuffer_size(
   const float sigma_s,   // spatial sigma (blur pixel coords)
   const float sigma_r)   // range sigma (blur luma values)
 {
-  float _x = roundf(width/sigma_s);
-  float _y = roundf(height/sigma_s);
-  float _z = roundf(100.0f/sigma_r);
-  size_t size_x = CLAMPS((int)_x, 4, DT_COMMON_BILATERAL_MAX_RES_S) + 1;
-  size_t size_y = CLAMPS((int)_y, 4, DT_COMMON_BILATERAL_MAX_RES_S) + 1;
-  size_t size_z = CLAMPS((int)_z, 4, DT_COMMON_BILATERAL_MAX_RES_R) + 1;
-
-  return size_x*size_y*size_z*sizeof(float);
+  size_t size_x, size_y, size_z;
+  dt_bilateral_grid_size(width, height, sigma_s, sigma_r, &size_x, &size_y, &size_z);
+
+  return size_x*size_y*((size_z+3)&~(size_t)3)*sizeof(float);
 }
 #endif
 
 
+// the grid is stored z fastest: cell (x, y, z) is at z + stride_z*(x + size_x*y),
+// with the z columns padded to a multiple of four floats. this way a pixel touches two
+// pairs of neighbouring floats in each of two grid rows, and the x and y blurs run on
+// four z slices at once.
 typedef struct dt_bilateral_t
 {
   size_t size_x, size_y, size_z;
+  size_t stride_z;
   int width, height;
   float sigma_s, sigma_r;
   float *buf;
@@ -100,22 +93,20 @@ dt_bilateral_init(
 {
   dt_bilateral_t *b = (dt_bilateral_t *)malloc(sizeof(dt_bilateral_t));
   if (!b) return NULL;
-  // if(width/sigma_s < 4 || width/sigma_s > 1000) fprintf(stderr, "[bilateral] need to clamp sigma_s!\n");
-  // if(height/sigma_s < 4 || height/sigma_s > 1000) fprintf(stderr, "[bilateral] need to clamp sigma_s!\n");
-  // if(100.0/sigma_r < 4 || 100.0/sigma_r > 100) fprintf(stderr, "[bilateral] need to clamp sigma_r!\n");
-  float _x = roundf(width/sigma_s);
-  float _y = roundf(height/sigma_s);
-  float _z = roundf(100.0f/sigma_r);
-  b->size_x = CLAMPS((int)_x, 4, DT_COMMON_BILATERAL_MAX_RES_S) + 1;
-  b->size_y = CLAMPS((int)_y, 4, DT_COMMON_BILATERAL_MAX_RES_S) + 1;
-  b->size_z = CLAMPS((int)_z, 4, DT_COMMON_BILATERAL_MAX_RES_R) + 1;
+  dt_bilateral_grid_size(width, height, sigma_s, sigma_r, &b->size_x, &b->size_y, &b->size_z);
+  b->stride_z = (b->size_z + 3) & ~(size_t)3;
   b->width = width;
   b->height = height;
   b->sigma_s = MAX(height/(b->size_y-1.0f), width/(b->size_x-1.0f));
   b->sigma_r = 100.0f/(b->size_z-1.0f);
-  b->buf = dt_alloc_align(16, b->size_x*b->size_y*b->size_z*sizeof(float));
+  b->buf = dt_alloc_align(16, b->size_x*b->size_y*b->stride_z*sizeof(float));
+  if(!b->buf)
+  {
+    free(b);
+    return NULL;
+  }
 
-  memset(b->buf, 0, b->size_x*b->size_y*b->size_z*sizeof(float));
+  memset(b->buf, 0, b->size_x*b->size_y*b->stride_z*sizeof(float));
 #if 0
   fprintf(stderr, "[bilateral] created grid [%d %d %d]"
           " with sigma (%f %f) (%f %f)\n", b->size_x, b->size_y, b->size_z,
@@ -124,21 +115,48 @@ dt_bilateral_init(
   return b;
 }
 
-void
-dt_bilateral_splat(
-  dt_bilateral_t *b,
-  const float    *const in)
+// trilinear weights of the corners (x, z), (x, z+1), (x+1, z), (x+1, z+1),
+// in the order they are loaded from and stored to the grid.
+static inline __m128
+grid_weights_xz(
+  const float xf,
+  const float zf)
 {
-  const int ox = 1;
-  const int oy = b->size_x;
-  const int oz = b->size_y*b->size_x;
-  // splat into downsampled grid
-#ifdef _OPENMP
-  #pragma omp parallel for default(none) shared(b)
-#endif
-  for(int j=0; j<b->height; j++)
+  return _mm_set_ps(xf*zf, xf*(1.0f-zf), (1.0f-xf)*zf, (1.0f-xf)*(1.0f-zf));
+}
+
+static inline __m128
+grid_load(
+  const float *const g,
+  const size_t ox)
+{
+  return _mm_loadh_pi(_mm_loadl_pi(_mm_setzero_ps(), (const __m64 *)g), (const __m64 *)(g + ox));
+}
+
+static inline void
+grid_store(
+  float *const g,
+  const size_t ox,
+  const __m128 v)
+{
+  _mm_storel_pi((__m64 *)g, v);
+  _mm_storeh_pi((__m64 *)(g + ox), v);
+}
+
+static void
+splat_rows(
+  const dt_bilateral_t *const b,
+  float          *const buf,
+  const float    *const in,
+  const int      j0,
+  const int      j1)
+{
+  const size_t ox = b->stride_z;
+  const size_t oy = b->stride_z*b->size_x;
+  const float norm = 100.0f/(b->sigma_s*b->sigma_s);
+  for(int j=j0; j<j1; j++)
   {
-    size_t index = 4*j*b->width;
+    size_t index = (size_t)4*j*b->width;
     for(int i=0; i<b->width; i++)
     {
       float x, y, z;
@@ -150,25 +168,82 @@ dt_bilateral_splat(
       const float xf = x - xi;
       const float yf = y - yi;
       const float zf = z - zi;
-      // nearest neighbour splatting:
-      const size_t grid_index = xi + b->size_x*(yi + b->size_y*zi);
       // sum up payload here, doesn't have to be same as edge stopping data
       // for cross bilateral applications.
       // also note that this is not clipped (as L->z is), so potentially hdr/out of gamut
       // should not cause clipping here.
-      for(int k=0; k<8; k++)
-      {
-        const size_t ii = grid_index + ((k&1)?ox:0) + ((k&2)?oy:0) + ((k&4)?oz:0);
-        const float contrib = ((k&1)?xf:(1.0f-xf)) * ((k&2)?yf:(1.0f-yf)) * ((k&4)?zf:(1.0f-zf))
-                              *100.0f/(b->sigma_s*b->sigma_s);
+      float *const g = buf + zi + ox*xi + oy*yi;
+      const __m128 w = grid_weights_xz(xf, zf);
+      grid_store(g, ox, _mm_add_ps(grid_load(g, ox), _mm_mul_ps(w, _mm_set1_ps((1.0f-yf)*norm))));
+      grid_store(g + oy, ox, _mm_add_ps(grid_load(g + oy, ox), _mm_mul_ps(w, _mm_set1_ps(yf*norm))));
+      index += 4;
+    }
+  }
+}
+
+void
+dt_bilateral_splat(
+  dt_bilateral_t *b,
+  const float    *const in)
+{
+  const int slabs = b->size_y - 1;
+  const int nthreads = dt_get_num_threads();
+  const size_t size = b->size_x*b->size_y*b->stride_z;
+
+  if(slabs < 4*nthreads &&
+     nthreads*size*sizeof(float) <= (size_t)MAX(dt_conf_get_int("bilateral_grid_memory"), 1) * 1024 * 1024)
+  {
+    // few grid rows for many threads, so the grid is small: splat into one copy per thread and sum up.
+    float *grids = dt_alloc_align(16, nthreads*size*sizeof(float));
+    if(grids)
+    {
+      memset(grids, 0, nthreads*size*sizeof(float));
 #ifdef _OPENMP
-        #pragma omp atomic
+      #pragma omp parallel for default(none) shared(b, grids) schedule(static)
 #endif
-        b->buf[ii] += contrib;
+      for(int t=0; t<nthreads; t++)
+        splat_rows(b, grids + t*size, in, (int64_t)b->height*t/nthreads, (int64_t)b->height*(t+1)/nthreads);
+#ifdef _OPENMP
+      #pragma omp parallel for default(none) shared(b, grids) schedule(static)
+#endif
+      for(size_t k=0; k<size; k+=4)
+      {
+        __m128 sum = _mm_load_ps(grids + k);
+        for(int t=1; t<nthreads; t++) sum = _mm_add_ps(sum, _mm_load_ps(grids + t*size + k));
+        _mm_store_ps(b->buf + k, sum);
       }
-      index += 4;
+      dt_free_align(grids);
+      return;
     }
   }
+
+  // the image rows mapping to grid row yi only touch grid rows yi and yi+1. so all
+  // slabs of rows with even yi can be splatted concurrently without atomics, then all odd ones.
+  int *start = (int *)calloc(2*slabs, sizeof(int));
+  if(!start)
+  {
+    // serial splat of all rows then
+    splat_rows(b, b->buf, in, 0, b->height);
+    return;
+  }
+  int *end = start + slabs;
+  for(int j=0; j<b->height; j++)
+  {
+    float x, y, z;
+    image_to_grid(b, 0, j, 0.0f, &x, &y, &z);
+    const int yi = MIN((int)y, b->size_y-2);
+    if(start[yi] == end[yi]) start[yi] = j;
+    end[yi] = j+1;
+  }
+  for(int parity=0; parity<2; parity++)
+  {
+#ifdef _OPENMP
+    #pragma omp parallel for default(none) shared(b, start, end, parity) schedule(dynamic)
+#endif
+    for(int s=parity; s<slabs; s+=2)
+      splat_rows(b, b->buf, in, start[s], end[s]);
+  }
+  free(start);
 }
 
 static void
@@ -217,6 +292,8 @@ blur_line_z(
   }
 }
 
+// same as the scalar blur along offset3, on four consecutive floats at a time.
+// all offsets need to be multiples of four.
 static void
 blur_line(
   float    *buf,
@@ -227,9 +304,9 @@ blur_line(
   const int size2,
   const int size3)
 {
-  const float w0 = 6.f/16.f;
-  const float w1 = 4.f/16.f;
-  const float w2 = 1.f/16.f;
+  const __m128 w0 = _mm_set1_ps(6.f/16.f);
+  const __m128 w1 = _mm_set1_ps(4.f/16.f);
+  const __m128 w2 = _mm_set1_ps(1.f/16.f);
 #ifdef _OPENMP
   #pragma omp parallel for default(none) shared(buf)
 #endif
@@ -238,28 +315,35 @@ blur_line(
     size_t index = (size_t)k*offset1;
     for(int j=0; j<size2; j++)
     {
-      float tmp1 = buf[index];
-      buf[index] = buf[index]*w0 + w1*buf[index + offset3] + w2*buf[index + 2*offset3];
-      index += offset3;
-      float tmp2 = buf[index];
-      buf[index] = buf[index]*w0 + w1*(buf[index + offset3] + tmp1) + w2*buf[index + 2*offset3];
-      index += offset3;
+      float *p = buf + index;
+      __m128 tmp1 = _mm_load_ps(p);
+      _mm_store_ps(p, _mm_add_ps(_mm_add_ps(_mm_mul_ps(tmp1, w0),
+                                            _mm_mul_ps(w1, _mm_load_ps(p + offset3))),
+                                 _mm_mul_ps(w2, _mm_load_ps(p + 2*offset3))));
+      p += offset3;
+      __m128 tmp2 = _mm_load_ps(p);
+      _mm_store_ps(p, _mm_add_ps(_mm_add_ps(_mm_mul_ps(tmp2, w0),
+                                            _mm_mul_ps(w1, _mm_add_ps(_mm_load_ps(p + offset3), tmp1))),
+                                 _mm_mul_ps(w2, _mm_load_ps(p + 2*offset3))));
+      p += offset3;
       for(int i=2; i<size3-2; i++)
       {
-        const float tmp3 = buf[index];
-        buf[index] = buf[index]*w0
-                     + w1*(buf[index + offset3]   + tmp2)
-                     + w2*(buf[index + 2*offset3] + tmp1);
-        index += offset3;
+        const __m128 tmp3 = _mm_load_ps(p);
+        _mm_store_ps(p, _mm_add_ps(_mm_add_ps(_mm_mul_ps(tmp3, w0),
+                                              _mm_mul_ps(w1, _mm_add_ps(_mm_load_ps(p + offset3), tmp2))),
+                                   _mm_mul_ps(w2, _mm_add_ps(_mm_load_ps(p + 2*offset3), tmp1))));
+        p += offset3;
         tmp1 = tmp2;
         tmp2 = tmp3;
       }
-      const float tmp3 = buf[index];
-      buf[index] = buf[index]*w0 + w1*(buf[index + offset3] + tmp2) + w2*tmp1;
-      index += offset3;
-      buf[index] = buf[index]*w0 + w1*tmp3 + w2*tmp2;
-      index += offset3;
-      index += offset2 - offset3*size3;
+      const __m128 tmp3 = _mm_load_ps(p);
+      _mm_store_ps(p, _mm_add_ps(_mm_add_ps(_mm_mul_ps(tmp3, w0),
+                                            _mm_mul_ps(w1, _mm_add_ps(_mm_load_ps(p + offset3), tmp2))),
+                                 _mm_mul_ps(w2, tmp1)));
+      p += offset3;
+      _mm_store_ps(p, _mm_add_ps(_mm_add_ps(_mm_mul_ps(_mm_load_ps(p), w0), _mm_mul_ps(w1, tmp3)),
+                                 _mm_mul_ps(w2, tmp2)));
+      index += offset2;
     }
   }
 }
@@ -269,18 +353,47 @@ void
 dt_bilateral_blur(
   dt_bilateral_t *b)
 {
+  const int sz = b->stride_z;
   // gaussian up to 3 sigma
-  blur_line(b->buf, b->size_x*b->size_y, b->size_x, 1,
-            b->size_z, b->size_y, b->size_x);
+  blur_line(b->buf, sz*b->size_x, 4, sz,
+            b->size_y, sz/4, b->size_x);
   // gaussian up to 3 sigma
-  blur_line(b->buf, b->size_x*b->size_y, 1, b->size_x,
-            b->size_z, b->size_x, b->size_y);
+  blur_line(b->buf, sz, 4, sz*b->size_x,
+            b->size_x, sz/4, b->size_y);
   // -2 derivative of the gaussian up to 3 sigma: x*exp(-x*x)
-  blur_line_z(b->buf, 1, b->size_x, b->size_x*b->size_y,
-              b->size_x, b->size_y, b->size_z);
+  blur_line_z(b->buf, sz*b->size_x, sz, 1,
+              b->size_y, b->size_x, b->size_z);
 }
 
 
+// trilinear lookup:
+static inline float
+slice_pixel(
+  const dt_bilateral_t *const b,
+  const int i,
+  const int j,
+  const float L)
+{
+  float x, y, z;
+  image_to_grid(b, i, j, L, &x, &y, &z);
+  const int xi = MIN((int)x, b->size_x-2);
+  const int yi = MIN((int)y, b->size_y-2);
+  const int zi = MIN((int)z, b->size_z-2);
+  const float xf = x - xi;
+  const float yf = y - yi;
+  const float zf = z - zi;
+  const size_t ox = b->stride_z;
+  const size_t oy = b->stride_z*b->size_x;
+  const float *const g = b->buf + zi + ox*xi + oy*yi;
+  const __m128 yw = _mm_set1_ps(yf);
+  const __m128 v0 = grid_load(g, ox);
+  // v0 + yf*(v1 - v0), then weighted by x and z and summed up
+  __m128 v = _mm_mul_ps(grid_weights_xz(xf, zf), _mm_add_ps(v0, _mm_mul_ps(yw, _mm_sub_ps(grid_load(g + oy, ox), v0))));
+  v = _mm_add_ps(v, _mm_movehl_ps(v, v));
+  v = _mm_add_ss(v, _mm_shuffle_ps(v, v, 1));
+  return _mm_cvtss_f32(v);
+}
+
 void
 dt_bilateral_slice(
   const dt_bilateral_t *const b,
@@ -290,37 +403,16 @@ dt_bilateral_slice(
 {
   // detail: 0 is leave as is, -1 is bilateral filtered, +1 is contrast boost
   const float norm = -detail * b->sigma_r * 0.04f;
-  const int ox = 1;
-  const int oy = b->size_x;
-  const int oz = b->size_y*b->size_x;
 #ifdef _OPENMP
   #pragma omp parallel for default(none) shared(out)
 #endif
   for(int j=0; j<b->height; j++)
   {
-    size_t index = 4*j*b->width;
+    size_t index = (size_t)4*j*b->width;
     for(int i=0; i<b->width; i++)
     {
-      float x, y, z;
       const float L = in[index];
-      image_to_grid(b, i, j, L, &x, &y, &z);
-      // trilinear lookup:
-      const int xi = MIN((int)x, b->size_x-2);
-      const int yi = MIN((int)y, b->size_y-2);
-      const int zi = MIN((int)z, b->size_z-2);
-      const float xf = x - xi;
-      const float yf = y - yi;
-      const float zf = z - zi;
-      const size_t gi = xi + b->size_x*(yi + b->size_y*zi);
-      const float Lout = L + norm * (
-                           b->buf[gi]          * (1.0f - xf) * (1.0f - yf) * (1.0f - zf) +
-                           b->buf[gi+ox]       * (       xf) * (1.0f - yf) * (1.0f - zf) +
-                           b->buf[gi+oy]       * (1.0f - xf) * (       yf) * (1.0f - zf) +
-                           b->buf[gi+ox+oy]    * (       xf) * (       yf) * (1.0f - zf) +
-                           b->buf[gi+oz]       * (1.0f - xf) * (1.0f - yf) * (       zf) +
-                           b->buf[gi+ox+oz]    * (       xf) * (1.0f - yf) * (       zf) +
-                           b->buf[gi+oy+oz]    * (1.0f - xf) * (       yf) * (       zf) +
-                           b->buf[gi+ox+oy+oz] * (       xf) * (       yf) * (       zf));
+      const float Lout = L + norm * slice_pixel(b, i, j, L);
       out[index] = MAX(0.0f, Lout);
       // and copy color and mask
       out[index+1] = in[index+1];
@@ -340,37 +432,16 @@ dt_bilateral_slice_to_output(
 {
   // detail: 0 is leave as is, -1 is bilateral filtered, +1 is contrast boost
   const float norm = -detail * b->sigma_r * 0.04f;
-  const int ox = 1;
-  const int oy = b->size_x;
-  const int oz = b->size_y*b->size_x;
 #ifdef _OPENMP
   #pragma omp parallel for default(none) shared(out)
 #endif
   for(int j=0; j<b->height; j++)
   {
-    size_t index = 4*j*b->width;
+    size_t index = (size_t)4*j*b->width;
     for(int i=0; i<b->width; i++)
     {
-      float x, y, z;
       const float L = in[index];
-      image_to_grid(b, i, j, L, &x, &y, &z);
-      // trilinear lookup:
-      const int xi = MIN((int)x, b->size_x-2);
-      const int yi = MIN((int)y, b->size_y-2);
-      const int zi = MIN((int)z, b->size_z-2);
-      const float xf = x - xi;
-      const float yf = y - yi;
-      const float zf = z - zi;
-      const size_t gi = xi + b->size_x*(yi + b->size_y*zi);
-      const float Lout = norm * (
-                           b->buf[gi]          * (1.0f - xf) * (1.0f - yf) * (1.0f - zf) +
-                           b->buf[gi+ox]       * (       xf) * (1.0f - yf) * (1.0f - zf) +
-                           b->buf[gi+oy]       * (1.0f - xf) * (       yf) * (1.0f - zf) +
-                           b->buf[gi+ox+oy]    * (       xf) * (       yf) * (1.0f - zf) +
-                           b->buf[gi+oz]       * (1.0f - xf) * (1.0f - yf) * (       zf) +
-                           b->buf[gi+ox+oz]    * (       xf) * (1.0f - yf) * (       zf) +
-                           b->buf[gi+oy+oz]    * (1.0f - xf) * (       yf) * (       zf) +
-                           b->buf[gi+ox+oy+oz] * (       xf) * (       yf) * (       zf));
+      const float Lout = norm * slice_pixel(b, i, j, L);
       out[index] = MAX(0.0f, out[index] + Lout);
       index += 4;
     }
@@ -386,7 +457,4 @@ dt_bilateral_free(
   free(b);
 }
 
-#undef DT_COMMON_BILATERAL_MAX_RES_S
-#undef DT_COMMON_BILATERAL_MAX_RES_R
-
 #endif
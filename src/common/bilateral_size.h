@@ -0,0 +1,63 @@
+/*
+    This file is part of darktable,
+    copyright (c) 2026 agent.
+
+    darktable is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    darktable is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with darktable.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+#ifndef DT_COMMON_BILATERAL_SIZE_H
+#define DT_COMMON_BILATERAL_SIZE_H
+
+#include "control/conf.h"
+#include <math.h>
+
+// range resolution of the grid. the grid should represent
+// the full precision reasonably faithfully, more slices don't help.
+#define DT_COMMON_BILATERAL_MAX_RES_R 50
+
+/**
+ * resolution of the bilateral grid, shared by the cpu and opencl code paths.
+ * the spatial resolution follows sigma_s, unless a grid of size_z slices of
+ * max_cells cells would not fit the memory budget (bilateral_grid_memory, in MB).
+ * then it is coarsened just enough to fit, instead of being clamped to a fixed
+ * size. tiling will further help reducing the memory footprint, and export will
+ * look the same as darkroom mode (only 1mpix there).
+ */
+static inline void
+dt_bilateral_grid_size(
+  const int width,       // width of input image
+  const int height,      // height of input image
+  const float sigma_s,   // spatial sigma (blur pixel coords)
+  const float sigma_r,   // range sigma (blur luma values)
+  size_t *size_x,
+  size_t *size_y,
+  size_t *size_z)
+{
+  const float _x = MAX(roundf(width/sigma_s), 4.0f);
+  const float _y = MAX(roundf(height/sigma_s), 4.0f);
+  const float _z = roundf(100.0f/sigma_r);
+  *size_z = CLAMPS((int)_z, 4, DT_COMMON_BILATERAL_MAX_RES_R) + 1;
+
+  // cells per slice we can afford. the cpu grid pads the slices to multiples of four.
+  const size_t budget = (size_t)MAX(dt_conf_get_int("bilateral_grid_memory"), 1) * 1024 * 1024;
+  const float max_cells = budget / (float)(sizeof(float) * ((*size_z + 3) & ~(size_t)3));
+  const float scale = (_x + 1.0f) * (_y + 1.0f) > max_cells ? sqrtf(max_cells / ((_x + 1.0f) * (_y + 1.0f))) : 1.0f;
+  *size_x = MAX((int)(_x * scale), 4) + 1;
+  *size_y = MAX((int)(_y * scale), 4) + 1;
+}
+
+#endif
+// modelines: These editor modelines have been set for all relevant files by tools/update_modelines.sh
+// vim: shiftwidth=2 expandtab tabstop=2 cindent
+// kate: tab-indents: off; indent-width 2; replace-tabs on; indent-mode cstyle; remove-trailing-space on;
@@ -21,6 +21,7 @@
 
 #ifdef HAVE_OPENCL
 #include "common/opencl.h"
+#include "common/bilateral_size.h"
 
 typedef struct dt_bilateral_cl_global_t
 {
@@ -77,12 +78,8 @@ dt_bilateral_memory_use(
   const float sigma_s,   // spatial sigma (blur pixel coords)
   const float sigma_r)   // range sigma (blur luma values)
 {
-  float _x = roundf(width/sigma_s);
-  float _y = roundf(height/sigma_s);
-  float _z = roundf(100.0f/sigma_r);
-  size_t size_x = CLAMPS((int)_x, 4, 900) + 1;
-  size_t size_y = CLAMPS((int)_y, 4, 900) + 1;
-  size_t size_z = CLAMPS((int)_z, 4, 50) + 1;
+  size_t size_x, size_y, size_z;
+  dt_bilateral_grid_size(width, height, sigma_s, sigma_r, &size_x, &size_y, &size_z);
 
   return size_x*size_y*size_z*sizeof(float)*2;
 }
@@ -95,12 +92,8 @@ dt_bilateral_singlebuffer_size(
   const float sigma_s,   // spatial sigma (blur pixel coords)
   const float sigma_r)   // range sigma (blur luma values)
 {
-  float _x = roundf(width/sigma_s);
-  float _y = roundf(height/sigma_s);
-  float _z = roundf(100.0f/sigma_r);
-  size_t size_x = CLAMPS((int)_x, 4, 900) + 1;
-  size_t size_y = CLAMPS((int)_y, 4, 900) + 1;
-  size_t size_z = CLAMPS((int)_z, 4, 50) + 1;
+  size_t size_x, size_y, size_z;
+  dt_bilateral_grid_size(width, height, sigma_s, sigma_r, &size_x, &size_y, &size_z);
 
   return size_x*size_y*size_z*sizeof(float);
 }
@@ -153,12 +146,7 @@ dt_bilateral_init_cl(
   if(!b) return NULL;
 
   b->global = darktable.opencl->bilateral;
-  float _x = roundf(width/sigma_s);
-  float _y = roundf(height/sigma_s);
-  float _z = roundf(100.0f/sigma_r);
-  b->size_x = CLAMPS((int)_x, 4, 900) + 1;
-  b->size_y = CLAMPS((int)_y, 4, 900) + 1;
-  b->size_z = CLAMPS((int)_z, 4, 50) + 1;
+  dt_bilateral_grid_size(width, height, sigma_s, sigma_r, &b->size_x, &b->size_y, &b->size_z);
   b->width = width;
   b->height = height;
   b->blocksizex = blocksizex;
@@ -33,6 +33,12 @@
 // and a hopscotch hashmap, source following the paper and
 // the additional material (GPLv2+ c++ concurrency package source)
 // `Hopscotch Hashing' by Maurice Herlihy, Nir Shavit and Moran Tzafrir
+//
+// cache hits don't take any lock shared between entries: the bucket chain
+// is walked optimistically and validated against the segment timestamp (like
+// dt_cache_contains()), and the read lock is a compare and swap on the bucket's
+// lock word. instead of moving hits to the front of the lru list, they only set
+// a reference bit which the garbage collector consumes (clock/second chance).
 
 #define DT_CACHE_NULL_DELTA SHRT_MIN
 #define DT_CACHE_EMPTY_HASH -1
@@ -40,18 +46,25 @@
 #define DT_CACHE_EMPTY_DATA  NULL
 
 
+// the lock word of a bucket holds the number of readers in the lower and
+// the number of writers (0 or 1) in the upper 16 bits. a bucket which is
+// being removed has all writer bits set, so no reader can sneak in.
+#define DT_CACHE_READERS(L)  ((int32_t)((L) & 0xffff))
+#define DT_CACHE_WRITERS(L)  ((int32_t)((L) >> 16))
+#define DT_CACHE_ONE_WRITER  0x10000u
+#define DT_CACHE_REMOVING    0xffff0000u
+
 typedef struct dt_cache_bucket_t
 {
   int16_t  first_delta;
   int16_t  next_delta;
-  int16_t  read;   // number of readers
-  int16_t  write;  // number of writers (0 or 1)
+  uint32_t lock;   // readers and writers, see above
   int32_t  lru;    // for garbage collection: lru list
   int32_t  mru;
   int32_t  cost;   // cost associated with this entry (such as byte size)
   uint32_t hash;   // hash of the element
   uint32_t key;    // key of the element
-  // due to alignment, we waste 32 bits here
+  uint32_t referenced; // set on every hit, cleared by the garbage collector
   void*    data;   // actual data
 }
 dt_cache_bucket_t;
@@ -162,57 +175,116 @@ remove_key(dt_cache_t *cache,
     else
       prev_key_bucket->next_delta = (prev_key_bucket->next_delta + key_bucket->next_delta);
   }
+  key_bucket->referenced = 0;
+  __sync_synchronize();
   segment->timestamp ++;
   key_bucket->next_delta = DT_CACHE_NULL_DELTA;
 }
 
-// unexposed helpers to increase the read lock count.
-// the segment needs to be locked by the caller.
+// unexposed helpers to change the lock count. these are atomic, because
+// hits take the read lock without holding the segment lock.
 static int
 dt_cache_bucket_read_testlock(dt_cache_bucket_t *bucket)
 {
-  if(bucket->write) return 1;
-  assert(bucket->read < 0x7ffe);
-  assert(bucket->write == 0);
-  bucket->read ++;
-  return 0;
+  while(1)
+  {
+    const uint32_t lock = bucket->lock;
+    if(DT_CACHE_WRITERS(lock)) return 1;
+    assert(DT_CACHE_READERS(lock) < 0x7ffe);
+    if(__sync_bool_compare_and_swap(&bucket->lock, lock, lock + 1)) return 0;
+  }
 }
 static void
 dt_cache_bucket_read_lock(dt_cache_bucket_t *bucket)
 {
-  assert(bucket->read < 0x7ffe);
-  assert(bucket->write == 0);
-  bucket->read ++;
+  const uint32_t lock = __sync_fetch_and_add(&bucket->lock, 1);
+  assert(DT_CACHE_READERS(lock) < 0x7ffe);
+  assert(DT_CACHE_WRITERS(lock) == 0);
+  (void)lock;
 }
 static void
 dt_cache_bucket_read_release(dt_cache_bucket_t *bucket)
 {
-  assert(bucket->read > 0);
-  assert(bucket->write == 0);
-  bucket->read --;
+  const uint32_t lock = __sync_fetch_and_sub(&bucket->lock, 1);
+  assert(DT_CACHE_READERS(lock) > 0);
+  // a writer may only be there if it's waiting for us to leave (see write_lock below):
+  assert(DT_CACHE_WRITERS(lock) == 0 || DT_CACHE_READERS(lock) > 1);
+  (void)lock;
 }
 static int
 dt_cache_bucket_write_testlock(dt_cache_bucket_t *bucket)
 {
-  if(bucket->read > 1) return 1;
-  assert(bucket->read == 1);
-  assert(bucket->write < 0x7ffe);
-  bucket->write ++;
-  return 0;
+  // only succeeds if we are the only reader:
+  return !__sync_bool_compare_and_swap(&bucket->lock, 1, 1 + DT_CACHE_ONE_WRITER);
 }
 static void
 dt_cache_bucket_write_lock(dt_cache_bucket_t *bucket)
 {
-  assert(bucket->read == 1);
-  assert(bucket->write < 0x7ffe);
-  bucket->write ++;
+  // only the one reader holding the bucket may upgrade, two of them would wait for each other forever:
+  const uint32_t lock = __sync_fetch_and_add(&bucket->lock, DT_CACHE_ONE_WRITER);
+  assert(DT_CACHE_WRITERS(lock) == 0);
+  assert(DT_CACHE_READERS(lock) > 0);
+  (void)lock;
+  // a reader which found this bucket through a stale chain may hold it for a moment. it is about
+  // to release it again, and no new one gets in now that the writer is announced:
+  while(DT_CACHE_READERS(__sync_fetch_and_add(&bucket->lock, 0)) > 1) sched_yield();
 }
 static void
 dt_cache_bucket_write_release(dt_cache_bucket_t *bucket)
 {
-  assert(bucket->read == 1);
-  assert(bucket->write > 0);
-  bucket->write --;
+  const int err = !__sync_bool_compare_and_swap(&bucket->lock, 1 + DT_CACHE_ONE_WRITER, 1);
+  assert(!err);
+  (void)err;
+}
+// claims an unused bucket for removal, fails if anyone holds a lock on it.
+static int
+dt_cache_bucket_remove_testlock(dt_cache_bucket_t *bucket)
+{
+  return !__sync_bool_compare_and_swap(&bucket->lock, 0, DT_CACHE_REMOVING);
+}
+static void
+dt_cache_bucket_remove_release(dt_cache_bucket_t *bucket)
+{
+  __sync_bool_compare_and_swap(&bucket->lock, DT_CACHE_REMOVING, 0);
+}
+
+// the hit path: find the key without the segment lock and read lock its bucket.
+// the walk is validated with the segment timestamp, which is bumped whenever a
+// key is removed or relocated. returns NULL whenever that doesn't work out
+// (not there, write locked, concurrent modification), the caller then takes
+// the segment lock and looks again.
+static dt_cache_bucket_t*
+dt_cache_read_lock_optimistic(dt_cache_t *cache, const uint32_t key)
+{
+  const uint32_t hash = key;
+  const dt_cache_segment_t *segment = cache->segments + ((hash >> cache->segment_shift) & cache->segment_mask);
+  const uint32_t start_timestamp = segment->timestamp;
+  __sync_synchronize();
+
+  const dt_cache_bucket_t *const end_bucket = cache->table + cache->bucket_mask;
+  dt_cache_bucket_t *curr_bucket = cache->table + (hash & cache->bucket_mask);
+  int16_t next_delta = curr_bucket->first_delta;
+  // chains are short, a long walk means we're racing a writer:
+  for(uint32_t steps=0; next_delta != DT_CACHE_NULL_DELTA && steps < 64; steps++)
+  {
+    curr_bucket += next_delta;
+    if(curr_bucket < cache->table || curr_bucket > end_bucket) return NULL;
+    if(hash == curr_bucket->hash && key == curr_bucket->key)
+    {
+      if(dt_cache_bucket_read_testlock(curr_bucket)) return NULL;
+      __sync_synchronize();
+      // still the same entry? removal changes the key before it bumps the timestamp.
+      if(curr_bucket->key != key || segment->timestamp != start_timestamp)
+      {
+        dt_cache_bucket_read_release(curr_bucket);
+        return NULL;
+      }
+      if(!curr_bucket->referenced) curr_bucket->referenced = 1;
+      return curr_bucket;
+    }
+    next_delta = curr_bucket->next_delta;
+  }
+  return NULL;
 }
 
 static void
@@ -235,6 +307,9 @@ add_key_to_beginning_of_list(
   free_bucket->key  = key;
   free_bucket->hash = hash;
   free_bucket->cost = cost;
+  free_bucket->referenced = 0;
+  // readers walk the chain without the segment lock:
+  __sync_synchronize();
 
   if(keys_bucket->first_delta == 0)
   {
@@ -274,7 +349,10 @@ add_key_to_end_of_list(
   free_bucket->key  = key;
   free_bucket->hash = hash;
   free_bucket->cost = cost;
+  free_bucket->referenced = 0;
   free_bucket->next_delta = DT_CACHE_NULL_DELTA;
+  // readers walk the chain without the segment lock:
+  __sync_synchronize();
 
   if(last_bucket == NULL)
     keys_bucket->first_delta = (int16_t)(free_bucket - keys_bucket);
@@ -386,8 +464,8 @@ dt_cache_init(dt_cache_t *cache, const int32_t capacity, const int32_t num_threa
     cache->table[k].hash        = DT_CACHE_EMPTY_HASH;
     cache->table[k].key         = DT_CACHE_EMPTY_KEY;
     cache->table[k].data        = DT_CACHE_EMPTY_DATA;
-    cache->table[k].read        = 0;
-    cache->table[k].write       = 0;
+    cache->table[k].lock        = 0;
+    cache->table[k].referenced  = 0;
     cache->table[k].lru         = -2;
     cache->table[k].mru         = -2;
   }
@@ -620,6 +698,9 @@ dt_cache_read_testget(
   dt_cache_t     *cache,
   const uint32_t  key)
 {
+  dt_cache_bucket_t *hit = dt_cache_read_lock_optimistic(cache, key);
+  if(hit) return hit->data;
+
   // just to support different keys:
   const uint32_t hash = key;
   dt_cache_segment_t *segment = cache->segments + ((hash >> cache->segment_shift) & cache->segment_mask);
@@ -639,8 +720,7 @@ dt_cache_read_testget(
       int err = dt_cache_bucket_read_testlock(compare_bucket);
       dt_cache_unlock(&segment->lock);
       if(err) return NULL;
-      // move this to the  most recently used slot, too:
-      lru_insert_locked(cache, compare_bucket);
+      compare_bucket->referenced = 1;
       return rc;
     }
     next_delta = compare_bucket->next_delta;
@@ -660,6 +740,10 @@ dt_cache_read_get(
 {
   assert(key != DT_CACHE_EMPTY_KEY);
 
+  // common case first, already there and not write locked:
+  dt_cache_bucket_t *hit = dt_cache_read_lock_optimistic(cache, key);
+  if(hit) return hit->data;
+
   // this is the blocking variant, we might need to allocate stuff.
   // also we have to retry if failed.
 
@@ -689,8 +773,8 @@ retry_cache_full:
         dt_cache_unlock(&segment->lock);
         // actually all good, just we couldn't get a lock on the bucket.
         if(err) goto wait;
-        // move this to the  most recently used slot, too:
-        lru_insert_locked(cache, compare_bucket);
+        // give it a second chance in the garbage collector:
+        compare_bucket->referenced = 1;
         // found and locked:
         return rc;
       }
@@ -841,7 +925,7 @@ dt_cache_remove(dt_cache_t *cache, const uint32_t key)
 
     if(hash == curr_bucket->hash && key == curr_bucket->key)
     {
-      if(curr_bucket->read || curr_bucket->write)
+      if(dt_cache_bucket_remove_testlock(curr_bucket))
       {
         // fprintf(stderr, "[cache remove] key still in use %u!\n", key);
         dt_cache_unlock(&segment->lock);
@@ -850,6 +934,7 @@ dt_cache_remove(dt_cache_t *cache, const uint32_t key)
       remove_key(cache, segment, start_bucket, curr_bucket, last_bucket, hash);
       if(cache->optimize_cacheline)
         optimize_cacheline_use(cache, segment, curr_bucket);
+      dt_cache_bucket_remove_release(curr_bucket);
       // put back into unused part of the cache: remove from lru list.
       dt_cache_unlock(&segment->lock);
       lru_remove_locked(cache, curr_bucket);
@@ -871,7 +956,8 @@ dt_cache_remove_no_lru_lock(dt_cache_t *cache, const uint32_t key)
 {
   const uint32_t hash = key;
   dt_cache_segment_t *segment = cache->segments + ((hash >> cache->segment_shift) & cache->segment_mask);
-  dt_cache_lock(&segment->lock);
+  // we hold the lru lock, and inserting takes it while holding the segment lock. don't wait here:
+  if(dt_cache_testlock(&segment->lock)) return 1;
 
   dt_cache_bucket_t *const start_bucket = cache->table + (hash & cache->bucket_mask);
   dt_cache_bucket_t *last_bucket = NULL;
@@ -889,7 +975,7 @@ dt_cache_remove_no_lru_lock(dt_cache_t *cache, const uint32_t key)
 
     if(hash == curr_bucket->hash && key == curr_bucket->key)
     {
-      if(curr_bucket->read || curr_bucket->write)
+      if(dt_cache_bucket_remove_testlock(curr_bucket))
       {
         // fprintf(stderr, "[cache remove] key still in use %u!\n", key);
         dt_cache_unlock(&segment->lock);
@@ -898,6 +984,7 @@ dt_cache_remove_no_lru_lock(dt_cache_t *cache, const uint32_t key)
       remove_key(cache, segment, start_bucket, curr_bucket, last_bucket, hash);
       if(cache->optimize_cacheline)
         optimize_cacheline_use(cache, segment, curr_bucket);
+      dt_cache_bucket_remove_release(curr_bucket);
       // put back into unused part of the cache: remove from lru list.
       dt_cache_unlock(&segment->lock);
       lru_remove(cache, curr_bucket);
@@ -917,7 +1004,8 @@ dt_cache_remove_bucket_no_lru_lock(dt_cache_t *cache, const uint32_t num)
   // dt_cache_remove works on key, not bucket number, so translate that:
   const uint32_t hash = num;
   dt_cache_segment_t *segment = cache->segments + ((hash >> cache->segment_shift) & cache->segment_mask);
-  dt_cache_lock(&segment->lock);
+  // we hold the lru lock, and inserting takes it while holding the segment lock. don't wait here:
+  if(dt_cache_testlock(&segment->lock)) return 1;
 
   dt_cache_bucket_t *const curr_bucket = cache->table + (hash & cache->bucket_mask);
   const uint32_t key = curr_bucket->key;
@@ -958,6 +1046,7 @@ dt_cache_gc(dt_cache_t *cache, const float fill_ratio)
   dt_cache_unlock(&cache->lru_lock);
 #endif
   int i = 0;
+  uint32_t second_chances = 0;
   // while still too full:
   while(cache->cost > fill_ratio * cache->cost_quota)
   {
@@ -981,6 +1070,24 @@ dt_cache_gc(dt_cache_t *cache, const float fill_ratio)
     }
     // fprintf(stderr, "[cache gc] from %u to %u\n", cache->cost, (uint32_t)(0.8*cache->cost_quota));
 
+    // read since we last came by? clear the bit and move it to the most recently used end.
+    // bounded, so a cache full of hot entries still evicts some on the second lap.
+    if(cache->table[curr].referenced && second_chances++ <= cache->bucket_mask)
+    {
+#ifndef DT_CACHE_BFL
+      dt_cache_lock(&cache->lru_lock);
+#endif
+      const int32_t next = cache->table[curr].mru;
+      cache->table[curr].referenced = 0;
+      lru_insert(cache, cache->table + curr);
+      // if it was the only one left, look at it again:
+      if(next >= 0) curr = next;
+#ifndef DT_CACHE_BFL
+      dt_cache_unlock(&cache->lru_lock);
+#endif
+      continue;
+    }
+
     // remove it. takes care of lru, cost, user cleanup, and hashtable
     // this could run into keys being concurrently removed, and will not remove these,
     // nor alter the lru list in that case (could be interleaved with the other thread
@@ -1031,6 +1138,30 @@ dt_cache_read_release(dt_cache_t *cache, const uint32_t key)
   const uint32_t hash = key;
   dt_cache_segment_t *segment = cache->segments + ((hash >> cache->segment_shift) & cache->segment_mask);
 
+  // we hold a read lock, so the bucket can't go away. only the chain leading
+  // to it may change under our feet, in which case the timestamp tells us.
+  const dt_cache_bucket_t *const end_bucket = cache->table + cache->bucket_mask;
+  for(int tries=0; tries<4; tries++)
+  {
+    const uint32_t start_timestamp = segment->timestamp;
+    __sync_synchronize();
+    dt_cache_bucket_t *compare_bucket = cache->table + (hash & cache->bucket_mask);
+    int16_t next_delta = compare_bucket->first_delta;
+    for(uint32_t steps=0; next_delta != DT_CACHE_NULL_DELTA && steps < 64; steps++)
+    {
+      compare_bucket += next_delta;
+      if(compare_bucket < cache->table || compare_bucket > end_bucket) break;
+      if(hash == compare_bucket->hash && (key == compare_bucket->key))
+      {
+        dt_cache_bucket_read_release(compare_bucket);
+        return;
+      }
+      next_delta = compare_bucket->next_delta;
+    }
+    if(start_timestamp == segment->timestamp) break;
+  }
+
+  // didn't find it without locking, try again the slow way:
   dt_cache_lock(&segment->lock);
 
   dt_cache_bucket_t *const start_bucket = cache->table + (hash & cache->bucket_mask);
@@ -1112,11 +1243,11 @@ dt_cache_realloc(dt_cache_t *cache, const uint32_t key, const int32_t cost, void
     compare_bucket += next_delta;
     if(hash == compare_bucket->hash && (key == compare_bucket->key))
     {
-      if(compare_bucket->write != 1 || compare_bucket->read != 1)
+      if(compare_bucket->lock != 1 + DT_CACHE_ONE_WRITER)
         fprintf(stderr, "[cache realloc] key %u not locked!\n", key);
       // need to have the bucket write locked:
-      assert(compare_bucket->write == 1);
-      assert(compare_bucket->read == 1);
+      assert(DT_CACHE_WRITERS(compare_bucket->lock) == 1);
+      assert(DT_CACHE_READERS(compare_bucket->lock) == 1);
       compare_bucket->data = data;
       const int32_t cost_diff = cost - compare_bucket->cost;
       compare_bucket->cost = cost;
@@ -1167,10 +1298,10 @@ void dt_cache_print(dt_cache_t *cache)
   {
     if(cache->table[k].key != DT_CACHE_EMPTY_KEY)
       fprintf(stderr, "[cache] bucket %d holds key %u with locks r %d w %d\n",
-              k, (cache->table[k].key & 0x1fffffff)+1, cache->table[k].read, cache->table[k].write);
+              k, (cache->table[k].key & 0x1fffffff)+1, DT_CACHE_READERS(cache->table[k].lock), DT_CACHE_WRITERS(cache->table[k].lock));
     else
       fprintf(stderr, "[cache] bucket %d is empty with locks r %d w %d\n",
-              k, cache->table[k].read, cache->table[k].write);
+              k, DT_CACHE_READERS(cache->table[k].lock), DT_CACHE_WRITERS(cache->table[k].lock));
   }
   fprintf(stderr, "[cache] lru entries:\n");
   dt_cache_lock(&cache->lru_lock);
@@ -1179,11 +1310,11 @@ void dt_cache_print(dt_cache_t *cache)
   {
     if(cache->table[curr].key != DT_CACHE_EMPTY_KEY)
       fprintf(stderr, "[cache] bucket %d holds key %u with locks r %d w %d\n",
-              curr, (cache->table[curr].key & 0x1fffffff)+1, cache->table[curr].read, cache->table[curr].write);
+              curr, (cache->table[curr].key & 0x1fffffff)+1, DT_CACHE_READERS(cache->table[curr].lock), DT_CACHE_WRITERS(cache->table[curr].lock));
     else
     {
       fprintf(stderr, "[cache] bucket %d is empty with locks r %d w %d\n",
-              curr, cache->table[curr].read, cache->table[curr].write);
+              curr, DT_CACHE_READERS(cache->table[curr].lock), DT_CACHE_WRITERS(cache->table[curr].lock));
       // this list should only ever contain valid buffers.
       assert(0);
     }
@@ -1203,10 +1334,10 @@ void dt_cache_print_locked(dt_cache_t *cache)
   int32_t i = 0;
   while(curr >= 0)
   {
-    if(cache->table[curr].key != DT_CACHE_EMPTY_KEY && (cache->table[curr].read || cache->table[curr].write))
+    if(cache->table[curr].key != DT_CACHE_EMPTY_KEY && cache->table[curr].lock)
     {
       fprintf(stderr, "[cache] bucket[%d|%d] holds key %u with locks r %d w %d\n",
-              i, curr, (cache->table[curr].key & 0x1fffffff)+1, cache->table[curr].read, cache->table[curr].write);
+              i, curr, (cache->table[curr].key & 0x1fffffff)+1, DT_CACHE_READERS(cache->table[curr].lock), DT_CACHE_WRITERS(cache->table[curr].lock));
     }
     if(curr == cache->mru) break;
     int32_t next = cache->table[curr].mru;
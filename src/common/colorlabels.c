@@ -97,6 +97,42 @@ void dt_colorlabels_toggle_label_selection (const int color)
   dt_collection_hint_message(darktable.collection);
 }
 
+void dt_colorlabels_toggle_label_images (const GList *imgs, const int color)
+{
+  if(!imgs) return;
+  sqlite3_stmt *stmt;
+  const gboolean transaction = dt_database_try_start_transaction(darktable.db);
+
+  // like for the selection: if any of the images doesn't have that color label, label them all
+  int all = 1;
+  DT_DEBUG_SQLITE3_PREPARE_V2(dt_database_get(darktable.db), "select 1 from color_labels where imgid=?1 and color=?2", -1, &stmt, NULL);
+  DT_DEBUG_SQLITE3_BIND_INT(stmt, 2, color);
+  for(const GList *iter = imgs; iter && all; iter = g_list_next(iter))
+  {
+    DT_DEBUG_SQLITE3_BIND_INT(stmt, 1, GPOINTER_TO_INT(iter->data));
+    if(sqlite3_step(stmt) != SQLITE_ROW) all = 0;
+    sqlite3_reset(stmt);
+  }
+  sqlite3_finalize(stmt);
+
+  if(all)
+    DT_DEBUG_SQLITE3_PREPARE_V2(dt_database_get(darktable.db), "delete from color_labels where imgid=?1 and color=?2", -1, &stmt, NULL);
+  else
+    DT_DEBUG_SQLITE3_PREPARE_V2(dt_database_get(darktable.db), "insert or ignore into color_labels (imgid, color) values (?1, ?2)", -1, &stmt, NULL);
+  DT_DEBUG_SQLITE3_BIND_INT(stmt, 2, color);
+  for(const GList *iter = imgs; iter; iter = g_list_next(iter))
+  {
+    DT_DEBUG_SQLITE3_BIND_INT(stmt, 1, GPOINTER_TO_INT(iter->data));
+    sqlite3_step(stmt);
+    sqlite3_reset(stmt);
+  }
+  sqlite3_finalize(stmt);
+
+  if(transaction) dt_database_release_transaction(darktable.db);
+  dt_image_synch_xmps_deferred(imgs);
+  dt_collection_hint_message(darktable.collection);
+}
+
 void dt_colorlabels_toggle_label (const int imgid, const int color)
 {
   if(imgid <= 0) return;
@@ -189,7 +225,7 @@ gboolean dt_colorlabels_key_accel_callback(GtkAccelGroup *accel_group,
   }
   // synch to file:
   // TODO: move color labels to image_t cache and sync via write_get!
-  dt_image_synch_xmp(selected);
+  dt_image_synch_xmp_deferred(selected);
   dt_control_signal_raise(darktable.signals, DT_SIGNAL_FILMROLLS_CHANGED);
   dt_control_queue_redraw_center();
   return TRUE;
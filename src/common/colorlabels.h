@@ -22,6 +22,8 @@ void dt_colorlabels_remove_labels_selection ();
 void dt_colorlabels_remove_labels (const int imgid);
 /** toggle color label of selection of images */
 void dt_colorlabels_toggle_label_selection (const int color);
+/** toggle color label of a list of image ids like for the selection, in one transaction */
+void dt_colorlabels_toggle_label_images (const GList *imgs, const int color);
 /** toggle color of imgid */
 void dt_colorlabels_toggle_label (const int imgid, const int color);
 /** assign a color label to imgid */
@@ -43,8 +43,10 @@
 #include "common/image_cache.h"
 #include "common/imageio_module.h"
 #include "common/mipmap_cache.h"
+#include "develop/pixelpipe_diskcache.h"
 #include "common/opencl.h"
 #include "common/points.h"
+#include "common/trace.h"
 #include "develop/imageop.h"
 #include "develop/blend.h"
 #include "libs/lib.h"
@@ -112,6 +114,7 @@ static int usage(const char *argv0)
   printf(" [--luacmd <lua command>]");
 #endif
   printf(" [--conf <key>=<value>]");
+  printf(" [--trace <trace file>]");
   printf("\n");
   return 1;
 }
@@ -458,6 +461,7 @@ int dt_init(int argc, char *argv[], const int init_gui,lua_State *L)
   char *tmpdir_from_command = NULL;
   char *configdir_from_command = NULL;
   char *cachedir_from_command = NULL;
+  char *trace_from_command = NULL;
 
   char *lua_command  __attribute__((unused))= NULL;
 
@@ -514,6 +518,10 @@ int dt_init(int argc, char *argv[], const int init_gui,lua_State *L)
       {
         cachedir_from_command = argv[++k];
       }
+      else if(!strcmp(argv[k], "--trace") && argc > k+1)
+      {
+        trace_from_command = argv[++k];
+      }
       else if(!strcmp(argv[k], "--localedir"))
       {
         bindtextdomain (GETTEXT_PACKAGE, argv[++k]);
@@ -579,6 +587,8 @@ int dt_init(int argc, char *argv[], const int init_gui,lua_State *L)
     dt_print_mem_usage();
   }
 
+  if(trace_from_command) dt_trace_init(trace_from_command);
+
 #ifdef _OPENMP
   omp_set_num_threads(darktable.num_openmp_threads);
 #endif
@@ -763,6 +773,9 @@ int dt_init(int argc, char *argv[], const int init_gui,lua_State *L)
   darktable.mipmap_cache = (dt_mipmap_cache_t *)calloc(1, sizeof(dt_mipmap_cache_t));
   dt_mipmap_cache_init(darktable.mipmap_cache);
 
+  darktable.pixelpipe_diskcache = (dt_dev_pixelpipe_diskcache_t *)calloc(1, sizeof(dt_dev_pixelpipe_diskcache_t));
+  dt_dev_pixelpipe_diskcache_init(darktable.pixelpipe_diskcache);
+
   // The GUI must be initialized before the views, because the init()
   // functions of the views depend on darktable.control->accels_* to register
   // their keyboard accelerators
@@ -895,6 +908,8 @@ void dt_cleanup()
   free(darktable.image_cache);
   dt_mipmap_cache_cleanup(darktable.mipmap_cache);
   free(darktable.mipmap_cache);
+  dt_dev_pixelpipe_diskcache_cleanup(darktable.pixelpipe_diskcache);
+  free(darktable.pixelpipe_diskcache);
   if(init_gui)
   {
     dt_control_cleanup(darktable.control);
@@ -932,6 +947,7 @@ void dt_cleanup()
 #ifdef HAVE_GEGL
   gegl_exit();
 #endif
+  dt_trace_cleanup();
 }
 
 void dt_print(dt_debug_thread_t thread, const char *msg, ...)
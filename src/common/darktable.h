@@ -146,6 +146,7 @@ struct dt_points_t;
 struct dt_imageio_t;
 struct dt_bauhaus_t;
 struct dt_undo_t;
+struct dt_trace_t;
 
 typedef enum dt_debug_thread_t
 {
@@ -187,6 +188,7 @@ typedef struct darktable_t
   struct dt_gui_gtk_t            *gui;
   struct dt_mipmap_cache_t       *mipmap_cache;
   struct dt_image_cache_t        *image_cache;
+  struct dt_dev_pixelpipe_diskcache_t *pixelpipe_diskcache;
   struct dt_bauhaus_t            *bauhaus;
   const struct dt_database_t     *db;
   const struct dt_fswatch_t      *fswatch;
@@ -200,6 +202,7 @@ typedef struct darktable_t
   struct dt_blendop_t            *blendop;
   struct dt_dbus_t               *dbus;
   struct dt_undo_t               *undo;
+  struct dt_trace_t              *trace;
   dt_pthread_mutex_t db_insert;
   dt_pthread_mutex_t plugin_threadsafe;
   dt_pthread_mutex_t capabilities_threadsafe;
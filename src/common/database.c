@@ -35,7 +35,7 @@
 #include <errno.h>
 
 // whenever _create_schema() gets changed you HAVE to bump this version and add an update path to _upgrade_schema_step()!
-#define CURRENT_DATABASE_VERSION 6
+#define CURRENT_DATABASE_VERSION 7
 
 typedef struct dt_database_t
 {
@@ -47,6 +47,10 @@ typedef struct dt_database_t
 
   /* ondisk DB */
   sqlite3 *handle;
+
+  /* explicit transactions, recursive per thread */
+  dt_pthread_mutex_t transaction_mutex;
+  int transaction_depth;
 } dt_database_t;
 
 
@@ -492,6 +496,40 @@ static int _upgrade_schema_step(dt_database_t *db, int version)
 
     sqlite3_exec(db->handle, "COMMIT", NULL, NULL, NULL);
     new_version = 6;
+  }
+  else if(version == 6)
+  {
+    // 6 -> 7 tag suggestions are counted from tagged_images on demand, drop tagxtag and its triggers
+    sqlite3_exec(db->handle, "BEGIN TRANSACTION", NULL, NULL, NULL);
+
+    const char *queries[] =
+    {
+      "DROP TRIGGER IF EXISTS insert_tag",
+      "DROP TRIGGER IF EXISTS attach_tag",
+      "DROP TRIGGER IF EXISTS detach_tag",
+      "DROP TRIGGER IF EXISTS delete_tag",
+      "DROP TABLE IF EXISTS tagxtag",
+      "CREATE TRIGGER delete_tag BEFORE DELETE on tags"
+      " BEGIN"
+      "   DELETE FROM tagged_images WHERE tagid=old.id;"
+      " END",
+      "DROP INDEX IF EXISTS tagged_images_tagid_index",
+      "CREATE INDEX tagged_images_tagid_imgid_index ON tagged_images (tagid, imgid)",
+    };
+    const int num_queries = sizeof(queries)/sizeof(queries[0]);
+    for(int k=0; k<num_queries; k++)
+    {
+      if(sqlite3_exec(db->handle, queries[k], NULL, NULL, NULL) != SQLITE_OK)
+      {
+        fprintf(stderr, "[init] can't replace tagxtag by an index on tagged_images\n");
+        fprintf(stderr, "[init]   %s\n", sqlite3_errmsg(db->handle));
+        sqlite3_exec(db->handle, "ROLLBACK TRANSACTION", NULL, NULL, NULL);
+        return version;
+      }
+    }
+
+    sqlite3_exec(db->handle, "COMMIT", NULL, NULL, NULL);
+    new_version = 7;
   }// maybe in the future, see commented out code elsewhere
 //   else if(version == XXX)
 //   {
@@ -583,44 +621,15 @@ static void _create_schema(dt_database_t *db)
   DT_DEBUG_SQLITE3_EXEC(db->handle,
                         "CREATE TABLE tagged_images (imgid INTEGER, tagid INTEGER, "
                         "PRIMARY KEY (imgid, tagid))", NULL, NULL, NULL);
+  // covering index for the tag suggestions, which count co-occurrences from tagged_images
   DT_DEBUG_SQLITE3_EXEC(db->handle,
-                        "CREATE INDEX tagged_images_tagid_index ON tagged_images (tagid)", NULL, NULL, NULL);
-  ////////////////////////////// tagxtag
-  DT_DEBUG_SQLITE3_EXEC(db->handle,
-                        "CREATE TABLE tagxtag (id1 INTEGER, id2 INTEGER, count INTEGER, "
-                        "PRIMARY KEY (id1, id2))", NULL, NULL, NULL);
-  DT_DEBUG_SQLITE3_EXEC(db->handle,
-                        "CREATE TRIGGER insert_tag AFTER INSERT ON tags"
-                        " BEGIN"
-                        "   INSERT INTO tagxtag SELECT id, new.id, 0 FROM TAGS;"
-                        "   UPDATE tagxtag SET count = 1000000 WHERE id1=new.id AND id2=new.id;"
-                        " END",
-                        NULL, NULL, NULL);
+                        "CREATE INDEX tagged_images_tagid_imgid_index ON tagged_images (tagid, imgid)", NULL, NULL, NULL);
   DT_DEBUG_SQLITE3_EXEC(db->handle,
                         "CREATE TRIGGER delete_tag BEFORE DELETE on tags"
                         " BEGIN"
-                        "   DELETE FROM tagxtag WHERE id1=old.id OR id2=old.id;"
                         "   DELETE FROM tagged_images WHERE tagid=old.id;"
                         " END",
                         NULL, NULL, NULL);
-  DT_DEBUG_SQLITE3_EXEC(db->handle,
-                        "CREATE TRIGGER attach_tag AFTER INSERT ON tagged_images"
-                        " BEGIN"
-                        "   UPDATE tagxtag"
-                        "     SET count = count + 1"
-                        "     WHERE (id1=new.tagid AND id2 IN (SELECT tagid FROM tagged_images WHERE imgid=new.imgid))"
-                        "        OR (id2=new.tagid AND id1 IN (SELECT tagid FROM tagged_images WHERE imgid=new.imgid));"
-                        " END",
-                        NULL, NULL, NULL);
-  DT_DEBUG_SQLITE3_EXEC(db->handle,
-                        "CREATE TRIGGER detach_tag BEFORE DELETE ON tagged_images"
-                        " BEGIN"
-                        "   UPDATE tagxtag"
-                        "     SET count = count - 1"
-                        "     WHERE (id1=old.tagid AND id2 IN (SELECT tagid FROM tagged_images WHERE imgid=old.imgid))"
-                        "        OR (id2=old.tagid AND id1 IN (SELECT tagid FROM tagged_images WHERE imgid=old.imgid));"
-                        " END",
-                        NULL, NULL, NULL);
   ////////////////////////////// styles
   DT_DEBUG_SQLITE3_EXEC(db->handle,
                         "CREATE TABLE styles (id INTEGER, name VARCHAR, description VARCHAR)", NULL, NULL, NULL);
@@ -690,6 +699,13 @@ dt_database_t *dt_database_init(char *alternative)
   db->is_new_database = FALSE;
   db->lock_acquired = FALSE;
 
+  pthread_mutexattr_t attr;
+  pthread_mutexattr_init(&attr);
+  pthread_mutexattr_settype(&attr, PTHREAD_MUTEX_RECURSIVE);
+  dt_pthread_mutex_init(&db->transaction_mutex, &attr);
+  pthread_mutexattr_destroy(&attr);
+  db->transaction_depth = 0;
+
   /* having more than one instance of darktable using the same database is a bad idea */
   /* try to get a lock for the database */
 #ifdef __WIN32__
@@ -903,6 +919,7 @@ void dt_database_destroy(const dt_database_t *db)
   sqlite3_close(db->handle);
   unlink(db->lockfile);
   g_free(db->lockfile);
+  dt_pthread_mutex_destroy(&((dt_database_t *)db)->transaction_mutex);
   g_free((dt_database_t *)db);
 }
 
@@ -911,6 +928,31 @@ sqlite3 *dt_database_get(const dt_database_t *db)
   return db->handle;
 }
 
+void dt_database_start_transaction(const struct dt_database_t *db)
+{
+  dt_database_t *d = (dt_database_t *)db;
+  dt_pthread_mutex_lock(&d->transaction_mutex);
+  if(d->transaction_depth++ == 0)
+    DT_DEBUG_SQLITE3_EXEC(d->handle, "BEGIN TRANSACTION", NULL, NULL, NULL);
+}
+
+gboolean dt_database_try_start_transaction(const struct dt_database_t *db)
+{
+  dt_database_t *d = (dt_database_t *)db;
+  if(dt_pthread_mutex_trylock(&d->transaction_mutex)) return FALSE;
+  if(d->transaction_depth++ == 0)
+    DT_DEBUG_SQLITE3_EXEC(d->handle, "BEGIN TRANSACTION", NULL, NULL, NULL);
+  return TRUE;
+}
+
+void dt_database_release_transaction(const struct dt_database_t *db)
+{
+  dt_database_t *d = (dt_database_t *)db;
+  if(--d->transaction_depth == 0)
+    DT_DEBUG_SQLITE3_EXEC(d->handle, "COMMIT", NULL, NULL, NULL);
+  dt_pthread_mutex_unlock(&d->transaction_mutex);
+}
+
 const gchar *dt_database_get_path(const struct dt_database_t *db)
 {
   return db->dbfilename;
@@ -35,6 +35,16 @@ gboolean dt_database_is_new(const struct dt_database_t *db);
 const gchar *dt_database_get_path(const struct dt_database_t *db);
 /** test if database was already locked by another instance */
 gboolean dt_database_get_lock_acquired(const struct dt_database_t *db);
+/** starts a transaction, so a batch of statements takes the data base lock and syncs to disk only once.
+    nested calls of the same thread join the outer transaction, other threads wait for it to be released.
+    the connection is shared, so keep it short: don't raise signals, take the gdk lock or wait for other
+    threads (e.g. an omp team) while holding it. */
+void dt_database_start_transaction(const struct dt_database_t *db);
+/** like dt_database_start_transaction(), but doesn't wait if another thread holds a transaction. for the
+    gui thread, which must not block on a worker. returns TRUE if the transaction has to be released. */
+gboolean dt_database_try_start_transaction(const struct dt_database_t *db);
+/** ends the transaction started last, commits when it is the outermost one. */
+void dt_database_release_transaction(const struct dt_database_t *db);
 #endif
 // modelines: These editor modelines have been set for all relevant files by tools/update_modelines.sh
 // vim: shiftwidth=2 expandtab tabstop=2 cindent
@@ -60,6 +60,16 @@ extern "C"
 
 static void _exif_import_tags(dt_image_t *img,Exiv2::XmpData::iterator &pos);
 
+// metadata of an image file and its sidecar, parsed by dt_exif_metadata_read()
+struct dt_exif_metadata_t
+{
+  Exiv2::Image::AutoPtr image;   // empty if the file couldn't be read
+  Exiv2::Image::AutoPtr sidecar; // empty if there is none
+};
+
+// the xmp toolkit isn't thread safe on its own
+static dt_pthread_mutex_t _exif_xmp_mutex;
+
 //this array should contain all XmpBag and XmpSeq keys used by dt
 const char *dt_xmp_keys[] =
 {
@@ -842,7 +852,7 @@ int dt_exif_read_from_blob(dt_image_t *img, uint8_t *blob, const int size)
 /** read the metadata of an image.
  * XMP data trumps IPTC data trumps EXIF data
  */
-int dt_exif_read(dt_image_t *img, const char* path)
+static int _exif_read(dt_image_t *img, const char* path, Exiv2::Image *image)
 {
   // at least set datetime taken to something useful in case there is no exif data in this file (pfm, png, ...)
   struct stat statbuf;
@@ -852,10 +862,14 @@ int dt_exif_read(dt_image_t *img, const char* path)
 
   try
   {
-    Exiv2::Image::AutoPtr image;
-    image = Exiv2::ImageFactory::open(path);
-    assert(image.get() != 0);
-    image->readMetadata();
+    Exiv2::Image::AutoPtr file;
+    if(!image)
+    {
+      file = Exiv2::ImageFactory::open(path);
+      assert(file.get() != 0);
+      file->readMetadata();
+      image = file.get();
+    }
     bool res = true;
 
     // EXIF metadata
@@ -894,6 +908,11 @@ int dt_exif_read(dt_image_t *img, const char* path)
   }
 }
 
+int dt_exif_read(dt_image_t *img, const char* path)
+{
+  return _exif_read(img, path, NULL);
+}
+
 int dt_exif_write_blob(uint8_t *blob,uint32_t size, const char* path)
 {
   try
@@ -1459,7 +1478,7 @@ static void _exif_import_tags(dt_image_t *img,Exiv2::XmpData::iterator &pos)
 }
 
 // need a write lock on *img (non-const) to write stars (and soon color labels).
-int dt_exif_xmp_read (dt_image_t *img, const char* filename, const int history_only)
+static int _exif_xmp_read(dt_image_t *img, const char* filename, const int history_only, Exiv2::Image *image)
 {
   // exclude pfm to avoid stupid errors on the console
   const char *c = filename + strlen(filename) - 4;
@@ -1467,10 +1486,14 @@ int dt_exif_xmp_read (dt_image_t *img, const char* filename, const int history_o
   try
   {
     // read xmp sidecar
-    Exiv2::Image::AutoPtr image;
-    image = Exiv2::ImageFactory::open(filename);
-    assert(image.get() != 0);
-    image->readMetadata();
+    Exiv2::Image::AutoPtr file;
+    if(!image)
+    {
+      file = Exiv2::ImageFactory::open(filename);
+      assert(file.get() != 0);
+      file->readMetadata();
+      image = file.get();
+    }
     Exiv2::XmpData &xmpData = image->xmpData();
 
     sqlite3_stmt *stmt;
@@ -1736,6 +1759,54 @@ int dt_exif_xmp_read (dt_image_t *img, const char* filename, const int history_o
   return 0;
 }
 
+int dt_exif_xmp_read (dt_image_t *img, const char* filename, const int history_only)
+{
+  return _exif_xmp_read(img, filename, history_only, NULL);
+}
+
+dt_exif_metadata_t *dt_exif_metadata_read(const char *path, const char *xmp_path)
+{
+  dt_exif_metadata_t *md = new dt_exif_metadata_t;
+  try
+  {
+    md->image = Exiv2::ImageFactory::open(path);
+    assert(md->image.get() != 0);
+    md->image->readMetadata();
+  }
+  catch (Exiv2::AnyError&)
+  {
+    md->image.reset();
+  }
+  if(xmp_path)
+  {
+    try
+    {
+      md->sidecar = Exiv2::ImageFactory::open(xmp_path);
+      assert(md->sidecar.get() != 0);
+      md->sidecar->readMetadata();
+    }
+    catch (Exiv2::AnyError&)
+    {
+      // most images don't have one yet
+      md->sidecar.reset();
+    }
+  }
+  return md;
+}
+
+int dt_exif_metadata_apply(dt_image_t *img, const char *path, const char *xmp_path, dt_exif_metadata_t *md)
+{
+  // an unreadable file is tried again here, which sets the fallbacks and reports the error
+  (void)_exif_read(img, path, md->image.get());
+  if(!xmp_path || !md->sidecar.get()) return 1;
+  return _exif_xmp_read(img, xmp_path, 0, md->sidecar.get());
+}
+
+void dt_exif_metadata_free(dt_exif_metadata_t *md)
+{
+  delete md;
+}
+
 // helper to create an xmp data thing. throws exiv2 exceptions if stuff goes wrong.
 static void
 dt_exif_xmp_read_data(Exiv2::XmpData &xmpData, const int imgid)
@@ -2193,6 +2264,12 @@ static void dt_exif_log_handler(int log_level, const char *message)
     fprintf(stderr, "[exiv2] %s\n", message);
 }
 
+static void _exif_xmp_lock(void *data, bool lock)
+{
+  if(lock) dt_pthread_mutex_lock((dt_pthread_mutex_t *)data);
+  else dt_pthread_mutex_unlock((dt_pthread_mutex_t *)data);
+}
+
 void dt_exif_init()
 {
   // mute exiv2:
@@ -2200,7 +2277,8 @@ void dt_exif_init()
   // preface the exiv2 messages with "[exiv2] "
   Exiv2::LogMsg::setHandler(&dt_exif_log_handler);
 
-  Exiv2::XmpParser::initialize();
+  dt_pthread_mutex_init(&_exif_xmp_mutex, NULL);
+  Exiv2::XmpParser::initialize(&_exif_xmp_lock, &_exif_xmp_mutex);
   // this has te stay with the old url (namespace already propagated outside dt)
   Exiv2::XmpProperties::registerNs("http://darktable.sf.net/", "darktable");
   Exiv2::XmpProperties::registerNs("http://ns.adobe.com/lightroom/1.0/", "lr");
@@ -2209,6 +2287,7 @@ void dt_exif_init()
 void dt_exif_cleanup()
 {
   Exiv2::XmpParser::terminate();
+  dt_pthread_mutex_destroy(&_exif_xmp_mutex);
 }
 
 // modelines: These editor modelines have been set for all relevant files by tools/update_modelines.sh
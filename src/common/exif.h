@@ -48,6 +48,18 @@ extern "C"
   /** read xmp sidecar file. */
   int dt_exif_xmp_read (dt_image_t * img, const char* filename, const int history_only);
 
+  /** metadata of an image file and its xmp sidecar, read but not yet applied. */
+  typedef struct dt_exif_metadata_t dt_exif_metadata_t;
+
+  /** parse the metadata of the file and of the xmp sidecar (may be NULL). touches neither the image
+      struct nor the data base, so several images can be read in parallel. */
+  dt_exif_metadata_t *dt_exif_metadata_read(const char *path, const char *xmp_path);
+
+  /** dt_exif_read() followed by dt_exif_xmp_read(img, xmp_path, 0), on parsed metadata. returns the result of the latter. */
+  int dt_exif_metadata_apply(dt_image_t *img, const char *path, const char *xmp_path, dt_exif_metadata_t *md);
+
+  void dt_exif_metadata_free(dt_exif_metadata_t *md);
+
   /** load exif thumbnail (these are like 160x120) */
   int dt_exif_thumbnail (const char *filename, uint8_t *out, uint32_t width, uint32_t height, int orientation, uint32_t *wd, uint32_t *ht);
 
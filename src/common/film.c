@@ -23,6 +23,7 @@
 #include "common/film.h"
 #include "common/dtpthread.h"
 #include "common/collection.h"
+#include "common/exif.h"
 #include "common/image_cache.h"
 #include "common/debug.h"
 #include "views/view.h"
@@ -39,6 +40,9 @@
 #include <errno.h>
 #include <assert.h>
 
+// number of images imported in one transaction
+#define DT_FILM_IMPORT_BATCH 256
+
 void dt_film_init(dt_film_t *film)
 {
   dt_pthread_mutex_init(&film->images_mutex, NULL);
@@ -342,7 +346,66 @@ int _film_filename_cmp(gchar *a, gchar *b)
   return ret;
 }
 
-void dt_film_import1(dt_film_t *film)
+/* check if we can find a gpx data file to be auto applied
+   to images in the just imported filmroll */
+static void _film_apply_gpx(dt_film_t *film)
+{
+  if(!film || !film->dir) return;
+  g_dir_rewind(film->dir);
+  const gchar *dfn = NULL;
+  while ((dfn = g_dir_read_name(film->dir)) != NULL)
+  {
+    /* check if we have a gpx to be auto applied to filmroll */
+    size_t len = strlen(dfn);
+    if(strcmp(dfn+len-4,".gpx") == 0 ||
+        strcmp(dfn+len-4,".GPX") == 0)
+    {
+      gchar *gpx_file = g_build_path (G_DIR_SEPARATOR_S, film->dirname, dfn, NULL);
+      gchar *tz = dt_conf_get_string("plugins/lighttable/geotagging/tz");
+      dt_control_gpx_apply(gpx_file, film->id, tz);
+      g_free(gpx_file);
+      g_free(tz);
+    }
+  }
+}
+
+/* imports a batch of files of one film roll: the rows are inserted in order (grouping depends on
+   the ones before), exif and xmp of the new images are parsed in parallel, and all the data base
+   writes (metadata, tags, history, sidecars) are done in order again. the parallel part doesn't
+   touch the data base, so no transaction is held while waiting for it. */
+static void _film_import_batch(const int32_t film_id, const gchar **files, const int num)
+{
+  uint32_t ids[DT_FILM_IMPORT_BATCH];
+  gboolean is_new[DT_FILM_IMPORT_BATCH];
+  dt_exif_metadata_t *md[DT_FILM_IMPORT_BATCH];
+
+  dt_database_start_transaction(darktable.db);
+  for(int k=0; k<num; k++)
+    ids[k] = dt_image_import_insert(film_id, files[k], FALSE, is_new + k);
+  dt_database_release_transaction(darktable.db);
+
+#ifdef _OPENMP
+  #pragma omp parallel for default(none) shared(ids, is_new, md, files) schedule(dynamic)
+#endif
+  for(int k=0; k<num; k++)
+    md[k] = (ids[k] && is_new[k]) ? dt_image_import_parse_metadata(files[k]) : NULL;
+
+  dt_database_start_transaction(darktable.db);
+  for(int k=0; k<num; k++)
+  {
+    if(!ids[k]) continue;
+    const int xmp_res = md[k] ? dt_image_import_read_metadata(ids[k], files[k], md[k]) : 0;
+    dt_image_import_finish(ids[k], files[k], is_new[k], xmp_res);
+    if(md[k]) dt_exif_metadata_free(md[k]);
+  }
+  dt_database_release_transaction(darktable.db);
+
+  // signal handlers take the gdk lock, so they only run once the transaction is released:
+  for(int k=0; k<num; k++)
+    if(ids[k] && is_new[k]) dt_control_signal_raise(darktable.signals, DT_SIGNAL_IMAGE_IMPORT, ids[k]);
+}
+
+void dt_film_import1(dt_job_t *job, dt_film_t *film)
 {
   gboolean recursive = dt_conf_get_bool("ui_last/import_recursive");
 
@@ -365,39 +428,20 @@ void dt_film_import1(dt_film_t *film)
   g_snprintf(message, sizeof(message) - 1,
              ngettext("importing %d image","importing %d images", total), total);
   const guint *jid = dt_control_backgroundjobs_create(darktable.control, 0, message);
+  if(job) dt_control_backgroundjobs_set_cancellable(darktable.control, jid, job);
 
-  /* loop thru the images and import to current film roll */
+  /* loop thru the images and import to current film roll, in batches */
+  const gchar *files[DT_FILM_IMPORT_BATCH];
   dt_film_t *cfr = film;
   GList *image = g_list_first(images);
-  do
+  while(image && (!job || dt_control_job_get_state(job) != DT_JOB_STATE_CANCELLED))
   {
     gchar *cdn = g_path_get_dirname((const gchar *)image->data);
 
     /* check if we need to initialize a new filmroll */
     if(!cfr || g_strcmp0(cfr->dirname, cdn) != 0)
     {
-      //FIXME: maybe refactor into function and call it?
-      if(cfr && cfr->dir)
-      {
-        /* check if we can find a gpx data file to be auto applied
-           to images in the jsut imported filmroll */
-        g_dir_rewind(cfr->dir);
-        const gchar *dfn = NULL;
-        while ((dfn = g_dir_read_name(cfr->dir)) != NULL)
-        {
-          /* check if we have a gpx to be auto applied to filmroll */
-          size_t len = strlen(dfn);
-          if(strcmp(dfn+len-4,".gpx") == 0 ||
-              strcmp(dfn+len-4,".GPX") == 0)
-          {
-            gchar *gpx_file = g_build_path (G_DIR_SEPARATOR_S, cfr->dirname, dfn, NULL);
-            gchar *tz = dt_conf_get_string("plugins/lighttable/geotagging/tz");
-            dt_control_gpx_apply(gpx_file, cfr->id, tz);
-            g_free(gpx_file);
-            g_free(tz);
-          }
-        }
-      }
+      _film_apply_gpx(cfr);
 
       /* cleanup previously imported filmroll*/
       if(cfr && cfr!=film)
@@ -417,16 +461,24 @@ void dt_film_import1(dt_film_t *film)
       dt_film_new(cfr, cdn);
     }
 
+    /* collect the following images of the same film roll */
+    int num = 0;
+    for(; image && num < DT_FILM_IMPORT_BATCH; image = g_list_next(image))
+    {
+      gchar *dn = g_path_get_dirname((const gchar *)image->data);
+      const int same = !g_strcmp0(dn, cdn);
+      g_free(dn);
+      if(!same) break;
+      files[num++] = (const gchar *)image->data;
+    }
     g_free(cdn);
 
-    /* import image */
-    dt_image_import(cfr->id, (const gchar *)image->data, FALSE);
+    /* import them */
+    _film_import_batch(cfr->id, files, num);
 
-    fraction+=1.0/total;
+    fraction += num/(double)total;
     dt_control_backgroundjobs_progress(darktable.control, jid, fraction);
-
   }
-  while( (image = g_list_next(image)) != NULL);
 
   // only redraw at the end, to not spam the cpu with exposure events
   dt_control_queue_redraw_center();
@@ -435,28 +487,9 @@ void dt_film_import1(dt_film_t *film)
   dt_control_backgroundjobs_destroy(darktable.control, jid);
   dt_control_signal_raise(darktable.signals , DT_SIGNAL_FILMROLLS_IMPORTED,film->id);
 
-  //FIXME: maybe refactor into function and call it?
-  if(cfr && cfr->dir)
-  {
-    /* check if we can find a gpx data file to be auto applied
-       to images in the just imported filmroll */
-    g_dir_rewind(cfr->dir);
-    const gchar *dfn = NULL;
-    while ((dfn = g_dir_read_name(cfr->dir)) != NULL)
-    {
-      /* check if we have a gpx to be auto applied to filmroll */
-      size_t len = strlen(dfn);
-      if(strcmp(dfn+len-4,".gpx") == 0 ||
-          strcmp(dfn+len-4,".GPX") == 0)
-      {
-        gchar *gpx_file = g_build_path (G_DIR_SEPARATOR_S, cfr->dirname, dfn, NULL);
-        gchar *tz = dt_conf_get_string("plugins/lighttable/geotagging/tz");
-        dt_control_gpx_apply(gpx_file, cfr->id, tz);
-        g_free(gpx_file);
-        g_free(tz);
-      }
-    }
-  }
+  _film_apply_gpx(cfr);
+
+  g_list_free_full(images, g_free);
 }
 
 
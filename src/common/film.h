@@ -51,8 +51,9 @@ int dt_film_open2(dt_film_t *film);
 int dt_film_open_recent(const int32_t num);
 /** import new film and all images in this directory as a background task(non-recursive, existing films/images are respected). */
 int dt_film_import(const char *dirname);
-/** helper for import threads. */
-void dt_film_import1(dt_film_t *film);
+/** helper for import threads. imports in batches, stops early if the (optional) job gets cancelled. */
+struct _dt_job_t;
+void dt_film_import1(struct _dt_job_t *job, dt_film_t *film);
 /** constructs the lighttable/query setting for this film, respecting stars and filters. */
 void dt_film_set_query(const int32_t id);
 /** removes this film and all its images from db. */
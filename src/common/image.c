@@ -31,6 +31,7 @@
 #include "control/conf.h"
 #include "control/jobs.h"
 #include "develop/lightroom.h"
+#include "develop/pixelpipe_diskcache.h"
 #include <math.h>
 #include <sqlite3.h>
 #include <string.h>
@@ -465,6 +466,8 @@ void dt_image_remove(const int32_t imgid)
 
   // make sure we remove from the cache first, or else the cache will look for imgid in sql
   dt_image_cache_remove(darktable.image_cache, imgid);
+  // ids get reused, so don't leave spilled pixelpipe buffers behind:
+  dt_dev_pixelpipe_diskcache_remove_image(darktable.pixelpipe_diskcache, imgid);
 
   int new_group_id = dt_grouping_remove_from_group(imgid);
   if(darktable.gui && darktable.gui->expanded_group_id == old_group_id)
@@ -623,8 +626,9 @@ void dt_image_read_duplicates(const uint32_t id, const char *filename)
 }
 
 
-uint32_t dt_image_import(const int32_t film_id, const char *filename, gboolean override_ignore_jpegs)
+uint32_t dt_image_import_insert(const int32_t film_id, const char *filename, gboolean override_ignore_jpegs, gboolean *is_new)
 {
+  *is_new = FALSE;
   if(!g_file_test(filename, G_FILE_TEST_IS_REGULAR) || dt_util_get_file_size(filename) == 0)
     return 0;
   const char *cc = filename + strlen(filename);
@@ -675,8 +679,6 @@ uint32_t dt_image_import(const int32_t film_id, const char *filename, gboolean o
     img->flags &= ~DT_IMAGE_REMOVE;
     dt_image_cache_write_release(darktable.image_cache, img, DT_IMAGE_CACHE_RELAXED);
     dt_image_cache_read_release(darktable.image_cache, img);
-    dt_image_read_duplicates(id, filename);
-    dt_image_synch_all_xmp(filename);
     return id;
   }
   sqlite3_finalize(stmt);
@@ -799,51 +801,93 @@ uint32_t dt_image_import(const int32_t film_id, const char *filename, gboolean o
 
   // printf("[image_import] importing `%s' to img id %d\n", imgfname, id);
 
+  g_free(ext);
+  g_free(imgfname);
+  g_free(basename);
+  g_free(sql_pattern);
+  *is_new = TRUE;
+  return id;
+}
+
+static void _image_import_sidecar_path(const char *filename, char *dtfilename, size_t dtfilename_len)
+{
+  g_strlcpy(dtfilename, filename, dtfilename_len);
+  //dt_image_path_append_version(id, dtfilename, dtfilename_len);
+  g_strlcat(dtfilename, ".xmp", dtfilename_len);
+}
+
+dt_exif_metadata_t *dt_image_import_parse_metadata(const char *filename)
+{
+  char dtfilename[PATH_MAX];
+  _image_import_sidecar_path(filename, dtfilename, sizeof(dtfilename));
+  return dt_exif_metadata_read(filename, dtfilename);
+}
+
+int dt_image_import_read_metadata(const uint32_t id, const char *filename, dt_exif_metadata_t *md)
+{
   // lock as shortly as possible:
   const dt_image_t *cimg = dt_image_cache_read_get(darktable.image_cache, id);
   dt_image_t *img = dt_image_cache_write_get(darktable.image_cache, cimg);
-  img->group_id = group_id;
 
   // read dttags and exif for database queries!
-  (void) dt_exif_read(img, filename);
   char dtfilename[PATH_MAX];
-  g_strlcpy(dtfilename, filename, sizeof(dtfilename));
-  //dt_image_path_append_version(id, dtfilename, sizeof(dtfilename));
-  g_strlcat(dtfilename, ".xmp", sizeof(dtfilename));
+  _image_import_sidecar_path(filename, dtfilename, sizeof(dtfilename));
 
-  int res = dt_exif_xmp_read(img, dtfilename, 0);
+  int res;
+  if(md)
+    res = dt_exif_metadata_apply(img, filename, dtfilename, md);
+  else
+  {
+    (void) dt_exif_read(img, filename);
+    res = dt_exif_xmp_read(img, dtfilename, 0);
+  }
 
   // write through to db, but not to xmp.
   dt_image_cache_write_release(darktable.image_cache, img, DT_IMAGE_CACHE_RELAXED);
   dt_image_cache_read_release(darktable.image_cache, cimg);
+  return res;
+}
 
-  if(res != 0)
+void dt_image_import_finish(const uint32_t id, const char *filename, const gboolean is_new, const int xmp_res)
+{
+  if(is_new)
   {
-    // Search for Lightroom sidecar file, import tags if found
-    dt_lightroom_import(id, NULL, TRUE);
-  }
+    if(xmp_res != 0)
+    {
+      // Search for Lightroom sidecar file, import tags if found
+      dt_lightroom_import(id, NULL, TRUE);
+    }
 
-  // add a tag with the file extension
-  guint tagid = 0;
-  char tagname[512];
-  snprintf(tagname, sizeof(tagname), "darktable|format|%s", ext);
-  g_free(ext);
-  dt_tag_new(tagname, &tagid);
-  dt_tag_attach(tagid,id);
+    // add a tag with the file extension
+    const char *cc = filename + strlen(filename);
+    for(; *cc!='.'&&cc>filename; cc--);
+    char *ext = g_ascii_strdown(cc+1, -1);
+    guint tagid = 0;
+    char tagname[512];
+    snprintf(tagname, sizeof(tagname), "darktable|format|%s", ext);
+    g_free(ext);
+    dt_tag_new(tagname, &tagid);
+    dt_tag_attach(tagid,id);
+  }
 
   // read all sidecar files
   dt_image_read_duplicates(id, filename);
   dt_image_synch_all_xmp(filename);
 
-  g_free(imgfname);
-  g_free(basename);
-  g_free(sql_pattern);
-
-  dt_control_signal_raise(darktable.signals,DT_SIGNAL_IMAGE_IMPORT,id);
   // the following line would look logical with new_tags_set being the return value
   // from dt_tag_new above, but this could lead to too rapid signals, being able to lock up the
   // keywords side pane when trying to use it, which can lock up the whole dt GUI ..
   //if (new_tags_set) dt_control_signal_raise(darktable.signals,DT_SIGNAL_TAG_CHANGED);
+}
+
+uint32_t dt_image_import(const int32_t film_id, const char *filename, gboolean override_ignore_jpegs)
+{
+  gboolean is_new = FALSE;
+  const uint32_t id = dt_image_import_insert(film_id, filename, override_ignore_jpegs, &is_new);
+  if(!id) return 0;
+  const int res = is_new ? dt_image_import_read_metadata(id, filename, NULL) : 0;
+  dt_image_import_finish(id, filename, is_new, res);
+  if(is_new) dt_control_signal_raise(darktable.signals,DT_SIGNAL_IMAGE_IMPORT,id);
   return id;
 }
 
@@ -1308,6 +1352,29 @@ void dt_image_synch_xmp(const int selected)
   }
 }
 
+void dt_image_synch_xmp_deferred(const int selected)
+{
+  if(selected > 0)
+  {
+    dt_image_cache_defer_sidecar(darktable.image_cache, selected);
+  }
+  else if(dt_conf_get_bool("write_sidecar_files"))
+  {
+    sqlite3_stmt *stmt;
+    DT_DEBUG_SQLITE3_PREPARE_V2(dt_database_get(darktable.db),
+                                "select imgid from selected_images", -1, &stmt, NULL);
+    while(sqlite3_step(stmt) == SQLITE_ROW)
+      dt_image_cache_defer_sidecar(darktable.image_cache, sqlite3_column_int(stmt, 0));
+    sqlite3_finalize(stmt);
+  }
+}
+
+void dt_image_synch_xmps_deferred(const GList *imgs)
+{
+  for(const GList *iter = imgs; iter; iter = g_list_next(iter))
+    dt_image_cache_defer_sidecar(darktable.image_cache, GPOINTER_TO_INT(iter->data));
+}
+
 void dt_image_synch_all_xmp(const gchar *pathname)
 {
   if(dt_conf_get_bool("write_sidecar_files"))
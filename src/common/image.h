@@ -153,6 +153,17 @@ void dt_image_print_exif(const dt_image_t *img, char *line, size_t line_len);
 void dt_image_read_duplicates(uint32_t id, const char *filename);
 /** imports a new image from raw/etc file and adds it to the data base and image cache. */
 uint32_t dt_image_import(int32_t film_id, const char *filename, gboolean override_ignore_jpegs);
+/** the stages of dt_image_import(), for batched imports: */
+/** checks the file and adds it to the data base, grouped. returns the id (0 if not imported), is_new is false if it was there already. */
+uint32_t dt_image_import_insert(const int32_t film_id, const char *filename, gboolean override_ignore_jpegs, gboolean *is_new);
+/** parses exif and the xmp sidecar of the file, without touching data base or cache. can run in parallel for different images. */
+struct dt_exif_metadata_t *dt_image_import_parse_metadata(const char *filename);
+/** applies exif and xmp sidecar (parsed before, or read now if md is NULL) to a new image and the data base.
+    returns the result of reading the xmp. */
+int dt_image_import_read_metadata(const uint32_t id, const char *filename, struct dt_exif_metadata_t *md);
+/** attaches the format tag, reads duplicates and synchs the sidecars. the caller raises DT_SIGNAL_IMAGE_IMPORT for new
+    images, outside of any transaction. */
+void dt_image_import_finish(const uint32_t id, const char *filename, const gboolean is_new, const int xmp_res);
 /** removes the given image from the database. */
 void dt_image_remove(const int32_t imgid);
 /** duplicates the given image in the database with the duplicate getting the supplied version number. if that version
@@ -347,6 +358,10 @@ void dt_image_local_copy_synch(void);
 // xmp functions:
 void dt_image_write_sidecar_file(int imgid);
 void dt_image_synch_xmp(const int selected);
+/** like dt_image_synch_xmp(), but the files are written by a background job, once per image for repeated changes. */
+void dt_image_synch_xmp_deferred(const int selected);
+/** same for a list of image ids. */
+void dt_image_synch_xmps_deferred(const GList *imgs);
 void dt_image_synch_all_xmp(const gchar *pathname);
 
 // add an offset to the exif_datetime_taken field
@@ -22,6 +22,7 @@
 #include "common/image.h"
 #include "common/image_cache.h"
 #include "control/conf.h"
+#include "control/control.h"
 #include "develop/develop.h"
 
 #include <sqlite3.h>
@@ -163,11 +164,19 @@ dt_image_cache_init(dt_image_cache_t *cache)
     // optimized initialization (avoid accessing conf):
     memcpy(cache->images + k, cache->images, sizeof(dt_image_t));
   }
+
+  dt_pthread_mutex_init(&cache->sidecar_mutex, NULL);
+  cache->sidecar_pending = g_hash_table_new(NULL, NULL);
+  cache->sidecar_job_queued = 0;
 }
 
 void
 dt_image_cache_cleanup(dt_image_cache_t *cache)
 {
+  // the job queue is gone already, write what it didn't get to.
+  dt_image_cache_flush_sidecars(cache);
+  g_hash_table_destroy(cache->sidecar_pending);
+  dt_pthread_mutex_destroy(&cache->sidecar_mutex);
   dt_cache_cleanup(&cache->cache);
   dt_free_align(cache->images);
 }
@@ -232,6 +241,11 @@ dt_image_cache_write_release(
   dt_image_cache_write_mode_t mode)
 {
   if(img->id <= 0) return;
+  if(mode == DT_IMAGE_CACHE_MEMORY)
+  {
+    dt_cache_write_release(&cache->cache, img->id);
+    return;
+  }
   sqlite3_stmt *stmt;
   DT_DEBUG_SQLITE3_PREPARE_V2(dt_database_get(darktable.db),
                               "UPDATE images SET width = ?1, height = ?2, maker = ?3, model = ?4, "
@@ -287,6 +301,52 @@ dt_image_cache_remove(
   dt_cache_remove(&cache->cache, imgid);
 }
 
+static int32_t
+_sidecar_job_run(dt_job_t *job)
+{
+  dt_image_cache_flush_sidecars(darktable.image_cache);
+  return 0;
+}
+
+void
+dt_image_cache_defer_sidecar(
+  dt_image_cache_t *cache,
+  const uint32_t imgid)
+{
+  if(imgid <= 0 || !dt_conf_get_bool("write_sidecar_files")) return;
+  dt_pthread_mutex_lock(&cache->sidecar_mutex);
+  g_hash_table_insert(cache->sidecar_pending, GINT_TO_POINTER(imgid), GINT_TO_POINTER(imgid));
+  const int queue = !cache->sidecar_job_queued;
+  cache->sidecar_job_queued = 1;
+  dt_pthread_mutex_unlock(&cache->sidecar_mutex);
+
+  if(queue)
+  {
+    dt_job_t *job = dt_control_job_create(&_sidecar_job_run, "write sidecar files");
+    if(!job || dt_control_add_job(darktable.control, DT_JOB_QUEUE_SYSTEM_BG, job))
+    {
+      // no job: write them right away instead
+      dt_image_cache_flush_sidecars(cache);
+    }
+  }
+}
+
+void
+dt_image_cache_flush_sidecars(
+  dt_image_cache_t *cache)
+{
+  // take the whole set, requests coming in meanwhile queue a new job.
+  dt_pthread_mutex_lock(&cache->sidecar_mutex);
+  GList *ids = g_hash_table_get_keys(cache->sidecar_pending);
+  g_hash_table_steal_all(cache->sidecar_pending);
+  cache->sidecar_job_queued = 0;
+  dt_pthread_mutex_unlock(&cache->sidecar_mutex);
+
+  for(GList *iter = ids; iter; iter = g_list_next(iter))
+    dt_image_write_sidecar_file(GPOINTER_TO_INT(iter->data));
+  g_list_free(ids);
+}
+
 
 
 // modelines: These editor modelines have been set for all relevant files by tools/update_modelines.sh
@@ -26,6 +26,11 @@ typedef struct dt_image_cache_t
   // one fat block of dt_image_t, to assign `dynamic' void* in cache to.
   dt_image_t *images;
   dt_cache_t cache;
+
+  // image ids of sidecar files waiting to be written by a background job
+  dt_pthread_mutex_t sidecar_mutex;
+  GHashTable *sidecar_pending;
+  int sidecar_job_queued;
 }
 dt_image_cache_t;
 
@@ -36,7 +41,9 @@ typedef enum dt_image_cache_write_mode_t
   // always write to database and xmp
   DT_IMAGE_CACHE_SAFE = 0,
   // only write to db and do xmp only during shutdown
-  DT_IMAGE_CACHE_RELAXED = 1
+  DT_IMAGE_CACHE_RELAXED = 1,
+  // only update the struct in the cache, the caller has written the db already
+  DT_IMAGE_CACHE_MEMORY = 2
 }
 dt_image_cache_write_mode_t;
 
@@ -92,6 +99,18 @@ dt_image_cache_remove(
   dt_image_cache_t *cache,
   const uint32_t imgid);
 
+// queues writing the xmp sidecar of this image in a background job.
+// requests for the same image before the job runs result in one write.
+void
+dt_image_cache_defer_sidecar(
+  dt_image_cache_t *cache,
+  const uint32_t imgid);
+
+// writes all queued sidecars now (done by the job and during shutdown).
+void
+dt_image_cache_flush_sidecars(
+  dt_image_cache_t *cache);
+
 #endif
 // modelines: These editor modelines have been set for all relevant files by tools/update_modelines.sh
 // vim: shiftwidth=2 expandtab tabstop=2 cindent
@@ -42,11 +42,13 @@
 #include "common/image_compression.h"
 #include "common/mipmap_cache.h"
 #include "common/styles.h"
+#include "common/trace.h"
 #include "control/control.h"
 #include "control/conf.h"
 #include "develop/develop.h"
 #include "develop/imageop.h"
 #include "develop/blend.h"
+#include "develop/tiling.h"
 #include "libraw/libraw.h"
 
 #include <inttypes.h>
@@ -60,8 +62,9 @@
 #include <glib/gstdio.h>
 
 
-// load a full-res thumbnail:
-int dt_imageio_large_thumbnail(const char *filename, uint8_t **buffer, int32_t *width, int32_t *height, int32_t *orientation)
+// load a full-res thumbnail, or decode it just large enough to fill max_width x max_height:
+int dt_imageio_large_thumbnail(const char *filename, uint8_t **buffer, int32_t *width, int32_t *height, int32_t *orientation,
+                               const int32_t max_width, const int32_t max_height)
 {
   int ret = 0;
   int res = 1;
@@ -82,6 +85,11 @@ int dt_imageio_large_thumbnail(const char *filename, uint8_t **buffer, int32_t *
   {
     dt_imageio_jpeg_t jpg;
     if(dt_imageio_jpeg_decompress_header(image->data, image->data_size, &jpg)) goto libraw_fail;
+    if(max_width > 0 && max_height > 0)
+    {
+      if(*orientation & 4) dt_imageio_jpeg_set_scale(&jpg, max_height, max_width);
+      else                 dt_imageio_jpeg_set_scale(&jpg, max_width, max_height);
+    }
     *buffer = (uint8_t *)malloc((size_t)sizeof(uint8_t)*jpg.width*jpg.height*4);
     if(!*buffer) goto libraw_fail;
     *width = jpg.width;
@@ -630,6 +638,113 @@ int dt_imageio_export(
                                         0, 0, high_quality, 0, NULL,copy_metadata,storage,storage_params);
 }
 
+// converts the output of the pixelpipe in place to what format->write_image() expects for the given bpp.
+static void _export_convert(uint8_t *buf, size_t pixels, const int bpp, const int32_t display_byteorder,
+                            const gboolean float_input)
+{
+  if(bpp == 8)
+  {
+    if(float_input)
+    {
+      // ldr output: char, flipped to display byte order if requested
+      const float *const inbuf = (float *)buf;
+      const int swap = display_byteorder ? 2 : 0;
+      for(size_t k=0; k<pixels; k++)
+      {
+        // convert in place, this is unfortunately very serial..
+        const uint8_t r = CLAMP(inbuf[4*k+swap]*0xff, 0, 0xff);
+        const uint8_t g = CLAMP(inbuf[4*k+1]*0xff, 0, 0xff);
+        const uint8_t b = CLAMP(inbuf[4*k+2-swap]*0xff, 0, 0xff);
+        buf[4*k+0] = r;
+        buf[4*k+1] = g;
+        buf[4*k+2] = b;
+      }
+    }
+    else if(!display_byteorder)
+    {
+      // processing output was 8-bit already, just flip byte order
+#ifdef _OPENMP
+#pragma omp parallel for default(none) shared(buf, pixels) schedule(static)
+#endif
+      for(size_t k=0; k<pixels; k++)
+      {
+        uint8_t tmp = buf[4*k+0];
+        buf[4*k+0] = buf[4*k+2];
+        buf[4*k+2] = tmp;
+      }
+    }
+    // else processing output was 8-bit already, and no need to swap order
+  }
+  else if(bpp == 16)
+  {
+    // uint16_t per color channel
+    float    *buff  = (float *)   buf;
+    uint16_t *buf16 = (uint16_t *)buf;
+    for(size_t k=0; k<pixels; k++)
+    {
+      // convert in place
+      for(int i=0; i<3; i++) buf16[4*k+i] = CLAMP(buff[4*k+i]*0x10000, 0, 0xffff);
+    }
+  }
+  // else output float, no further harm done to the pixels :)
+}
+
+static int _export_exif(const uint32_t imgid, const int sRGB, const int width, const int height, uint8_t *exif_profile)
+{
+  char pathname[PATH_MAX];
+  gboolean from_cache = TRUE;
+  dt_image_full_path(imgid, pathname, sizeof(pathname), &from_cache);
+  // last param is dng mode, it's false here
+  return dt_exif_read_blob(exif_profile, pathname, imgid, sRGB, width, height, 0);
+}
+
+// strips only give the same result as the full buffer if every module computes its output from a bounded
+// neighbourhood, which is what tiling requires as well. the others (auto levels, equalizer, grain, ..) need
+// to see the whole image.
+static gboolean _export_can_stream(const dt_dev_pixelpipe_t *pipe)
+{
+  for(const GList *nodes = pipe->nodes; nodes; nodes = g_list_next(nodes))
+  {
+    const dt_dev_pixelpipe_iop_t *piece = (const dt_dev_pixelpipe_iop_t *)nodes->data;
+    if(piece->enabled && !(piece->module->flags() & IOP_FLAGS_ALLOW_TILING))
+    {
+      dt_print(DT_DEBUG_DEV, "[export] module `%s' needs the full image, not streaming\n", piece->module->op);
+      return FALSE;
+    }
+  }
+  return TRUE;
+}
+
+// pulls the image through the pipe in horizontal strips, using the roi machinery like the darkroom
+// does when zoomed in, and hands every strip to the streaming writer of the format. only the buffers
+// of one strip (each module still tiles on its own if needed) are ever held in memory.
+static int _export_strips(dt_dev_pixelpipe_t *pipe, dt_develop_t *dev, dt_imageio_module_format_t *format,
+                          dt_imageio_module_data_t *format_params, const char *filename, const uint32_t imgid,
+                          const int32_t display_byteorder, const double scale, const int bpp,
+                          void *exif, const int exif_len)
+{
+  const int width = format_params->width, height = format_params->height;
+  int rows = MAX(dt_conf_get_int("export_strip_height"), 16);
+  // input and output of the module running, and the converted strip:
+  while(rows > 16 && !dt_tiling_piece_fits_host_memory(width, rows, 4*sizeof(float), 3.0f, 0)) rows /= 2;
+  dt_print(DT_DEBUG_DEV, "[export] streaming %dx%d image in strips of %d rows\n", width, height, rows);
+
+  if(format->write_image_begin(format_params, filename, exif, exif_len, imgid)) return 1;
+  int err = 0;
+  for(int y=0; y<height && !err; y+=rows)
+  {
+    const int strip = MIN(rows, height - y);
+    if(bpp == 8)
+      err = dt_dev_pixelpipe_process(pipe, dev, 0, y, width, strip, scale);
+    else
+      err = dt_dev_pixelpipe_process_no_gamma(pipe, dev, 0, y, width, strip, scale);
+    if(err) break;
+    _export_convert(pipe->backbuf, (size_t)width*strip, bpp, display_byteorder, FALSE);
+    err = format->write_image_rows(format_params, pipe->backbuf, strip);
+  }
+  return format->write_image_end(format_params, err);
+}
+
 // internal function: to avoid exif blob reading + 8-bit byteorder flag + high-quality override
 int dt_imageio_export_with_flags(
   const uint32_t              imgid,
@@ -659,10 +774,16 @@ int dt_imageio_export_with_flags(
 
   int res = 0;
 
+  // very large exports go through the pipe in strips, if the format can write them as they come:
+  const int streaming_mp = dt_conf_get_int("export_streaming_megapixels");
+  gboolean streaming = !thumbnail_export && format->write_image_begin && streaming_mp > 0 &&
+                       (double)wd*ht >= streaming_mp*1e6;
+  const int pipe_ht = streaming ? MIN(ht, MAX(dt_conf_get_int("export_strip_height"), 16)) : ht;
+
   dt_times_t start;
   dt_get_times(&start);
   dt_dev_pixelpipe_t pipe;
-  res = thumbnail_export ? dt_dev_pixelpipe_init_thumbnail(&pipe, wd, ht) : dt_dev_pixelpipe_init_export(&pipe, wd, ht, format->levels(format_params));
+  res = thumbnail_export ? dt_dev_pixelpipe_init_thumbnail(&pipe, wd, ht) : dt_dev_pixelpipe_init_export(&pipe, wd, pipe_ht, format->levels(format_params));
   if(!res)
   {
     dt_control_log(_("failed to allocate memory for %s, please lower the threads used for export or buy more memory."), thumbnail_export ? C_("noun", "thumbnail export") : C_("noun", "export"));
@@ -747,6 +868,8 @@ int dt_imageio_export_with_flags(
     if(!strncmp(filter, "post:", 5))
       dt_dev_pixelpipe_disable_before(&pipe, filter+5);
   }
+  // the cache grows its buffers on demand, so the pipe sized for strips can still process the full image:
+  if(streaming && !_export_can_stream(&pipe)) streaming = FALSE;
   dt_show_times(&start, "[export] creating pixelpipe", NULL);
 
   // find output color profile for this image:
@@ -794,7 +917,19 @@ int dt_imageio_export_with_flags(
   // downsampling done last, if high quality processing was requested:
   uint8_t *outbuf = pipe.backbuf;
   uint8_t *moutbuf = NULL; // keep track of alloc'ed memory
+  uint8_t exif_profile[65535]; // C++ alloc'ed buffer is uncool, so we waste some bits here.
   dt_get_times(&start);
+  if(streaming && !high_quality_processing)
+  {
+    // the high quality path needs the full buffer for the final downscale, everything else can stream:
+    format_params->width  = processed_width;
+    format_params->height = processed_height;
+    const int length = ignore_exif ? 0 : _export_exif(imgid, sRGB, processed_width, processed_height, exif_profile);
+    res = _export_strips(&pipe, &dev, format, format_params, filename, imgid, display_byteorder, scale, bpp,
+                         ignore_exif ? NULL : exif_profile, length);
+    dt_show_times(&start, "[dev_process_export] streaming pixel pipeline processing", NULL);
+    goto finish;
+  }
   if(high_quality_processing)
   {
     dt_dev_pixelpipe_process_no_gamma(&pipe, &dev, 0, 0, processed_width, processed_height, scale);
@@ -828,93 +963,25 @@ int dt_imageio_export_with_flags(
   dt_show_times(&start, thumbnail_export ? "[dev_process_thumbnail] pixel pipeline processing" : "[dev_process_export] pixel pipeline processing", NULL);
 
   // downconversion to low-precision formats:
-  if(bpp == 8)
-  {
-    if(display_byteorder)
-    {
-      if(high_quality_processing)
-      {
-        const float *const inbuf = (float *)outbuf;
-        for(size_t k=0; k<(size_t)processed_width*processed_height; k++)
-        {
-          // convert in place, this is unfortunately very serial..
-          const uint8_t r = CLAMP(inbuf[4*k+2]*0xff, 0, 0xff);
-          const uint8_t g = CLAMP(inbuf[4*k+1]*0xff, 0, 0xff);
-          const uint8_t b = CLAMP(inbuf[4*k+0]*0xff, 0, 0xff);
-          outbuf[4*k+0] = r;
-          outbuf[4*k+1] = g;
-          outbuf[4*k+2] = b;
-        }
-      }
-      // else processing output was 8-bit already, and no need to swap order
-    }
-    else // need to flip 
-    {
-      // ldr output: char
-      if(high_quality_processing)
-      {
-        const float *const inbuf = (float *)outbuf;
-        for(size_t k=0; k<(size_t)processed_width*processed_height; k++)
-        {
-          // convert in place, this is unfortunately very serial..
-          const uint8_t r = CLAMP(inbuf[4*k+0]*0xff, 0, 0xff);
-          const uint8_t g = CLAMP(inbuf[4*k+1]*0xff, 0, 0xff);
-          const uint8_t b = CLAMP(inbuf[4*k+2]*0xff, 0, 0xff);
-          outbuf[4*k+0] = r;
-          outbuf[4*k+1] = g;
-          outbuf[4*k+2] = b;
-        }
-      }
-      else
-      { // !display_byteorder, need to swap:
-        uint8_t *const buf8 = pipe.backbuf;
-#ifdef _OPENMP
-#pragma omp parallel for default(none) shared(processed_width, processed_height) schedule(static)
-#endif
-        // just flip byte order
-        for(size_t k=0; k<(size_t)processed_width*processed_height; k++)
-        {
-          uint8_t tmp = buf8[4*k+0];
-          buf8[4*k+0] = buf8[4*k+2];
-          buf8[4*k+2] = tmp;
-        }
-      }
-    }
-  }
-  else if(bpp == 16)
-  {
-    // uint16_t per color channel
-    float    *buff  = (float *)   outbuf;
-    uint16_t *buf16 = (uint16_t *)outbuf;
-    for(int y=0; y<processed_height; y++) for(int x=0; x<processed_width ; x++)
-      {
-        // convert in place
-        const size_t k = (size_t)processed_width*y + x;
-        for(int i=0; i<3; i++) buf16[4*k+i] = CLAMP(buff[4*k+i]*0x10000, 0, 0xffff);
-      }
-  }
-  // else output float, no further harm done to the pixels :)
+  _export_convert(outbuf, (size_t)processed_width*processed_height, bpp, display_byteorder, high_quality_processing);
 
   format_params->width  = processed_width;
   format_params->height = processed_height;
 
+  const double trace_begin = dt_trace_begin();
   if(!ignore_exif)
   {
-    int length;
-    uint8_t exif_profile[65535]; // C++ alloc'ed buffer is uncool, so we waste some bits here.
-    char pathname[PATH_MAX];
-    gboolean from_cache = TRUE;
-    dt_image_full_path(imgid, pathname, sizeof(pathname), &from_cache);
-    // last param is dng mode, it's false here
-    length = dt_exif_read_blob(exif_profile, pathname, imgid, sRGB, processed_width, processed_height, 0);
-
+    const int length = _export_exif(imgid, sRGB, processed_width, processed_height, exif_profile);
     res = format->write_image (format_params, filename, outbuf, exif_profile, length, imgid);
   }
   else
   {
     res = format->write_image (format_params, filename, outbuf, NULL, 0, imgid);
   }
+  dt_trace_complete("export", "write", trace_begin, "\"imgid\":%d,\"format\":\"%s\",\"width\":%d,\"height\":%d",
+                    imgid, format->plugin_name, processed_width, processed_height);
 
+finish:
   dt_dev_pixelpipe_cleanup(&pipe);
   dt_dev_cleanup(&dev);
   dt_mipmap_cache_read_release(darktable.mipmap_cache, &buf);
@@ -36,6 +36,9 @@ extern "C"
   void  free_params  (struct dt_imageio_module_format_t *self, dt_imageio_module_data_t *data);
   int   set_params   (struct dt_imageio_module_format_t *self, const void *params, const int size);
   int write_image(dt_imageio_module_data_t *data, const char *filename, const void *in, void *exif, int exif_len, int imgid);
+  int write_image_begin(dt_imageio_module_data_t *data, const char *filename, void *exif, int exif_len, int imgid);
+  int write_image_rows(dt_imageio_module_data_t *data, const void *in, int rows);
+  int write_image_end(dt_imageio_module_data_t *data, int error);
   int bpp(dt_imageio_module_data_t *data);
   int flags(dt_imageio_module_data_t *data);
   int levels(dt_imageio_module_data_t *data);
@@ -69,6 +69,52 @@ void dt_imageio_jpeg_skip_input_data(j_decompress_ptr cinfo, long num_bytes)
 }
 void dt_imageio_jpeg_term_source(j_decompress_ptr cinfo) {}
 
+// reads the (cropped) scanlines to out, 4 bytes per pixel. returns non-zero if the data ended early.
+static int _read_scanlines(dt_imageio_jpeg_t *jpg, JSAMPROW row, uint8_t *out)
+{
+  const int ch = jpg->dinfo.num_components;
+  const int end = jpg->crop_y + jpg->height;
+  while((int)jpg->dinfo.output_scanline < end)
+  {
+    const int j = jpg->dinfo.output_scanline;
+    if(jpeg_read_scanlines(&(jpg->dinfo), &row, 1) != 1) return 1;
+    if(j < jpg->crop_y) continue;
+    uint8_t *tmp = out + (size_t)4*jpg->width*(j - jpg->crop_y);
+    const JSAMPLE *in = row + ch*jpg->crop_x;
+    if(ch < 3)
+      for(int i=0; i<jpg->width; i++) for(int k=0; k<3; k++)
+          tmp[4*i+k] = in[ch*i];
+    else
+      for(int i=0; i<jpg->width; i++) for(int k=0; k<3; k++)
+          tmp[4*i+k] = in[3*i+k];
+  }
+  return 0;
+}
+
+void dt_imageio_jpeg_set_scale(dt_imageio_jpeg_t *jpg, const int max_width, const int max_height)
+{
+  // libjpeg can scale by n/8 during the idct, only powers of two are fast.
+  const float scale = fmaxf(jpg->dinfo.image_width/(float)MAX(1, max_width),
+                            jpg->dinfo.image_height/(float)MAX(1, max_height));
+  int denom = 1;
+  while(denom < 8 && 2*denom <= scale) denom *= 2;
+  jpg->dinfo.scale_num = 1;
+  jpg->dinfo.scale_denom = denom;
+  jpeg_calc_output_dimensions(&(jpg->dinfo));
+  jpg->crop_x = jpg->crop_y = 0;
+  jpg->width  = jpg->dinfo.output_width;
+  jpg->height = jpg->dinfo.output_height;
+}
+
+void dt_imageio_jpeg_set_crop(dt_imageio_jpeg_t *jpg, const int x, const int y, const int width, const int height)
+{
+  jpeg_calc_output_dimensions(&(jpg->dinfo));
+  jpg->crop_x = CLAMP(x, 0, (int)jpg->dinfo.output_width  - 1);
+  jpg->crop_y = CLAMP(y, 0, (int)jpg->dinfo.output_height - 1);
+  jpg->width  = CLAMP(width,  1, (int)jpg->dinfo.output_width  - jpg->crop_x);
+  jpg->height = CLAMP(height, 1, (int)jpg->dinfo.output_height - jpg->crop_y);
+}
+
 
 int dt_imageio_jpeg_decompress_header(const void *in, size_t length, dt_imageio_jpeg_t *jpg)
 {
@@ -95,6 +141,7 @@ int dt_imageio_jpeg_decompress_header(const void *in, size_t length, dt_imageio_
   jpeg_read_header(&(jpg->dinfo), TRUE);
   jpg->width  = jpg->dinfo.image_width;
   jpg->height = jpg->dinfo.image_height;
+  jpg->crop_x = jpg->crop_y = 0;
   return 0;
 }
 
@@ -110,17 +157,10 @@ int dt_imageio_jpeg_decompress(dt_imageio_jpeg_t *jpg, uint8_t *out)
   (void)jpeg_start_decompress(&(jpg->dinfo));
   JSAMPROW row_pointer[1];
   row_pointer[0] = (uint8_t *)malloc(jpg->dinfo.output_width*jpg->dinfo.num_components);
-  uint8_t *tmp = out;
-  while(jpg->dinfo.output_scanline < jpg->dinfo.image_height)
+  if(_read_scanlines(jpg, row_pointer[0], out))
   {
-    if(jpeg_read_scanlines(&(jpg->dinfo), row_pointer, 1) != 1)
-    {
-      free(row_pointer[0]);
-      return 1;
-    }
-    for(unsigned int i=0; i<jpg->dinfo.image_width; i++) for(int k=0; k<3; k++)
-        tmp[4*i+k] = row_pointer[0][3*i+k];
-    tmp += 4*jpg->width;
+    free(row_pointer[0]);
+    return 1;
   }
   // jpg->dinfo.src = NULL;
   // (void)jpeg_finish_decompress(&(jpg->dinfo)); // ???
@@ -499,6 +539,7 @@ int dt_imageio_jpeg_read_header(const char *filename, dt_imageio_jpeg_t *jpg)
   jpeg_read_header(&(jpg->dinfo), TRUE);
   jpg->width  = jpg->dinfo.image_width;
   jpg->height = jpg->dinfo.image_height;
+  jpg->crop_x = jpg->crop_y = 0;
   return 0;
 }
 
@@ -515,23 +556,12 @@ int dt_imageio_jpeg_read(dt_imageio_jpeg_t *jpg, uint8_t *out)
   (void)jpeg_start_decompress(&(jpg->dinfo));
   JSAMPROW row_pointer[1];
   row_pointer[0] = (uint8_t *)malloc(jpg->dinfo.output_width*jpg->dinfo.num_components);
-  uint8_t *tmp = out;
-  while(jpg->dinfo.output_scanline < jpg->dinfo.image_height)
+  if(_read_scanlines(jpg, row_pointer[0], out))
   {
-    if(jpeg_read_scanlines(&(jpg->dinfo), row_pointer, 1) != 1)
-    {
-      jpeg_destroy_decompress(&(jpg->dinfo));
-      free(row_pointer[0]);
-      fclose(jpg->f);
-      return 1;
-    }
-    if(jpg->dinfo.num_components < 3)
-      for(unsigned int i=0; i<jpg->dinfo.image_width; i++) for(int k=0; k<3; k++)
-          tmp[4*i+k] = row_pointer[0][jpg->dinfo.num_components*i+0];
-    else
-      for(unsigned int i=0; i<jpg->dinfo.image_width; i++) for(int k=0; k<3; k++)
-          tmp[4*i+k] = row_pointer[0][3*i+k];
-    tmp += 4*jpg->width;
+    jpeg_destroy_decompress(&(jpg->dinfo));
+    free(row_pointer[0]);
+    fclose(jpg->f);
+    return 1;
   }
   // (void)jpeg_finish_decompress(&(jpg->dinfo));
   jpeg_destroy_decompress(&(jpg->dinfo));
@@ -549,7 +579,9 @@ int dt_imageio_jpeg_read_profile(dt_imageio_jpeg_t *jpg, uint8_t **out)
   return res?length:0;
 }
 
-dt_imageio_retval_t dt_imageio_open_jpeg(dt_image_t *img,  const char *filename, dt_mipmap_cache_allocator_t a)
+// reads the jpeg to a new 8-bit buffer in tmp and fills in img. decodes at reduced size if max_width/max_height are set.
+static dt_imageio_retval_t _open_jpeg(dt_image_t *img, const char *filename, const int max_width, const int max_height,
+                                      dt_imageio_jpeg_t *jpg, uint8_t **tmp)
 {
   const char *ext = filename + strlen(filename);
   while(*ext != '.' && ext > filename) ext--;
@@ -561,18 +593,32 @@ dt_imageio_retval_t dt_imageio_open_jpeg(dt_image_t *img,  const char *filename,
 
   const int orientation = dt_image_orientation(img);
 
-  dt_imageio_jpeg_t jpg;
-  if(dt_imageio_jpeg_read_header(filename, &jpg)) return DT_IMAGEIO_FILE_CORRUPTED;
-  img->width  = (orientation & 4) ? jpg.height : jpg.width;
-  img->height = (orientation & 4) ? jpg.width  : jpg.height;
+  if(dt_imageio_jpeg_read_header(filename, jpg)) return DT_IMAGEIO_FILE_CORRUPTED;
+  img->width  = (orientation & 4) ? jpg->height : jpg->width;
+  img->height = (orientation & 4) ? jpg->width  : jpg->height;
 
+  if(max_width > 0 && max_height > 0)
+  {
+    if(orientation & 4) dt_imageio_jpeg_set_scale(jpg, max_height, max_width);
+    else                dt_imageio_jpeg_set_scale(jpg, max_width, max_height);
+  }
 
-  uint8_t *tmp = (uint8_t *)malloc(sizeof(uint8_t)*jpg.width*jpg.height*4);
-  if(dt_imageio_jpeg_read(&jpg, tmp))
+  *tmp = (uint8_t *)malloc(sizeof(uint8_t)*jpg->width*jpg->height*4);
+  if(dt_imageio_jpeg_read(jpg, *tmp))
   {
-    free(tmp);
+    free(*tmp);
+    *tmp = NULL;
     return DT_IMAGEIO_FILE_CORRUPTED;
   }
+  return DT_IMAGEIO_OK;
+}
+
+dt_imageio_retval_t dt_imageio_open_jpeg(dt_image_t *img,  const char *filename, dt_mipmap_cache_allocator_t a)
+{
+  dt_imageio_jpeg_t jpg;
+  uint8_t *tmp = NULL;
+  const dt_imageio_retval_t ret = _open_jpeg(img, filename, 0, 0, &jpg, &tmp);
+  if(ret != DT_IMAGEIO_OK) return ret;
 
   img->bpp = 4*sizeof(float);
   void *buf = dt_mipmap_cache_alloc(img, DT_MIPMAP_FULL, a);
@@ -582,7 +628,33 @@ dt_imageio_retval_t dt_imageio_open_jpeg(dt_image_t *img,  const char *filename,
     return DT_IMAGEIO_CACHE_FULL;
   }
 
-  dt_imageio_flip_buffers_ui8_to_float((float *)buf, tmp, 0.0f, 255.0f, 4, jpg.width, jpg.height, jpg.width, jpg.height, 4*jpg.width, orientation);
+  dt_imageio_flip_buffers_ui8_to_float((float *)buf, tmp, 0.0f, 255.0f, 4, jpg.width, jpg.height, jpg.width, jpg.height, 4*jpg.width, dt_image_orientation(img));
+
+  free(tmp);
+
+  return DT_IMAGEIO_OK;
+}
+
+dt_imageio_retval_t dt_imageio_open_jpeg_scaled(dt_image_t *img, const char *filename, const int max_width, const int max_height,
+    float **out, int *width, int *height)
+{
+  dt_imageio_jpeg_t jpg;
+  uint8_t *tmp = NULL;
+  const dt_imageio_retval_t ret = _open_jpeg(img, filename, max_width, max_height, &jpg, &tmp);
+  if(ret != DT_IMAGEIO_OK) return ret;
+
+  img->bpp = 4*sizeof(float);
+  *out = (float *)dt_alloc_align(16, sizeof(float)*4*jpg.width*jpg.height);
+  if(!*out)
+  {
+    free(tmp);
+    return DT_IMAGEIO_CACHE_FULL;
+  }
+
+  const int orientation = dt_image_orientation(img);
+  dt_imageio_flip_buffers_ui8_to_float(*out, tmp, 0.0f, 255.0f, 4, jpg.width, jpg.height, jpg.width, jpg.height, 4*jpg.width, orientation);
+  *width  = (orientation & 4) ? jpg.height : jpg.width;
+  *height = (orientation & 4) ? jpg.width  : jpg.height;
 
   free(tmp);
 
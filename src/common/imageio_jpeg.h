@@ -34,6 +34,7 @@
 typedef struct dt_imageio_jpeg_t
 {
   int width, height;
+  int crop_x, crop_y;
   struct jpeg_source_mgr src;
   struct jpeg_destination_mgr dest;
   struct jpeg_decompress_struct dinfo;
@@ -46,6 +47,12 @@ dt_imageio_jpeg_t;
 int dt_imageio_jpeg_decompress_header(const void *in, size_t length, dt_imageio_jpeg_t *jpg);
 /** reads the whole image to the out buffer, which has to be large enough. */
 int dt_imageio_jpeg_decompress(dt_imageio_jpeg_t *jpg, uint8_t *out);
+/** decode at 1/2, 1/4 or 1/8 of the size in the dct domain: the smallest one which still covers
+    max_width x max_height when scaled to fit. call after reading the header, updates width/height. */
+void dt_imageio_jpeg_set_scale(dt_imageio_jpeg_t *jpg, const int max_width, const int max_height);
+/** only decode the region at x, y of size width x height of the (scaled) image. call after setting
+    the scale, updates width/height. */
+void dt_imageio_jpeg_set_crop(dt_imageio_jpeg_t *jpg, const int x, const int y, const int width, const int height);
 /** compresses in to out buffer with given quality (0..100). out buffer must be large enough. returns actual data length. */
 int dt_imageio_jpeg_compress(const uint8_t *in, uint8_t *out, const int width, const int height, const int quality);
 
@@ -62,6 +69,11 @@ int dt_imageio_jpeg_read_profile(dt_imageio_jpeg_t *jpg, uint8_t **out);
 
 /** utility function to read and open jpeg from imagio.c */
 dt_imageio_retval_t dt_imageio_open_jpeg(dt_image_t *img, const char *filename, dt_mipmap_cache_allocator_t a);
+/** for thumbnail-only requests: reads the jpeg decoded at reduced size, covering at least max_width x max_height
+    after orientation. returns a float buffer allocated with dt_alloc_align in out and its size in width/height.
+    fills in img like dt_imageio_open_jpeg(), with the full size. */
+dt_imageio_retval_t dt_imageio_open_jpeg_scaled(dt_image_t *img, const char *filename, const int max_width, const int max_height,
+    float **out, int *width, int *height);
 #endif
 // modelines: These editor modelines have been set for all relevant files by tools/update_modelines.sh
 // vim: shiftwidth=2 expandtab tabstop=2 cindent
@@ -104,6 +104,10 @@ dt_imageio_load_module_format (dt_imageio_module_format_t *module, const char *l
   if(!g_module_symbol(module->module, "flags",                        (gpointer)&(module->flags)))                        module->flags = _default_format_flags;
   if(!g_module_symbol(module->module, "levels",                       (gpointer)&(module->levels)))                       module->levels = _default_format_levels;
   if(!g_module_symbol(module->module, "read_image",                   (gpointer)&(module->read_image)))                   module->read_image = NULL;
+  if(!g_module_symbol(module->module, "write_image_begin",            (gpointer)&(module->write_image_begin)) ||
+     !g_module_symbol(module->module, "write_image_rows",             (gpointer)&(module->write_image_rows)) ||
+     !g_module_symbol(module->module, "write_image_end",              (gpointer)&(module->write_image_end)))
+    module->write_image_begin = NULL;
 
 #ifdef USE_LUA
   {
@@ -102,6 +102,13 @@ typedef struct dt_imageio_module_format_t
   int (*bpp)(dt_imageio_module_data_t *data);
   /* write to file, with exif if not NULL, and icc profile if supported. */
   int (*write_image)(dt_imageio_module_data_t *data, const char *filename, const void *in, void *exif, int exif_len, int imgid);
+  /* optional streaming version of write_image, for images too large to be held in memory at once.
+   * begin opens the file for data->width x data->height pixels and keeps exif until end is called,
+   * rows is called with consecutive blocks of rows (same layout as for write_image) from top to bottom,
+   * and end finishes the file, or only cleans up if error is set. all return != 0 on fail. */
+  int (*write_image_begin)(dt_imageio_module_data_t *data, const char *filename, void *exif, int exif_len, int imgid);
+  int (*write_image_rows)(dt_imageio_module_data_t *data, const void *in, int rows);
+  int (*write_image_end)(dt_imageio_module_data_t *data, int error);
   /* flag that describes the available precision/levels of output format. mainly used for dithering. */
   int (*levels)(dt_imageio_module_data_t *data);
 
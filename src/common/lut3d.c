@@ -0,0 +1,190 @@
+/*
+    This file is part of darktable,
+    copyright (c) 2026 agent.
+
+    darktable is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    darktable is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with darktable.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef DT_UNIT_TEST
+#include "common/darktable.h"
+#endif
+#include "common/lut3d.h"
+
+#include <glib.h>
+#include <math.h>
+#include <stdlib.h>
+#include <string.h>
+#include <xmmintrin.h>
+#include <emmintrin.h>
+
+// maps input values to [0,1] before they are scaled to node coordinates:
+static void _domain(const dt_lut3d_domain_t domain, float offset[4], float scale[4])
+{
+  if(domain == DT_LUT3D_DOMAIN_LAB)
+  {
+    offset[0] = 0.0f;   scale[0] = 1.0f/100.0f;
+    // the icc encoding of a and b, so the nodes coincide with those of lut based profiles:
+    offset[1] = 128.0f; scale[1] = 1.0f/255.0f;
+    offset[2] = 128.0f; scale[2] = 1.0f/255.0f;
+  }
+  else
+  {
+    for(int k=0; k<3; k++)
+    {
+      offset[k] = 0.0f;
+      scale[k] = 1.0f;
+    }
+  }
+  offset[3] = 0.0f;
+  scale[3] = 0.0f;
+}
+
+void dt_lut3d_fingerprint(uint8_t key[16], cmsHPROFILE *profiles, const int num_profiles, const int *settings,
+                          const int num_settings)
+{
+  GChecksum *checksum = g_checksum_new(G_CHECKSUM_MD5);
+  for(int k=0; k<num_profiles; k++)
+  {
+    cmsUInt8Number id[16] = {0};
+    // the id in the header is not always set, compute it from the contents:
+    if(profiles[k] && cmsMD5computeID(profiles[k])) cmsGetHeaderProfileID(profiles[k], id);
+    g_checksum_update(checksum, id, sizeof(id));
+  }
+  g_checksum_update(checksum, (const guchar *)settings, num_settings*sizeof(int));
+  gsize length = 16;
+  g_checksum_get_digest(checksum, key, &length);
+  g_checksum_free(checksum);
+}
+
+void dt_lut3d_cleanup(dt_lut3d_t *lut)
+{
+  dt_free_align(lut->table);
+  lut->table = NULL;
+  lut->res = 0;
+}
+
+int dt_lut3d_compile(dt_lut3d_t *lut, const int res, const dt_lut3d_domain_t domain, const uint8_t key[16],
+                     cmsHTRANSFORM xform, cmsHTRANSFORM xform2)
+{
+  if(lut->table && lut->res == res && lut->domain == domain && !memcmp(lut->key, key, sizeof(lut->key)))
+    return 0;
+  dt_lut3d_cleanup(lut);
+  if(!xform || res < 2) return 1;
+
+  const size_t num = (size_t)res*res*res;
+  float *table = (float *)dt_alloc_align(16, 4*sizeof(float)*num);
+  float *nodes = (float *)dt_alloc_align(16, 4*sizeof(float)*num);
+  if(!table || !nodes)
+  {
+    dt_free_align(table);
+    dt_free_align(nodes);
+    return 1;
+  }
+
+  float offset[4], scale[4];
+  _domain(domain, offset, scale);
+  float *n = nodes;
+  for(int b=0; b<res; b++) for(int g=0; g<res; g++) for(int r=0; r<res; r++, n+=4)
+  {
+    const int c[3] = {r, g, b};
+    for(int k=0; k<3; k++)
+    {
+      float x = c[k]/(res - 1.0f);
+      if(domain == DT_LUT3D_DOMAIN_RGB) x *= x;
+      n[k] = x/scale[k] - offset[k];
+    }
+    n[3] = 0.0f;
+  }
+
+  if(xform2)
+  {
+    cmsDoTransform(xform, nodes, table, num);
+    for(size_t k=0; k<4*num; k++) table[k] = fminf(fmaxf(table[k], 0.0f), 1.0f);
+    cmsDoTransform(xform2, table, nodes, num);
+    memcpy(table, nodes, 4*sizeof(float)*num);
+  }
+  else cmsDoTransform(xform, nodes, table, num);
+  dt_free_align(nodes);
+
+  lut->table = table;
+  lut->res = res;
+  lut->domain = domain;
+  memcpy(lut->key, key, sizeof(lut->key));
+  return 0;
+}
+
+void dt_lut3d_apply(const dt_lut3d_t *lut, const float *in, float *out, const size_t num)
+{
+  const int res = lut->res;
+  const float *const table = lut->table;
+  // node strides in floats:
+  const int sx = 4, sy = 4*res, sz = 4*res*res;
+  float offset[4], scale[4];
+  _domain(lut->domain, offset, scale);
+  const __m128 off = _mm_load_ps(offset), sc = _mm_load_ps(scale);
+  const __m128 zero = _mm_setzero_ps(), one = _mm_set1_ps(1.0f);
+  const __m128 nodes = _mm_set1_ps(res - 1.0f);
+  const __m128i last = _mm_set1_epi32(res - 2);
+  const int rgb = lut->domain == DT_LUT3D_DOMAIN_RGB;
+  const __m128 color = _mm_castsi128_ps(_mm_set_epi32(0, -1, -1, -1));
+
+  for(size_t j=0; j<num; j++, in+=4, out+=4)
+  {
+    const __m128 pixel = _mm_load_ps(in);
+    // node coordinates, the cell and the position inside:
+    // max/min return their second operand if one is NaN, so NaN ends up at 0 here:
+    __m128 f = _mm_min_ps(_mm_max_ps(_mm_mul_ps(_mm_add_ps(pixel, off), sc), zero), one);
+    if(rgb) f = _mm_sqrt_ps(f);
+    f = _mm_mul_ps(f, nodes);
+    __m128i i = _mm_cvttps_epi32(f);
+    // _mm_min_epi32 is sse4.1:
+    const __m128i over = _mm_cmpgt_epi32(i, last);
+    i = _mm_or_si128(_mm_and_si128(over, last), _mm_andnot_si128(over, i));
+    const __m128 d = _mm_sub_ps(f, _mm_cvtepi32_ps(i));
+    int idx[4] __attribute__((aligned(16)));
+    float w[4] __attribute__((aligned(16)));
+    _mm_store_si128((__m128i *)idx, i);
+    _mm_store_ps(w, d);
+
+    // tetrahedral interpolation: walk from the first to the last corner of the cell
+    // along the edges in the order of decreasing weights.
+    const float *c0 = table + (size_t)idx[0]*sx + (size_t)idx[1]*sy + (size_t)idx[2]*sz;
+    int o1, o2;
+    float w1, w2, w3;
+    if(w[0] >= w[1])
+    {
+      if(w[1] >= w[2])      { o1 = sx; o2 = sx+sy; w1 = w[0]; w2 = w[1]; w3 = w[2]; }
+      else if(w[0] >= w[2]) { o1 = sx; o2 = sx+sz; w1 = w[0]; w2 = w[2]; w3 = w[1]; }
+      else                  { o1 = sz; o2 = sz+sx; w1 = w[2]; w2 = w[0]; w3 = w[1]; }
+    }
+    else
+    {
+      if(w[2] >= w[1])      { o1 = sz; o2 = sz+sy; w1 = w[2]; w2 = w[1]; w3 = w[0]; }
+      else if(w[2] >= w[0]) { o1 = sy; o2 = sy+sz; w1 = w[1]; w2 = w[2]; w3 = w[0]; }
+      else                  { o1 = sy; o2 = sy+sx; w1 = w[1]; w2 = w[0]; w3 = w[2]; }
+    }
+    const __m128 v0 = _mm_load_ps(c0);
+    const __m128 v1 = _mm_load_ps(c0 + o1);
+    const __m128 v2 = _mm_load_ps(c0 + o2);
+    const __m128 v3 = _mm_load_ps(c0 + sx + sy + sz);
+    __m128 res4 = _mm_add_ps(v0, _mm_mul_ps(_mm_set1_ps(w1), _mm_sub_ps(v1, v0)));
+    res4 = _mm_add_ps(res4, _mm_mul_ps(_mm_set1_ps(w2), _mm_sub_ps(v2, v1)));
+    res4 = _mm_add_ps(res4, _mm_mul_ps(_mm_set1_ps(w3), _mm_sub_ps(v3, v2)));
+    // pass the fourth channel through:
+    _mm_store_ps(out, _mm_or_ps(_mm_and_ps(color, res4), _mm_andnot_ps(color, pixel)));
+  }
+}
+
+// modelines: These editor modelines have been set for all relevant files by tools/update_modelines.sh
+// vim: shiftwidth=2 expandtab tabstop=2 cindent
+// kate: tab-indents: off; indent-width 2; replace-tabs on; indent-mode cstyle; remove-trailing-space on;
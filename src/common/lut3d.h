@@ -0,0 +1,75 @@
+/*
+    This file is part of darktable,
+    copyright (c) 2026 agent.
+
+    darktable is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    darktable is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with darktable.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef DT_LUT3D_H
+#define DT_LUT3D_H
+
+#include <lcms2.h>
+#include <inttypes.h>
+#include <stddef.h>
+
+/**
+ * lcms2 float transforms through lut based profiles are slow, as lcms
+ * evaluates the whole pipeline of the profiles for every pixel. these
+ * helpers sample such a transform once on a regular grid and evaluate
+ * the grid with tetrahedral interpolation instead.
+ */
+
+/** number of nodes per axis the color modules use. */
+#define DT_LUT3D_RES 33
+
+typedef enum dt_lut3d_domain_t
+{
+  DT_LUT3D_DOMAIN_RGB = 0,  // rgb in [0,1], nodes spaced evenly in sqrt(x) for precision in the shadows
+  DT_LUT3D_DOMAIN_LAB = 1   // L in [0,100], a and b in [-128,127]
+}
+dt_lut3d_domain_t;
+
+typedef struct dt_lut3d_t
+{
+  int res;                  // nodes per axis
+  dt_lut3d_domain_t domain;
+  float *table;             // res^3 nodes of 4 floats, first coordinate varying fastest. NULL if not compiled
+  uint8_t key[16];          // fingerprint of what the table was compiled from
+}
+dt_lut3d_t;
+
+/** fingerprint of the given profiles (NULL entries are fine) and settings (intent, flags..). */
+void dt_lut3d_fingerprint(uint8_t key[16], cmsHPROFILE *profiles, const int num_profiles, const int *settings,
+                          const int num_settings);
+
+/** samples xform (4 floats in and out per pixel), followed by xform2 on the result clipped to [0,1] if that is
+    not NULL. keeps the current table if it was compiled from the same key. returns 0 on success. */
+int dt_lut3d_compile(dt_lut3d_t *lut, const int res, const dt_lut3d_domain_t domain, const uint8_t key[16],
+                     cmsHTRANSFORM xform, cmsHTRANSFORM xform2);
+
+/** frees the table. */
+void dt_lut3d_cleanup(dt_lut3d_t *lut);
+
+static inline int dt_lut3d_valid(const dt_lut3d_t *lut)
+{
+  return lut->table != NULL;
+}
+
+/** converts num pixels of 4 floats, in and out 16-byte aligned. input outside of the domain is clamped, the fourth
+    channel is passed through. */
+void dt_lut3d_apply(const dt_lut3d_t *lut, const float *in, float *out, const size_t num);
+
+#endif
+// modelines: These editor modelines have been set for all relevant files by tools/update_modelines.sh
+// vim: shiftwidth=2 expandtab tabstop=2 cindent
+// kate: tab-indents: off; indent-width 2; replace-tabs on; indent-mode cstyle; remove-trailing-space on;
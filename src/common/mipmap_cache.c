@@ -24,6 +24,7 @@
 #include "common/imageio_module.h"
 #include "common/imageio_jpeg.h"
 #include "common/mipmap_cache.h"
+#include "common/trace.h"
 #include "control/conf.h"
 #include "control/jobs.h"
 #include "libraw/libraw.h"
@@ -42,9 +43,8 @@
 #include <glib/gstdio.h>
 #include <errno.h>
 #include <xmmintrin.h>
+#include <emmintrin.h>
 
-#define DT_MIPMAP_CACHE_FILE_MAGIC 0xD71337
-#define DT_MIPMAP_CACHE_FILE_VERSION 23
 #define DT_MIPMAP_CACHE_DEFAULT_FILE_NAME "mipmaps"
 
 #define DT_MIPMAP_BUFFER_DSC_FLAG_GENERATE (1<<0)
@@ -155,63 +155,6 @@ get_size(const uint32_t key)
   return (dt_mipmap_size_t)(key >> 29);
 }
 
-typedef struct _iterate_data_t
-{
-  FILE *f;
-  uint8_t *blob;
-  int compression_type;
-  dt_mipmap_size_t mip;
-}
-_iterate_data_t;
-
-static int
-_write_buffer(const uint32_t key, const void *data, void *user_data)
-{
-  if(!data) return 1;
-  struct dt_mipmap_buffer_dsc* dsc = (struct dt_mipmap_buffer_dsc*)data;
-  // too small to write. no error, but don't write.
-  if(dsc->width <= 8 && dsc->height <= 8) return 0;
-
-  _iterate_data_t *d = (_iterate_data_t *)user_data;
-  int written = fwrite(&(d->mip), sizeof(dt_mipmap_size_t), 1, d->f);
-  if(written != 1) return 1;
-  written = fwrite(&key, sizeof(uint32_t), 1, d->f);
-  if(written != 1) return 1;
-
-  if(d->compression_type)
-  {
-    // write buffer size, wd, ht and the full blob, as it is in memory.
-    const int32_t length = compressed_buffer_size(d->compression_type, dsc->width, dsc->height);
-    written = fwrite(&length, sizeof(int32_t), 1, d->f);
-    if(written != 1) return 1;
-    written = fwrite(&dsc->width, sizeof(int32_t), 1, d->f);
-    if(written != 1) return 1;
-    written = fwrite(&dsc->height, sizeof(int32_t), 1, d->f);
-    if(written != 1) return 1;
-    written = fwrite(dsc+1, sizeof(uint8_t), length, d->f);
-    if(written != length) return 1;
-  }
-  else
-  {
-    dt_mipmap_buffer_t buf;
-    buf.width  = dsc->width;
-    buf.height = dsc->height;
-    buf.imgid  = get_imgid(key);
-    buf.size   = get_size(key);
-    // skip to next 8-byte alignment, for sse buffers.
-    buf.buf    = (uint8_t *)(dsc+1);
-
-    const int cache_quality = dt_conf_get_int("database_cache_quality");
-    const int32_t length = dt_imageio_jpeg_compress(buf.buf, d->blob, buf.width, buf.height, MIN(100, MAX(10, cache_quality)));
-    written = fwrite(&length, sizeof(int32_t), 1, d->f);
-    if(written != 1) return 1;
-    written = fwrite(d->blob, sizeof(uint8_t), length, d->f);
-    if(written != length) return 1;
-  }
-
-  return 0;
-}
-
 static int
 dt_mipmap_cache_get_filename(
   gchar* mipmapfilename, size_t size)
@@ -254,235 +197,123 @@ exit:
   return r;
 }
 
-static int
-dt_mipmap_cache_serialize(dt_mipmap_cache_t *cache)
+// opens the on-disk store of the 8-bit levels, next to the library the thumbnails belong to.
+static void
+dt_mipmap_cache_store_init(dt_mipmap_cache_t *cache)
 {
+  uint32_t max_width[DT_MIPMAP_F], max_height[DT_MIPMAP_F];
+  for(int k=DT_MIPMAP_0; k<DT_MIPMAP_F; k++)
+  {
+    max_width[k] = cache->mip[k].max_width;
+    max_height[k] = cache->mip[k].max_height;
+  }
+
   gchar dbfilename[PATH_MAX];
   if (dt_mipmap_cache_get_filename(dbfilename, sizeof(dbfilename)))
   {
-    fprintf(stderr, "[mipmap_cache] could not retrieve cache filename; not serializing\n");
-    return 1;
+    fprintf(stderr, "[mipmap_cache] could not retrieve cache filename; not keeping thumbnails on disk\n");
+    dt_mipmap_store_init(&cache->store, NULL, cache->compression_type, max_width, max_height, FALSE);
+    return;
   }
   if (!strcmp(dbfilename, ":memory:"))
   {
-    // fprintf(stderr, "[mipmap_cache] library is in memory; not serializing\n");
-    return 0;
-  }
-
-  // only store smallest thumbs.
-  const dt_mipmap_size_t mip = DT_MIPMAP_2;
-
-  _iterate_data_t d;
-  d.f = NULL;
-  d.blob = (uint8_t *)malloc(cache->mip[mip].buffer_size);
-  int written = 0;
-  FILE *f = fopen(dbfilename, "wb");
-  if(!f) goto write_error;
-  d.f = f;
-  // fprintf(stderr, "[mipmap_cache] serializing to `%s'\n", dbfilename);
-
-  // write version info:
-  const int32_t magic = DT_MIPMAP_CACHE_FILE_MAGIC + DT_MIPMAP_CACHE_FILE_VERSION;
-  written = fwrite(&magic, sizeof(int32_t), 1, f);
-  if(written != 1) goto write_error;
-
-  // store compression type
-  written = fwrite(&cache->compression_type, sizeof(int32_t), 1, f);
-  if(written != 1) goto write_error;
-
-  for(int i=0; i<=mip; i++)
-  {
-    // print max sizes for this cache
-    written = fwrite(&cache->mip[i].max_width, sizeof(int32_t), 1, f);
-    if(written != 1) goto write_error;
-    written = fwrite(&cache->mip[i].max_height, sizeof(int32_t), 1, f);
-    if(written != 1) goto write_error;
+    // library is in memory, so are the thumbnails.
+    dt_mipmap_store_init(&cache->store, NULL, cache->compression_type, max_width, max_height, FALSE);
+    return;
   }
 
-  for(int i=0; i<=mip; i++)
+  // the single file older versions wrote at shutdown is superseded by the store:
+  if(g_file_test(dbfilename, G_FILE_TEST_IS_REGULAR))
   {
-    d.mip = (dt_mipmap_size_t)i;
-    d.compression_type = cache->compression_type;
-    if(dt_cache_for_all(&cache->mip[i].cache, _write_buffer, &d)) goto write_error;
+    fprintf(stderr, "[mipmap_cache] dropping old thumbnail cache `%s'\n", dbfilename);
+    g_unlink(dbfilename);
   }
 
-  free(d.blob);
-  fclose(f);
-  return 0;
-
-write_error:
-  fprintf(stderr, "[mipmap_cache] serialization to `%s' failed!\n", dbfilename);
-  if(f) fclose(f);
-  free(d.blob);
-  return 1;
+  // drop any old thumbnails if the database is new. newly imported images would probably be mapped to them.
+  const gboolean drop = dt_database_is_new(darktable.db);
+  gchar *path = g_strconcat(dbfilename, ".d", NULL);
+  dt_mipmap_store_init(&cache->store, path, cache->compression_type, max_width, max_height, drop);
+  g_free(path);
 }
 
+// fills an 8-bit buffer from the on-disk store. returns 0 on success.
 static int
-dt_mipmap_cache_deserialize(dt_mipmap_cache_t *cache)
+dt_mipmap_cache_store_read(
+  dt_mipmap_cache_t *cache,
+  struct dt_mipmap_buffer_dsc *dsc,
+  const uint32_t imgid,
+  const dt_mipmap_size_t mip)
 {
-  size_t rd = 0;
-  const dt_mipmap_size_t mip = DT_MIPMAP_2;
-  uint32_t *blob = NULL;
-  FILE *f = NULL;
-  int file_width[mip+1], file_height[mip+1];
-
-  gchar dbfilename[PATH_MAX];
-  if (dt_mipmap_cache_get_filename(dbfilename, sizeof(dbfilename)))
-  {
-    fprintf(stderr, "[mipmap_cache] could not retrieve cache filename; not deserializing\n");
-    return 1;
-  }
-  if (!strcmp(dbfilename, ":memory:"))
-  {
-    // fprintf(stderr, "[mipmap_cache] library is in memory; not deserializing\n");
-    return 0;
-  }
-
-  // drop any old cache if the database is new. in that case newly imported images will probably mapped to old thumbnails
-  if(dt_database_is_new(darktable.db) && g_file_test(dbfilename, G_FILE_TEST_IS_REGULAR))
+  const double trace_begin = dt_trace_begin();
+  uint32_t width = 0, height = 0;
+  size_t length = 0;
+  if(cache->compression_type)
   {
-    fprintf(stderr, "[mipmap_cache] database is new, dropping old cache `%s'\n", dbfilename);
-    goto read_finalize;
+    // stored as it is in memory:
+    const size_t max_length = compressed_buffer_size(cache->compression_type, cache->mip[mip].max_width, cache->mip[mip].max_height);
+    if(dt_mipmap_store_read(&cache->store, mip, imgid, &width, &height, (uint8_t *)(dsc+1), max_length, &length) ||
+       length != compressed_buffer_size(cache->compression_type, width, height))
+      return 1;
   }
-
-  f = fopen(dbfilename, "rb");
-  if(!f)
+  else
   {
-    if (errno == ENOENT)
+    // no compression, the image is still compressed on disk, as jpg
+    const size_t max_length = cache->mip[mip].buffer_size;
+    uint8_t *blob = (uint8_t *)malloc(max_length);
+    if(!blob) return 1;
+    dt_imageio_jpeg_t jpg;
+    int err = dt_mipmap_store_read(&cache->store, mip, imgid, &width, &height, blob, max_length, &length);
+    if(!err &&
+       (dt_imageio_jpeg_decompress_header(blob, length, &jpg) ||
+        (jpg.width > cache->mip[mip].max_width || jpg.height > cache->mip[mip].max_height) ||
+        dt_imageio_jpeg_decompress(&jpg, (uint8_t *)(dsc+1))))
     {
-      fprintf(stderr, "[mipmap_cache] cache is empty, file `%s' doesn't exist\n", dbfilename);
+      fprintf(stderr, "[mipmap_cache] failed to decompress thumbnail for image %d!\n", imgid);
+      err = 1;
     }
-    else
-    {
-      fprintf(stderr, "[mipmap_cache] failed to open the cache from `%s'\n", dbfilename);
-    }
-    goto read_finalize;
-  }
-
-  // read version info:
-  const int32_t magic = DT_MIPMAP_CACHE_FILE_MAGIC + DT_MIPMAP_CACHE_FILE_VERSION;
-  int32_t magic_file = 0;
-  rd = fread(&magic_file, sizeof(int32_t), 1, f);
-  if(rd != 1) goto read_error;
-  if(magic_file == DT_MIPMAP_CACHE_FILE_MAGIC + 22)
-  {
-    // same format, but compression was broken in 22 and below
-  }
-  else if(magic_file != magic)
-  {
-    if(magic_file > DT_MIPMAP_CACHE_FILE_MAGIC && magic_file < magic)
-      fprintf(stderr, "[mipmap_cache] cache version too old, dropping `%s' cache\n", dbfilename);
-    else
-      fprintf(stderr, "[mipmap_cache] invalid cache file, dropping `%s' cache\n", dbfilename);
-    goto read_finalize;
+    free(blob);
+    if(err) return 1;
+    width = jpg.width;
+    height = jpg.height;
   }
+  dsc->width = width;
+  dsc->height = height;
+  dt_trace_complete("mipmap", "read from disk", trace_begin, "\"imgid\":%u,\"mip\":%d,\"bytes\":%zu",
+                    imgid, (int)mip, length);
+  return 0;
+}
 
-  // also read compression type and yell out on missmatch.
-  int32_t compression = -1;
-  rd = fread(&compression, sizeof(int32_t), 1, f);
-  if(rd != 1) goto read_error;
-  if(compression != cache->compression_type)
-  {
-    fprintf(stderr, "[mipmap_cache] cache is %s, but settings say we should use %s, dropping `%s' cache\n",
-            compression == 0 ? "uncompressed" : (compression == 1 ? "low quality compressed" : "high quality compressed"),
-            cache->compression_type == 0 ? "no compression" : (cache->compression_type == 1 ? "low quality compression" : "high quality compression"),
-            dbfilename);
-    goto read_finalize;
-  }
-  if(compression && (magic_file == DT_MIPMAP_CACHE_FILE_MAGIC + 22))
-  {
-    // compression is enabled and we have the affected version. can't read that.
-    fprintf(stderr, "[mipmap_cache] dropping compressed cache v22 to regenerate mips without artifacts.\n");
-    goto read_finalize;
-  }
+// appends a freshly generated 8-bit buffer to the on-disk store.
+static void
+dt_mipmap_cache_store_write(
+  dt_mipmap_cache_t *cache,
+  const struct dt_mipmap_buffer_dsc *dsc,
+  const uint32_t imgid,
+  const dt_mipmap_size_t mip)
+{
+  // too small to write (failed, or a skull). no error, but don't write.
+  if(dsc->width <= 8 && dsc->height <= 8) return;
 
-  for (int i=0; i<=mip; i++)
+  if(cache->compression_type)
   {
-    rd = fread(&file_width[i], sizeof(int32_t), 1, f);
-    if(rd != 1) goto read_error;
-    rd = fread(&file_height[i], sizeof(int32_t), 1, f);
-    if(rd != 1) goto read_error;
-    if(file_width[i]  != cache->mip[i].max_width ||
-        file_height[i] != cache->mip[i].max_height)
-    {
-      fprintf(stderr, "[mipmap_cache] cache settings changed, dropping `%s' cache\n", dbfilename);
-      goto read_finalize;
-    }
+    dt_mipmap_store_write(&cache->store, mip, imgid, dsc->width, dsc->height, (const uint8_t *)(dsc+1),
+                          compressed_buffer_size(cache->compression_type, dsc->width, dsc->height));
   }
-
-  if(cache->compression_type) blob = NULL;
-  else blob = malloc(sizeof(uint32_t)*file_width[mip]*file_height[mip]);
-
-  while(!feof(f))
+  else
   {
-    int level = 0;
-    rd = fread(&level, sizeof(int), 1, f);
-    if (rd != 1 || level > mip) break;
-
-    int32_t key = 0;
-    rd = fread(&key, sizeof(int32_t), 1, f);
-    if(rd != 1) break; // first value is break only, goes to eof.
-    int32_t length = 0;
-    rd = fread(&length, sizeof(int32_t), 1, f);
-    if(rd != 1) goto read_error;
-
-    uint8_t *data = (uint8_t *)dt_cache_read_get(&cache->mip[level].cache, key);
-    struct dt_mipmap_buffer_dsc* dsc = (struct dt_mipmap_buffer_dsc*)data;
-    if(dsc->flags & DT_MIPMAP_BUFFER_DSC_FLAG_GENERATE)
-    {
-      if(cache->compression_type)
-      {
-        int32_t wd, ht;
-        rd = fread(&wd, sizeof(int32_t), 1, f);
-        if(rd != 1) goto read_error;
-        rd = fread(&ht, sizeof(int32_t), 1, f);
-        if(rd != 1) goto read_error;
-        dsc->width = wd;
-        dsc->height = ht;
-        if(length != compressed_buffer_size(cache->compression_type, wd, ht)) goto read_error;
-        // directly read from disk into cache:
-        rd = fread(data + sizeof(*dsc), 1, length, f);
-        if(rd != length) goto read_error;
-      }
-      else
-      {
-        // jpg too large?
-        if(length > sizeof(uint32_t)*file_width[mip]*file_height[mip]) goto read_error;
-        rd = fread(blob, sizeof(uint8_t), length, f);
-        if(rd != length) goto read_error;
-        // no compression, the image is still compressed on disk, as jpg
-        dt_imageio_jpeg_t jpg;
-        if(dt_imageio_jpeg_decompress_header(blob, length, &jpg) ||
-            (jpg.width > file_width[level] || jpg.height > file_height[level]) ||
-            dt_imageio_jpeg_decompress(&jpg, data+sizeof(*dsc)))
-        {
-          fprintf(stderr, "[mipmap_cache] failed to decompress thumbnail for image %d!\n", get_imgid(key));
-        }
-        dsc->width = jpg.width;
-        dsc->height = jpg.height;
-      }
-      dsc->flags &= ~DT_MIPMAP_BUFFER_DSC_FLAG_GENERATE;
-      // these come write locked in case idata[3] == 1, so release that!
-      dt_cache_write_release(&cache->mip[level].cache, key);
-    }
-    dt_cache_read_release(&cache->mip[level].cache, key);
+    uint8_t *blob = (uint8_t *)malloc(cache->mip[mip].buffer_size);
+    if(!blob) return;
+    const int cache_quality = dt_conf_get_int("database_cache_quality");
+    const int32_t length = dt_imageio_jpeg_compress((const uint8_t *)(dsc+1), blob, dsc->width, dsc->height, MIN(100, MAX(10, cache_quality)));
+    if(length > 0) dt_mipmap_store_write(&cache->store, mip, imgid, dsc->width, dsc->height, blob, length);
+    free(blob);
   }
-
-  fclose(f);
-  free(blob);
-  return 0;
-
-read_error:
-  fprintf(stderr, "[mipmap_cache] failed to recover the cache from `%s'\n", dbfilename);
-read_finalize:
-  if(f) fclose(f);
-  free(blob);
-  g_unlink(dbfilename);
-  return 1;
 }
 
 static void _init_f(float   *buf, uint32_t *width, uint32_t *height, const uint32_t imgid);
 static void _init_8(uint8_t *buf, uint32_t *width, uint32_t *height, const uint32_t imgid, const dt_mipmap_size_t size);
+static void _init_smaller_8(dt_mipmap_cache_t *cache, const uint8_t *in, const uint32_t width, const uint32_t height,
+                            const uint32_t imgid, const dt_mipmap_size_t size);
 
 static int32_t
 scratchmem_allocate(void *data, const uint32_t key, int32_t *cost, void **buf)
@@ -768,12 +599,17 @@ void dt_mipmap_cache_init(dt_mipmap_cache_t *cache)
   cache->mip[DT_MIPMAP_F].size = DT_MIPMAP_F;
   cache->mip[DT_MIPMAP_F].buf = NULL;
 
-  dt_mipmap_cache_deserialize(cache);
+  memset(&cache->prefetch, 0, sizeof(cache->prefetch));
+  dt_pthread_mutex_init(&cache->prefetch.lock, NULL);
+
+  dt_mipmap_cache_store_init(cache);
 }
 
 void dt_mipmap_cache_cleanup(dt_mipmap_cache_t *cache)
 {
-  dt_mipmap_cache_serialize(cache);
+  dt_mipmap_store_cleanup(&cache->store);
+  dt_pthread_mutex_destroy(&cache->prefetch.lock);
+  free(cache->prefetch.imgids);
   for(int k=0; k<DT_MIPMAP_F; k++)
   {
     dt_cache_cleanup(&cache->mip[k].cache);
@@ -900,6 +736,7 @@ dt_mipmap_cache_read_get(
       //assert(dsc->flags & DT_MIPMAP_BUFFER_DSC_FLAG_GENERATE || dsc->size == 0);
       if(dsc->flags & DT_MIPMAP_BUFFER_DSC_FLAG_GENERATE)
       {
+        const double trace_begin = dt_trace_begin();
         __sync_fetch_and_add (&(cache->mip[mip].stats_fetches), 1);
         // fprintf(stderr, "[mipmap cache get] now initializing buffer for img %u mip %d!\n", imgid, mip);
         // we're write locked here, as requested by the alloc callback.
@@ -955,6 +792,10 @@ dt_mipmap_cache_read_get(
         {
           _init_f((float *)(dsc+1), &dsc->width, &dsc->height, imgid);
         }
+        else if(!dt_mipmap_cache_store_read(cache, dsc, imgid, mip))
+        {
+          // 8-bit thumb was kept on disk, nothing to generate.
+        }
         else
         {
           // 8-bit thumbs, possibly need to be compressed:
@@ -972,14 +813,19 @@ dt_mipmap_cache_read_get(
             buf->size   = mip;
             buf->buf = (uint8_t *)(dsc+1);
             dt_mipmap_cache_compress(buf, scratchmem);
+            _init_smaller_8(cache, scratchmem, dsc->width, dsc->height, imgid, mip);
             dt_cache_write_release(&cache->scratchmem.cache, key);
             dt_cache_read_release(&cache->scratchmem.cache, key);
           }
           else
           {
             _init_8((uint8_t *)(dsc+1), &dsc->width, &dsc->height, imgid, mip);
+            _init_smaller_8(cache, (uint8_t *)(dsc+1), dsc->width, dsc->height, imgid, mip);
           }
+          dt_mipmap_cache_store_write(cache, dsc, imgid, mip);
         }
+        dt_trace_complete("mipmap", "load", trace_begin, "\"imgid\":%u,\"mip\":%d,\"width\":%d,\"height\":%d",
+                          imgid, (int)mip, dsc->width, dsc->height);
         dsc->flags &= ~DT_MIPMAP_BUFFER_DSC_FLAG_GENERATE;
         // drop the write lock
         dt_cache_write_release(&cache->mip[mip].cache, key);
@@ -1032,6 +878,82 @@ dt_mipmap_cache_read_get(
   }
 }
 
+// maximum number of background jobs generating prefetched thumbnails at the same time.
+#define DT_MIPMAP_PREFETCH_JOBS 2
+
+static int32_t
+_prefetch_job_run(dt_job_t *job)
+{
+  dt_mipmap_cache_t *cache = (dt_mipmap_cache_t *)dt_control_job_get_params(job);
+  dt_mipmap_prefetch_t *p = &cache->prefetch;
+  while(1)
+  {
+    dt_pthread_mutex_lock(&p->lock);
+    if(p->next >= p->num || dt_control_job_get_state(job) == DT_JOB_STATE_CANCELLED)
+    {
+      p->jobs--;
+      dt_pthread_mutex_unlock(&p->lock);
+      break;
+    }
+    const uint32_t imgid = p->imgids[p->next++];
+    const dt_mipmap_size_t mip = p->mip;
+    dt_pthread_mutex_unlock(&p->lock);
+
+    // might have been loaded in the meantime, by the view itself:
+    if(dt_cache_contains(&cache->mip[mip].cache, get_key(imgid, mip))) continue;
+    dt_mipmap_buffer_t buf;
+    dt_mipmap_cache_read_get(cache, &buf, imgid, mip, DT_MIPMAP_BLOCKING);
+    if(buf.buf) dt_mipmap_cache_read_release(cache, &buf);
+  }
+  return 0;
+}
+
+void
+dt_mipmap_cache_prefetch(
+  dt_mipmap_cache_t *cache,
+  const uint32_t *imgids,
+  const int num,
+  const dt_mipmap_size_t mip)
+{
+  if(mip >= DT_MIPMAP_F || (int)mip < DT_MIPMAP_0) return;
+  dt_mipmap_prefetch_t *p = &cache->prefetch;
+  dt_pthread_mutex_lock(&p->lock);
+  if(num > p->alloc)
+  {
+    uint32_t *imgids = (uint32_t *)realloc(p->imgids, sizeof(uint32_t)*num);
+    if(!imgids)
+    {
+      dt_pthread_mutex_unlock(&p->lock);
+      return;
+    }
+    p->imgids = imgids;
+    p->alloc = num;
+  }
+  // stale requests are simply overwritten, jobs pick up the new list with their next image.
+  p->num = 0;
+  p->next = 0;
+  p->mip = mip;
+  for(int k=0; k<num; k++)
+    if(!dt_cache_contains(&cache->mip[mip].cache, get_key(imgids[k], mip)))
+      p->imgids[p->num++] = imgids[k];
+  int spawn = MIN(DT_MIPMAP_PREFETCH_JOBS - p->jobs, p->num);
+  p->jobs += MAX(spawn, 0);
+  dt_pthread_mutex_unlock(&p->lock);
+
+  for(; spawn > 0; spawn--)
+  {
+    dt_job_t *job = dt_control_job_create(&_prefetch_job_run, "prefetch thumbnails");
+    if(job)
+    {
+      dt_control_job_set_params(job, cache);
+      if(!dt_control_add_job(darktable.control, DT_JOB_QUEUE_SYSTEM_BG, job)) continue;
+    }
+    dt_pthread_mutex_lock(&p->lock);
+    p->jobs--;
+    dt_pthread_mutex_unlock(&p->lock);
+  }
+}
+
 void
 dt_mipmap_cache_write_get(
   dt_mipmap_cache_t *cache,
@@ -1117,6 +1039,64 @@ dt_mipmap_cache_remove(
     const uint32_t key = get_key(imgid, k);
     dt_cache_remove(&cache->mip[k].cache, key);
   }
+  // and their copies on disk:
+  dt_mipmap_store_remove(&cache->store, imgid);
+}
+
+// thumbnail-only request for a jpeg which isn't loaded at full size: decode it in the dct domain
+// at the smallest scale which still covers the mip, instead of loading the full image.
+static int
+_init_f_jpeg(
+  float          *out,
+  uint32_t       *width,
+  uint32_t       *height,
+  const uint32_t  imgid,
+  const char     *filename)
+{
+  const uint32_t wd = *width, ht = *height;
+  const char *c = filename + strlen(filename);
+  while(*c != '.' && c > filename) c--;
+  if(strcasecmp(c, ".jpg") && strcasecmp(c, ".jpeg")) return 1;
+
+  dt_image_t buffered_image;
+  const dt_image_t *cimg = dt_image_cache_read_get(darktable.image_cache, imgid);
+  buffered_image = *cimg;
+  dt_image_cache_read_release(darktable.image_cache, cimg);
+
+  float *buf = NULL;
+  int bw = 0, bh = 0;
+  if(dt_imageio_open_jpeg_scaled(&buffered_image, filename, wd, ht, &buf, &bw, &bh) != DT_IMAGEIO_OK) return 1;
+  buffered_image.filters = 0;
+  buffered_image.flags &= ~DT_IMAGE_RAW;
+  buffered_image.flags &= ~DT_IMAGE_HDR;
+  buffered_image.flags |= DT_IMAGE_LDR;
+
+  // the full size is known now, write it back as loading the full buffer would:
+  cimg = dt_image_cache_read_get(darktable.image_cache, imgid);
+  dt_image_t *img = dt_image_cache_write_get(darktable.image_cache, cimg);
+  *img = buffered_image;
+  dt_image_cache_write_release(darktable.image_cache, img, DT_IMAGE_CACHE_RELAXED);
+  dt_image_cache_read_release(darktable.image_cache, img);
+
+  // same output size as downsampling the full buffer
+  const float scale = fminf(wd/(float)buffered_image.width, ht/(float)buffered_image.height);
+  dt_iop_roi_t roi_in, roi_out;
+  roi_in.x = roi_in.y = 0;
+  roi_in.width = bw;
+  roi_in.height = bh;
+  roi_in.scale = 1.0f;
+
+  roi_out.x = roi_out.y = 0;
+  roi_out.width  = scale * buffered_image.width;
+  roi_out.height = scale * buffered_image.height;
+  roi_out.scale = scale * buffered_image.width / (float)bw;
+
+  dt_iop_clip_and_zoom(out, buf, &roi_out, &roi_in, roi_out.width, roi_in.width);
+  dt_free_align(buf);
+
+  *width  = roi_out.width;
+  *height = roi_out.height;
+  return 0;
 }
 
 static void
@@ -1138,6 +1118,10 @@ _init_f(
     return;
   }
 
+  if(!dt_cache_contains(&darktable.mipmap_cache->mip[DT_MIPMAP_FULL].cache, get_key(imgid, DT_MIPMAP_FULL)) &&
+     !_init_f_jpeg(out, width, height, imgid, filename))
+    return;
+
   dt_mipmap_buffer_t buf;
   dt_mipmap_cache_read_get(darktable.mipmap_cache, &buf, imgid, DT_MIPMAP_FULL, DT_MIPMAP_BLOCKING);
 
@@ -1280,6 +1264,9 @@ _init_8(
       dt_imageio_jpeg_t jpg;
       if(!dt_imageio_jpeg_read_header(filename, &jpg))
       {
+        // decode only as large as needed in the dct domain
+        if(orientation & 4) dt_imageio_jpeg_set_scale(&jpg, ht, wd);
+        else                dt_imageio_jpeg_set_scale(&jpg, wd, ht);
         uint8_t *tmp = (uint8_t *)malloc(sizeof(uint8_t)*jpg.width*jpg.height*4);
         if(!dt_imageio_jpeg_read(&jpg, tmp))
         {
@@ -1294,7 +1281,7 @@ _init_8(
     {
       uint8_t *tmp = 0;
       int32_t thumb_width, thumb_height, orientation;
-      res = dt_imageio_large_thumbnail(filename, &tmp, &thumb_width, &thumb_height, &orientation);
+      res = dt_imageio_large_thumbnail(filename, &tmp, &thumb_width, &thumb_height, &orientation, wd, ht);
       if(!res)
       {
         // scale to fit
@@ -1336,11 +1323,98 @@ _init_8(
   }
 
   // TODO: various speed optimizations:
-  // TODO: also init all smaller mips!
   // TODO: use mipf, but:
   // TODO: if output is cropped, don't use mipf!
 }
 
+// box filter a 4 channel 8-bit buffer to fit into max_width x max_height, keeping the aspect ratio.
+static void
+_downsample_8(
+  const uint8_t  *in,
+  const uint32_t  iw,
+  const uint32_t  ih,
+  uint8_t        *out,
+  const uint32_t  max_width,
+  const uint32_t  max_height,
+  uint32_t       *width,
+  uint32_t       *height)
+{
+  const float scale = fmaxf(1.0f, fmaxf(iw/(float)max_width, ih/(float)max_height));
+  const uint32_t wd = *width  = MAX(1, MIN(max_width,  iw/scale));
+  const uint32_t ht = *height = MAX(1, MIN(max_height, ih/scale));
+#ifdef _OPENMP
+  #pragma omp parallel for schedule(static) default(none) shared(in, out)
+#endif
+  for(uint32_t j=0; j<ht; j++)
+  {
+    // footprint of the output pixel, at least one input pixel:
+    const uint32_t y0 = (uint64_t)j*ih/ht, y1 = MAX(y0+1, (uint64_t)(j+1)*ih/ht);
+    uint8_t *o = out + 4*(size_t)wd*j;
+    for(uint32_t i=0; i<wd; i++, o+=4)
+    {
+      const uint32_t x0 = (uint64_t)i*iw/wd, x1 = MAX(x0+1, (uint64_t)(i+1)*iw/wd);
+      __m128i sum = _mm_setzero_si128();
+      for(uint32_t y=y0; y<y1; y++)
+      {
+        const uint8_t *p = in + 4*((size_t)iw*y + x0);
+        for(uint32_t x=x0; x<x1; x++, p+=4)
+        {
+          // all four channels of the pixel, widened to 32 bits:
+          const __m128i px = _mm_cvtsi32_si128(*(const int32_t *)p);
+          sum = _mm_add_epi32(sum, _mm_unpacklo_epi16(_mm_unpacklo_epi8(px, _mm_setzero_si128()), _mm_setzero_si128()));
+        }
+      }
+      const __m128 avg = _mm_mul_ps(_mm_cvtepi32_ps(sum), _mm_set1_ps(1.0f/((x1-x0)*(y1-y0))));
+      const __m128i px = _mm_cvtps_epi32(avg);
+      *(int32_t *)o = _mm_cvtsi128_si32(_mm_packus_epi16(_mm_packs_epi32(px, px), _mm_setzero_si128()));
+    }
+  }
+}
+
+// fill all smaller thumbnails of the image which are not cached yet from the freshly generated one
+// (uncompressed in `in'). saves loading the image or running the thumbnail pipe again for each of them.
+static void
+_init_smaller_8(
+  dt_mipmap_cache_t      *cache,
+  const uint8_t          *in,
+  const uint32_t          width,
+  const uint32_t          height,
+  const uint32_t          imgid,
+  const dt_mipmap_size_t  size)
+{
+  if(width == 0 || height == 0) return;
+  uint8_t *tmp = NULL;
+  for(int k=(int)size-1; k>=DT_MIPMAP_0; k--)
+  {
+    const uint32_t key = get_key(imgid, k);
+    if(dt_cache_contains(&cache->mip[k].cache, key)) continue;
+    // read get allocates and write locks the slot for us, unless someone else got there first:
+    struct dt_mipmap_buffer_dsc* dsc = (struct dt_mipmap_buffer_dsc*)dt_cache_read_get(&cache->mip[k].cache, key);
+    if(!dsc) continue;
+    if(dsc->flags & DT_MIPMAP_BUFFER_DSC_FLAG_GENERATE)
+    {
+      if(cache->compression_type)
+      {
+        if(!tmp) tmp = dt_alloc_align(64, (size_t)4*cache->mip[k].max_width*cache->mip[k].max_height);
+        if(tmp)
+        {
+          _downsample_8(in, width, height, tmp, cache->mip[k].max_width, cache->mip[k].max_height, &dsc->width, &dsc->height);
+          dt_mipmap_buffer_t buf = { .size = k, .imgid = imgid, .width = dsc->width, .height = dsc->height, .buf = (uint8_t *)(dsc+1) };
+          dt_mipmap_cache_compress(&buf, tmp);
+        }
+        else dsc->width = dsc->height = 0;
+      }
+      else
+        _downsample_8(in, width, height, (uint8_t *)(dsc+1), cache->mip[k].max_width, cache->mip[k].max_height, &dsc->width, &dsc->height);
+      dt_mipmap_cache_store_write(cache, dsc, imgid, k);
+      dsc->flags &= ~DT_MIPMAP_BUFFER_DSC_FLAG_GENERATE;
+      dt_cache_write_release(&cache->mip[k].cache, key);
+    }
+    dt_cache_read_release(&cache->mip[k].cache, key);
+  }
+  if(tmp) dt_free_align(tmp);
+}
+
 // compression stuff: alloc a buffer if needed
 uint8_t*
 dt_mipmap_cache_alloc_scratchmem(
@@ -20,6 +20,7 @@
 
 #include "common/cache.h"
 #include "common/image.h"
+#include "common/mipmap_store.h"
 
 
 // sizes stored in the mipmap cache.
@@ -102,6 +103,18 @@ typedef struct dt_mipmap_cache_one_t
 }
 dt_mipmap_cache_one_t;
 
+// pending speculative requests, drained by a few background jobs.
+typedef struct dt_mipmap_prefetch_t
+{
+  dt_pthread_mutex_t lock;
+  uint32_t *imgids;       // requested images, most important first
+  int32_t num, next;      // number of requests and the next one to serve
+  int32_t alloc;          // allocated size of imgids
+  dt_mipmap_size_t mip;   // level to generate for all of them
+  int32_t jobs;           // prefetch jobs queued or running
+}
+dt_mipmap_prefetch_t;
+
 typedef struct dt_mipmap_cache_t
 {
   // one cache per mipmap level
@@ -110,6 +123,10 @@ typedef struct dt_mipmap_cache_t
   int compression_type; // 0 - none, 1 - low quality, 2 - slow
   // per-thread cache of uncompressed buffers, in case compression is requested.
   dt_mipmap_cache_one_t scratchmem;
+  // speculative generation of thumbnails the user is about to see.
+  dt_mipmap_prefetch_t prefetch;
+  // 8-bit levels on disk, survives restarts (and crashes).
+  dt_mipmap_store_t store;
 }
 dt_mipmap_cache_t;
 
@@ -139,6 +156,16 @@ dt_mipmap_cache_read_get(
   const dt_mipmap_size_t mip,
   const dt_mipmap_get_flags_t flags);
 
+// replace all pending prefetch requests by the given images, most important
+// first. requests which were not served yet are dropped, images already in
+// the cache at the given level are skipped. num == 0 cancels all requests.
+void
+dt_mipmap_cache_prefetch(
+  dt_mipmap_cache_t *cache,
+  const uint32_t *imgids,
+  const int num,
+  const dt_mipmap_size_t mip);
+
 // lock it for writing. this is always blocking.
 // requires you already hold a read lock.
 void
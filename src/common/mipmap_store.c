@@ -0,0 +1,407 @@
+/*
+    This file is part of darktable,
+    copyright (c) 2026 agent.
+
+    darktable is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    darktable is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with darktable.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include "common/mipmap_store.h"
+#include "common/darktable.h"
+
+#include <errno.h>
+#include <fcntl.h>
+#include <glib/gstdio.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#define DT_MIPMAP_STORE_MAGIC         0xd7d15c00
+#define DT_MIPMAP_STORE_VERSION       1
+#define DT_MIPMAP_STORE_ENTRY_MAGIC   0xd7e1d7e1
+#define DT_MIPMAP_STORE_RECORD_MAGIC  0xd7ec0dd7
+
+// levels are only rewritten when at least this many bytes can be reclaimed:
+#define DT_MIPMAP_STORE_COMPACT_MIN   (8u<<20)
+
+typedef struct _store_header_t
+{
+  uint32_t magic;
+  uint32_t version;
+  int32_t  format;
+  uint32_t max_width, max_height;
+  uint32_t pad[3];
+}
+_store_header_t;
+
+// one entry of the index file. an entry with length 0 removes the image.
+typedef struct _store_entry_t
+{
+  uint32_t magic;
+  uint32_t imgid;
+  uint32_t width, height;
+  uint64_t offset;    // of the record in the data file
+  uint32_t length;    // of the payload
+  uint32_t checksum;  // of the payload
+}
+_store_entry_t;
+
+// in front of every payload in the data file.
+typedef struct _store_record_t
+{
+  uint32_t magic;
+  uint32_t imgid;
+  uint32_t length;
+  uint32_t checksum;
+}
+_store_record_t;
+
+static uint32_t _checksum(const uint8_t *data, const size_t length)
+{
+  // fnv-1a, only meant to detect torn writes.
+  uint32_t hash = 2166136261u;
+  for(size_t k=0; k<length; k++) hash = (hash ^ data[k]) * 16777619u;
+  return hash;
+}
+
+static gchar *_level_filename(const dt_mipmap_store_t *store, const int level, const char *ext)
+{
+  gchar *name = g_strdup_printf("%d.%s", level, ext);
+  gchar *filename = g_build_filename(store->path, name, NULL);
+  g_free(name);
+  return filename;
+}
+
+static int _write_all(const int fd, const void *data, const size_t length, const off_t offset)
+{
+  size_t done = 0;
+  while(done < length)
+  {
+    const ssize_t w = offset < 0 ? write(fd, (const uint8_t *)data + done, length - done)
+                                 : pwrite(fd, (const uint8_t *)data + done, length - done, offset + done);
+    if(w < 0 && errno == EINTR) continue;
+    if(w <= 0) return 1;
+    done += w;
+  }
+  return 0;
+}
+
+static int _read_all(const int fd, void *data, const size_t length, const off_t offset)
+{
+  size_t done = 0;
+  while(done < length)
+  {
+    const ssize_t r = pread(fd, (uint8_t *)data + done, length - done, offset + done);
+    if(r < 0 && errno == EINTR) continue;
+    if(r <= 0) return 1;
+    done += r;
+  }
+  return 0;
+}
+
+static void _level_close(dt_mipmap_store_level_t *l)
+{
+  if(l->map) g_mapped_file_unref(l->map);
+  if(l->index) g_hash_table_destroy(l->index);
+  if(l->data_fd >= 0) close(l->data_fd);
+  if(l->index_fd >= 0) close(l->index_fd);
+  memset(l, 0, sizeof(*l));
+  l->data_fd = l->index_fd = -1;
+}
+
+// adds an entry to the in-memory index, keeping track of how much of the data file is still in use.
+static void _index_insert(dt_mipmap_store_level_t *l, const _store_entry_t *e)
+{
+  const _store_entry_t *old = (const _store_entry_t *)g_hash_table_lookup(l->index, GUINT_TO_POINTER(e->imgid));
+  if(old)
+  {
+    l->live -= old->length + sizeof(_store_record_t);
+    l->dead += old->length + sizeof(_store_record_t);
+  }
+  if(e->length)
+  {
+    g_hash_table_replace(l->index, GUINT_TO_POINTER(e->imgid), g_memdup(e, sizeof(_store_entry_t)));
+    l->live += e->length + sizeof(_store_record_t);
+  }
+  else
+    g_hash_table_remove(l->index, GUINT_TO_POINTER(e->imgid));
+}
+
+static int _level_open(dt_mipmap_store_t *store, const int level, const int32_t format, const uint32_t max_width,
+                       const uint32_t max_height, const int drop)
+{
+  dt_mipmap_store_level_t *l = store->level + level;
+  gchar *dataname = _level_filename(store, level, "data");
+  gchar *indexname = _level_filename(store, level, "index");
+  int res = 1;
+
+  l->index = g_hash_table_new_full(g_direct_hash, g_direct_equal, NULL, g_free);
+  l->data_fd = g_open(dataname, O_RDWR | O_CREAT, 0600);
+  l->index_fd = g_open(indexname, O_RDWR | O_CREAT | O_APPEND, 0600);
+  if(l->data_fd < 0 || l->index_fd < 0) goto error;
+
+  _store_header_t expected = { DT_MIPMAP_STORE_MAGIC, DT_MIPMAP_STORE_VERSION, format, max_width, max_height, { 0 } };
+  _store_header_t header;
+  struct stat st;
+  if(fstat(l->index_fd, &st)) goto error;
+  if(drop || st.st_size < sizeof(header) || _read_all(l->index_fd, &header, sizeof(header), 0) ||
+     memcmp(&header, &expected, sizeof(header)))
+  {
+    if(st.st_size > 0 && !drop)
+      dt_print(DT_DEBUG_CACHE, "[mipmap_store] level %d has changed format, dropping it\n", level);
+    if(ftruncate(l->index_fd, 0) || ftruncate(l->data_fd, 0)) goto error;
+    if(_write_all(l->index_fd, &expected, sizeof(expected), -1)) goto error;
+    st.st_size = sizeof(expected);
+  }
+
+  struct stat dst;
+  if(fstat(l->data_fd, &dst)) goto error;
+  l->data_size = dst.st_size;
+
+  // replay the index. later entries replace earlier ones, entries pointing past the
+  // end of the data file were written right before a crash and are ignored.
+  const size_t num = (st.st_size - sizeof(header)) / sizeof(_store_entry_t);
+  _store_entry_t *entries = (_store_entry_t *)g_malloc(MAX(num, 1) * sizeof(_store_entry_t));
+  if(num && _read_all(l->index_fd, entries, num * sizeof(_store_entry_t), sizeof(header)))
+  {
+    g_free(entries);
+    goto error;
+  }
+  for(size_t k=0; k<num; k++)
+  {
+    const _store_entry_t *e = entries + k;
+    if(e->magic != DT_MIPMAP_STORE_ENTRY_MAGIC) continue;
+    if(e->length && e->offset + sizeof(_store_record_t) + e->length > l->data_size) continue;
+    _index_insert(l, e);
+  }
+  g_free(entries);
+  // cut off a torn entry at the end, so the next ones are aligned again:
+  if(st.st_size != sizeof(header) + num * sizeof(_store_entry_t) &&
+     ftruncate(l->index_fd, sizeof(header) + num * sizeof(_store_entry_t)))
+    goto error;
+
+  if(l->data_size)
+  {
+    l->map = g_mapped_file_new(dataname, FALSE, NULL);
+    if(l->map) l->mapped_size = g_mapped_file_get_length(l->map);
+  }
+  dt_print(DT_DEBUG_CACHE, "[mipmap_store] level %d: %u thumbnails, %.1f MB in use, %.1f MB superseded\n", level,
+           g_hash_table_size(l->index), l->live/(1024.0*1024.0), l->dead/(1024.0*1024.0));
+  res = 0;
+
+error:
+  if(res)
+  {
+    fprintf(stderr, "[mipmap_store] could not open `%s', thumbnails of level %d won't be kept on disk\n",
+            dataname, level);
+    _level_close(l);
+  }
+  g_free(dataname);
+  g_free(indexname);
+  return res;
+}
+
+// writes all live records of a level into fresh files and swaps them in. needs the lock.
+static void _level_compact(dt_mipmap_store_t *store, const int level)
+{
+  dt_mipmap_store_level_t *l = store->level + level;
+  gchar *dataname = _level_filename(store, level, "data");
+  gchar *indexname = _level_filename(store, level, "index");
+  gchar *tmpdata = g_strconcat(dataname, ".tmp", NULL);
+  gchar *tmpindex = g_strconcat(indexname, ".tmp", NULL);
+  uint8_t *payload = NULL;
+  int err = 1;
+
+  const int data_fd = g_open(tmpdata, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+  const int index_fd = g_open(tmpindex, O_WRONLY | O_CREAT | O_TRUNC, 0600);
+  if(data_fd < 0 || index_fd < 0) goto done;
+
+  _store_header_t header;
+  if(_read_all(l->index_fd, &header, sizeof(header), 0)) goto done;
+  if(_write_all(index_fd, &header, sizeof(header), -1)) goto done;
+
+  size_t offset = 0;
+  GHashTableIter it;
+  gpointer key, value;
+  g_hash_table_iter_init(&it, l->index);
+  while(g_hash_table_iter_next(&it, &key, &value))
+  {
+    _store_entry_t e = *(_store_entry_t *)value;
+    const size_t size = sizeof(_store_record_t) + e.length;
+    payload = (uint8_t *)g_realloc(payload, size);
+    if(_read_all(l->data_fd, payload, size, e.offset)) continue;
+    if(_checksum(payload + sizeof(_store_record_t), e.length) != e.checksum) continue;
+    e.offset = offset;
+    if(_write_all(data_fd, payload, size, -1) || _write_all(index_fd, &e, sizeof(e), -1)) goto done;
+    offset += size;
+  }
+  if(fsync(data_fd) || fsync(index_fd)) goto done;
+  // data first: an old index on new data only fails checksums, it never shows wrong thumbnails.
+  if(g_rename(tmpdata, dataname) || g_rename(tmpindex, indexname)) goto done;
+  dt_print(DT_DEBUG_CACHE, "[mipmap_store] level %d compacted from %.1f to %.1f MB\n", level,
+           l->data_size/(1024.0*1024.0), offset/(1024.0*1024.0));
+  err = 0;
+
+done:
+  if(data_fd >= 0) close(data_fd);
+  if(index_fd >= 0) close(index_fd);
+  if(err)
+  {
+    g_unlink(tmpdata);
+    g_unlink(tmpindex);
+  }
+  g_free(payload);
+  g_free(dataname);
+  g_free(indexname);
+  g_free(tmpdata);
+  g_free(tmpindex);
+}
+
+void dt_mipmap_store_init(dt_mipmap_store_t *store, const char *path, const int32_t format,
+                          const uint32_t *max_width, const uint32_t *max_height, const int drop)
+{
+  memset(store, 0, sizeof(dt_mipmap_store_t));
+  dt_pthread_mutex_init(&store->lock, NULL);
+  for(int k=0; k<DT_MIPMAP_STORE_LEVELS; k++) store->level[k].data_fd = store->level[k].index_fd = -1;
+  if(!path) return;
+
+  store->path = g_strdup(path);
+  if(g_mkdir_with_parents(store->path, 0700))
+  {
+    fprintf(stderr, "[mipmap_store] could not create directory `%s', thumbnails won't be kept on disk\n", path);
+    return;
+  }
+  for(int k=0; k<DT_MIPMAP_STORE_LEVELS; k++)
+    _level_open(store, k, format, max_width[k], max_height[k], drop);
+  store->enabled = 1;
+}
+
+void dt_mipmap_store_cleanup(dt_mipmap_store_t *store)
+{
+  dt_pthread_mutex_lock(&store->lock);
+  for(int k=0; k<DT_MIPMAP_STORE_LEVELS; k++)
+  {
+    dt_mipmap_store_level_t *l = store->level + k;
+    if(l->index && l->dead > l->live && l->dead > DT_MIPMAP_STORE_COMPACT_MIN) _level_compact(store, k);
+    if(l->index) _level_close(l);
+  }
+  store->enabled = 0;
+  dt_pthread_mutex_unlock(&store->lock);
+  dt_pthread_mutex_destroy(&store->lock);
+  g_free(store->path);
+  store->path = NULL;
+}
+
+// appends an index entry and applies it. needs the lock.
+static int _append_entry(dt_mipmap_store_level_t *l, const _store_entry_t *e)
+{
+  if(_write_all(l->index_fd, e, sizeof(_store_entry_t), -1)) return 1;
+  _index_insert(l, e);
+  return 0;
+}
+
+int dt_mipmap_store_read(dt_mipmap_store_t *store, const int level, const uint32_t imgid, uint32_t *width,
+                         uint32_t *height, uint8_t *blob, const size_t max_length, size_t *length)
+{
+  if(!store->enabled || level < 0 || level >= DT_MIPMAP_STORE_LEVELS) return 1;
+  dt_mipmap_store_level_t *l = store->level + level;
+
+  dt_pthread_mutex_lock(&store->lock);
+  const _store_entry_t *found = l->index ? (const _store_entry_t *)g_hash_table_lookup(l->index, GUINT_TO_POINTER(imgid)) : NULL;
+  _store_entry_t e;
+  if(found) e = *found;
+  const uint8_t *mapped = l->map ? (const uint8_t *)g_mapped_file_get_contents(l->map) : NULL;
+  const size_t mapped_size = l->mapped_size;
+  dt_pthread_mutex_unlock(&store->lock);
+  if(!found || e.length > max_length) return 1;
+
+  _store_record_t record;
+  int err = 0;
+  if(mapped && e.offset + sizeof(record) + e.length <= mapped_size)
+  {
+    // written before this session, straight out of the mapping:
+    memcpy(&record, mapped + e.offset, sizeof(record));
+    memcpy(blob, mapped + e.offset + sizeof(record), e.length);
+  }
+  else
+  {
+    err = _read_all(l->data_fd, &record, sizeof(record), e.offset) ||
+          _read_all(l->data_fd, blob, e.length, e.offset + sizeof(record));
+  }
+  if(err || record.magic != DT_MIPMAP_STORE_RECORD_MAGIC || record.imgid != imgid || record.length != e.length ||
+     record.checksum != e.checksum || _checksum(blob, e.length) != e.checksum)
+  {
+    dt_print(DT_DEBUG_CACHE, "[mipmap_store] dropping broken thumbnail of image %u level %d\n", imgid, level);
+    _store_entry_t gone = { DT_MIPMAP_STORE_ENTRY_MAGIC, imgid, 0, 0, 0, 0, 0 };
+    dt_pthread_mutex_lock(&store->lock);
+    // only if it hasn't been replaced in the meantime:
+    found = (const _store_entry_t *)g_hash_table_lookup(l->index, GUINT_TO_POINTER(imgid));
+    if(found && found->offset == e.offset) _append_entry(l, &gone);
+    dt_pthread_mutex_unlock(&store->lock);
+    return 1;
+  }
+  *width = e.width;
+  *height = e.height;
+  *length = e.length;
+  return 0;
+}
+
+int dt_mipmap_store_write(dt_mipmap_store_t *store, const int level, const uint32_t imgid, const uint32_t width,
+                          const uint32_t height, const uint8_t *blob, const size_t length)
+{
+  if(!store->enabled || level < 0 || level >= DT_MIPMAP_STORE_LEVELS || !length) return 1;
+  dt_mipmap_store_level_t *l = store->level + level;
+  const uint32_t checksum = _checksum(blob, length);
+  const _store_record_t record = { DT_MIPMAP_STORE_RECORD_MAGIC, imgid, length, checksum };
+
+  // reserve the space, then write without holding the lock:
+  dt_pthread_mutex_lock(&store->lock);
+  if(!l->index)
+  {
+    dt_pthread_mutex_unlock(&store->lock);
+    return 1;
+  }
+  const size_t offset = l->data_size;
+  l->data_size += sizeof(record) + length;
+  dt_pthread_mutex_unlock(&store->lock);
+
+  if(_write_all(l->data_fd, &record, sizeof(record), offset) ||
+     _write_all(l->data_fd, blob, length, offset + sizeof(record)))
+    return 1;
+
+  // the record only becomes visible now:
+  const _store_entry_t e = { DT_MIPMAP_STORE_ENTRY_MAGIC, imgid, width, height, offset, length, checksum };
+  dt_pthread_mutex_lock(&store->lock);
+  const int err = _append_entry(l, &e);
+  dt_pthread_mutex_unlock(&store->lock);
+  return err;
+}
+
+void dt_mipmap_store_remove(dt_mipmap_store_t *store, const uint32_t imgid)
+{
+  if(!store->enabled) return;
+  const _store_entry_t gone = { DT_MIPMAP_STORE_ENTRY_MAGIC, imgid, 0, 0, 0, 0, 0 };
+  dt_pthread_mutex_lock(&store->lock);
+  for(int k=0; k<DT_MIPMAP_STORE_LEVELS; k++)
+  {
+    dt_mipmap_store_level_t *l = store->level + k;
+    if(l->index && g_hash_table_lookup(l->index, GUINT_TO_POINTER(imgid))) _append_entry(l, &gone);
+  }
+  dt_pthread_mutex_unlock(&store->lock);
+}
+
+// modelines: These editor modelines have been set for all relevant files by tools/update_modelines.sh
+// vim: shiftwidth=2 expandtab tabstop=2 cindent
+// kate: tab-indents: off; indent-width 2; replace-tabs on; indent-mode cstyle; remove-trailing-space on;
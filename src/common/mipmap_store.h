@@ -0,0 +1,80 @@
+/*
+    This file is part of darktable,
+    copyright (c) 2026 agent.
+
+    darktable is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    darktable is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with darktable.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef DT_MIPMAP_STORE_H
+#define DT_MIPMAP_STORE_H
+
+#include "common/dtpthread.h"
+#include <glib.h>
+#include <inttypes.h>
+#include <stddef.h>
+
+/**
+ * on-disk store for the 8-bit thumbnails of the mipmap cache.
+ *
+ * every level has an append-only data file holding one record per written
+ * thumbnail, and an append-only index of fixed size entries pointing into it.
+ * only the index is read on startup, the data file is memory mapped and
+ * thumbnails are copied out of it when the cache misses them. a record only
+ * becomes visible after its index entry has been appended, and every record
+ * carries a checksum, so a crash at any point costs at most the thumbnails
+ * written last, never the whole store.
+ */
+
+#define DT_MIPMAP_STORE_LEVELS 4
+
+typedef struct dt_mipmap_store_level_t
+{
+  int data_fd, index_fd;
+  GMappedFile *map;       // the data file as it was when opened
+  size_t mapped_size;
+  size_t data_size;       // current end of the data file, new records go here
+  size_t live, dead;      // bytes of current and superseded records
+  GHashTable *index;      // imgid -> index entry
+}
+dt_mipmap_store_level_t;
+
+typedef struct dt_mipmap_store_t
+{
+  int enabled;
+  gchar *path;            // directory holding the files of all levels
+  dt_pthread_mutex_t lock;
+  dt_mipmap_store_level_t level[DT_MIPMAP_STORE_LEVELS];
+}
+dt_mipmap_store_t;
+
+/** opens (or creates) the store in the given directory, or a disabled one if path is NULL. a level is
+    wiped if drop is set or it was written with another format (compression type, max dimensions). */
+void dt_mipmap_store_init(dt_mipmap_store_t *store, const char *path, const int32_t format,
+                          const uint32_t *max_width, const uint32_t *max_height, const int drop);
+/** closes the store, rewriting levels which are mostly made of superseded records. */
+void dt_mipmap_store_cleanup(dt_mipmap_store_t *store);
+
+/** copies the thumbnail of imgid at the given level to blob (of max_length bytes).
+    returns 0 on success. */
+int dt_mipmap_store_read(dt_mipmap_store_t *store, const int level, const uint32_t imgid, uint32_t *width,
+                         uint32_t *height, uint8_t *blob, const size_t max_length, size_t *length);
+/** appends a thumbnail, replacing any older one of the same image and level. returns 0 on success. */
+int dt_mipmap_store_write(dt_mipmap_store_t *store, const int level, const uint32_t imgid, const uint32_t width,
+                          const uint32_t height, const uint8_t *blob, const size_t length);
+/** forgets all thumbnails of an image. */
+void dt_mipmap_store_remove(dt_mipmap_store_t *store, const uint32_t imgid);
+
+#endif
+// modelines: These editor modelines have been set for all relevant files by tools/update_modelines.sh
+// vim: shiftwidth=2 expandtab tabstop=2 cindent
+// kate: tab-indents: off; indent-width 2; replace-tabs on; indent-mode cstyle; remove-trailing-space on;
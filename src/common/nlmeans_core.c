@@ -0,0 +1,222 @@
+/*
+    This file is part of darktable,
+    copyright (c) 2026 agent.
+
+    darktable is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    darktable is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with darktable.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include "common/nlmeans_core.h"
+#include "common/darktable.h"
+
+#include <string.h>
+#include <xmmintrin.h>
+#include <emmintrin.h>
+
+// size of the blocks of output pixels which are done by one thread for all offsets.
+// the distances in the overlap of neighbouring blocks are computed twice, the output
+// and the input rows around it stay in cache.
+#define DT_NLMEANS_BLOCK_WIDTH 256
+#define DT_NLMEANS_BLOCK_HEIGHT 64
+
+// floats per scratch row: the block plus the search and patch radius on both sides
+static size_t _scratch_stride(const dt_nlmeans_param_t *const p)
+{
+  return ((DT_NLMEANS_BLOCK_WIDTH + 2*(p->search_radius + p->patch_radius) + 3) & ~3) + 4;
+}
+
+size_t dt_nlmeans_scratch_size(const dt_nlmeans_param_t *const p)
+{
+  // column sums and a ring buffer of search_radius+1 rows of weights per thread
+  return (size_t)dt_get_num_threads() * (p->search_radius + 2) * _scratch_stride(p) * sizeof(float);
+}
+
+// 2^-x for x >= 0, same approximation as fast_mexp2f() in the modules
+static inline __m128 _fast_mexp2f_sse(const __m128 x)
+{
+  const __m128 i1 = _mm_set1_ps((float)0x3f800000u); // 2^0
+  const __m128 i2 = _mm_set1_ps((float)0x3f000000u); // 2^-1
+  const __m128 k0 = _mm_add_ps(i1, _mm_mul_ps(x, _mm_sub_ps(i2, i1)));
+  const __m128 valid = _mm_cmpge_ps(k0, _mm_set1_ps((float)0x800000u));
+  return _mm_and_ps(valid, _mm_castsi128_ps(_mm_cvttps_epi32(k0)));
+}
+
+// adds sign times the channel weighted squared difference of row y and row y+qj shifted by qi
+// to col, for columns x0..x1-1 (which need to be valid for both).
+static inline void _dist_row(const float *const in, const int width, const int y, const int qi, const int qj,
+                             const int x0, const int x1, const float *const norm, const float sign,
+                             float *const col)
+{
+  const float *a = in + 4*((size_t)width*y + x0);
+  const float *b = in + 4*((size_t)width*(y+qj) + x0 + qi);
+  const __m128 n0 = _mm_set1_ps(sign*norm[0]);
+  const __m128 n1 = _mm_set1_ps(sign*norm[1]);
+  const __m128 n2 = _mm_set1_ps(sign*norm[2]);
+  int x = x0;
+  for(; x+4<=x1; x+=4, a+=16, b+=16)
+  {
+    __m128 d0 = _mm_sub_ps(_mm_load_ps(a),    _mm_load_ps(b));
+    __m128 d1 = _mm_sub_ps(_mm_load_ps(a+4),  _mm_load_ps(b+4));
+    __m128 d2 = _mm_sub_ps(_mm_load_ps(a+8),  _mm_load_ps(b+8));
+    __m128 d3 = _mm_sub_ps(_mm_load_ps(a+12), _mm_load_ps(b+12));
+    // now one channel of four pixels per vector
+    _MM_TRANSPOSE4_PS(d0, d1, d2, d3);
+    const __m128 sum = _mm_add_ps(_mm_add_ps(_mm_mul_ps(n0, _mm_mul_ps(d0, d0)),
+                                             _mm_mul_ps(n1, _mm_mul_ps(d1, d1))),
+                                  _mm_mul_ps(n2, _mm_mul_ps(d2, d2)));
+    _mm_storeu_ps(col + x, _mm_add_ps(_mm_loadu_ps(col + x), sum));
+  }
+  for(; x<x1; x++, a+=4, b+=4)
+    for(int k=0; k<3; k++)
+      col[x] += sign*norm[k]*(a[k] - b[k])*(a[k] - b[k]);
+}
+
+// out[x] += w[x] * (in[x] with the weight in the last channel), for x0..x1-1
+static inline void _accumulate(const float *in, const float *w, float *out, const int n)
+{
+  const __m128 rgb = _mm_castsi128_ps(_mm_set_epi32(0, -1, -1, -1));
+  const __m128 one = _mm_set_ps(1.0f, 0.0f, 0.0f, 0.0f);
+  for(int x=0; x<n; x++, in+=4, out+=4)
+  {
+    const __m128 iv = _mm_or_ps(_mm_and_ps(_mm_load_ps(in), rgb), one);
+    _mm_store_ps(out, _mm_add_ps(_mm_load_ps(out), _mm_mul_ps(iv, _mm_set1_ps(w[x]))));
+  }
+}
+
+static void _nlmeans_block(const float *const in, float *const out, const int width, const int height,
+                           const int x0, const int x1, const int j0, const int j1,
+                           const dt_nlmeans_param_t *const p, float *const scratch)
+{
+  const int P = p->patch_radius;
+  const int K = p->search_radius;
+  const size_t stride = _scratch_stride(p);
+  float *const col = scratch;
+  float *const ring = scratch + stride;
+  const __m128 scale = _mm_set1_ps(p->scale);
+  const __m128 bias = _mm_set1_ps(p->bias);
+
+  // the pixel itself, at distance zero
+  float w0;
+  _mm_store_ss(&w0, _fast_mexp2f_sse(_mm_max_ps(_mm_setzero_ps(), _mm_sub_ps(_mm_setzero_ps(), bias))));
+  for(int x=x0; x<x1; x++) ring[x-x0] = w0;
+  for(int j=j0; j<j1; j++)
+  {
+    float *o = out + 4*((size_t)width*j + x0);
+    memset(o, 0, sizeof(float)*4*(x1-x0));
+    _accumulate(in + 4*((size_t)width*j + x0), ring, o, x1-x0);
+  }
+
+  for(int qj=0; qj<=K; qj++) for(int qi=-K; qi<=K; qi++)
+    {
+      // -q is done together with q
+      if(qj == 0 && qi <= 0) continue;
+      // weights needed: at the pixels of the block for q, and shifted by -q for -q.
+      const int dx0 = MAX(0, x0 - MAX(qi, 0));
+      const int dx1 = MIN(width, x1 - MIN(qi, 0));
+      // column sums needed for the patches around those
+      const int cx0 = MAX(0, dx0 - P);
+      const int cx1 = MIN(width, dx1 + P);
+      // columns where the neighbour at q is inside the image
+      const int vx0 = MAX(cx0, -qi);
+      const int vx1 = MIN(cx1, width - qi);
+      // rows where the neighbour at q is inside the image
+      const int vy1 = height - qj;
+      const int jb = MAX(0, j0 - qj);
+      float *const c = col - cx0;
+
+      memset(col, 0, sizeof(float)*(cx1 - cx0));
+      for(int y=MAX(0, jb-P); y<MIN(vy1, jb+P); y++)
+        _dist_row(in, width, y, qi, qj, vx0, vx1, p->norm, 1.0f, c);
+
+      for(int j=jb; j<j1; j++)
+      {
+        // column sums over rows j-P..j+P
+        if(j+P < vy1) _dist_row(in, width, j+P, qi, qj, vx0, vx1, p->norm, 1.0f, c);
+        if(j > jb && j-P-1 >= 0 && j-P-1 < vy1) _dist_row(in, width, j-P-1, qi, qj, vx0, vx1, p->norm, -1.0f, c);
+
+        // box filter them horizontally and convert to weights, into the ring buffer
+        float *const w = ring + (size_t)(j % (K+1))*stride;
+        float s = 0.0f;
+        for(int x=cx0; x<MIN(cx1, dx0+P); x++) s += c[x];
+        for(int x=dx0; x<dx1; x++)
+        {
+          if(x+P < cx1) s += c[x+P];
+          if(x-P-1 >= cx0) s -= c[x-P-1];
+          w[x-dx0] = s;
+        }
+        for(int x=0; x<dx1-dx0; x+=4)
+        {
+          const __m128 d = _mm_sub_ps(_mm_mul_ps(_mm_loadu_ps(w + x), scale), bias);
+          _mm_storeu_ps(w + x, _fast_mexp2f_sse(_mm_max_ps(_mm_setzero_ps(), d)));
+        }
+
+        if(j < j0) continue;
+        float *const o = out + 4*(size_t)width*j;
+        // the neighbour at q of the pixels in row j
+        if(j + qj < height)
+        {
+          const int a = MAX(x0, -qi), b = MIN(x1, width - qi);
+          if(a < b) _accumulate(in + 4*((size_t)width*(j+qj) + a + qi), w + a - dx0, o + 4*a, b - a);
+        }
+        // and the pixels in row j-qj having row j as their neighbour at q
+        if(j - qj >= 0)
+        {
+          const float *const wm = ring + (size_t)((j - qj) % (K+1))*stride;
+          const int a = MAX(x0, qi), b = MIN(x1, width + qi);
+          if(a < b) _accumulate(in + 4*((size_t)width*(j-qj) + a - qi), wm + a - qi - dx0, o + 4*a, b - a);
+        }
+      }
+    }
+}
+
+void dt_nlmeans_denoise(const float *const in, float *const out, const int width, const int height,
+                        const dt_nlmeans_param_t *const params)
+{
+  const int blocks_x = (width + DT_NLMEANS_BLOCK_WIDTH - 1) / DT_NLMEANS_BLOCK_WIDTH;
+  const int blocks_y = (height + DT_NLMEANS_BLOCK_HEIGHT - 1) / DT_NLMEANS_BLOCK_HEIGHT;
+  const size_t scratch_size = (size_t)(params->search_radius + 2) * _scratch_stride(params);
+  float *scratch = dt_alloc_align(64, (size_t)dt_get_num_threads() * scratch_size * sizeof(float));
+  if(!scratch)
+  {
+    // out of memory: every pixel keeps its own value, with weight one, so normalizing gives the input back
+    for(size_t k=0; k<(size_t)width*height; k++)
+    {
+      out[4*k+0] = in[4*k+0];
+      out[4*k+1] = in[4*k+1];
+      out[4*k+2] = in[4*k+2];
+      out[4*k+3] = 1.0f;
+    }
+    return;
+  }
+
+#ifdef _OPENMP
+#if !defined(__SUNOS__) && !defined(__NetBSD__)
+  #pragma omp parallel for default(none) schedule(dynamic) shared(scratch)
+#else
+  #pragma omp parallel for schedule(dynamic) shared(scratch)
+#endif
+#endif
+  for(int b=0; b<blocks_x*blocks_y; b++)
+  {
+    const int x0 = (b % blocks_x) * DT_NLMEANS_BLOCK_WIDTH;
+    const int j0 = (b / blocks_x) * DT_NLMEANS_BLOCK_HEIGHT;
+    _nlmeans_block(in, out, width, height, x0, MIN(width, x0 + DT_NLMEANS_BLOCK_WIDTH),
+                   j0, MIN(height, j0 + DT_NLMEANS_BLOCK_HEIGHT), params,
+                   scratch + dt_get_thread_num() * scratch_size);
+  }
+
+  dt_free_align(scratch);
+}
+
+// modelines: These editor modelines have been set for all relevant files by tools/update_modelines.sh
+// vim: shiftwidth=2 expandtab tabstop=2 cindent
+// kate: tab-indents: off; indent-width 2; replace-tabs on; indent-mode cstyle; remove-trailing-space on;
@@ -0,0 +1,57 @@
+/*
+    This file is part of darktable,
+    copyright (c) 2026 agent.
+
+    darktable is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    darktable is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with darktable.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef DT_COMMON_NLMEANS_CORE_H
+#define DT_COMMON_NLMEANS_CORE_H
+
+#include <stddef.h>
+
+/**
+ * cpu core of the non-local means filters (nlmeans and denoiseprofile).
+ *
+ * for every pixel p and every offset q in the search window, the weight of
+ * the pixel p+q is 2^-max(0, scale*D - bias), where D is the sum over the
+ * (2*patch_radius+1)^2 patch around p of the squared differences between the
+ * pixels and their neighbours at q, channels weighted with norm[]. parts of a
+ * patch outside the image are left out.
+ *
+ * the distance of p to p+q is the one of p+q to p, so every pair of offsets
+ * +q/-q is computed only once. the image is processed in blocks which stay in
+ * cache for all offsets.
+ */
+
+typedef struct dt_nlmeans_param_t
+{
+  int patch_radius;     // P
+  int search_radius;    // K, offsets go from -K to K in both directions
+  float norm[3];        // weights of the squared channel differences
+  float scale, bias;    // map the patch distance to the exponent of the weight
+}
+dt_nlmeans_param_t;
+
+/** writes the weighted sum of the neighbours of every pixel of in (4 channels, width x height)
+    to out, with the sum of the weights in out[3]. the caller normalizes. */
+void dt_nlmeans_denoise(const float *const in, float *const out, const int width, const int height,
+                        const dt_nlmeans_param_t *const params);
+
+/** temporary memory used by dt_nlmeans_denoise(), independent of the image size (for tiling->overhead). */
+size_t dt_nlmeans_scratch_size(const dt_nlmeans_param_t *const params);
+
+#endif
+// modelines: These editor modelines have been set for all relevant files by tools/update_modelines.sh
+// vim: shiftwidth=2 expandtab tabstop=2 cindent
+// kate: tab-indents: off; indent-width 2; replace-tabs on; indent-mode cstyle; remove-trailing-space on;
@@ -38,6 +38,51 @@ void dt_ratings_apply_to_image (int imgid, int rating)
   dt_collection_hint_message(darktable.collection);
 }
 
+void dt_ratings_apply_to_images (const GList *imgs, int rating)
+{
+  if(!imgs) return;
+  sqlite3_stmt *stmt;
+
+  // all images with one statement in one transaction. one star is a toggle per image, as above.
+  const gboolean transaction = dt_database_try_start_transaction(darktable.db);
+  DT_DEBUG_SQLITE3_PREPARE_V2(dt_database_get(darktable.db),
+                              "update images set flags = (flags & ~7) | "
+                              "(case when ?1 = 1 and (flags & 7) = 1 then 0 else ?1 end) where id = ?2",
+                              -1, &stmt, NULL);
+  DT_DEBUG_SQLITE3_BIND_INT(stmt, 1, 0x7 & rating);
+  for(const GList *iter = imgs; iter; iter = g_list_next(iter))
+  {
+    DT_DEBUG_SQLITE3_BIND_INT(stmt, 2, GPOINTER_TO_INT(iter->data));
+    sqlite3_step(stmt);
+    sqlite3_reset(stmt);
+  }
+  sqlite3_finalize(stmt);
+  if(transaction) dt_database_release_transaction(darktable.db);
+
+  // the image structs which are in the cache get the new flags from the db, without writing back
+  DT_DEBUG_SQLITE3_PREPARE_V2(dt_database_get(darktable.db), "select flags from images where id = ?1", -1, &stmt, NULL);
+  for(const GList *iter = imgs; iter; iter = g_list_next(iter))
+  {
+    const int imgid = GPOINTER_TO_INT(iter->data);
+    if(!dt_cache_contains(&darktable.image_cache->cache, imgid)) continue;
+    DT_DEBUG_SQLITE3_BIND_INT(stmt, 1, imgid);
+    if(sqlite3_step(stmt) == SQLITE_ROW)
+    {
+      const int flags = sqlite3_column_int(stmt, 0);
+      const dt_image_t *cimg = dt_image_cache_read_get(darktable.image_cache, imgid);
+      dt_image_t *image = dt_image_cache_write_get(darktable.image_cache, cimg);
+      image->flags = (image->flags & ~0x7) | (flags & 0x7);
+      dt_image_cache_write_release(darktable.image_cache, image, DT_IMAGE_CACHE_MEMORY);
+      dt_image_cache_read_release(darktable.image_cache, image);
+    }
+    sqlite3_reset(stmt);
+  }
+  sqlite3_finalize(stmt);
+
+  dt_image_synch_xmps_deferred(imgs);
+  dt_collection_hint_message(darktable.collection);
+}
+
 void dt_ratings_apply_to_selection (int rating)
 {
   uint32_t count = dt_collection_get_selected_count(darktable.collection);
@@ -47,23 +92,11 @@ void dt_ratings_apply_to_selection (int rating)
       dt_control_log(ngettext("rejecting %d image", "rejecting %d images", count), count);
     else
       dt_control_log(ngettext("applying rating %d to %d image", "applying rating %d to %d images", count), rating, count);
-#if 0 // not updating cache
-    gchar query[1024]= {0};
-    g_snprintf(query,sizeof(query),
-               "update images set flags=(images.flags & ~7) | (7 & %d) where id in (select imgid from selected_images)",
-               rating
-              );
-    DT_DEBUG_SQLITE3_EXEC(dt_database_get(darktable.db), query, NULL, NULL, NULL);
-#endif
 
-    /* for each selected image update rating */
-    sqlite3_stmt *stmt;
-    DT_DEBUG_SQLITE3_PREPARE_V2(dt_database_get(darktable.db), "select imgid from selected_images", -1, &stmt, NULL);
-    while(sqlite3_step(stmt) == SQLITE_ROW)
-    {
-      dt_ratings_apply_to_image(sqlite3_column_int(stmt, 0), rating);
-    }
-    sqlite3_finalize(stmt);
+    /* update the rating of all selected images at once */
+    GList *imgs = dt_collection_get_selected(darktable.collection, -1);
+    dt_ratings_apply_to_images(imgs, rating);
+    g_list_free(imgs);
 
     /* redraw view */
     /* dt_control_queue_redraw_center() */
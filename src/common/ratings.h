@@ -29,6 +29,9 @@ void dt_ratings_apply_to_selection(int rating);
 /** apply rating to the specified image */
 void dt_ratings_apply_to_image (int imgid, int rating);
 
+/** apply rating to a list of image ids, in one transaction. sidecars are written in the background. */
+void dt_ratings_apply_to_images (const GList *imgs, int rating);
+
 #endif
 // modelines: These editor modelines have been set for all relevant files by tools/update_modelines.sh
 // vim: shiftwidth=2 expandtab tabstop=2 cindent
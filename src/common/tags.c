@@ -168,7 +168,6 @@ gboolean dt_tag_exists(const char *name,guint *tagid)
   return FALSE;
 }
 
-//FIXME: shall we increment count in tagxtag if the image was already tagged?
 void dt_tag_attach(guint tagid,gint imgid)
 {
   sqlite3_stmt *stmt;
@@ -194,6 +193,29 @@ void dt_tag_attach(guint tagid,gint imgid)
   }
 }
 
+// steps the statement for every image of the list, in one transaction
+static void _tag_images(const char *query, guint tagid, const GList *imgs)
+{
+  if(!imgs) return;
+  sqlite3_stmt *stmt;
+  const gboolean transaction = dt_database_try_start_transaction(darktable.db);
+  DT_DEBUG_SQLITE3_PREPARE_V2(dt_database_get(darktable.db), query, -1, &stmt, NULL);
+  DT_DEBUG_SQLITE3_BIND_INT(stmt, 1, tagid);
+  for(const GList *iter = imgs; iter; iter = g_list_next(iter))
+  {
+    DT_DEBUG_SQLITE3_BIND_INT(stmt, 2, GPOINTER_TO_INT(iter->data));
+    sqlite3_step(stmt);
+    sqlite3_reset(stmt);
+  }
+  sqlite3_finalize(stmt);
+  if(transaction) dt_database_release_transaction(darktable.db);
+}
+
+void dt_tag_attach_images(guint tagid, const GList *imgs)
+{
+  _tag_images("INSERT OR REPLACE INTO tagged_images (tagid, imgid) VALUES (?1, ?2)", tagid, imgs);
+}
+
 void dt_tag_attach_list(GList *tags,gint imgid)
 {
   GList *child=NULL;
@@ -257,6 +279,11 @@ void dt_tag_detach(guint tagid,gint imgid)
   }
 }
 
+void dt_tag_detach_images(guint tagid, const GList *imgs)
+{
+  _tag_images("DELETE FROM tagged_images WHERE tagid = ?1 AND imgid = ?2", tagid, imgs);
+}
+
 void dt_tag_detach_by_string(const char *name, gint imgid)
 {
   char query[2048]= {0};
@@ -383,28 +410,25 @@ gchar *dt_tag_get_hierarchical(gint imgid, const gchar *separator)
 }
 
 /*
- * dt_tag_get_suggestions() takes a string (keyword) and searches the
- * tagxtags table for possibly-related tags. The list we construct at
- * the end of the function is made up as follows:
+ * dt_tag_get_suggestions() takes a string (keyword) and suggests the tags
+ * which have been attached together with the tags matching it. The list we
+ * construct at the end of the function is made up as follows:
  *
- * * Tags which appear as tagxtag.id2, where (keyword's name = tagxtag.id1)
- *   are listed first, ordered by count of times seen already.
- * * Tags which appear as tagxtag.id1, where (keyword's name = tagxtag.id2)
- *   are listed second, ordered as before.
+ * * The tags matching the keyword themselves are listed first.
+ * * Tags which are attached to images together with one of those are listed
+ *   second, ordered by the number of times they appear together.
  *
- * We do not suggest tags which have not yet been matched up in tagxtag,
+ * We do not suggest tags which have not yet been attached together,
  * because it is up to the user to add new tags to the list and thereby
  * make the association.
  *
- * Expressing these as separate queries avoids making the sqlite3 engine
- * do a large number of operations and thus makes the user experience
- * snappy.
+ * The co-occurrences are counted from tagged_images on demand, both
+ * sides of the join are covered by an index (imgid, tagid) and (tagid, imgid).
+ * That way attaching tags does not have to maintain a table of all pairs of tags.
  *
  * SELECT T.id FROM tags T WHERE T.name LIKE '?1';  --> into temp table
- * SELECT TXT.id2 FROM tagxtag TXT WHERE TXT.id1 IN (temp table)
- *   AND TXT.count > 0 ORDER BY TXT.count DESC;
- * SELECT TXT.id1 FROM tagxtag TXT WHERE TXT.id2 IN (temp table)
- *   AND TXT.count > 0 ORDER BY TXT.count DESC;
+ * SELECT TI2.tagid, COUNT(*) FROM tagged_images TI1 JOIN tagged_images TI2
+ *   ON TI2.imgid = TI1.imgid WHERE TI1.tagid IN (temp table) GROUP BY TI2.tagid;
  *
  * SELECT DISTINCT(T.name) FROM tags T JOIN memoryquery MQ on MQ.id = T.id;
  *
@@ -436,27 +460,21 @@ uint32_t dt_tag_get_suggestions(const gchar *keyword, GList **result)
                         NULL, NULL, NULL);
 
   /*
-   * SELECT TXT.id2 FROM tagxtag TXT WHERE TXT.id1 IN (temp table)
-   *   AND TXT.count > 0 ORDER BY TXT.count DESC;
+   * SELECT TI2.tagid, COUNT(*) FROM tagged_images TI1 JOIN tagged_images TI2
+   *   ON TI2.imgid = TI1.imgid WHERE TI1.tagid IN (temp table) GROUP BY TI2.tagid;
    */
   DT_DEBUG_SQLITE3_EXEC(dt_database_get(darktable.db),
                         "INSERT INTO memory.taglist (id, count) "
-                        "SELECT DISTINCT(TXT.id2), TXT.count FROM tagxtag TXT "
-                        "WHERE TXT.count > 0 "
-                        " AND TXT.id1 IN (SELECT id FROM memory.tagq) "
-                        "ORDER BY TXT.count DESC",
+                        "SELECT TI2.tagid, COUNT(*) FROM tagged_images TI1 "
+                        "JOIN tagged_images TI2 ON TI2.imgid = TI1.imgid "
+                        "WHERE TI1.tagid IN (SELECT id FROM memory.tagq) "
+                        "GROUP BY TI2.tagid",
                         NULL, NULL, NULL);
 
-  /*
-   * SELECT TXT.id1 FROM tagxtag TXT WHERE TXT.id2 IN (temp table)
-   *   AND TXT.count > 0 ORDER BY TXT.count DESC;
-   */
+  /* the matching tags themselves go first (taglist replaces on conflict) */
   DT_DEBUG_SQLITE3_EXEC(dt_database_get(darktable.db),
-                        "INSERT OR REPLACE INTO memory.taglist (id, count) "
-                        "SELECT DISTINCT(TXT.id1), TXT.count FROM tagxtag TXT "
-                        "WHERE TXT.count > 0 "
-                        " AND TXT.id2 IN (SELECT id FROM memory.tagq) "
-                        "ORDER BY TXT.count DESC",
+                        "INSERT INTO memory.taglist (id, count) "
+                        "SELECT id, 1000000 FROM memory.tagq",
                         NULL, NULL, NULL);
 
   /* Now put all the bits together */
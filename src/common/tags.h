@@ -46,6 +46,9 @@ gboolean dt_tag_exists(const char *name,guint *tagid);
 /** attach a list of tags on selected images. \param[in] tagid id of tag to attach. \param[in] imgid the image id to attach tag to, if < 0 selected images are used. */
 void dt_tag_attach(guint tagid,gint imgid);
 
+/** attach a tag to a list of image ids, with one statement in one transaction. */
+void dt_tag_attach_images(guint tagid, const GList *imgs);
+
 /** attach a list of tags on selected images. \param[in] tags a list of ids of tags. \param[in] imgid the image id to attach tag to, if < 0 selected images are used. \note If tag not exists it's created.*/
 void dt_tag_attach_list(GList *tags,gint imgid);
 
@@ -55,6 +58,9 @@ void dt_tag_attach_string_list(const gchar *tags, gint imgid);
 /** detach tag from images. \param[in] tagid if of tag to deattach. \param[in] imgid the image id to attach tag from, if < 0 selected images are used. */
 void dt_tag_detach(guint tagid,gint imgid);
 
+/** detach a tag from a list of image ids, with one statement in one transaction. */
+void dt_tag_detach_images(guint tagid, const GList *imgs);
+
 /** detach tags from images that matches name, it is valid to use % to match tag */
 void dt_tag_detach_by_string(const char *name, gint imgid);
 
@@ -0,0 +1,128 @@
+/*
+    This file is part of darktable,
+    copyright (c) 2026 agent.
+
+    darktable is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    darktable is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with darktable.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#include "common/trace.h"
+
+#include <stdarg.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+// small per-thread ids, handed out on the first event of each thread:
+static __thread int32_t _trace_tid = -1;
+
+static int32_t _get_tid(dt_trace_t *t)
+{
+  if(_trace_tid < 0) _trace_tid = __sync_fetch_and_add(&t->num_threads, 1);
+  return _trace_tid;
+}
+
+// names come from module ops and job descriptions, keep them valid json.
+static void _write_string(FILE *f, const char *s)
+{
+  fputc('"', f);
+  for(; s && *s; s++)
+  {
+    if(*s == '"' || *s == '\\') fputc('\\', f);
+    fputc((unsigned char)*s < 0x20 ? ' ' : *s, f);
+  }
+  fputc('"', f);
+}
+
+// writes one event. needs the lock.
+static void _write_event(dt_trace_t *t, const char phase, const char *category, const char *name,
+                         const double ts, const double dur, const int32_t tid, const char *args, va_list ap)
+{
+  fprintf(t->f, ",\n{\"ph\":\"%c\",\"pid\":%d,\"tid\":%d,\"ts\":%.1f", phase, (int)getpid(), tid, ts);
+  if(phase == 'X') fprintf(t->f, ",\"dur\":%.1f", dur);
+  if(phase == 'i') fprintf(t->f, ",\"s\":\"t\"");
+  fprintf(t->f, ",\"cat\":");
+  _write_string(t->f, category);
+  fprintf(t->f, ",\"name\":");
+  _write_string(t->f, name);
+  if(args)
+  {
+    fprintf(t->f, ",\"args\":{");
+    vfprintf(t->f, args, ap);
+    fputc('}', t->f);
+  }
+  fputc('}', t->f);
+}
+
+void dt_trace_init(const char *filename)
+{
+  FILE *f = fopen(filename, "wb");
+  if(!f)
+  {
+    fprintf(stderr, "[trace] could not open `%s' for writing\n", filename);
+    return;
+  }
+  dt_trace_t *t = (dt_trace_t *)calloc(1, sizeof(dt_trace_t));
+  t->f = f;
+  t->start = dt_get_wtime();
+  dt_pthread_mutex_init(&t->lock, NULL);
+  // the array format, so the file stays loadable if we crash before closing it.
+  // the first element is just there to make the separators simple.
+  fprintf(f, "[{\"ph\":\"M\",\"pid\":%d,\"name\":\"process_name\",\"args\":{\"name\":\"darktable\"}}",
+          (int)getpid());
+  darktable.trace = t;
+}
+
+void dt_trace_cleanup()
+{
+  dt_trace_t *t = darktable.trace;
+  if(!t) return;
+  darktable.trace = NULL;
+  dt_pthread_mutex_lock(&t->lock);
+  fprintf(t->f, "\n]\n");
+  fclose(t->f);
+  dt_pthread_mutex_unlock(&t->lock);
+  dt_pthread_mutex_destroy(&t->lock);
+  free(t);
+}
+
+void dt_trace_complete(const char *category, const char *name, const double begin, const char *args, ...)
+{
+  dt_trace_t *t = darktable.trace;
+  if(!t || begin <= 0.0) return;
+  const double end = dt_get_wtime();
+  const int32_t tid = _get_tid(t);
+  va_list ap;
+  va_start(ap, args);
+  dt_pthread_mutex_lock(&t->lock);
+  _write_event(t, 'X', category, name, (begin - t->start)*1e6, (end - begin)*1e6, tid, args, ap);
+  dt_pthread_mutex_unlock(&t->lock);
+  va_end(ap);
+}
+
+void dt_trace_instant(const char *category, const char *name, const char *args, ...)
+{
+  dt_trace_t *t = darktable.trace;
+  if(!t) return;
+  const double now = dt_get_wtime();
+  const int32_t tid = _get_tid(t);
+  va_list ap;
+  va_start(ap, args);
+  dt_pthread_mutex_lock(&t->lock);
+  _write_event(t, 'i', category, name, (now - t->start)*1e6, 0.0, tid, args, ap);
+  dt_pthread_mutex_unlock(&t->lock);
+  va_end(ap);
+}
+
+// modelines: These editor modelines have been set for all relevant files by tools/update_modelines.sh
+// vim: shiftwidth=2 expandtab tabstop=2 cindent
+// kate: tab-indents: off; indent-width 2; replace-tabs on; indent-mode cstyle; remove-trailing-space on;
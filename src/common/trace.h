@@ -0,0 +1,72 @@
+/*
+    This file is part of darktable,
+    copyright (c) 2026 agent.
+
+    darktable is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    darktable is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with darktable.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef DT_TRACE_H
+#define DT_TRACE_H
+
+#include "common/darktable.h"
+#include "common/dtpthread.h"
+
+#include <stdio.h>
+
+/**
+ * structured timing log, written as chrome trace events (load the file in
+ * chrome://tracing or ui.perfetto.dev). enabled with --trace <file> on the
+ * command line, costs one pointer check per call site otherwise.
+ *
+ * spans are recorded after the fact: take a timestamp with dt_trace_begin()
+ * and pass it to dt_trace_complete() when done. args are printf style and
+ * form the body of a json object, for example "\"imgid\":%d".
+ */
+
+typedef struct dt_trace_t
+{
+  FILE *f;
+  double start;   // dt_get_wtime() at init, timestamps are relative to that
+  int32_t num_threads;
+  dt_pthread_mutex_t lock;
+}
+dt_trace_t;
+
+/** opens the log and sets darktable.trace. */
+void dt_trace_init(const char *filename);
+/** finishes and closes the log. */
+void dt_trace_cleanup();
+
+static inline int dt_trace_enabled()
+{
+  return darktable.trace != NULL;
+}
+
+/** start of a span, 0 if tracing is off. */
+static inline double dt_trace_begin()
+{
+  return darktable.trace ? dt_get_wtime() : 0.0;
+}
+
+/** a span from begin until now. */
+void dt_trace_complete(const char *category, const char *name, const double begin, const char *args, ...)
+__attribute__((format(printf, 4, 5)));
+
+/** a point in time, such as a cache hit. */
+void dt_trace_instant(const char *category, const char *name, const char *args, ...)
+__attribute__((format(printf, 3, 4)));
+
+#endif
+// modelines: These editor modelines have been set for all relevant files by tools/update_modelines.sh
+// vim: shiftwidth=2 expandtab tabstop=2 cindent
+// kate: tab-indents: off; indent-width 2; replace-tabs on; indent-mode cstyle; remove-trailing-space on;
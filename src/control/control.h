@@ -215,13 +215,13 @@ typedef struct dt_control_t
 
   // job management
   int32_t running;
-  dt_pthread_mutex_t queue_mutex, cond_mutex, run_mutex;
+  dt_pthread_mutex_t res_mutex, cond_mutex, run_mutex;
   pthread_cond_t cond;
   int32_t num_threads;
   pthread_t *thread,kick_on_workers_thread;
 
-  GList *queues[DT_JOB_QUEUE_MAX];
-  size_t queue_length[DT_JOB_QUEUE_MAX];
+  // one job deque per worker thread, see jobs.c
+  struct dt_control_worker_queue_t *worker_queues;
 
   dt_job_t *job_res[DT_CTL_WORKER_RESERVED];
   uint8_t new_res[DT_CTL_WORKER_RESERVED];
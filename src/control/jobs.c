@@ -21,10 +21,27 @@
 
 #include "control/jobs.h"
 #include "control/control.h"
+#include "common/trace.h"
 
 #define DT_CONTROL_FG_PRIORITY 4
 #define DT_CONTROL_MAX_JOBS 30
 
+/* every worker owns one of these, with one lane per dt_job_queue_t.
+   jobs are pushed into the deque of the submitting worker (or the least loaded
+   one for jobs coming from other threads), and idle workers steal from the
+   others. this way dispatching a job only ever takes the lock of one deque
+   instead of a global one.
+*/
+typedef struct dt_control_worker_queue_t
+{
+  dt_pthread_mutex_t mutex;
+  GQueue lanes[DT_JOB_QUEUE_MAX];  // the head is the job the owner runs next
+  int skipped[DT_JOB_QUEUE_MAX];    // rounds a non-empty lane was passed over, used to age lower lanes
+  volatile int32_t length;          // number of queued jobs in all lanes, read without lock as a hint
+  char padding[64];                 // keep the hot mutexes of neighbouring workers off the same cache line
+}
+dt_control_worker_queue_t;
+
 /* the queue can have scheduled jobs but all
     the workers are sleeping, so this kicks the workers
     on timed interval.
@@ -45,17 +62,18 @@ typedef struct _dt_job_t
   dt_pthread_mutex_t wait_mutex;
 
   dt_job_state_t state;
-  unsigned char priority;
   dt_job_queue_t queue;
 
   dt_job_state_change_callback state_changed_cb;
 
+  double queued; // when it was added to a queue, only set when tracing
+
   char description[DT_CONTROL_DESCRIPTION_LEN];
 }
 _dt_job_t;
 
 /** check if two jobs are to be considered equal. a simple memcmp won't work since the mutexes probably won't match
-    we don't want to compare result, priority or state since these will change during the course of processing.
+    we don't want to compare result or state since these will change during the course of processing.
     TODO: somehow compare params. maybe we have to pass the sizeof(params) when setting the params to do a memcmp, or maybe even
           allow to pass a comparator for that.
  */
@@ -64,7 +82,7 @@ static inline int dt_control_job_equal(_dt_job_t * j1, _dt_job_t * j2)
   return (j1->execute == j2->execute              &&
      j1->state_changed_cb == j2->state_changed_cb &&
      j1->queue == j2->queue                       &&
-     g_strcmp0(j1->description, j2->description)
+     !g_strcmp0(j1->description, j2->description)
     );
 }
 
@@ -73,6 +91,7 @@ static void dt_control_job_set_state(_dt_job_t *job, dt_job_state_t state)
   if(!job) return;
   dt_pthread_mutex_lock(&job->state_mutex);
   job->state = state;
+  if(state == DT_JOB_STATE_QUEUED) job->queued = dt_trace_begin();
   /* pass state change to callback */
   if(job->state_changed_cb)
     job->state_changed_cb(job, state);
@@ -137,7 +156,7 @@ void dt_control_job_set_state_callback(_dt_job_t *job, dt_job_state_change_callb
 static void dt_control_job_print(_dt_job_t *job)
 {
   if(!job) return;
-  dt_print(DT_DEBUG_CONTROL, "%s | queue: %d | priority: %d", job->description, job->queue, job->priority);
+  dt_print(DT_DEBUG_CONTROL, "%s | queue: %d", job->description, job->queue);
 }
 
 void dt_control_job_cancel(_dt_job_t *job)
@@ -163,14 +182,14 @@ static int32_t dt_control_run_job_res(dt_control_t *control, int32_t res)
   if(((unsigned int)res) >= DT_CTL_WORKER_RESERVED) return -1;
 
   _dt_job_t *job = NULL;
-  dt_pthread_mutex_lock(&control->queue_mutex);
+  dt_pthread_mutex_lock(&control->res_mutex);
   if(control->new_res[res])
   {
     job = control->job_res[res];
     control->job_res[res] = NULL; // this job belongs to us now, the queue may not touch it any longer
   }
   control->new_res[res] = 0;
-  dt_pthread_mutex_unlock(&control->queue_mutex);
+  dt_pthread_mutex_unlock(&control->res_mutex);
   if(!job)
     return -1;
 
@@ -185,7 +204,10 @@ static int32_t dt_control_run_job_res(dt_control_t *control, int32_t res)
     dt_control_job_set_state(job, DT_JOB_STATE_RUNNING);
 
     /* execute job */
+    const double trace_begin = dt_trace_begin();
     job->result = job->execute(job);
+    dt_trace_complete("jobs", job->description, trace_begin, "\"queued_ms\":%.3f",
+                      job->queued > 0.0 ? (trace_begin - job->queued)*1000.0 : 0.0);
 
     dt_control_job_set_state(job, DT_JOB_STATE_FINISHED);
     dt_print(DT_DEBUG_CONTROL, "[run_job-] %02d %f ", res, dt_get_wtime());
@@ -197,61 +219,83 @@ static int32_t dt_control_run_job_res(dt_control_t *control, int32_t res)
   return 0;
 }
 
-static _dt_job_t* dt_control_schedule_job(dt_control_t *control)
+// index of the deque owned by the current thread, -1 for threads which are not (non-reserved) workers.
+static __thread int worker_queue = -1;
+
+// takes the next job out of a worker's deque, or returns NULL. needs q->mutex.
+static _dt_job_t* dt_control_take_job(dt_control_worker_queue_t *q, const int steal)
 {
   /*
-   * job scheduling works like this:
-   * - when there is a single job in the queue head with a maximal priority -> pick it
-   * - otherwise pick among the ones with the maximal priority in the following order:
+   * lanes are served in the order of dt_job_queue_t:
    *   * user foreground
    *   * system foreground
    *   * user background
    *   * system background
-   * - the jobs that didn't get picked this round get their priority incremented
+   * - a lane that got passed over while it had jobs ages, and once it has waited
+   *   for more than DT_CONTROL_FG_PRIORITY rounds it is served first. background
+   *   jobs thus can't starve behind a constant stream of foreground work.
    */
-
-  dt_pthread_mutex_lock(&control->queue_mutex);
-
-  // find the job
-  _dt_job_t *job = NULL;
-  int winner_queue = DT_JOB_QUEUE_MAX;
-  int max_priority = -1;
+  int winner = -1;
   for(int i = 0; i < DT_JOB_QUEUE_MAX; i++)
   {
-    if(control->queues[i] == NULL) continue;
-    _dt_job_t *_job = (_dt_job_t*)control->queues[i]->data;
-    if(_job->priority > max_priority)
+    if(g_queue_is_empty(&q->lanes[i])) continue;
+    if(winner < 0 || q->skipped[i] > DT_CONTROL_FG_PRIORITY)
     {
-      max_priority = _job->priority;
-      job = _job;
-      winner_queue = i;
+      winner = i;
+      if(q->skipped[i] > DT_CONTROL_FG_PRIORITY) break;
     }
   }
+  if(winner < 0) return NULL;
 
-  if(!job)
+  for(int i = 0; i < DT_JOB_QUEUE_MAX; i++)
   {
-    dt_pthread_mutex_unlock(&control->queue_mutex);
-    return NULL;
+    if(i == winner || g_queue_is_empty(&q->lanes[i])) continue;
+    q->skipped[i]++;
   }
+  q->skipped[winner] = 0;
 
-  // the order of the queues in control->queues matches our priority, and we only update job when the priority is strictly bigger
-  // invariant -> job is the one we are looking for
+  // the system foreground lane is a stack: its owner runs the newest job first,
+  // thieves take the oldest one from the other end. all other lanes are fifos.
+  _dt_job_t *job;
+  if(steal && winner == DT_JOB_QUEUE_SYSTEM_FG)
+    job = (_dt_job_t*)g_queue_pop_tail(&q->lanes[winner]);
+  else
+    job = (_dt_job_t*)g_queue_pop_head(&q->lanes[winner]);
+  q->length--;
+  return job;
+}
 
-  // remove the to be scheduled job from its queue
-  GList **queue = &control->queues[winner_queue];
-  *queue = g_list_delete_link(*queue, *queue);
-  control->queue_length[winner_queue]--;
+static _dt_job_t* dt_control_schedule_job(dt_control_t *control)
+{
+  const int num = control->num_threads;
+  const int self = worker_queue >= 0 ? worker_queue : 0;
+  _dt_job_t *job = NULL;
 
-  // increment the priorities of the others
-  for(int i = 0; i < DT_JOB_QUEUE_MAX; i++)
+  // own deque first:
+  dt_control_worker_queue_t *q = control->worker_queues + self;
+  if(q->length > 0)
   {
-    if(i == winner_queue || control->queues[i] == NULL) continue;
-    ((_dt_job_t*)control->queues[i]->data)->priority++;
+    dt_pthread_mutex_lock(&q->mutex);
+    job = dt_control_take_job(q, 0);
+    dt_pthread_mutex_unlock(&q->mutex);
+    if(job) return job;
   }
 
-  dt_pthread_mutex_unlock(&control->queue_mutex);
-
-  return job;
+  // then try to steal from the others, starting with our neighbour so thieves spread out:
+  for(int i = 1; i < num; i++)
+  {
+    q = control->worker_queues + (self + i) % num;
+    if(q->length <= 0) continue;
+    dt_pthread_mutex_lock(&q->mutex);
+    job = dt_control_take_job(q, 1);
+    dt_pthread_mutex_unlock(&q->mutex);
+    if(job)
+    {
+      dt_print(DT_DEBUG_CONTROL, "[schedule_job] worker %d stole from worker %d\n", self, (self + i) % num);
+      return job;
+    }
+  }
+  return NULL;
 }
 
 static int32_t dt_control_run_job(dt_control_t *control)
@@ -273,7 +317,10 @@ static int32_t dt_control_run_job(dt_control_t *control)
     dt_control_job_set_state(job, DT_JOB_STATE_RUNNING);
 
     /* execute job */
+    const double trace_begin = dt_trace_begin();
     job->result = job->execute(job);
+    dt_trace_complete("jobs", job->description, trace_begin, "\"queued_ms\":%.3f",
+                      job->queued > 0.0 ? (trace_begin - job->queued)*1000.0 : 0.0);
 
     dt_control_job_set_state(job, DT_JOB_STATE_FINISHED);
 
@@ -299,7 +346,7 @@ int32_t dt_control_add_job_res(dt_control_t *control, _dt_job_t *job, int32_t re
   }
 
   // TODO: pthread cancel and restart in tough cases?
-  dt_pthread_mutex_lock(&control->queue_mutex);
+  dt_pthread_mutex_lock(&control->res_mutex);
 
   // if there is a job in the queue we have to discard that first
   if(control->job_res[res])
@@ -316,7 +363,7 @@ int32_t dt_control_add_job_res(dt_control_t *control, _dt_job_t *job, int32_t re
   control->job_res[res] = job;
   control->new_res[res] = 1;
 
-  dt_pthread_mutex_unlock(&control->queue_mutex);
+  dt_pthread_mutex_unlock(&control->res_mutex);
 
   dt_pthread_mutex_lock(&control->cond_mutex);
   pthread_cond_broadcast(&control->cond);
@@ -325,9 +372,61 @@ int32_t dt_control_add_job_res(dt_control_t *control, _dt_job_t *job, int32_t re
   return 0;
 }
 
+// pick the deque a new job goes to.
+static int dt_control_job_target_queue(dt_control_t *control, _dt_job_t *job)
+{
+  const int num = control->num_threads;
+  // duplicates of a system foreground job always end up in the same deque, so
+  // they can still be found and moved to the top there:
+  if(job->queue == DT_JOB_QUEUE_SYSTEM_FG) return g_str_hash(job->description) % num;
+  // jobs spawned by a worker stay with it, their data is likely still in its caches:
+  if(worker_queue >= 0) return worker_queue;
+  // everything else goes to the least loaded worker:
+  int target = 0;
+  for(int i = 1; i < num; i++)
+    if(control->worker_queues[i].length < control->worker_queues[target].length) target = i;
+  return target;
+}
+
+// drops the oldest jobs of the longest system foreground stacks until all workers together
+// have no more than DT_CONTROL_MAX_JOBS of them queued.
+static void dt_control_limit_system_fg(dt_control_t *control)
+{
+  while(1)
+  {
+    // the lengths are only a hint, they are read without the locks
+    int total = 0, longest = 0;
+    guint longest_length = 0;
+    for(int i = 0; i < control->num_threads; i++)
+    {
+      const guint length = control->worker_queues[i].lanes[DT_JOB_QUEUE_SYSTEM_FG].length;
+      total += length;
+      if(length > longest_length)
+      {
+        longest = i;
+        longest_length = length;
+      }
+    }
+    if(total <= DT_CONTROL_MAX_JOBS) return;
+
+    dt_control_worker_queue_t *q = control->worker_queues + longest;
+    dt_pthread_mutex_lock(&q->mutex);
+    _dt_job_t *job = (_dt_job_t*)g_queue_pop_tail(&q->lanes[DT_JOB_QUEUE_SYSTEM_FG]);
+    if(job)
+    {
+      q->length--;
+      dt_control_job_set_state(job, DT_JOB_STATE_DISCARDED);
+    }
+    dt_pthread_mutex_unlock(&q->mutex);
+    // the workers got to it first
+    if(!job) return;
+  }
+}
+
 int dt_control_add_job(dt_control_t *control, dt_job_queue_t queue_id, _dt_job_t *job)
 {
-  if(((unsigned int)queue_id) >= DT_JOB_QUEUE_MAX || !job)
+  // without gui (darktable-cli) or after shutdown there are no workers, the callers do the work themselves:
+  if(((unsigned int)queue_id) >= DT_JOB_QUEUE_MAX || !job || !control->worker_queues || control->num_threads <= 0)
   {
     dt_control_job_dispose(job);
     return 1;
@@ -335,22 +434,21 @@ int dt_control_add_job(dt_control_t *control, dt_job_queue_t queue_id, _dt_job_t
 
   job->queue = queue_id;
 
-  dt_pthread_mutex_lock(&control->queue_mutex);
+  const int target = dt_control_job_target_queue(control, job);
+  dt_control_worker_queue_t *q = control->worker_queues + target;
+  dt_pthread_mutex_lock(&q->mutex);
 
-  GList **queue = &control->queues[queue_id];
-  size_t length = control->queue_length[queue_id];
+  GQueue *queue = &q->lanes[queue_id];
 
-  dt_print(DT_DEBUG_CONTROL, "[add_job] %ld | ", length);
+  dt_print(DT_DEBUG_CONTROL, "[add_job] %d:%u | ", target, g_queue_get_length(queue));
   dt_control_job_print(job);
   dt_print(DT_DEBUG_CONTROL, "\n");
 
   if(queue_id == DT_JOB_QUEUE_SYSTEM_FG)
   {
     // this is a stack with limited size and bubble up and all that stuff
-    job->priority = DT_CONTROL_FG_PRIORITY;
-
     // if the job is already in the queue -> move it to the top
-    for(GList *iter = *queue; iter; iter = g_list_next(iter))
+    for(GList *iter = queue->head; iter; iter = g_list_next(iter))
     {
       _dt_job_t* other_job = (_dt_job_t*)iter->data;
       if(dt_control_job_equal(job, other_job))
@@ -359,8 +457,8 @@ int dt_control_add_job(dt_control_t *control, dt_job_queue_t queue_id, _dt_job_t
         dt_control_job_print(job);
         dt_print(DT_DEBUG_CONTROL, "\n");
 
-        *queue = g_list_delete_link(*queue, iter);
-        length--;
+        g_queue_delete_link(queue, iter);
+        q->length--;
         dt_control_job_set_state(job, DT_JOB_STATE_DISCARDED);
         dt_control_job_dispose(job);
         job = other_job;
@@ -369,32 +467,21 @@ int dt_control_add_job(dt_control_t *control, dt_job_queue_t queue_id, _dt_job_t
     }
 
     // now we can add the new job to the list
-    *queue = g_list_prepend(*queue, job);
-    length++;
-
-    // and take care of the maximal queue size
-    if(length > DT_CONTROL_MAX_JOBS)
-    {
-      GList *last = g_list_last(*queue);
-      dt_control_job_set_state((_dt_job_t*)last->data, DT_JOB_STATE_DISCARDED);
-      *queue = g_list_delete_link(*queue, last);
-      length--;
-    }
-
-    control->queue_length[queue_id] = length;
+    g_queue_push_head(queue, job);
+    q->length++;
   }
   else
   {
     // the rest are FIFOs
-    if(queue_id == DT_JOB_QUEUE_USER_BG || queue_id == DT_JOB_QUEUE_SYSTEM_BG)
-      job->priority = 0;
-    else
-      job->priority = DT_CONTROL_FG_PRIORITY;
-    *queue = g_list_append(*queue, job);
-    control->queue_length[queue_id]++;
+    g_queue_push_tail(queue, job);
+    q->length++;
   }
   dt_control_job_set_state(job, DT_JOB_STATE_QUEUED);
-  dt_pthread_mutex_unlock(&control->queue_mutex);
+  dt_pthread_mutex_unlock(&q->mutex);
+
+  // and take care of the maximal size of the stacks, which is shared among all workers.
+  // this is done without holding our deque lock, two threads never wait for each other's.
+  if(queue_id == DT_JOB_QUEUE_SYSTEM_FG) dt_control_limit_system_fg(control);
 
   // notify workers
   dt_pthread_mutex_lock(&control->cond_mutex);
@@ -466,6 +553,7 @@ static void *dt_control_work(void *ptr)
   worker_thread_parameters_t *params = (worker_thread_parameters_t*)ptr;
   dt_control_t *control = params->self;
   threadid = params->threadid;
+  worker_queue = params->threadid;
   free(params);
   // int32_t threadid = dt_control_get_threadid();
   while(dt_control_running())
@@ -488,6 +576,12 @@ void dt_control_jobs_init(dt_control_t *control)
   // start threads
   control->num_threads = CLAMP(dt_conf_get_int ("worker_threads"), 1, 8);
   control->thread = (pthread_t *)calloc(control->num_threads, sizeof(pthread_t));
+  control->worker_queues = (dt_control_worker_queue_t *)calloc(control->num_threads, sizeof(dt_control_worker_queue_t));
+  for(int k=0; k<control->num_threads; k++)
+  {
+    dt_pthread_mutex_init(&control->worker_queues[k].mutex, NULL);
+    for(int i=0; i<DT_JOB_QUEUE_MAX; i++) g_queue_init(&control->worker_queues[k].lanes[i]);
+  }
   dt_pthread_mutex_lock(&control->run_mutex);
   control->running = 1;
   dt_pthread_mutex_unlock(&control->run_mutex);
@@ -513,6 +607,20 @@ void dt_control_jobs_init(dt_control_t *control)
   }
 }
 
+void dt_control_jobs_cleanup(dt_control_t *control)
+{
+  // the workers are joined already. jobs left in the deques are not disposed, as their
+  // state callbacks might refer to gui parts which are gone by now.
+  for(int k=0; k<control->num_threads; k++)
+  {
+    dt_control_worker_queue_t *q = control->worker_queues + k;
+    for(int i=0; i<DT_JOB_QUEUE_MAX; i++) g_queue_clear(&q->lanes[i]);
+    dt_pthread_mutex_destroy(&q->mutex);
+  }
+  free(control->worker_queues);
+  control->worker_queues = NULL;
+}
+
 // modelines: These editor modelines have been set for all relevant files by tools/update_modelines.sh
 // vim: shiftwidth=2 expandtab tabstop=2 cindent
 // kate: tab-indents: off; indent-width 2; replace-tabs on; indent-mode cstyle; remove-trailing-space on;
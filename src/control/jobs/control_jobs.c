@@ -33,6 +33,7 @@
 #include "common/gpx.h"
 #include "control/conf.h"
 #include "control/jobs/control_jobs.h"
+#include "develop/tiling.h"
 
 #include "gui/gtk.h"
 
@@ -826,6 +827,99 @@ static int32_t dt_control_local_copy_images_job_run(dt_job_t *job)
   return 0;
 }
 
+/* export scheduler: the omp threads of darktable are shared between images in
+ * flight and the omp parallel iops inside each pipe. every export thread owns a
+ * slot and runs its pixelpipe with threads/slots omp threads (nested), so the
+ * total never exceeds the pool. images are only admitted while their estimated
+ * buffers fit into the host memory limit next to the ones already running. */
+typedef struct dt_control_export_scheduler_t
+{
+  dt_pthread_mutex_t mutex;
+  pthread_cond_t cond;
+  int threads;        // omp threads shared by all images
+  int slots;          // max number of images processed at the same time
+  int in_flight;      // images currently processed
+  size_t memory;      // estimated bytes of the images in flight
+}
+dt_control_export_scheduler_t;
+
+// number of full size 4-channel float buffers one export pipe holds at a time
+// (input, output and scratch of the module currently processed).
+#define DT_CONTROL_EXPORT_BUFFERS 3
+
+static void _export_scheduler_init(dt_control_export_scheduler_t *s, const int total)
+{
+  dt_pthread_mutex_init(&s->mutex, NULL);
+  pthread_cond_init(&s->cond, NULL);
+  s->threads = MAX(1, darktable.num_openmp_threads);
+  // parallel_export == 0 means: choose automatically, giving every image a few cores
+  const int requested = dt_conf_get_int("parallel_export");
+  const int slots = requested > 0 ? requested : s->threads / 4;
+  s->slots = CLAMP(MIN(slots, total), 1, s->threads);
+  s->in_flight = 0;
+  s->memory = 0;
+}
+
+static void _export_scheduler_cleanup(dt_control_export_scheduler_t *s)
+{
+  pthread_cond_destroy(&s->cond);
+  dt_pthread_mutex_destroy(&s->mutex);
+}
+
+// estimated memory footprint of exporting the given image.
+static void _export_scheduler_dimensions(const int imgid, const uint32_t max_width, const uint32_t max_height,
+                                         const int high_quality, size_t *width, size_t *height)
+{
+  *width = *height = 0;
+  const dt_image_t *image = dt_image_cache_read_get(darktable.image_cache, imgid);
+  if(!image) return;
+  double scale = 1.0;
+  // low quality exports only process the downscaled buffer:
+  if(!high_quality && max_width > 0 && image->width > 0) scale = MIN(scale, max_width / (double)image->width);
+  if(!high_quality && max_height > 0 && image->height > 0) scale = MIN(scale, max_height / (double)image->height);
+  *width = MAX(1, (size_t)(image->width * scale));
+  *height = MAX(1, (size_t)(image->height * scale));
+  dt_image_cache_read_release(darktable.image_cache, image);
+}
+
+// blocks until the image can be processed next to the ones in flight, returns the memory reserved for it
+// and sets the number of omp threads the calling thread should use for its pixelpipe.
+static size_t _export_scheduler_admit(dt_control_export_scheduler_t *s, const int imgid, const int remaining,
+                                      const uint32_t max_width, const uint32_t max_height, const int high_quality)
+{
+  size_t width, height;
+  _export_scheduler_dimensions(imgid, max_width, max_height, high_quality, &width, &height);
+  const size_t bytes = width * height * 4 * sizeof(float) * DT_CONTROL_EXPORT_BUFFERS;
+
+  dt_pthread_mutex_lock(&s->mutex);
+  // always let one image through, it will tile if it is too large on its own.
+  while(s->in_flight > 0 &&
+        !dt_tiling_piece_fits_host_memory(width, height, 4*sizeof(float), DT_CONTROL_EXPORT_BUFFERS, s->memory))
+    dt_pthread_cond_wait(&s->cond, &s->mutex);
+  s->in_flight++;
+  s->memory += bytes;
+  // towards the end of the batch fewer images are left, hand their cores to the rest:
+  const int sharing = CLAMP(MIN(s->slots, remaining + s->in_flight), 1, s->threads);
+  const int threads = MAX(1, s->threads / sharing);
+  dt_pthread_mutex_unlock(&s->mutex);
+
+#ifdef _OPENMP
+  omp_set_num_threads(threads);
+#endif
+  dt_print(DT_DEBUG_CONTROL, "[export_job] image %d: %d images in flight, %d threads, %.1f MB\n", imgid,
+           sharing, threads, bytes / (1024.0 * 1024.0));
+  return bytes;
+}
+
+static void _export_scheduler_release(dt_control_export_scheduler_t *s, const size_t bytes)
+{
+  dt_pthread_mutex_lock(&s->mutex);
+  s->in_flight--;
+  s->memory -= MIN(s->memory, bytes);
+  pthread_cond_broadcast(&s->cond);
+  dt_pthread_mutex_unlock(&s->mutex);
+}
+
 static int32_t dt_control_export_job_run(dt_job_t *job)
 {
   int imgid = -1;
@@ -868,17 +962,21 @@ static int32_t dt_control_export_job_run(dt_job_t *job)
   const dt_control_t *control = darktable.control;
 
   double fraction=0;
+  // images taken from the list, their tags are updated in one go when all threads are done
+  GList *exported = NULL;
+  dt_control_export_scheduler_t scheduler;
+  _export_scheduler_init(&scheduler, total);
 #ifdef _OPENMP
-  // limit this to num threads = num full buffers - 1 (keep one for darkroom mode)
-  // use min of user request and mipmap cache entries
-  const int full_entries = dt_conf_get_int ("parallel_export");
   // GCC won't accept that this variable is used in a macro, considers
   // it set but not used, which makes for instance Fedora break.
-  const __attribute__((__unused__)) int num_threads = MAX(1, MIN(full_entries, 8));
+  const __attribute__((__unused__)) int num_threads = scheduler.slots;
+  // the iops of every image get their share of the pool in nested parallel regions:
+  const int nested = omp_get_nested();
+  omp_set_nested(num_threads > 1);
 #if !defined(__SUNOS__) && !defined(__NetBSD__) && !defined(__WIN32__)
-  #pragma omp parallel default(none) private(imgid) shared(control, fraction, w, h, stderr, mformat, mstorage, t, sdata, job, jid, darktable, settings) num_threads(num_threads) if(num_threads > 1)
+  #pragma omp parallel default(none) private(imgid) shared(control, fraction, w, h, stderr, mformat, mstorage, t, sdata, job, jid, darktable, settings, scheduler, exported) num_threads(num_threads) if(num_threads > 1)
 #else
-  #pragma omp parallel private(imgid) shared(control, fraction, w, h, mformat, mstorage, t, sdata, job, jid, darktable, settings) num_threads(num_threads) if(num_threads > 1)
+  #pragma omp parallel private(imgid) shared(control, fraction, w, h, mformat, mstorage, t, sdata, job, jid, darktable, settings, scheduler, exported) num_threads(num_threads) if(num_threads > 1)
 #endif
   {
 #endif
@@ -889,12 +987,7 @@ static int32_t dt_control_export_job_run(dt_job_t *job)
     fdata->max_width = (w!=0 && fdata->max_width >w)?w:fdata->max_width;
     fdata->max_height = (h!=0 && fdata->max_height >h)?h:fdata->max_height;
     g_strlcpy(fdata->style, settings->style, sizeof(fdata->style));
-    guint num = 0;
-    // Invariant: the tagid for 'darktable|changed' will not change while this function runs. Is this a sensible assumption?
-    guint tagid = 0,
-          etagid = 0;
-    dt_tag_new("darktable|changed",&tagid);
-    dt_tag_new("darktable|exported",&etagid);
+    guint num = 0, remaining = 0;
 
     while(t && dt_control_job_get_state(job) != DT_JOB_STATE_CANCELLED)
     {
@@ -908,13 +1001,12 @@ static int32_t dt_control_export_job_run(dt_job_t *job)
         {
           imgid = GPOINTER_TO_INT(t->data);
           t = g_list_delete_link(t, t);
-          num = total - g_list_length(t);
+          remaining = g_list_length(t);
+          num = total - remaining;
+          exported = g_list_prepend(exported, GINT_TO_POINTER(imgid));
         }
       }
-      // remove 'changed' tag from image
-      dt_tag_detach(tagid, imgid);
-      // make sure the 'exported' tag is set on the image
-      dt_tag_attach(etagid, imgid);
+      if(!imgid) break;
       // check if image still exists:
       char imgfilename[PATH_MAX];
       const dt_image_t *image = dt_image_cache_read_get(darktable.image_cache, (int32_t)imgid);
@@ -932,8 +1024,12 @@ static int32_t dt_control_export_job_run(dt_job_t *job)
         else
         {
           dt_image_cache_read_release(darktable.image_cache, image);
-          if(mstorage->store(mstorage,sdata, imgid, mformat, fdata, num, total, settings->high_quality) != 0)
+          const size_t reserved = _export_scheduler_admit(&scheduler, imgid, remaining, fdata->max_width,
+                                                          fdata->max_height, settings->high_quality);
+          if(dt_control_job_get_state(job) != DT_JOB_STATE_CANCELLED &&
+             mstorage->store(mstorage,sdata, imgid, mformat, fdata, num, total, settings->high_quality) != 0)
             dt_control_job_cancel(job);
+          _export_scheduler_release(&scheduler, reserved);
         }
       }
 #ifdef _OPENMP
@@ -957,8 +1053,20 @@ static int32_t dt_control_export_job_run(dt_job_t *job)
     // all threads free their fdata
     mformat->free_params (mformat, fdata);
 #ifdef _OPENMP
+    omp_set_num_threads(darktable.num_openmp_threads);
   }
+  omp_set_nested(nested);
 #endif
+  _export_scheduler_cleanup(&scheduler);
+
+  // remove 'changed' tag and make sure the 'exported' tag is set on the images
+  guint tagid = 0, etagid = 0;
+  dt_tag_new("darktable|changed",&tagid);
+  dt_tag_new("darktable|exported",&etagid);
+  dt_tag_detach_images(tagid, exported);
+  dt_tag_attach_images(etagid, exported);
+  dt_image_synch_xmps_deferred(exported);
+  g_list_free(exported);
   g_free(params->data);
   free(params);
   return 0;
@@ -23,6 +23,8 @@
 #include "common/gaussian.h"
 #include "blend.h"
 
+#include <xmmintrin.h>
+
 #define CLAMP_RANGE(x,y,z)      (CLAMP(x,y,z))
 
 typedef void (_blend_row_func)(dt_iop_colorspace_type_t cst,const float *a, float *b, const float *mask, size_t stride, int flag);
@@ -395,6 +397,20 @@ static inline void _blend_Lab_rescale(const float *i, float *o)
 static void _blend_make_mask(dt_iop_colorspace_type_t cst, const unsigned int blendif, const float *blendif_parameters, const unsigned int mask_mode, const unsigned int mask_combine,
                              const float gopacity, const float *a, const float *b, float *mask, size_t stride)
 {
+  if(!(mask_mode & DEVELOP_MASK_CONDITIONAL) || (cst != iop_cs_Lab && cst != iop_cs_rgb))
+  {
+    // no parametric mask, don't look at the pixels at all:
+    const float conditional = (mask_combine & DEVELOP_COMBINE_INCL) ? 0.0f : 1.0f;
+    for(size_t i=0, j=0; j<stride; i++, j+=4)
+    {
+      float form = mask[i];
+      float opacity = (mask_combine & DEVELOP_COMBINE_INCL) ? 1.0f - (1.0f - form) * (1.0f - conditional) : form * conditional ;
+      opacity = (mask_combine & DEVELOP_COMBINE_INV) ? 1.0f - opacity : opacity;
+      mask[i] = opacity*gopacity;
+    }
+    return;
+  }
+
   for(size_t i=0, j=0; j<stride; i++, j+=4)
   {
     float form = mask[i];
@@ -1903,6 +1919,106 @@ static void _blend_HSV_color(dt_iop_colorspace_type_t cst,const float *a, float
 
 
 
+/* sse versions of the operators which work on every channel the same way. _blend_sse() is the template,
+   instantiated per blend mode below; the compiler drops the switches as mode and bounded are constants.
+   they compute exactly what the scalar versions above do, for the rgb and Lab color spaces. */
+static inline __m128 _blend_sse_op(const int mode, const __m128 a, const __m128 b, const __m128 range)
+{
+  switch(mode)
+  {
+    case DEVELOP_BLEND_LIGHTEN:
+      return _mm_max_ps(a, b);
+    case DEVELOP_BLEND_DARKEN:
+      return _mm_min_ps(a, b);
+    case DEVELOP_BLEND_MULTIPLY:
+      return _mm_mul_ps(a, b);
+    case DEVELOP_BLEND_AVERAGE:
+      return _mm_mul_ps(_mm_add_ps(a, b), _mm_set1_ps(0.5f));
+    case DEVELOP_BLEND_ADD:
+      return _mm_add_ps(a, b);
+    case DEVELOP_BLEND_SUBSTRACT:
+      return _mm_sub_ps(_mm_add_ps(b, a), range);
+    default: // normal
+      return b;
+  }
+}
+
+static inline void _blend_sse(const int mode, const int bounded, dt_iop_colorspace_type_t cst, const float *a, float *b,
+                              const float *mask, size_t stride, int flag)
+{
+  float max[4] = {0}, min[4] = {0};
+  _blend_colorspace_channel_range(cst, min, max);
+  const int lab = cst == iop_cs_Lab;
+  const __m128 vmin = _mm_set_ps(min[3], min[2], min[1], min[0]);
+  const __m128 vmax = _mm_set_ps(max[3], max[2], max[1], max[0]);
+  const __m128 range = _mm_set_ps(fabsf(min[3]+max[3]), fabsf(min[2]+max[2]), fabsf(min[1]+max[1]), fabsf(min[0]+max[0]));
+  // Lab is blended scaled to the channel ranges:
+  const __m128 scale = lab ? _mm_set_ps(1.0f, 128.0f, 128.0f, 100.0f) : _mm_set1_ps(1.0f);
+  // channels keeping the input (a and b with flag set), and the one receiving the opacity:
+  const __m128 keep = _mm_castsi128_ps(lab && flag ? _mm_set_epi32(0, -1, -1, 0) : _mm_setzero_si128());
+  const __m128 alpha = _mm_castsi128_ps(_mm_set_epi32(-1, 0, 0, 0));
+  const __m128 one = _mm_set1_ps(1.0f);
+
+  for(size_t i=0, j=0; j<stride; i++, j+=4)
+  {
+    const __m128 opacity = _mm_set1_ps(mask[i]);
+    const __m128 ta = lab ? _mm_div_ps(_mm_loadu_ps(a+j), scale) : _mm_loadu_ps(a+j);
+    const __m128 tb = lab ? _mm_div_ps(_mm_load_ps(b+j), scale) : _mm_load_ps(b+j);
+    __m128 res = _mm_add_ps(_mm_mul_ps(ta, _mm_sub_ps(one, opacity)),
+                            _mm_mul_ps(_blend_sse_op(mode, ta, tb, range), opacity));
+    if(bounded) res = _mm_min_ps(_mm_max_ps(res, vmin), vmax);
+    res = _mm_or_ps(_mm_and_ps(keep, ta), _mm_andnot_ps(keep, res));
+    if(lab) res = _mm_mul_ps(res, scale);
+    _mm_store_ps(b+j, _mm_or_ps(_mm_and_ps(alpha, opacity), _mm_andnot_ps(alpha, res)));
+  }
+}
+
+#define _BLEND_SSE(name, mode, bounded) \
+static void name(dt_iop_colorspace_type_t cst,const float *a, float *b, const float *mask, size_t stride, int flag) \
+{ \
+  _blend_sse(mode, bounded, cst, a, b, mask, stride, flag); \
+}
+
+_BLEND_SSE(_blend_normal_bounded_sse,   DEVELOP_BLEND_BOUNDED,   1)
+_BLEND_SSE(_blend_normal_unbounded_sse, DEVELOP_BLEND_UNBOUNDED, 0)
+_BLEND_SSE(_blend_average_sse,          DEVELOP_BLEND_AVERAGE,   1)
+_BLEND_SSE(_blend_add_sse,              DEVELOP_BLEND_ADD,       1)
+_BLEND_SSE(_blend_substract_sse,        DEVELOP_BLEND_SUBSTRACT, 1)
+// the Lab versions of these also mix the chroma depending on the lightness change, rgb only:
+_BLEND_SSE(_blend_lighten_sse,          DEVELOP_BLEND_LIGHTEN,   1)
+_BLEND_SSE(_blend_darken_sse,           DEVELOP_BLEND_DARKEN,    1)
+_BLEND_SSE(_blend_multiply_sse,         DEVELOP_BLEND_MULTIPLY,  1)
+
+#undef _BLEND_SSE
+
+static _blend_row_func *_blend_sse_row_func(const dt_iop_colorspace_type_t cst, const unsigned int blend_mode)
+{
+  if(cst != iop_cs_Lab && cst != iop_cs_rgb) return NULL;
+  switch(blend_mode)
+  {
+    case DEVELOP_BLEND_NORMAL:
+    case DEVELOP_BLEND_BOUNDED:
+      return _blend_normal_bounded_sse;
+    case DEVELOP_BLEND_NORMAL2:
+    case DEVELOP_BLEND_UNBOUNDED:
+      return _blend_normal_unbounded_sse;
+    case DEVELOP_BLEND_AVERAGE:
+      return _blend_average_sse;
+    case DEVELOP_BLEND_ADD:
+      return _blend_add_sse;
+    case DEVELOP_BLEND_SUBSTRACT:
+      return _blend_substract_sse;
+    case DEVELOP_BLEND_LIGHTEN:
+      return cst == iop_cs_rgb ? _blend_lighten_sse : NULL;
+    case DEVELOP_BLEND_DARKEN:
+      return cst == iop_cs_rgb ? _blend_darken_sse : NULL;
+    case DEVELOP_BLEND_MULTIPLY:
+      return cst == iop_cs_rgb ? _blend_multiply_sse : NULL;
+    default:
+      return NULL;
+  }
+}
+
 void dt_develop_blend_process (struct dt_iop_module_t *self, struct dt_dev_pixelpipe_iop_t *piece, void *i, void *o, const struct dt_iop_roi_t *roi_in, const struct dt_iop_roi_t *roi_out)
 {
   int ch = piece->colors;
@@ -2034,6 +2150,10 @@ void dt_develop_blend_process (struct dt_iop_module_t *self, struct dt_dev_pixel
   /* get channel max values depending on colorspace */
   const dt_iop_colorspace_type_t cst = dt_iop_module_colorspace(self);
 
+  /* prefer the sse version of the operator, where there is one */
+  _blend_row_func *blend_sse = _blend_sse_row_func(cst, blend_mode);
+  if(blend_sse) blend = blend_sse;
+
   /* correct bpp per pixel for raw
      \TODO actually invest why channels per pixel is 4 in raw..
   */
@@ -2048,21 +2168,14 @@ void dt_develop_blend_process (struct dt_iop_module_t *self, struct dt_dev_pixel
     return;
   }
 
-  if(mask_mode == DEVELOP_MASK_ENABLED)
-  {
-    /* blend uniformly (no drawn or parametric mask) */
+  const int maskblur = fabs(d->radius) <= 0.1f ? 0 : 1;
+  /* check if mask should be suppressed temporarily (i.e. just set to global opacity value) */
+  const int suppress = self->suppress_mask && self->dev->gui_attached && (self == self->dev->gui_module) && (piece->pipe == self->dev->pipe) && (mask_mode & DEVELOP_MASK_BOTH);
+  /* unless the mask gets blurred, it is finished row by row in the blending pass below, so the
+     image is only read once. */
+  const int blurred_mask = mask_mode != DEVELOP_MASK_ENABLED && maskblur;
 
-    const size_t buffsize = (size_t)roi_out->width*roi_out->height;
-#ifdef _OPENMP
-#if !defined(__SUNOS__) && !defined(__NetBSD__)
-    #pragma omp parallel for default(none) shared(mask)
-#else
-    #pragma omp parallel for shared(mask)
-#endif
-#endif
-    for (size_t i=0; i<buffsize; i++) mask[i] = opacity;
-  }
-  else
+  if(mask_mode != DEVELOP_MASK_ENABLED)
   {
     /* we blend with a drawn and/or parametric mask */
 
@@ -2117,7 +2230,10 @@ void dt_develop_blend_process (struct dt_iop_module_t *self, struct dt_dev_pixel
       for (size_t i=0; i<buffsize; i++) mask[i] = fill;
     }
 
-  
+  }
+
+  if(blurred_mask)
+  {
 #ifdef _OPENMP
 #if !defined(__SUNOS__) && !defined(__NetBSD__) && !defined(__WIN32__)
     #pragma omp parallel for default(none) shared(i,roi_out,o,mask,blend,d,stderr,ch)
@@ -2136,12 +2252,9 @@ void dt_develop_blend_process (struct dt_iop_module_t *self, struct dt_dev_pixel
       _blend_make_mask(cst, d->blendif, d->blendif_parameters, d->mask_mode, d->mask_combine, opacity, in, out, m, stride);
     }
 
-
-    const int maskblur = fabs(d->radius) <= 0.1f ? 0 : 1;
     const int gaussian = d->radius > 0.0f ? 1 : 0;
     const float radius = fabs(d->radius);
 
-    if(maskblur)
     {
       if(gaussian)
       {
@@ -2164,8 +2277,7 @@ void dt_develop_blend_process (struct dt_iop_module_t *self, struct dt_dev_pixel
     }
 
 
-    /* check if mask should be suppressed temporarily (i.e. just set to global opacity value) */
-    if(self->suppress_mask && self->dev->gui_attached && (self == self->dev->gui_module) && (piece->pipe == self->dev->pipe) && (mask_mode & DEVELOP_MASK_BOTH))
+    if(suppress)
     {
 #ifdef _OPENMP
 #if !defined(__SUNOS__) && !defined(__WIN32__)
@@ -2184,9 +2296,9 @@ void dt_develop_blend_process (struct dt_iop_module_t *self, struct dt_dev_pixel
   /* now apply blending with per-pixel opacity value as defined in mask */
 #ifdef _OPENMP
 #if !defined(__SUNOS__) && !defined(__WIN32__)
-  #pragma omp parallel for default(none) shared(i,roi_out,o,mask,blend,stderr,ch)
+  #pragma omp parallel for default(none) shared(i,roi_out,o,mask,blend,d,stderr,ch)
 #else
-  #pragma omp parallel for shared(i,roi_out,o,mask,blend,ch)
+  #pragma omp parallel for shared(i,roi_out,o,mask,blend,d,ch)
 #endif
 #endif
   for (size_t y=0; y<roi_out->height; y++)
@@ -2197,6 +2309,20 @@ void dt_develop_blend_process (struct dt_iop_module_t *self, struct dt_dev_pixel
     float *in = (float *)i + iindex;
     float *out = (float *)o + oindex;
     float *m = (float *)mask + y * roi_out->width;
+
+    if(mask_mode == DEVELOP_MASK_ENABLED)
+    {
+      /* blend uniformly (no drawn or parametric mask) */
+      for(size_t k=0; k<roi_out->width; k++) m[k] = opacity;
+    }
+    else if(!blurred_mask)
+    {
+      if(suppress)
+        for(size_t k=0; k<roi_out->width; k++) m[k] = opacity;
+      else
+        _blend_make_mask(cst, d->blendif, d->blendif_parameters, d->mask_mode, d->mask_combine, opacity, in, out, m, stride);
+    }
+
     blend(cst, in, out, m, stride, blendflag);
 
     if(mask_display && cst != iop_cs_RAW)
@@ -44,6 +44,7 @@
 #define DT_DEV_AVERAGE_DELAY_START            250
 #define DT_DEV_PREVIEW_AVERAGE_DELAY_START     50
 #define DT_DEV_AVERAGE_DELAY_COUNT              5
+#define DT_DEV_PROGRESSIVE_DELAY              100
 
 const gchar* dt_dev_histogram_type_names[DT_DEV_HISTOGRAM_N] = { "logarithmic", "linear", "waveform" };
 
@@ -261,6 +262,14 @@ restart:
   dt_mipmap_cache_read_release(darktable.mipmap_cache, &buf);
 }
 
+// downscaling of the first pass of progressive rendering, 1 if the full pass is quick enough anyways.
+static int _dev_progressive_factor(dt_develop_t *dev)
+{
+  if(!dt_conf_get_bool("darkroom/ui/progressive_rendering") || dev->average_delay < DT_DEV_PROGRESSIVE_DELAY) return 1;
+  // aim for a first pass of about DT_DEV_PROGRESSIVE_DELAY, it scales with the number of pixels:
+  return dev->average_delay > 16*DT_DEV_PROGRESSIVE_DELAY ? 8 : 4;
+}
+
 void dt_dev_process_image_job(dt_develop_t *dev)
 {
   dt_pthread_mutex_lock(&dev->pipe_mutex);
@@ -324,6 +333,8 @@ restart:
     return;
   }
   dev->pipe->input_timestamp = dev->timestamp;
+  // params changed, as opposed to zooming or panning?
+  const int params_changed = dev->pipe->changed & (DT_DEV_PIPE_TOP_CHANGED | DT_DEV_PIPE_SYNCH | DT_DEV_PIPE_REMOVE);
   // this locks dev->history_mutex.
   dt_dev_pixelpipe_change(dev->pipe, dev);
   // determine scale according to new dimensions
@@ -337,6 +348,30 @@ restart:
   x = MAX(0, scale*dev->pipe->processed_width *(.5+zoom_x)-dev->capwidth/2);
   y = MAX(0, scale*dev->pipe->processed_height*(.5+zoom_y)-dev->capheight/2);
 
+  // progressive rendering: while sliders are dragged, show a coarse pass first. darkroom scales it up
+  // until the full pass is done, which is interrupted and started over by the next change.
+  const int factor = (params_changed && !dev->image_loading) ? _dev_progressive_factor(dev) : 1;
+  if(factor > 1)
+  {
+    // keep the full resolution buffer the next passes resume from pinned:
+    dev->pipe->coarse_pass = 1;
+    const int err = dt_dev_pixelpipe_process(dev->pipe, dev, x/factor, y/factor, dev->capwidth/factor,
+                                             dev->capheight/factor, scale/factor);
+    dev->pipe->coarse_pass = 0;
+    if(err)
+    {
+      if(!dev->image_force_reload) goto restart;
+      dt_mipmap_cache_read_release(darktable.mipmap_cache, &buf);
+      dt_control_log_busy_leave();
+      dt_pthread_mutex_unlock(&dev->pipe_mutex);
+      return;
+    }
+    if(dev->pipe->changed != DT_DEV_PIPE_UNCHANGED) goto restart;
+    dev->image_dirty = 0;
+    if(dev->gui_attached)
+      dt_control_queue_redraw_center();
+  }
+
   dt_get_times(&start);
   if(dt_dev_pixelpipe_process(dev->pipe, dev, x, y, dev->capwidth, dev->capheight, scale))
   {
@@ -162,6 +162,16 @@ typedef struct dt_masks_form_t
 }
 dt_masks_form_t;
 
+/** rasterised masks of one pixelpipe. forms are only rendered again when they, the pieces in front of the
+    module using them or the region of interest changed. */
+typedef struct dt_masks_cache_t
+{
+  dt_pthread_mutex_t lock;
+  GList *entries;           // most recently used first
+  size_t size, max_size;    // in bytes
+}
+dt_masks_cache_t;
+
 typedef struct dt_masks_form_gui_points_t
 {
   float *points;
@@ -233,6 +243,14 @@ int dt_masks_get_mask_roi(dt_iop_module_t *module, dt_dev_pixelpipe_iop_t *piece
 int dt_masks_group_render(dt_iop_module_t *module, dt_dev_pixelpipe_iop_t *piece, dt_masks_form_t *form, float **buffer, int *roi, float scale);
 int dt_masks_group_render_roi(dt_iop_module_t *module, dt_dev_pixelpipe_iop_t *piece, dt_masks_form_t *form, const dt_iop_roi_t *roi, float *buffer);
 
+/** fills the inside of a closed polygon (even-odd rule) with 1.0f. points are count (x,y) pairs in buffer
+    coordinates, pixels are filled from the first to the last one crossed by the outline on every row. */
+void dt_masks_fill_polygon(float *buffer, const int width, const int height, const float *points, const int count);
+
+/** the mask cache of a pixelpipe, max_size is taken from the config. */
+void dt_masks_cache_init(dt_masks_cache_t *cache);
+void dt_masks_cache_cleanup(dt_masks_cache_t *cache);
+
 /** we create a completely new form. */
 dt_masks_form_t *dt_masks_create(dt_masks_type_t type);
 /** retrieve a form with is id */
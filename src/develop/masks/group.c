@@ -411,6 +411,58 @@ int dt_masks_group_render(dt_iop_module_t *module, dt_dev_pixelpipe_iop_t *piece
   return 1;
 }
 
+/** combines one row of a shape into the row of the group. pixels the (possibly inverted) shape doesn't cover
+    only matter for intersection and plain copy, which clear them, so only the covered span is combined. */
+static inline void _group_combine_row(float *out, const float *in, const int width, const int state, const float op)
+{
+  const float inv = (state & DT_MASKS_STATE_INVERSE) ? 1.0f : 0.0f;
+  int x0 = 0, x1 = width;
+  while (x0 < x1 && fabsf(inv - in[x0]) <= 0.0f) x0++;
+  while (x1 > x0 && fabsf(inv - in[x1-1]) <= 0.0f) x1--;
+
+  if (state & DT_MASKS_STATE_UNION)
+  {
+    for (int x=x0; x<x1; x++) out[x] = fmaxf(out[x], fabsf(inv - in[x])*op);
+  }
+  else if (state & DT_MASKS_STATE_INTERSECTION)
+  {
+    for (int x=0; x<x0; x++) out[x] = 0.0f;
+    for (int x=x0; x<x1; x++)
+    {
+      const float b1 = out[x];
+      const float b2 = fabsf(inv - in[x]);
+      if (b1>0.0f && b2>0.0f) out[x] = fminf(b1,b2*op);
+      else out[x] = 0.0f;
+    }
+    for (int x=x1; x<width; x++) out[x] = 0.0f;
+  }
+  else if (state & DT_MASKS_STATE_DIFFERENCE)
+  {
+    for (int x=x0; x<x1; x++)
+    {
+      const float b1 = out[x];
+      const float b2 = fabsf(inv - in[x])*op;
+      if (b1>0.0f && b2>0.0f) out[x] = b1*(1.0f-b2);
+    }
+  }
+  else if (state & DT_MASKS_STATE_EXCLUSION)
+  {
+    for (int x=x0; x<x1; x++)
+    {
+      const float b1 = out[x];
+      const float b2 = fabsf(inv - in[x])*op;
+      if (b1>0.0f && b2>0.0f) out[x] = fmaxf((1.0f-b1)*b2,b1*(1.0f-b2));
+      else out[x] = fmaxf(b1, b2);
+    }
+  }
+  else //if we are here, this mean that we just have to copy the shape and null other parts
+  {
+    for (int x=0; x<x0; x++) out[x] = 0.0f;
+    for (int x=x0; x<x1; x++) out[x] = fabsf(inv - in[x])*op;
+    for (int x=x1; x<width; x++) out[x] = 0.0f;
+  }
+}
+
 static int dt_group_get_mask_roi(dt_iop_module_t *module, dt_dev_pixelpipe_iop_t *piece, dt_masks_form_t *form, const dt_iop_roi_t *roi, float *buffer)
 {
   double start2 = dt_get_wtime();
@@ -444,111 +496,18 @@ static int dt_group_get_mask_roi(dt_iop_module_t *module, dt_dev_pixelpipe_iop_t
 
       if (ok) 
       {
-        //first see if we need to invert this shape
-        if (state & DT_MASKS_STATE_INVERSE)
-        {
+        // inverting and combining is done in one pass, row by row
 #ifdef _OPENMP
 #if !defined(__SUNOS__) && !defined(__NetBSD__)
-          #pragma omp parallel for default(none) shared(bufs)
+        #pragma omp parallel for default(none) shared(bufs,buffer)
 #else
-          #pragma omp parallel for shared(bufs)
+        #pragma omp parallel for shared(bufs,buffer)
 #endif
 #endif
-          for(int y=0; y<height; y++)
-            for(int x=0; x<width; x++)
-            {
-              size_t index = (size_t)y*width + x;
-              bufs[index] = 1.0f - bufs[index];
-            }
-        }
-
-        if (state & DT_MASKS_STATE_UNION)
+        for (int y=0; y<height; y++)
         {
-#ifdef _OPENMP
-#if !defined(__SUNOS__) && !defined(__NetBSD__)
-          #pragma omp parallel for default(none) shared(bufs,buffer)
-#else
-          #pragma omp parallel for shared(bufs,buffer)
-#endif
-#endif
-          for (int y=0; y<height; y++)
-            for (int x=0; x<width; x++)
-            {
-              size_t index = (size_t)y*width + x;
-              buffer[index] = fmaxf(buffer[index], bufs[index]*op);
-            }
-        }
-        else if (state & DT_MASKS_STATE_INTERSECTION)
-        {
-#ifdef _OPENMP
-#if !defined(__SUNOS__) && !defined(__NetBSD__)
-          #pragma omp parallel for default(none) shared(bufs,buffer)
-#else
-          #pragma omp parallel for shared(bufs,buffer)
-#endif
-#endif
-          for (int y=0; y<height; y++)
-            for (int x=0; x<width; x++)
-            {
-              size_t index = (size_t)y*width + x;
-              float b1 = buffer[index];
-              float b2 = b2 = bufs[index]; //FIXME: is this line correct? what it supposed to be doing?
-              if (b1>0.0f && b2>0.0f) buffer[index] = fminf(b1,b2*op);
-              else buffer[index] = 0.0f;
-            }
-        }
-        else if (state & DT_MASKS_STATE_DIFFERENCE)
-        {
-#ifdef _OPENMP
-#if !defined(__SUNOS__) && !defined(__NetBSD__)
-          #pragma omp parallel for default(none) shared(bufs,buffer)
-#else
-          #pragma omp parallel for shared(bufs,buffer)
-#endif
-#endif
-          for (int y=0; y<height; y++)
-            for (int x=0; x<width; x++)
-            {
-              size_t index = (size_t)y*width + x;
-              float b1 = buffer[index];
-              float b2 = bufs[index]*op;
-              if (b1>0.0f && b2>0.0f) buffer[index] = b1*(1.0f-b2);
-            }
-        }
-        else if (state & DT_MASKS_STATE_EXCLUSION)
-        {
-#ifdef _OPENMP
-#if !defined(__SUNOS__) && !defined(__NetBSD__)
-          #pragma omp parallel for default(none) shared(bufs,buffer)
-#else
-          #pragma omp parallel for shared(bufs,buffer)
-#endif
-#endif
-          for (int y=0; y<height; y++)
-            for (int x=0; x<width; x++)
-            {
-              size_t index = (size_t)y*width + x;
-              float b1 = buffer[index];
-              float b2 = bufs[index]*op;
-              if (b1>0.0f && b2>0.0f) buffer[index] = fmaxf((1.0f-b1)*b2,b1*(1.0f-b2));
-              else buffer[index] = fmaxf(b1, b2);
-            }
-        }
-        else //if we are here, this mean that we just have to copy the shape and null other parts
-        {
-#ifdef _OPENMP
-#if !defined(__SUNOS__) && !defined(__NetBSD__)
-          #pragma omp parallel for default(none) shared(bufs,buffer)
-#else
-          #pragma omp parallel for shared(bufs,buffer)
-#endif
-#endif
-          for (int y=0; y<height; y++)
-            for (int x=0; x<width; x++)
-            {
-              size_t index = (size_t)y*width + x;
-              buffer[index] = bufs[index]*op;
-            }
+          const size_t index = (size_t)y*width;
+          _group_combine_row(buffer + index, bufs + index, width, state, op);
         }
 
         if (darktable.unmuted & DT_DEBUG_PERF) dt_print(DT_DEBUG_MASKS, "[masks %d] combine took %0.04f sec\n", nb_ok, dt_get_wtime()-start2);
@@ -566,17 +525,6 @@ static int dt_group_get_mask_roi(dt_iop_module_t *module, dt_dev_pixelpipe_iop_t
   return (nb_ok != 0);
 }
 
-int dt_masks_group_render_roi(dt_iop_module_t *module, dt_dev_pixelpipe_iop_t *piece, dt_masks_form_t *form, const dt_iop_roi_t *roi, float *buffer)
-{
-  double start2 = dt_get_wtime();
-  if (!form) return 0;
-
-  int ok = dt_masks_get_mask_roi(module,piece,form,roi,buffer);
-
-  if (darktable.unmuted & DT_DEBUG_PERF) dt_print(DT_DEBUG_MASKS, "[masks] render all masks took %0.04f sec\n", dt_get_wtime()-start2);
-  return ok;
-}
-
 // modelines: These editor modelines have been set for all relevant files by tools/update_modelines.sh
 // vim: shiftwidth=2 expandtab tabstop=2 cindent
 // kate: tab-indents: off; indent-width 2; replace-tabs on; indent-mode cstyle; remove-trailing-space on;
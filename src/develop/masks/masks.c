@@ -399,7 +399,7 @@ int dt_masks_get_source_area(dt_iop_module_t *module, dt_dev_pixelpipe_iop_t *pi
   return 0;
 }
 
-int dt_masks_get_mask(dt_iop_module_t *module, dt_dev_pixelpipe_iop_t *piece, dt_masks_form_t *form, float **buffer, int *width, int *height, int *posx, int *posy)
+static int _masks_get_mask(dt_iop_module_t *module, dt_dev_pixelpipe_iop_t *piece, dt_masks_form_t *form, float **buffer, int *width, int *height, int *posx, int *posy)
 {
   if (form->type & DT_MASKS_CIRCLE)
   {
@@ -457,6 +457,306 @@ int dt_masks_get_mask_roi(dt_iop_module_t *module, dt_dev_pixelpipe_iop_t *piece
   return 0;
 }
 
+typedef struct _masks_cache_entry_t
+{
+  uint64_t hash;
+  int width, height, posx, posy;
+  float *buffer;
+}
+_masks_cache_entry_t;
+
+static inline uint64_t _masks_hash_bytes(uint64_t hash, const void *data, const size_t size)
+{
+  // bernstein hash (djb2), as the pixelpipe cache does
+  const char *str = (const char *)data;
+  for(size_t i=0; i<size; i++) hash = ((hash << 5) + hash) ^ str[i];
+  return hash;
+}
+
+static size_t _masks_point_size(const dt_masks_type_t type)
+{
+  if (type & DT_MASKS_CIRCLE) return sizeof(dt_masks_point_circle_t);
+  else if (type & DT_MASKS_PATH) return sizeof(dt_masks_point_path_t);
+  else if (type & DT_MASKS_GRADIENT) return sizeof(dt_masks_point_gradient_t);
+  else if (type & DT_MASKS_ELLIPSE) return sizeof(dt_masks_point_ellipse_t);
+  else if (type & DT_MASKS_BRUSH) return sizeof(dt_masks_point_brush_t);
+  return 0;
+}
+
+static uint64_t _masks_hash_form(dt_develop_t *dev, dt_masks_form_t *form, uint64_t hash)
+{
+  hash = _masks_hash_bytes(hash, &form->type, sizeof(dt_masks_type_t));
+  hash = _masks_hash_bytes(hash, &form->formid, sizeof(int));
+  hash = _masks_hash_bytes(hash, &form->version, sizeof(int));
+  hash = _masks_hash_bytes(hash, form->source, 2*sizeof(float));
+  const size_t point_size = _masks_point_size(form->type);
+  for(GList *l = g_list_first(form->points); l; l = g_list_next(l))
+  {
+    if (form->type & DT_MASKS_GROUP)
+    {
+      dt_masks_point_group_t *grpt = (dt_masks_point_group_t *)l->data;
+      dt_masks_form_t *f = dt_masks_get_from_id(dev,grpt->formid);
+      if (!f) continue;
+      hash = _masks_hash_bytes(hash, &grpt->state, sizeof(int));
+      hash = _masks_hash_bytes(hash, &grpt->opacity, sizeof(float));
+      hash = _masks_hash_form(dev, f, hash);
+    }
+    else hash = _masks_hash_bytes(hash, l->data, point_size);
+  }
+  return hash;
+}
+
+// the key of a mask: the form, everything which distorts it on its way to the module, and the roi
+// (or NULL for the masks of dt_masks_get_mask(), which are in full image coordinates).
+static uint64_t _masks_cache_hash(dt_iop_module_t *module, dt_dev_pixelpipe_iop_t *piece, dt_masks_form_t *form, const dt_iop_roi_t *roi)
+{
+  dt_dev_pixelpipe_t *pipe = piece->pipe;
+  uint64_t hash = 5381 + pipe->image.id;
+  hash = _masks_hash_bytes(hash, &pipe->iwidth, sizeof(int));
+  hash = _masks_hash_bytes(hash, &pipe->iheight, sizeof(int));
+  hash = _masks_hash_bytes(hash, &pipe->iscale, sizeof(float));
+  for(GList *nodes = pipe->nodes; nodes; nodes = g_list_next(nodes))
+  {
+    dt_dev_pixelpipe_iop_t *p = (dt_dev_pixelpipe_iop_t *)nodes->data;
+    if (p->module == module) break;
+    if (p->enabled) hash = ((hash << 5) + hash) ^ p->hash;
+  }
+  hash = _masks_hash_form(module->dev, form, hash);
+  const int tag = roi ? 1 : 0;
+  hash = _masks_hash_bytes(hash, &tag, sizeof(int));
+  if (roi) hash = _masks_hash_bytes(hash, roi, sizeof(dt_iop_roi_t));
+  return hash;
+}
+
+static void _masks_cache_free_entry(gpointer data)
+{
+  _masks_cache_entry_t *e = (_masks_cache_entry_t *)data;
+  free(e->buffer);
+  free(e);
+}
+
+static inline size_t _masks_cache_entry_size(const _masks_cache_entry_t *e)
+{
+  return (size_t)e->width*e->height*sizeof(float);
+}
+
+void dt_masks_cache_init(dt_masks_cache_t *cache)
+{
+  dt_pthread_mutex_init(&cache->lock, NULL);
+  cache->entries = NULL;
+  cache->size = 0;
+  cache->max_size = (size_t)MAX(dt_conf_get_int("masks_cache_size"), 0) * 1024 * 1024;
+}
+
+void dt_masks_cache_cleanup(dt_masks_cache_t *cache)
+{
+  g_list_free_full(cache->entries, _masks_cache_free_entry);
+  cache->entries = NULL;
+  cache->size = 0;
+  dt_pthread_mutex_destroy(&cache->lock);
+}
+
+// copies the mask out of the cache, to a new buffer if *buffer is NULL. returns 1 on a hit.
+static int _masks_cache_get(dt_masks_cache_t *cache, const uint64_t hash, float **buffer, int *width, int *height, int *posx, int *posy)
+{
+  if (!cache || !cache->max_size) return 0;
+  int hit = 0;
+  dt_pthread_mutex_lock(&cache->lock);
+  for(GList *l = cache->entries; l; l = g_list_next(l))
+  {
+    _masks_cache_entry_t *e = (_masks_cache_entry_t *)l->data;
+    if (e->hash != hash) continue;
+    const size_t size = _masks_cache_entry_size(e);
+    if (!*buffer) *buffer = malloc(size);
+    if (*buffer)
+    {
+      memcpy(*buffer, e->buffer, size);
+      *width = e->width;
+      *height = e->height;
+      *posx = e->posx;
+      *posy = e->posy;
+      cache->entries = g_list_remove_link(cache->entries, l);
+      cache->entries = g_list_concat(l, cache->entries);
+      hit = 1;
+    }
+    break;
+  }
+  dt_pthread_mutex_unlock(&cache->lock);
+  return hit;
+}
+
+static void _masks_cache_put(dt_masks_cache_t *cache, const uint64_t hash, const float *buffer, const int width, const int height, const int posx, const int posy)
+{
+  if (!cache || !cache->max_size || width <= 0 || height <= 0) return;
+  const size_t size = (size_t)width*height*sizeof(float);
+  // a single mask should not flush everything else
+  if (size > cache->max_size/2) return;
+  _masks_cache_entry_t *e = (_masks_cache_entry_t *)malloc(sizeof(_masks_cache_entry_t));
+  if (!e) return;
+  e->buffer = malloc(size);
+  if (!e->buffer)
+  {
+    free(e);
+    return;
+  }
+  memcpy(e->buffer, buffer, size);
+  e->hash = hash;
+  e->width = width;
+  e->height = height;
+  e->posx = posx;
+  e->posy = posy;
+
+  dt_pthread_mutex_lock(&cache->lock);
+  // drop the least recently used masks until the new one fits
+  while(cache->entries && cache->size + size > cache->max_size)
+  {
+    GList *last = g_list_last(cache->entries);
+    cache->size -= _masks_cache_entry_size((_masks_cache_entry_t *)last->data);
+    _masks_cache_free_entry(last->data);
+    cache->entries = g_list_delete_link(cache->entries, last);
+  }
+  cache->entries = g_list_prepend(cache->entries, e);
+  cache->size += size;
+  dt_pthread_mutex_unlock(&cache->lock);
+}
+
+int dt_masks_get_mask(dt_iop_module_t *module, dt_dev_pixelpipe_iop_t *piece, dt_masks_form_t *form, float **buffer, int *width, int *height, int *posx, int *posy)
+{
+  dt_masks_cache_t *cache = piece->pipe->masks_cache;
+  const uint64_t hash = _masks_cache_hash(module, piece, form, NULL);
+  *buffer = NULL;
+  if (_masks_cache_get(cache, hash, buffer, width, height, posx, posy))
+  {
+    dt_print(DT_DEBUG_MASKS, "[masks %s] from cache\n", form->name);
+    return 1;
+  }
+
+  const int ok = _masks_get_mask(module, piece, form, buffer, width, height, posx, posy);
+  if (ok && *buffer) _masks_cache_put(cache, hash, *buffer, *width, *height, *posx, *posy);
+  return ok;
+}
+
+int dt_masks_group_render_roi(dt_iop_module_t *module, dt_dev_pixelpipe_iop_t *piece, dt_masks_form_t *form, const dt_iop_roi_t *roi, float *buffer)
+{
+  double start2 = dt_get_wtime();
+  if (!form) return 0;
+
+  // only the final mask is cached here, the forms of a group are rendered into the whole roi each
+  dt_masks_cache_t *cache = piece->pipe->masks_cache;
+  const uint64_t hash = _masks_cache_hash(module, piece, form, roi);
+  int width, height, posx, posy;
+  if (_masks_cache_get(cache, hash, &buffer, &width, &height, &posx, &posy))
+  {
+    if (darktable.unmuted & DT_DEBUG_PERF) dt_print(DT_DEBUG_MASKS, "[masks] all masks from cache took %0.04f sec\n", dt_get_wtime()-start2);
+    return 1;
+  }
+
+  int ok = dt_masks_get_mask_roi(module,piece,form,roi,buffer);
+  if (ok) _masks_cache_put(cache, hash, buffer, roi->width, roi->height, roi->x, roi->y);
+
+  if (darktable.unmuted & DT_DEBUG_PERF) dt_print(DT_DEBUG_MASKS, "[masks] render all masks took %0.04f sec\n", dt_get_wtime()-start2);
+  return ok;
+}
+
+// an edge of a polygon. rows yy with ystart <= yy < yend are crossed by it, this way vertices shared by two
+// edges are counted once, and horizontal edges never.
+typedef struct _masks_edge_t
+{
+  float xstart, ystart, yend, m;
+  int first;
+}
+_masks_edge_t;
+
+static int _masks_edge_cmp(const void *a, const void *b)
+{
+  const _masks_edge_t *ea = (const _masks_edge_t *)a;
+  const _masks_edge_t *eb = (const _masks_edge_t *)b;
+  return (ea->first > eb->first) - (ea->first < eb->first);
+}
+
+void dt_masks_fill_polygon(float *buffer, const int width, const int height, const float *points, const int count)
+{
+  if (count < 3) return;
+
+  _masks_edge_t *edges = (_masks_edge_t *)malloc(sizeof(_masks_edge_t)*count);
+  int *active = (int *)malloc(sizeof(int)*count);
+  float *cross = (float *)malloc(sizeof(float)*count);
+  if (!edges || !active || !cross)
+  {
+    free(edges);
+    free(active);
+    free(cross);
+    return;
+  }
+
+  int nb_edges = 0;
+  int ymin = INT_MAX, ymax = INT_MIN;
+  for (int k=0; k<count; k++)
+  {
+    const int k0 = k ? k-1 : count-1;
+    float x0 = points[2*k0], y0 = points[2*k0+1];
+    float x1 = points[2*k], y1 = points[2*k+1];
+    if (y0 > y1)
+    {
+      float tmp;
+      tmp = y0, y0 = y1, y1 = tmp;
+      tmp = x0, x0 = x1, x1 = tmp;
+    }
+    const int first = MAX((int)ceilf(y0), 0);
+    if ((float)first >= y1 || first >= height) continue;
+    _masks_edge_t *e = edges + nb_edges;
+    e->xstart = x0;
+    e->ystart = y0;
+    e->yend = y1;
+    e->m = (x1 - x0) / (y1 - y0);
+    e->first = first;
+    ymin = MIN(ymin, first);
+    ymax = MAX(ymax, MIN((int)ceilf(y1)-1, height-1));
+    nb_edges++;
+  }
+  qsort(edges, nb_edges, sizeof(_masks_edge_t), _masks_edge_cmp);
+
+  int next = 0, nb_active = 0;
+  for (int yy=ymin; yy<=ymax && nb_edges; yy++)
+  {
+    // update the active edge list
+    while (next < nb_edges && edges[next].first <= yy) active[nb_active++] = next++;
+    int nb_cross = 0;
+    for (int k=0; k<nb_active; k++)
+    {
+      const _masks_edge_t *e = edges + active[k];
+      if ((float)yy >= e->yend)
+      {
+        active[k--] = active[--nb_active];
+        continue;
+      }
+      const float x = e->xstart + e->m * (yy - e->ystart);
+      // and keep the crossings sorted
+      int j = nb_cross++;
+      while (j > 0 && cross[j-1] > x)
+      {
+        cross[j] = cross[j-1];
+        j--;
+      }
+      cross[j] = x;
+    }
+
+    // fill from pixel to pixel, rounded as the outline is
+    float *row = buffer + (size_t)yy*width;
+    for (int k=0; k+1<nb_cross; k+=2)
+    {
+      const int x0 = floorf(cross[k] + 0.5f);
+      const int x1 = floorf(cross[k+1] + 0.5f);
+      if (x0 == x1) continue;
+      for (int xx=MAX(x0, 0); xx<=MIN(x1, width-1); xx++) row[xx] = 1.0f;
+    }
+  }
+
+  free(edges);
+  free(active);
+  free(cross);
+}
+
 dt_masks_form_t *dt_masks_create(dt_masks_type_t type)
 {
   dt_masks_form_t *form = (dt_masks_form_t *)malloc(sizeof(dt_masks_form_t));
@@ -2105,95 +2105,18 @@ static int dt_path_get_mask(dt_iop_module_t *module, dt_dev_pixelpipe_iop_t *pie
   //we allocate the buffer
   *buffer = calloc((*width)*(*height), sizeof(float));
 
-  //we write all the point around the path into the buffer
-  int nbp = border_count;
-  int lastx,lasty,lasty2,nx;
-  if (nbp>2)
-  {
-    lastx = (int) points[(nbp-1)*2];
-    lasty = (int) points[(nbp-1)*2+1];
-    lasty2 = (int) points[(nbp-2)*2+1];
-
-    int just_change_dir = 0;
-    for (int ii=nb_corner*3; ii < 2*nbp; ii++)
-    {
-      //we are writing more than 1 loop in the case the dir in y change
-      //exactly at start/end point
-      int i = ii;
-      if (ii >= nbp) i = ii - nbp + nb_corner*3;
-      int xx = (int) points[i*2];
-      int yy = (int) points[i*2+1];
-
-      //we don't store the point if it has the same y value as the last one
-      if (yy == lasty) continue;
-
-      //we want to be sure that there is no y jump
-      if (yy-lasty > 1 || yy-lasty < -1)
-      {
-        if (yy<lasty)
-        {
-          for (int j=yy+1; j<lasty; j++)
-          {
-            int nx = (j-yy)*(lastx-xx)/(float)(lasty-yy)+xx;
-            (*buffer)[(j-(*posy))*(*width)+nx-(*posx)] = 1.0f;
-          }
-          lasty2 = yy+2;
-          lasty = yy+1;
-        }
-        else
-        {
-          for (int j=lasty+1; j<yy; j++)
-          {
-            nx = (j-lasty)*(xx-lastx)/(float)(yy-lasty)+lastx;
-            (*buffer)[(j-(*posy))*(*width)+nx-(*posx)] = 1.0f;
-          }
-          lasty2 = yy-2;
-          lasty = yy-1;
-        }
-      }
-      //if we change the direction of the path (in y), then we add a extra point
-      if ((lasty-lasty2)*(lasty-yy)>0)
-      {
-        (*buffer)[(lasty-(*posy))*(*width)+lastx+1-(*posx)] = 1.0f;
-        just_change_dir = 1;
-      }
-      //we add the point
-      if (just_change_dir && ii==i)
-      {
-        //if we have changed the direction, we have to be carefull that point can be at the same place
-        //as the previous one , especially on sharp edges
-        float v = (*buffer)[(yy-(*posy))*(*width)+xx-(*posx)];
-        if (v>0.0)
-        {
-          if (xx-(*posx)>0) (*buffer)[(yy-(*posy))*(*width)+xx-1-(*posx)] = 1.0f;
-          else if (xx-(*posx)<(*width)-1) (*buffer)[(yy-(*posy))*(*width)+xx+1-(*posx)] = 1.0f;
-        }
-        else
-        {
-          (*buffer)[(yy-(*posy))*(*width)+xx-(*posx)] = 1.0f;
-          just_change_dir = 0;
-        }
-      }
-      else (*buffer)[(yy-(*posy))*(*width)+xx-(*posx)] = 1.0f;
-      //we change last values
-      lasty2 = lasty;
-      lasty = yy;
-      lastx = xx;
-      if (ii != i) break;
-    }
-  }
-  if (darktable.unmuted & DT_DEBUG_PERF) dt_print(DT_DEBUG_MASKS, "[masks %s] path_fill draw path took %0.04f sec\n", form->name, dt_get_wtime()-start2);
-  start2 = dt_get_wtime();
-
-  for (int yy=0; yy<hb; yy++)
+  //we fill the inside of the path, on the same integer positions the falloff uses
+  const int nbp = points_count-nb_corner*3;
+  float *fpoints = malloc(2*nbp*sizeof(float));
+  if (fpoints)
   {
-    int state = 0;
-    for (int xx=0; xx<wb; xx++)
+    for (int i=0; i<nbp; i++)
     {
-      float v = (*buffer)[yy*wb+xx];
-      if (v == 1.0f) state = !state;
-      if (state) (*buffer)[yy*wb+xx] = 1.0f;
+      fpoints[i*2] = (int)points[(i+nb_corner*3)*2] - (*posx);
+      fpoints[i*2+1] = (int)points[(i+nb_corner*3)*2+1] - (*posy);
     }
+    dt_masks_fill_polygon(*buffer, wb, hb, fpoints, nbp);
+    free(fpoints);
   }
 
   if (darktable.unmuted & DT_DEBUG_PERF) dt_print(DT_DEBUG_MASKS, "[masks %s] path_fill fill plain took %0.04f sec\n", form->name, dt_get_wtime()-start2);
@@ -2202,7 +2125,6 @@ static int dt_path_get_mask(dt_iop_module_t *module, dt_dev_pixelpipe_iop_t *pie
   //now we fill the falloff
   int p0[2], p1[2];
   int last0[2] = {-100,-100}, last1[2] = {-100,-100};
-  nbp = 0;
   int next = 0;
   for (int i=nb_corner*3; i<border_count; i++)
   {
@@ -2239,145 +2161,6 @@ static int dt_path_get_mask(dt_iop_module_t *module, dt_dev_pixelpipe_iop_t *pie
 }
 
 
-/** crop path to roi given by xmin, xmax, ymin, ymax. path segments outside of roi are replaced by
-    nodes lying on roi borders. */
-static int _path_crop_to_roi(float *path, const int point_count, float xmin, float xmax, float ymin, float ymax)
-{
-  int point_start = -1;
-  int l = -1, r = -1;
-
-
-  // first try to find a node clearly inside roi
-  for(int k=0; k<point_count; k++)
-  {
-    float x = path[2*k];
-    float y = path[2*k+1];
-   
-    if(x >= xmin+1 && y >= ymin+1 && x <= xmax-1 && y <= ymax-1)
-    {
-      point_start = k;
-      break;
-    }
-  }  
-
-  //printf("crop to xmin %f, xmax %f, ymin %f, ymax %f - start %d (%f, %f)\n", xmin, xmax, ymin, ymax, point_start, path[2*point_start], path[2*point_start+1]);
-
-  if(point_start < 0) return 0;   // no point means roi lies completely within path
-
-  // find the crossing points with xmin and replace segment by nodes on border
-  for(int k=0; k<point_count; k++)
-  {
-    int kk = (k + point_start) % point_count;
-
-    if(l <  0 && path[2*kk] <  xmin) l = k;      // where we leave roi
-    if(l >= 0 && path[2*kk] >= xmin) r = k - 1;  // where we re-enter roi
-
-    // replace that segment
-    if(l >= 0 && r >= 0)
-    {
-      int count = r - l + 1;
-      int ll = (l - 1 + point_start) % point_count;
-      int rr = (r + 1 + point_start) % point_count;
-      float delta_y = (count == 1) ? 0 : (path[2*rr+1] - path[2*ll+1])/(count - 1);
-      float start_y = path[2*ll+1];
-
-      for(int n = 0; n < count; n++)
-      {
-        int nn = (n + l + point_start) % point_count;
-        path[2*nn] = xmin;
-        path[2*nn+1] = start_y + n * delta_y;
-      }
-
-      l = r = -1;
-    }
-  }
-
-  // find the crossing points with xmax and replace segment by nodes on border
-  for(int k=0; k<point_count; k++)
-  {
-    int kk = (k + point_start) % point_count;
-
-    if(l <  0 && path[2*kk] >  xmax) l = k;      // where we leave roi
-    if(l >= 0 && path[2*kk] <= xmax) r = k - 1;  // where we re-enter roi
-
-    // replace that segment
-    if(l >= 0 && r >= 0)
-    {
-      int count = r - l + 1;
-      int ll = (l - 1 + point_start) % point_count;
-      int rr = (r + 1 + point_start) % point_count;
-      float delta_y = (count == 1) ? 0 : (path[2*rr+1] - path[2*ll+1])/(count - 1);
-      float start_y = path[2*ll+1];
-      
-      for(int n = 0; n < count; n++)
-      {
-        int nn = (n + l + point_start) % point_count;
-        path[2*nn] = xmax;
-        path[2*nn+1] = start_y + n * delta_y;
-      }
-
-      l = r = -1;
-    }
-  }
-
-  // find the crossing points with ymin and replace segment by nodes on border
-  for(int k=0; k<point_count; k++)
-  {
-    int kk = (k + point_start) % point_count;
-
-    if(l <  0 && path[2*kk+1] <  ymin) l = k;      // where we leave roi
-    if(l >= 0 && path[2*kk+1] >= ymin) r = k - 1;  // where we re-enter roi
-
-    // replace that segment
-    if(l >= 0 && r >= 0)
-    {
-      int count = r - l + 1;
-      int ll = (l - 1 + point_start) % point_count;
-      int rr = (r + 1 + point_start) % point_count;
-      float delta_x = (count == 1) ? 0 : (path[2*rr] - path[2*ll])/(count - 1);
-      float start_x = path[2*ll];
-      
-      for(int n = 0; n < count; n++)
-      {
-        int nn = (n + l + point_start) % point_count;
-        path[2*nn] = start_x + n * delta_x;
-        path[2*nn+1] = ymin;
-      }
-
-      l = r = -1;
-    }
-  }
-
-  // find the crossing points with ymax and replace segment by nodes on border
-  for(int k=0; k<point_count; k++)
-  {
-    int kk = (k + point_start) % point_count;
-
-    if(l <  0 && path[2*kk+1] >  ymax) l = k;      // where we leave roi
-    if(l >= 0 && path[2*kk+1] <= ymax) r = k - 1;  // where we re-enter roi
-
-    // replace that segment
-    if(l >= 0 && r >= 0)
-    {
-      int count = r - l + 1;
-      int ll = (l - 1 + point_start) % point_count;
-      int rr = (r + 1 + point_start) % point_count;
-      float delta_x = (count == 1) ? 0 : (path[2*rr] - path[2*ll])/(count - 1);
-      float start_x = path[2*ll];
-      
-      for(int n = 0; n < count; n++)
-      {
-        int nn = (n + l + point_start) % point_count;
-        path[2*nn] = start_x + n * delta_x;
-        path[2*nn+1] = ymax;
-      }
-
-      l = r = -1;
-    }
-  }
-  return 1;
-}
-
 /** we write a falloff segment respecting limits of buffer */
 static void _path_falloff_roi(float *buffer, int *p0, int *p1, int bw, int bh)
 {
@@ -2426,7 +2209,7 @@ static int dt_path_get_mask_roi(dt_iop_module_t *module, dt_dev_pixelpipe_iop_t
   int path_encircles_roi = 0;
 
   //we get buffers for all points
-  float *points = NULL, *border = NULL, *cpoints = NULL;
+  float *points = NULL, *border = NULL;
   int points_count, border_count;
   if (!_path_get_points_border(module->dev,form,module->priority,piece->pipe,&points,&points_count,&border,&border_count,0) || (points_count <= 2))
   {
@@ -2528,60 +2311,9 @@ static int dt_path_get_mask_roi(dt_iop_module_t *module, dt_dev_pixelpipe_iop_t
     return 1;
   }
 
-  // now get min/max values
-  float xmin, xmax, ymin, ymax;
-  xmin = ymin = FLT_MAX;
-  xmax = ymax = FLT_MIN;
-  for (int i=nb_corner*3; i < points_count; i++)
-  {
-    float xx = points[i*2];
-    float yy = points[i*2+1];
-    xmin = fminf(xx,xmin);
-    xmax = fmaxf(xx,xmax);
-    ymin = fminf(yy,ymin);
-    ymax = fmaxf(yy,ymax);
-  }
-  for (int i=nb_corner*3; i < border_count; i++)
-  {
-    float xx = border[i*2];
-    float yy = border[i*2+1];
-    if (xx == -999999)
-    {
-      if (yy == -999999) break; //that means we have to skip the end of the border path
-      i = yy-1;
-      continue;
-    }
-    xmin = fminf(xx,xmin);
-    xmax = fmaxf(xx,xmax);
-    ymin = fminf(yy,ymin);
-    ymax = fmaxf(yy,ymax);
-  }
-
-  if (darktable.unmuted & DT_DEBUG_PERF) dt_print(DT_DEBUG_MASKS, "[masks %s] path_fill min max took %0.04f sec\n", form->name, dt_get_wtime()-start2);
-  start2 = dt_get_wtime();
-
   //deal with path if it does not lie outside of roi
   if(path_in_roi)
   {
-    //second copy of path which we can modify when cropping to roi
-    cpoints = malloc(2*points_count*sizeof(float));
-    if (cpoints == NULL)
-    {
-      free(points);
-      free(border);
-      return 0;
-    }
-    memcpy(cpoints, points, 2*points_count*sizeof(float));
-
-    // now we clip cpoints to roi -> catch special case when roi lies completely within path.
-    // dirty trick: we allow path to extend one pixel beyond height-1. this avoids need of special handling
-    // of the last roi line in the following edge-flag polygon fill algorithm.
-    int  crop_success = _path_crop_to_roi(cpoints+2*(nb_corner*3), points_count-nb_corner*3, 0, width-1, 0, height);
-    path_encircles_roi = path_encircles_roi || !crop_success;
-
-    if (darktable.unmuted & DT_DEBUG_PERF) dt_print(DT_DEBUG_MASKS, "[masks %s] path_fill crop to roi took %0.04f sec\n", form->name, dt_get_wtime()-start2);
-    start2 = dt_get_wtime();
-
     if(path_encircles_roi)
     {
       // roi lies completely within path
@@ -2589,70 +2321,12 @@ static int dt_path_get_mask_roi(dt_iop_module_t *module, dt_dev_pixelpipe_iop_t
     }
     else
     {
-      // all other cases
-
-      //edge-flag polygon fill: we write all the point around the path into the buffer
-      float xlast = cpoints[(points_count-1)*2];
-      float ylast = cpoints[(points_count-1)*2+1];
-
-      for (int i=nb_corner*3; i<points_count; i++)
-      {
-        float xstart = xlast;
-        float ystart = ylast;
-
-        float xend = xlast = cpoints[i*2];
-        float yend = ylast = cpoints[i*2+1];
-
-        if(ystart > yend)
-        {
-          float tmp;
-          tmp = ystart, ystart = yend, yend = tmp;
-          tmp = xstart, xstart = xend, xend = tmp;
-        }
-
-        const float m = (xstart - xend) / (ystart - yend);  // we don't need special handling of ystart==yend as following loop will take care
-
-        for(int yy = (int)ceilf(ystart); (float)yy < yend; yy++)  // this would normally never touch the last roi line => see comment further above
-        {
-          const float xcross = xstart + m * (yy - ystart);
-          
-          int xx = floorf(xcross);
-          if ((float)xx + 0.5f <= xcross) xx++;
-
-          if(xx < 0 || xx >= width || yy < 0 || yy >= height) continue;  // sanity check just to be on the safe side
-
-          size_t index = (size_t)yy*width+xx;
-
-          buffer[index] = 1.0f - buffer[index];
-        }
-      }
-
-      if (darktable.unmuted & DT_DEBUG_PERF) dt_print(DT_DEBUG_MASKS, "[masks %s] path_fill draw path took %0.04f sec\n", form->name, dt_get_wtime()-start2);
-      start2 = dt_get_wtime();
-
-      //we fill the inside plain
-      //we don't need to deal with parts of shape outside of roi
-      xmin = fmaxf(xmin, 0);
-      xmax = fminf(xmax, width-1);
-      ymin = fmaxf(ymin, 0);
-      ymax = fminf(ymax, height-1);
-
-      for (int yy=ymin; yy<=ymax; yy++)
-      {
-        int state = 0;
-        for (int xx=xmin ; xx<=xmax; xx++)
-        {
-          size_t index = (size_t)yy*width+xx;
-          float v = buffer[index];
-          if (v > 0.5f) state = !state;
-          if (state) buffer[index] = 1.0f;
-        }
-      }
+      // all other cases: parts of the path outside of roi are clipped row by row by the filler
+      dt_masks_fill_polygon(buffer, width, height, points+2*(nb_corner*3), points_count-nb_corner*3);
 
       if (darktable.unmuted & DT_DEBUG_PERF) dt_print(DT_DEBUG_MASKS, "[masks %s] path_fill fill plain took %0.04f sec\n", form->name, dt_get_wtime()-start2);
       start2 = dt_get_wtime();
     }
-    free(cpoints);
   }
 
   //deal with feather if it does not lie outside of roi
@@ -20,6 +20,8 @@
 #include "develop/pixelpipe_hb.h"
 #include "libs/lib.h"
 #include <stdlib.h>
+#include <stdint.h>
+#include <string.h>
 
 
 // TODO: make cache global (needs to be thread safe then)
@@ -31,51 +33,302 @@
 //   ping, pong, and priority buffer (focused plugin)
 // - drop read by the time another is requested (with priority, drop that, or alternating ping and pong?)
 
-int dt_dev_pixelpipe_cache_init(dt_dev_pixelpipe_cache_t *cache, int entries, size_t size)
+// size classes: four steps per power of two, so a recycled buffer is at most 25% larger than needed.
+static inline int _cache_size_class(size_t size)
 {
-  cache->entries = entries;
-  cache->data = (void **)calloc(entries, sizeof(void *));
-  cache->size = (size_t *)calloc(entries, sizeof(size_t));
-  cache->hash = (uint64_t *)calloc(entries, sizeof(uint64_t));
-  cache->used = (int32_t *)calloc(entries, sizeof(int32_t));
-  for(int k=0; k<entries; k++)
+  if(size < 4096) size = 4096;
+  const size_t s = size - 1;
+  const int msb = 63 - __builtin_clzll((unsigned long long)s);
+  const int sub = (s >> (msb - 2)) & (DT_DEV_PIXELPIPE_CACHE_CLASS_STEPS - 1);
+  return msb * DT_DEV_PIXELPIPE_CACHE_CLASS_STEPS + sub;
+}
+
+static inline size_t _cache_class_size(int c)
+{
+  const int msb = c / DT_DEV_PIXELPIPE_CACHE_CLASS_STEPS;
+  const int sub = c % DT_DEV_PIXELPIPE_CACHE_CLASS_STEPS;
+  return (size_t)(DT_DEV_PIXELPIPE_CACHE_CLASS_STEPS + 1 + sub) << (msb - 2);
+}
+
+static inline uint32_t _cache_hash_slot(const dt_dev_pixelpipe_cache_t *cache, const uint64_t hash)
+{
+  // the djb2 hashes are not well distributed in their lower bits, mix them first:
+  uint64_t h = hash * 0x9E3779B97F4A7C15ull;
+  return (uint32_t)(h >> 32) & cache->index_mask;
+}
+
+static inline uint32_t _cache_data_slot(const dt_dev_pixelpipe_cache_t *cache, const void *data)
+{
+  uint64_t h = ((uint64_t)(uintptr_t)data >> 4) * 0x9E3779B97F4A7C15ull;
+  return (uint32_t)(h >> 32) & cache->index_mask;
+}
+
+static int32_t _cache_find(const dt_dev_pixelpipe_cache_t *cache, const uint64_t hash)
+{
+  if(!cache->capacity) return -1;
+  for(int32_t k=cache->hash_index[_cache_hash_slot(cache, hash)]; k>=0; k=cache->lines[k].hash_next)
+    if(cache->lines[k].hash == hash) return k;
+  return -1;
+}
+
+static int32_t _cache_find_data(const dt_dev_pixelpipe_cache_t *cache, const void *data)
+{
+  if(!cache->capacity || !data) return -1;
+  for(int32_t k=cache->data_index[_cache_data_slot(cache, data)]; k>=0; k=cache->lines[k].data_next)
+    if(cache->lines[k].data == data) return k;
+  return -1;
+}
+
+static void _cache_lru_unlink(dt_dev_pixelpipe_cache_t *cache, const int32_t k)
+{
+  dt_dev_pixelpipe_cache_line_t *l = cache->lines + k;
+  if(l->lru_prev >= 0) cache->lines[l->lru_prev].lru_next = l->lru_next;
+  else cache->lru_head = l->lru_next;
+  if(l->lru_next >= 0) cache->lines[l->lru_next].lru_prev = l->lru_prev;
+  else cache->lru_tail = l->lru_prev;
+  l->lru_prev = l->lru_next = -1;
+}
+
+static void _cache_lru_push_head(dt_dev_pixelpipe_cache_t *cache, const int32_t k)
+{
+  dt_dev_pixelpipe_cache_line_t *l = cache->lines + k;
+  l->lru_prev = -1;
+  l->lru_next = cache->lru_head;
+  if(cache->lru_head >= 0) cache->lines[cache->lru_head].lru_prev = k;
+  cache->lru_head = k;
+  if(cache->lru_tail < 0) cache->lru_tail = k;
+}
+
+static void _cache_index_insert(dt_dev_pixelpipe_cache_t *cache, const int32_t k)
+{
+  const uint32_t slot = _cache_hash_slot(cache, cache->lines[k].hash);
+  cache->lines[k].hash_next = cache->hash_index[slot];
+  cache->hash_index[slot] = k;
+}
+
+static void _cache_index_remove(dt_dev_pixelpipe_cache_t *cache, const int32_t k)
+{
+  int32_t *link = cache->hash_index + _cache_hash_slot(cache, cache->lines[k].hash);
+  while(*link >= 0 && *link != k) link = &cache->lines[*link].hash_next;
+  if(*link == k) *link = cache->lines[k].hash_next;
+  cache->lines[k].hash_next = -1;
+}
+
+static void _cache_data_insert(dt_dev_pixelpipe_cache_t *cache, const int32_t k)
+{
+  const uint32_t slot = _cache_data_slot(cache, cache->lines[k].data);
+  cache->lines[k].data_next = cache->data_index[slot];
+  cache->data_index[slot] = k;
+}
+
+static void _cache_data_remove(dt_dev_pixelpipe_cache_t *cache, const int32_t k)
+{
+  int32_t *link = cache->data_index + _cache_data_slot(cache, cache->lines[k].data);
+  while(*link >= 0 && *link != k) link = &cache->lines[*link].data_next;
+  if(*link == k) *link = cache->lines[k].data_next;
+  cache->lines[k].data_next = -1;
+}
+
+// put the buffer of line k into the free list of its size class. the line must not be in the lru list.
+static void _cache_recycle(dt_dev_pixelpipe_cache_t *cache, const int32_t k)
+{
+  dt_dev_pixelpipe_cache_line_t *l = cache->lines + k;
+  const int c = _cache_size_class(l->size);
+  l->hash = -1;
+  l->important = 0;
+  l->hash_next = cache->free_class[c];
+  cache->free_class[c] = k;
+}
+
+// drop the valid cache line k from the index and the lru list and recycle its buffer.
+static void _cache_evict(dt_dev_pixelpipe_cache_t *cache, const int32_t k)
+{
+  _cache_index_remove(cache, k);
+  _cache_lru_unlink(cache, k);
+  _cache_recycle(cache, k);
+  cache->used_lines--;
+}
+
+// take a recycled buffer of class c out of its free list, or return -1.
+static int32_t _cache_take_free(dt_dev_pixelpipe_cache_t *cache, const int c)
+{
+  const int32_t k = cache->free_class[c];
+  if(k < 0) return -1;
+  cache->free_class[c] = cache->lines[k].hash_next;
+  cache->lines[k].hash_next = -1;
+  return k;
+}
+
+// release one recycled buffer to the system, largest class first. returns 0 if there is none.
+static int _cache_release_free(dt_dev_pixelpipe_cache_t *cache)
+{
+  for(int c=DT_DEV_PIXELPIPE_CACHE_CLASSES-1; c>=0; c--)
   {
-    cache->data[k] = (void *)dt_alloc_align(16, size);
-    if(!cache->data[k])
-      goto alloc_memory_fail;
-    cache->size[k] = size;
+    const int32_t k = _cache_take_free(cache, c);
+    if(k < 0) continue;
+    dt_dev_pixelpipe_cache_line_t *l = cache->lines + k;
+    _cache_data_remove(cache, k);
+    dt_free_align(l->data);
+    cache->memory -= l->size;
+    l->data = NULL;
+    l->size = 0;
+    return 1;
+  }
+  return 0;
+}
+
+// evict the least recently used line, honouring second chances of important lines.
+// the most recently used line is never evicted. returns 0 if nothing could be evicted.
+static int _cache_evict_lru_unpinned(dt_dev_pixelpipe_cache_t *cache)
+{
+  int32_t k = cache->lru_tail;
+  // every line gets at most one more trip through the list per second chance it holds,
+  // so this terminates after a bounded number of rotations.
+  while(k >= 0 && k != cache->lru_head && cache->lines[k].important > 0)
+  {
+    cache->lines[k].important--;
+    _cache_lru_unlink(cache, k);
+    // keep the mru line at the head, insert right behind it:
+    dt_dev_pixelpipe_cache_line_t *head = cache->lines + cache->lru_head;
+    dt_dev_pixelpipe_cache_line_t *l = cache->lines + k;
+    l->lru_prev = cache->lru_head;
+    l->lru_next = head->lru_next;
+    if(head->lru_next >= 0) cache->lines[head->lru_next].lru_prev = k;
+    else cache->lru_tail = k;
+    head->lru_next = k;
+    k = cache->lru_tail;
+  }
+  if(k < 0 || k == cache->lru_head) return 0;
+  _cache_evict(cache, k);
+  return 1;
+}
+
+// same, but the pinned line is never evicted either.
+static int _cache_evict_lru(dt_dev_pixelpipe_cache_t *cache)
+{
+  const int32_t pinned = cache->pinned_hash == (uint64_t)-1 ? -1 : _cache_find(cache, cache->pinned_hash);
+  if(pinned < 0 || pinned == cache->lru_head) return _cache_evict_lru_unpinned(cache);
+  // take it out of the lru list meanwhile, and put it back right behind the head:
+  _cache_lru_unlink(cache, pinned);
+  const int ret = _cache_evict_lru_unpinned(cache);
+  dt_dev_pixelpipe_cache_line_t *l = cache->lines + pinned;
+  if(cache->lru_head < 0)
+  {
+    _cache_lru_push_head(cache, pinned);
+    return ret;
+  }
+  dt_dev_pixelpipe_cache_line_t *head = cache->lines + cache->lru_head;
+  l->lru_prev = cache->lru_head;
+  l->lru_next = head->lru_next;
+  if(head->lru_next >= 0) cache->lines[head->lru_next].lru_prev = pinned;
+  else cache->lru_tail = pinned;
+  head->lru_next = pinned;
+  return ret;
+}
+
+static int32_t _cache_empty_slot(dt_dev_pixelpipe_cache_t *cache)
+{
+  for(int32_t k=0; k<cache->capacity; k++)
+    if(!cache->lines[k].data) return k;
+  return -1;
+}
+
+// returns the slot of a buffer of size class c, which is neither in the lru list nor in a free list.
+static int32_t _cache_acquire(dt_dev_pixelpipe_cache_t *cache, const int c)
+{
+  const size_t csize = _cache_class_size(c);
+  int32_t k = -1;
+  while(1)
+  {
+    // recycled buffers of the right size (or one class larger) are free to take:
+    if((k = _cache_take_free(cache, c)) >= 0) return k;
+    if(c+1 < DT_DEV_PIXELPIPE_CACHE_CLASSES && (k = _cache_take_free(cache, c+1)) >= 0) return k;
+
+    // within budget and with a spare slot, allocate a new one:
+    const int over_budget = cache->memory + csize > cache->max_memory && cache->used_lines >= cache->entries;
+    if(!over_budget && (k = _cache_empty_slot(cache)) >= 0) break;
+
+    // make room: drop recycled buffers of other sizes first, then evict lru lines.
+    if(_cache_release_free(cache)) continue;
+    if(_cache_evict_lru(cache)) continue;
+
+    // nothing left to evict, exceed the budget rather than fail:
+    if((k = _cache_empty_slot(cache)) >= 0) break;
+    return -1;
+  }
+  dt_dev_pixelpipe_cache_line_t *l = cache->lines + k;
+  l->data = dt_alloc_align(16, csize);
+  if(!l->data)
+  {
+    // out of memory, retry after returning all recycled buffers to the system:
+    while(_cache_release_free(cache));
+    l->data = dt_alloc_align(16, csize);
+    if(!l->data) return -1;
+  }
+  l->size = csize;
+  cache->memory += csize;
 #ifdef _DEBUG
-    memset(cache->data[k], 0x5d, size);
+  memset(l->data, 0x5d, csize);
 #endif
-    cache->hash[k] = -1;
-    cache->used[k] = 0;
-  }
+  _cache_data_insert(cache, k);
+  return k;
+}
+
+int dt_dev_pixelpipe_cache_init(dt_dev_pixelpipe_cache_t *cache, int entries, size_t size, size_t max_memory)
+{
+  memset(cache, 0, sizeof(dt_dev_pixelpipe_cache_t));
+  cache->entries = entries;
+  cache->capacity = entries ? MAX(entries, DT_DEV_PIXELPIPE_CACHE_MAX_LINES) : 0;
+  cache->max_memory = MAX(max_memory, entries * _cache_class_size(_cache_size_class(size)));
+  cache->lru_head = cache->lru_tail = -1;
+  cache->pinned_hash = -1;
+  for(int c=0; c<DT_DEV_PIXELPIPE_CACHE_CLASSES; c++) cache->free_class[c] = -1;
   cache->queries = cache->misses = 0;
-  return 1;
+  if(!entries) return 1;
 
-alloc_memory_fail:
-  for(int k=0; k<entries; k++)
+  int index_size = 1;
+  while(index_size < 2*cache->capacity) index_size <<= 1;
+  cache->index_mask = index_size - 1;
+  cache->lines = (dt_dev_pixelpipe_cache_line_t *)calloc(cache->capacity, sizeof(dt_dev_pixelpipe_cache_line_t));
+  cache->hash_index = (int32_t *)malloc(sizeof(int32_t)*index_size);
+  cache->data_index = (int32_t *)malloc(sizeof(int32_t)*index_size);
+  if(!cache->lines || !cache->hash_index || !cache->data_index)
+    goto alloc_memory_fail;
+  for(int k=0; k<index_size; k++) cache->hash_index[k] = cache->data_index[k] = -1;
+  for(int k=0; k<cache->capacity; k++)
   {
-    if(cache->data[k])
-      dt_free_align(cache->data[k]);
+    dt_dev_pixelpipe_cache_line_t *l = cache->lines + k;
+    l->hash = -1;
+    l->lru_prev = l->lru_next = l->hash_next = l->data_next = -1;
   }
 
-  free(cache->data);
-  free(cache->size);
-  free(cache->hash);
-  free(cache->used);
+  // preallocate the minimum number of lines, so running out of memory is detected early:
+  const int c = _cache_size_class(size);
+  for(int k=0; k<entries; k++)
+  {
+    const int32_t slot = _cache_acquire(cache, c);
+    if(slot < 0)
+      goto alloc_memory_fail;
+    _cache_recycle(cache, slot);
+  }
+  return 1;
 
+alloc_memory_fail:
+  dt_dev_pixelpipe_cache_cleanup(cache);
   return 0;
-
 }
 
 void dt_dev_pixelpipe_cache_cleanup(dt_dev_pixelpipe_cache_t *cache)
 {
-  for(int k=0; k<cache->entries; k++) dt_free_align(cache->data[k]);
-  free(cache->data);
-  free(cache->hash);
-  free(cache->used);
-  free(cache->size);
+  if(cache->lines)
+    for(int k=0; k<cache->capacity; k++) dt_free_align(cache->lines[k].data);
+  free(cache->lines);
+  free(cache->hash_index);
+  free(cache->data_index);
+  cache->lines = NULL;
+  cache->hash_index = cache->data_index = NULL;
+  cache->capacity = cache->entries = cache->used_lines = 0;
+  cache->memory = 0;
 }
 
 uint64_t dt_dev_pixelpipe_cache_hash(int imgid, const dt_iop_roi_t *roi, dt_dev_pixelpipe_t *pipe, int module)
@@ -115,9 +368,7 @@ uint64_t dt_dev_pixelpipe_cache_hash(int imgid, const dt_iop_roi_t *roi, dt_dev_
 
 int dt_dev_pixelpipe_cache_available(dt_dev_pixelpipe_cache_t *cache, const uint64_t hash)
 {
-  // search for hash in cache
-  for(int32_t k=0; k<cache->entries; k++) if(cache->hash[k] == hash) return 1;
-  return 0;
+  return _cache_find(cache, hash) >= 0;
 }
 
 int dt_dev_pixelpipe_cache_get_important(dt_dev_pixelpipe_cache_t *cache, const uint64_t hash, const size_t size, void **data)
@@ -134,83 +385,88 @@ int dt_dev_pixelpipe_cache_get_weighted(dt_dev_pixelpipe_cache_t *cache, const u
 {
   cache->queries ++;
   *data = NULL;
-  int max_used = -1, max = 0;
-  size_t sz = 0;
-  for(int k=0; k<cache->entries; k++)
-  {
-    // search for hash in cache
-    if(cache->used[k] > max_used)
-    {
-      max_used = cache->used[k];
-      max = k;
-    }
-    cache->used[k]++; // age all entries
-    if(cache->hash[k] == hash)
-    {
-      *data = cache->data[k];
-      sz = cache->size[k];
-      cache->used[k] = weight; // this is the MRU entry
-    }
-  }
+  if(!cache->capacity) return 1;
 
-  if(!*data || sz < size)
+  int32_t k = _cache_find(cache, hash);
+  if(k >= 0 && cache->lines[k].size >= size)
   {
-    // kill LRU entry
-    // printf("[pixelpipe_cache_get] hash not found, returning slot %d/%d age %d\n", max, cache->entries, weight);
-    if(cache->size[max] < size)
-    {
-      dt_free_align(cache->data[max]);
-      cache->data[max] = (void *)dt_alloc_align(16, size);
-      cache->size[max] = size;
-    }
-    *data = cache->data[max];
-    cache->hash[max] = hash;
-    cache->used[max] = weight;
-    cache->misses++;
-    return 1;
+    // hit, this is the mru entry now:
+    _cache_lru_unlink(cache, k);
+    _cache_lru_push_head(cache, k);
+    cache->lines[k].important = MAX(0, -weight);
+    *data = cache->lines[k].data;
+    return 0;
   }
-  else return 0;
+  // a line for this hash that is too small is useless now:
+  if(k >= 0) _cache_evict(cache, k);
+
+  cache->misses++;
+  k = _cache_acquire(cache, _cache_size_class(size));
+  if(k < 0) return 1;
+  dt_dev_pixelpipe_cache_line_t *l = cache->lines + k;
+  l->hash = hash;
+  l->important = MAX(0, -weight);
+  _cache_index_insert(cache, k);
+  _cache_lru_push_head(cache, k);
+  cache->used_lines++;
+  *data = l->data;
+  return 1;
 }
 
 void dt_dev_pixelpipe_cache_flush(dt_dev_pixelpipe_cache_t *cache)
 {
-  for(int k=0; k<cache->entries; k++)
-  {
-    cache->hash[k] = -1;
-    cache->used[k] = 0;
-  }
+  // keep the buffers around for reuse, only drop their contents:
+  while(cache->lru_head >= 0) _cache_evict(cache, cache->lru_head);
+  cache->pinned_hash = -1;
+}
+
+void dt_dev_pixelpipe_cache_pin(dt_dev_pixelpipe_cache_t *cache, void *data)
+{
+  const int32_t k = _cache_find_data(cache, data);
+  cache->pinned_hash = k >= 0 ? cache->lines[k].hash : (uint64_t)-1;
 }
 
 void dt_dev_pixelpipe_cache_reweight(dt_dev_pixelpipe_cache_t *cache, void *data)
 {
-  for(int k=0; k<cache->entries; k++)
-  {
-    if(cache->data[k] == data)
-    {
-      cache->used[k] = -cache->entries;
-    }
-  }
+  const int32_t k = _cache_find_data(cache, data);
+  if(k >= 0 && cache->lines[k].hash != (uint64_t)-1)
+    cache->lines[k].important = cache->entries;
 }
 
 void dt_dev_pixelpipe_cache_invalidate(dt_dev_pixelpipe_cache_t *cache, void *data)
 {
-  for(int k=0; k<cache->entries; k++)
+  const int32_t k = _cache_find_data(cache, data);
+  // only lines in the lru list carry a valid hash, recycled buffers have hash -1:
+  if(k >= 0 && cache->lines[k].hash != (uint64_t)-1)
   {
-    if(cache->data[k] == data)
+    if(cache->lines[k].hash == cache->pinned_hash) cache->pinned_hash = -1;
+    _cache_index_remove(cache, k);
+    cache->lines[k].hash = -1;
+    // keep the buffer alive and in the lru list position, as the caller still holds it.
+    // it will be the first victim on the next eviction.
+    _cache_lru_unlink(cache, k);
+    if(cache->lru_tail >= 0)
     {
-      cache->hash[k] = -1;
+      cache->lines[cache->lru_tail].lru_next = k;
+      cache->lines[k].lru_prev = cache->lru_tail;
+      cache->lru_tail = k;
     }
+    else _cache_lru_push_head(cache, k);
+    cache->lines[k].important = 0;
   }
 }
 
 void dt_dev_pixelpipe_cache_print(dt_dev_pixelpipe_cache_t *cache)
 {
-  for(int k=0; k<cache->entries; k++)
+  int n = 0;
+  for(int32_t k=cache->lru_head; k>=0; k=cache->lines[k].lru_next, n++)
   {
-    printf("pixelpipe cacheline %d ", k);
-    printf("used %d by %"PRIu64"", cache->used[k], cache->hash[k]);
+    printf("pixelpipe cacheline %d ", n);
+    printf("size %zu important %d by %"PRIu64"%s", cache->lines[k].size, cache->lines[k].important, cache->lines[k].hash,
+           cache->lines[k].hash == cache->pinned_hash ? " pinned" : "");
     printf("\n");
   }
+  printf("cache memory %.2f/%.2f MB\n", cache->memory/(1024.0*1024.0), cache->max_memory/(1024.0*1024.0));
   printf("cache hit rate so far: %.3f\n", (cache->queries - cache->misses)/(float)cache->queries);
 }
 
@@ -19,19 +19,49 @@
 #define DT_PIXELPIPE_CACHE_H
 
 #include <inttypes.h>
+#include <stddef.h>
 /**
- * implements a simple pixel cache suitable for caching float images
+ * implements a pixel cache suitable for caching float images
  * corresponding to history items and zoom/pan settings in the develop module.
- * it is optimized for very few entries (~5), so most operations are O(N).
+ * cache lines are found through a hash index and kept in an O(1) lru list.
+ * buffers of evicted lines are recycled through size-class buckets, and the
+ * number of lines is bounded by a byte budget rather than a fixed count.
  */
+
+/** maximum number of buffers (live cache lines and recycled ones) a cache may hold. */
+#define DT_DEV_PIXELPIPE_CACHE_MAX_LINES 64
+/** number of size classes per power of two, controls the slack of recycled buffers. */
+#define DT_DEV_PIXELPIPE_CACHE_CLASS_STEPS 4
+#define DT_DEV_PIXELPIPE_CACHE_CLASSES (64*DT_DEV_PIXELPIPE_CACHE_CLASS_STEPS)
+
+typedef struct dt_dev_pixelpipe_cache_line_t
+{
+  void    *data;          // NULL if this slot holds no buffer
+  size_t   size;          // allocated size of data, always the size of its class
+  uint64_t hash;          // -1 if the buffer is not a valid cache line (recycled)
+  int32_t  important;     // number of second chances left before eviction
+  int32_t  lru_prev;      // lru list, head is the most recently used line
+  int32_t  lru_next;
+  int32_t  hash_next;     // chain in the hash index, or in the free list of the size class
+  int32_t  data_next;     // chain in the buffer pointer index
+}
+dt_dev_pixelpipe_cache_line_t;
+
 struct dt_dev_pixelpipe_t;
 typedef struct dt_dev_pixelpipe_cache_t
 {
-  int32_t  entries;
-  void    **data;
-  size_t   *size;
-  uint64_t *hash;
-  int32_t  *used;
+  int32_t  entries;       // number of lines which are kept regardless of the byte budget
+  int32_t  capacity;      // number of slots in lines
+  dt_dev_pixelpipe_cache_line_t *lines;
+  int32_t  lru_head, lru_tail;
+  int32_t  index_mask;    // both indices have index_mask+1 buckets
+  int32_t *hash_index;
+  int32_t *data_index;
+  int32_t  free_class[DT_DEV_PIXELPIPE_CACHE_CLASSES];
+  int32_t  used_lines;    // number of valid cache lines in the lru list
+  uint64_t pinned_hash;   // the line with this hash is never evicted, -1 for none
+  size_t   memory;        // bytes currently allocated, valid and recycled
+  size_t   max_memory;    // byte budget
 #ifdef HAVE_OPENCL
   void    **gpu_mem;
 #endif
@@ -41,10 +71,11 @@ typedef struct dt_dev_pixelpipe_cache_t
 }
 dt_dev_pixelpipe_cache_t;
 
-/** constructs a new cache with given cache line count (entries) and float buffer entry size in bytes.
+/** constructs a new cache with given minimum cache line count (entries) and float buffer entry size in bytes.
+  * the cache grows up to max_memory bytes, which is raised to at least entries*size.
 	\param[out] returns 0 if fail to allocate mem cache.
 */
-int dt_dev_pixelpipe_cache_init(dt_dev_pixelpipe_cache_t *cache, int entries, size_t size);
+int dt_dev_pixelpipe_cache_init(dt_dev_pixelpipe_cache_t *cache, int entries, size_t size, size_t max_memory);
 void dt_dev_pixelpipe_cache_cleanup(dt_dev_pixelpipe_cache_t *cache);
 
 struct dt_iop_roi_t;
@@ -52,8 +83,10 @@ struct dt_iop_roi_t;
 uint64_t dt_dev_pixelpipe_cache_hash(int imgid, const struct dt_iop_roi_t *roi, struct dt_dev_pixelpipe_t *pipe, int module);
 
 /** returns the float data buffer for the given hash from the cache. if the hash does not match any
-  * cache line, the least recently used cache line will be cleared and an empty buffer is returned
-  * together with a non-zero return value. */
+  * cache line, least recently used cache lines will be recycled until the byte budget allows for
+  * the requested size, and an empty buffer is returned together with a non-zero return value.
+  * the most recently used line is never evicted, so a module's input stays valid while its output
+  * is reserved. */
 int dt_dev_pixelpipe_cache_get(dt_dev_pixelpipe_cache_t *cache, const uint64_t hash, const size_t size, void **data);
 int dt_dev_pixelpipe_cache_get_important(dt_dev_pixelpipe_cache_t *cache, const uint64_t hash, const size_t size, void **data);
 int dt_dev_pixelpipe_cache_get_weighted(dt_dev_pixelpipe_cache_t *cache, const uint64_t hash, const size_t size, void **data, int weight);
@@ -67,6 +100,9 @@ void dt_dev_pixelpipe_cache_flush(dt_dev_pixelpipe_cache_t *cache);
 /** makes this buffer very important after it has been pulled from the cache. */
 void dt_dev_pixelpipe_cache_reweight(dt_dev_pixelpipe_cache_t *cache, void *data);
 
+/** keeps the cache line of this buffer until another one is pinned, NULL unpins. only one line is pinned at a time. */
+void dt_dev_pixelpipe_cache_pin(dt_dev_pixelpipe_cache_t *cache, void *data);
+
 /** mark the given cache line pointer as invalid. */
 void dt_dev_pixelpipe_cache_invalidate(dt_dev_pixelpipe_cache_t *cache, void *data);
 
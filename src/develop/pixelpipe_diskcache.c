@@ -0,0 +1,316 @@
+/*
+    This file is part of darktable,
+    copyright (c) 2026 agent.
+
+    darktable is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    darktable is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with darktable.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifdef HAVE_CONFIG_H
+#include "config.h"
+#endif
+#include "develop/pixelpipe_diskcache.h"
+#include "develop/pixelpipe_hb.h"
+#include "common/darktable.h"
+#include "common/file_location.h"
+#include "common/image.h"
+#include "control/conf.h"
+
+#include <glib/gstdio.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/stat.h>
+#include <sys/types.h>
+#include <unistd.h>
+
+#define DT_PIXELPIPE_DISKCACHE_MAGIC   0xd7ca5e00
+#define DT_PIXELPIPE_DISKCACHE_VERSION 2
+
+// header in front of the raw pixel data of every file.
+typedef struct _diskcache_header_t
+{
+  uint32_t magic;
+  uint32_t version;
+  char     package_version[32]; // processing may change between releases, even with the same params
+  int32_t  imgid;
+  int32_t  bpp;
+  uint64_t hash;
+  int64_t  source_mtime;        // the source file may be replaced or rewritten under the same image id
+  uint64_t source_size;
+  int32_t  roi[4];
+  float    scale;
+  float    processed_maximum[3];
+  uint64_t size;
+}
+_diskcache_header_t;
+
+typedef struct _diskcache_file_t
+{
+  gchar *filename;
+  time_t mtime;
+  size_t size;
+}
+_diskcache_file_t;
+
+static gchar *_filename(const dt_dev_pixelpipe_diskcache_t *cache, const int imgid, const uint64_t hash)
+{
+  return g_strdup_printf("%s/%d-%016"PRIx64".dtpc", cache->path, imgid, hash);
+}
+
+// returns non-zero if the source file of the image can't be found.
+static int _fill_header(_diskcache_header_t *h, const int imgid, const uint64_t hash, const dt_iop_roi_t *roi,
+                        const int bpp)
+{
+  memset(h, 0, sizeof(_diskcache_header_t));
+  char pathname[PATH_MAX] = { 0 };
+  gboolean from_cache = TRUE;
+  dt_image_full_path(imgid, pathname, sizeof(pathname), &from_cache);
+  struct stat st;
+  if(!pathname[0] || stat(pathname, &st)) return 1;
+  h->source_mtime = st.st_mtime;
+  h->source_size = st.st_size;
+  h->magic = DT_PIXELPIPE_DISKCACHE_MAGIC;
+  h->version = DT_PIXELPIPE_DISKCACHE_VERSION;
+  g_strlcpy(h->package_version, PACKAGE_VERSION, sizeof(h->package_version));
+  h->imgid = imgid;
+  h->bpp = bpp;
+  h->hash = hash;
+  h->roi[0] = roi->x;
+  h->roi[1] = roi->y;
+  h->roi[2] = roi->width;
+  h->roi[3] = roi->height;
+  h->scale = roi->scale;
+  h->size = (uint64_t)bpp*roi->width*roi->height;
+  return 0;
+}
+
+static gint _sort_by_mtime(gconstpointer a, gconstpointer b)
+{
+  const _diskcache_file_t *fa = (const _diskcache_file_t *)a;
+  const _diskcache_file_t *fb = (const _diskcache_file_t *)b;
+  return (fa->mtime > fb->mtime) - (fa->mtime < fb->mtime);
+}
+
+// lists all cache files in the directory, and sums up their size.
+static GList *_list_files(const dt_dev_pixelpipe_diskcache_t *cache, size_t *total)
+{
+  GList *files = NULL;
+  *total = 0;
+  GDir *dir = g_dir_open(cache->path, 0, NULL);
+  if(!dir) return NULL;
+  const gchar *name;
+  while((name = g_dir_read_name(dir)))
+  {
+    if(!g_str_has_suffix(name, ".dtpc")) continue;
+    gchar *filename = g_build_filename(cache->path, name, NULL);
+    struct stat st;
+    if(g_stat(filename, &st))
+    {
+      g_free(filename);
+      continue;
+    }
+    _diskcache_file_t *f = (_diskcache_file_t *)malloc(sizeof(_diskcache_file_t));
+    f->filename = filename;
+    f->mtime = st.st_mtime;
+    f->size = st.st_size;
+    *total += st.st_size;
+    files = g_list_prepend(files, f);
+  }
+  g_dir_close(dir);
+  return files;
+}
+
+static void _free_file(gpointer data)
+{
+  _diskcache_file_t *f = (_diskcache_file_t *)data;
+  g_free(f->filename);
+  free(f);
+}
+
+// remove least recently used files until we are well below the budget. needs cache->lock.
+static void _shrink(dt_dev_pixelpipe_diskcache_t *cache)
+{
+  size_t total = 0;
+  GList *files = g_list_sort(_list_files(cache, &total), _sort_by_mtime);
+  const size_t target = cache->max_size - cache->max_size/8;
+  for(GList *l = files; l && total > target; l = g_list_next(l))
+  {
+    _diskcache_file_t *f = (_diskcache_file_t *)l->data;
+    if(!g_unlink(f->filename)) total -= f->size;
+  }
+  g_list_free_full(files, _free_file);
+  cache->size = total;
+}
+
+void dt_dev_pixelpipe_diskcache_init(dt_dev_pixelpipe_diskcache_t *cache)
+{
+  memset(cache, 0, sizeof(dt_dev_pixelpipe_diskcache_t));
+  dt_pthread_mutex_init(&cache->lock, NULL);
+  cache->enabled = dt_conf_get_bool("pixelpipe_diskcache");
+  if(!cache->enabled) return;
+
+  char cachedir[PATH_MAX];
+  dt_loc_get_user_cache_dir(cachedir, sizeof(cachedir));
+  cache->path = g_build_filename(cachedir, "pixelpipe", NULL);
+  if(g_mkdir_with_parents(cache->path, 0700))
+  {
+    fprintf(stderr, "[pixelpipe_diskcache] could not create directory `%s', disabling disk cache\n", cache->path);
+    cache->enabled = 0;
+    return;
+  }
+
+  gchar *modules = dt_conf_get_string("pixelpipe_diskcache_modules");
+  cache->modules = g_strsplit(modules ? modules : "", ",", -1);
+  for(gchar **m = cache->modules; *m; m++) g_strstrip(*m);
+  g_free(modules);
+
+  cache->max_size = (size_t)MAX(dt_conf_get_int("pixelpipe_diskcache_size"), 0) * 1024 * 1024;
+  GList *files = _list_files(cache, &cache->size);
+  g_list_free_full(files, _free_file);
+  if(cache->size > cache->max_size) _shrink(cache);
+  dt_print(DT_DEBUG_CACHE, "[pixelpipe_diskcache] using `%s', %.2f/%.2f MB\n", cache->path,
+           cache->size/(1024.0*1024.0), cache->max_size/(1024.0*1024.0));
+}
+
+void dt_dev_pixelpipe_diskcache_cleanup(dt_dev_pixelpipe_diskcache_t *cache)
+{
+  g_free(cache->path);
+  g_strfreev(cache->modules);
+  cache->path = NULL;
+  cache->modules = NULL;
+  cache->enabled = 0;
+  dt_pthread_mutex_destroy(&cache->lock);
+}
+
+int dt_dev_pixelpipe_diskcache_wants(const dt_dev_pixelpipe_diskcache_t *cache, const dt_dev_pixelpipe_t *pipe,
+                                     const dt_iop_module_t *module)
+{
+  if(!cache || !cache->enabled || !module || !cache->max_size) return 0;
+  // only the export pipe sees the same image with the same roi often enough to pay off:
+  if(pipe->type != DT_DEV_PIXELPIPE_EXPORT) return 0;
+  for(gchar **m = cache->modules; *m; m++)
+    if(!strcmp(*m, module->op)) return 1;
+  return 0;
+}
+
+int dt_dev_pixelpipe_diskcache_read(dt_dev_pixelpipe_diskcache_t *cache, const int imgid, const uint64_t hash,
+                                    const dt_iop_roi_t *roi, const int bpp, void *data, float *processed_maximum)
+{
+  if(!cache->enabled) return 1;
+  gchar *filename = _filename(cache, imgid, hash);
+  GMappedFile *map = g_mapped_file_new(filename, FALSE, NULL);
+  if(!map)
+  {
+    g_free(filename);
+    return 1;
+  }
+
+  int res = 1;
+  _diskcache_header_t expected;
+  const int stamped = !_fill_header(&expected, imgid, hash, roi, bpp);
+  const _diskcache_header_t *header = (const _diskcache_header_t *)g_mapped_file_get_contents(map);
+  const size_t length = g_mapped_file_get_length(map);
+  if(stamped && length == sizeof(_diskcache_header_t) + expected.size &&
+     header->magic == expected.magic && header->version == expected.version &&
+     !strncmp(header->package_version, expected.package_version, sizeof(expected.package_version)) &&
+     header->imgid == imgid && header->hash == hash && header->bpp == bpp &&
+     header->source_mtime == expected.source_mtime && header->source_size == expected.source_size &&
+     !memcmp(header->roi, expected.roi, sizeof(expected.roi)) && header->scale == expected.scale)
+  {
+    memcpy(data, header + 1, expected.size);
+    for(int k=0; k<3; k++) processed_maximum[k] = header->processed_maximum[k];
+    // touch the file, eviction goes by modification time:
+    g_utime(filename, NULL);
+    res = 0;
+  }
+  g_mapped_file_unref(map);
+  if(res)
+  {
+    // stale or truncated, don't try again:
+    g_unlink(filename);
+  }
+  dt_print(DT_DEBUG_CACHE, "[pixelpipe_diskcache] %s `%s'\n", res ? "rejected" : "loaded", filename);
+  g_free(filename);
+  return res;
+}
+
+int dt_dev_pixelpipe_diskcache_write(dt_dev_pixelpipe_diskcache_t *cache, const int imgid, const uint64_t hash,
+                                     const dt_iop_roi_t *roi, const int bpp, const void *data,
+                                     const float *processed_maximum)
+{
+  if(!cache->enabled) return 1;
+  _diskcache_header_t header;
+  if(_fill_header(&header, imgid, hash, roi, bpp)) return 1;
+  for(int k=0; k<3; k++) header.processed_maximum[k] = processed_maximum[k];
+  const size_t total = sizeof(_diskcache_header_t) + header.size;
+  if(total > cache->max_size) return 1;
+
+  // write to a temporary file first and rename it when done, so concurrent
+  // export threads and crashes never leave a partial file under the final name.
+  gchar *tmpname = g_build_filename(cache->path, ".spill-XXXXXX", NULL);
+  const int fd = g_mkstemp(tmpname);
+  if(fd < 0)
+  {
+    g_free(tmpname);
+    return 1;
+  }
+  FILE *f = fdopen(fd, "wb");
+  int err = !f;
+  if(!err) err = fwrite(&header, sizeof(_diskcache_header_t), 1, f) != 1;
+  if(!err) err = fwrite(data, 1, header.size, f) != header.size;
+  if(f) err |= fclose(f) != 0;
+  else close(fd);
+
+  gchar *filename = _filename(cache, imgid, hash);
+  if(!err) err = g_rename(tmpname, filename) != 0;
+  if(err) g_unlink(tmpname);
+  else
+  {
+    dt_pthread_mutex_lock(&cache->lock);
+    cache->size += total;
+    if(cache->size > cache->max_size) _shrink(cache);
+    dt_pthread_mutex_unlock(&cache->lock);
+  }
+  dt_print(DT_DEBUG_CACHE, "[pixelpipe_diskcache] %s `%s'\n", err ? "failed to write" : "wrote", filename);
+  g_free(filename);
+  g_free(tmpname);
+  return err;
+}
+
+void dt_dev_pixelpipe_diskcache_remove_image(dt_dev_pixelpipe_diskcache_t *cache, const int imgid)
+{
+  if(!cache->enabled) return;
+  gchar *prefix = g_strdup_printf("%d-", imgid);
+  dt_pthread_mutex_lock(&cache->lock);
+  GDir *dir = g_dir_open(cache->path, 0, NULL);
+  if(dir)
+  {
+    const gchar *name;
+    while((name = g_dir_read_name(dir)))
+    {
+      if(!g_str_has_prefix(name, prefix) || !g_str_has_suffix(name, ".dtpc")) continue;
+      gchar *filename = g_build_filename(cache->path, name, NULL);
+      struct stat st;
+      if(!g_stat(filename, &st) && !g_unlink(filename))
+        cache->size -= MIN(cache->size, (size_t)st.st_size);
+      g_free(filename);
+    }
+    g_dir_close(dir);
+  }
+  dt_pthread_mutex_unlock(&cache->lock);
+  g_free(prefix);
+}
+
+// modelines: These editor modelines have been set for all relevant files by tools/update_modelines.sh
+// vim: shiftwidth=2 expandtab tabstop=2 cindent
+// kate: tab-indents: off; indent-width 2; replace-tabs on; indent-mode cstyle; remove-trailing-space on;
@@ -0,0 +1,72 @@
+/*
+    This file is part of darktable,
+    copyright (c) 2026 agent.
+
+    darktable is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    darktable is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with darktable.  If not, see <http://www.gnu.org/licenses/>.
+*/
+#ifndef DT_PIXELPIPE_DISKCACHE_H
+#define DT_PIXELPIPE_DISKCACHE_H
+
+#include "common/dtpthread.h"
+#include <inttypes.h>
+#include <glib.h>
+
+/**
+ * second tier of the pixelpipe cache: selected intermediate buffers of the export
+ * pipe are spilled to files in the user cache dir, keyed by image id and the
+ * dt_dev_pixelpipe_cache_hash() of the module prefix (which covers the roi).
+ * a header checked on read rejects files of another darktable version or of a
+ * source file which changed since (mtime and size).
+ * re-exports after late pipe tweaks then restart from the spilled buffer instead
+ * of running the raw front half again.
+ */
+struct dt_dev_pixelpipe_t;
+struct dt_iop_module_t;
+struct dt_iop_roi_t;
+
+typedef struct dt_dev_pixelpipe_diskcache_t
+{
+  int enabled;
+  gchar *path;       // directory holding the cache files
+  gchar **modules;   // NULL terminated list of ops whose output is spilled
+  size_t size;       // bytes currently on disk
+  size_t max_size;   // budget in bytes, oldest files are removed above that
+  dt_pthread_mutex_t lock;
+}
+dt_dev_pixelpipe_diskcache_t;
+
+/** reads the configuration and scans the cache directory. */
+void dt_dev_pixelpipe_diskcache_init(dt_dev_pixelpipe_diskcache_t *cache);
+void dt_dev_pixelpipe_diskcache_cleanup(dt_dev_pixelpipe_diskcache_t *cache);
+
+/** returns non-zero if the output of the given module in the given pipe goes to the disk cache. */
+int dt_dev_pixelpipe_diskcache_wants(const dt_dev_pixelpipe_diskcache_t *cache, const struct dt_dev_pixelpipe_t *pipe,
+                                     const struct dt_iop_module_t *module);
+
+/** fills data (of bpp*roi->width*roi->height bytes) and processed_maximum from the disk. returns 0 on success. */
+int dt_dev_pixelpipe_diskcache_read(dt_dev_pixelpipe_diskcache_t *cache, const int imgid, const uint64_t hash,
+                                    const struct dt_iop_roi_t *roi, const int bpp, void *data, float *processed_maximum);
+
+/** writes data and processed_maximum to the disk. returns 0 on success. */
+int dt_dev_pixelpipe_diskcache_write(dt_dev_pixelpipe_diskcache_t *cache, const int imgid, const uint64_t hash,
+                                     const struct dt_iop_roi_t *roi, const int bpp, const void *data,
+                                     const float *processed_maximum);
+
+/** removes all spilled buffers of the given image, for example when its source file changed. */
+void dt_dev_pixelpipe_diskcache_remove_image(dt_dev_pixelpipe_diskcache_t *cache, const int imgid);
+
+#endif
+// modelines: These editor modelines have been set for all relevant files by tools/update_modelines.sh
+// vim: shiftwidth=2 expandtab tabstop=2 cindent
+// kate: tab-indents: off; indent-width 2; replace-tabs on; indent-mode cstyle; remove-trailing-space on;
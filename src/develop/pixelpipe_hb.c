@@ -17,7 +17,9 @@
     along with darktable.  If not, see <http://www.gnu.org/licenses/>.
 */
 #include "develop/pixelpipe.h"
+#include "develop/pixelpipe_diskcache.h"
 #include "develop/blend.h"
+#include "develop/masks.h"
 #include "develop/tiling.h"
 #include "gui/gtk.h"
 #include "control/control.h"
@@ -29,6 +31,7 @@
 #include "iop/colorout.h"
 #include "common/colorspaces.h"
 #include "common/histogram.h"
+#include "common/trace.h"
 
 #include <assert.h>
 #include <string.h>
@@ -81,7 +84,7 @@ static char *_pipe_type_to_str(int pipe_type)
 
 int dt_dev_pixelpipe_init_export(dt_dev_pixelpipe_t *pipe, int32_t width, int32_t height, int levels)
 {
-  int res = dt_dev_pixelpipe_init_cached(pipe, 4*sizeof(float)*width*height, 2);
+  int res = dt_dev_pixelpipe_init_cached(pipe, 4*sizeof(float)*width*height, 2, 0);
   pipe->type = DT_DEV_PIXELPIPE_EXPORT;
   pipe->levels = levels;
   return res;
@@ -89,41 +92,45 @@ int dt_dev_pixelpipe_init_export(dt_dev_pixelpipe_t *pipe, int32_t width, int32_
 
 int dt_dev_pixelpipe_init_thumbnail(dt_dev_pixelpipe_t *pipe, int32_t width, int32_t height)
 {
-  int res = dt_dev_pixelpipe_init_cached(pipe, 4*sizeof(float)*width*height, 2);
+  int res = dt_dev_pixelpipe_init_cached(pipe, 4*sizeof(float)*width*height, 2, 0);
   pipe->type = DT_DEV_PIXELPIPE_THUMBNAIL;
   return res;
 }
 
 int dt_dev_pixelpipe_init_dummy(dt_dev_pixelpipe_t *pipe, int32_t width, int32_t height)
 {
-  int res = dt_dev_pixelpipe_init_cached(pipe, 4*sizeof(float)*width*height, 0);
+  int res = dt_dev_pixelpipe_init_cached(pipe, 4*sizeof(float)*width*height, 0, 0);
   pipe->type = DT_DEV_PIXELPIPE_THUMBNAIL;
   return res;
 }
 
 int dt_dev_pixelpipe_init_preview(dt_dev_pixelpipe_t *pipe)
 {
-  int res = dt_dev_pixelpipe_init_cached(pipe, 4*sizeof(float)*darktable.thumbnail_width*darktable.thumbnail_height, 5);
+  int res = dt_dev_pixelpipe_init_cached(pipe, 4*sizeof(float)*darktable.thumbnail_width*darktable.thumbnail_height, 5,
+                                         dt_conf_get_int64("pixelpipe_cache_memory"));
   pipe->type = DT_DEV_PIXELPIPE_PREVIEW;
   return res;
 }
 
 int dt_dev_pixelpipe_init(dt_dev_pixelpipe_t *pipe)
 {
-  int res = dt_dev_pixelpipe_init_cached(pipe, 4*sizeof(float)*darktable.thumbnail_width*darktable.thumbnail_height, 5);
+  int res = dt_dev_pixelpipe_init_cached(pipe, 4*sizeof(float)*darktable.thumbnail_width*darktable.thumbnail_height, 5,
+                                         dt_conf_get_int64("pixelpipe_cache_memory"));
   pipe->type = DT_DEV_PIXELPIPE_FULL;
   return res;
 }
 
-int dt_dev_pixelpipe_init_cached(dt_dev_pixelpipe_t *pipe, size_t size, int32_t entries)
+int dt_dev_pixelpipe_init_cached(dt_dev_pixelpipe_t *pipe, size_t size, int32_t entries, size_t memory)
 {
   pipe->devid = -1;
   pipe->changed = DT_DEV_PIPE_UNCHANGED;
   pipe->processed_width  = pipe->backbuf_width  = pipe->iwidth = 0;
   pipe->processed_height = pipe->backbuf_height = pipe->iheight = 0;
+  pipe->backbuf_scale = 0.0f;
   pipe->nodes = NULL;
+  pipe->masks_cache = NULL;
   pipe->backbuf_size = size;
-  if(!dt_dev_pixelpipe_cache_init(&(pipe->cache), entries, pipe->backbuf_size))
+  if(!dt_dev_pixelpipe_cache_init(&(pipe->cache), entries, pipe->backbuf_size, memory))
     return 0;
   pipe->cache_obsolete = 0;
   pipe->backbuf = NULL;
@@ -132,10 +139,13 @@ int dt_dev_pixelpipe_init_cached(dt_dev_pixelpipe_t *pipe, size_t size, int32_t
   pipe->opencl_error = 0;
   pipe->tiling = 0;
   pipe->mask_display = 0;
+  pipe->coarse_pass = 0;
   pipe->input_timestamp = 0;
   pipe->levels = IMAGEIO_RGB | IMAGEIO_INT8;
   dt_pthread_mutex_init(&(pipe->backbuf_mutex), NULL);
   dt_pthread_mutex_init(&(pipe->busy_mutex), NULL);
+  pipe->masks_cache = (dt_masks_cache_t *)malloc(sizeof(dt_masks_cache_t));
+  dt_masks_cache_init(pipe->masks_cache);
   return 1;
 }
 
@@ -157,6 +167,12 @@ void dt_dev_pixelpipe_cleanup(dt_dev_pixelpipe_t *pipe)
   dt_dev_pixelpipe_cleanup_nodes(pipe);
   // so now it's safe to clean up cache:
   dt_dev_pixelpipe_cache_cleanup(&(pipe->cache));
+  if(pipe->masks_cache)
+  {
+    dt_masks_cache_cleanup(pipe->masks_cache);
+    free(pipe->masks_cache);
+    pipe->masks_cache = NULL;
+  }
   dt_pthread_mutex_unlock(&pipe->backbuf_mutex);
   dt_pthread_mutex_destroy(&(pipe->backbuf_mutex));
   dt_pthread_mutex_destroy(&(pipe->busy_mutex));
@@ -188,6 +204,8 @@ void dt_dev_pixelpipe_create_nodes(dt_dev_pixelpipe_t *pipe, dt_develop_t *dev)
 {
   dt_pthread_mutex_lock(&pipe->busy_mutex);
   pipe->shutdown = 0;
+  pipe->resume_pos = 0;
+  dt_dev_pixelpipe_cache_pin(&pipe->cache, NULL);
   g_assert(pipe->nodes == NULL);
   // for all modules in dev:
   GList *modules = dev->iop;
@@ -206,6 +224,7 @@ void dt_dev_pixelpipe_create_nodes(dt_dev_pixelpipe_t *pipe, dt_develop_t *dev)
       piece->pipe    = pipe;
       piece->data = NULL;
       piece->hash = 0;
+      piece->last_hash = -1;
       piece->process_cl_ready = 0;
       dt_iop_init_pipe(piece->module, pipe,piece);
       pipe->nodes = g_list_append(pipe->nodes, piece);
@@ -710,11 +729,41 @@ dt_dev_pixelpipe_process_rec(dt_dev_pixelpipe_t *pipe, dt_develop_t *dev, void *
     else      for(int k=0; k<3; k++) pipe->processed_maximum[k] = 1.0f;
     (void) dt_dev_pixelpipe_cache_get(&(pipe->cache), hash, bufsize, output);
     dt_pthread_mutex_unlock(&pipe->busy_mutex);
+    dt_trace_instant("pipe", "cache hit", "\"module\":\"%s\",\"pipe\":\"%s\"",
+                     module ? module->op : "input", _pipe_type_to_str(pipe->type));
     if(!modules) return 0;
     // go to post-collect directly:
     goto post_process_collect_info;
   }
   else dt_pthread_mutex_unlock(&pipe->busy_mutex);
+  dt_trace_instant("pipe", "cache miss", "\"module\":\"%s\",\"pipe\":\"%s\"",
+                   module ? module->op : "input", _pipe_type_to_str(pipe->type));
+
+  // 1b) the second tier cache might have this buffer on disk from an earlier export
+  if(dt_dev_pixelpipe_diskcache_wants(darktable.pixelpipe_diskcache, pipe, module))
+  {
+    dt_pthread_mutex_lock(&pipe->busy_mutex);
+    if(pipe->shutdown)
+    {
+      dt_pthread_mutex_unlock(&pipe->busy_mutex);
+      return 1;
+    }
+    void *buf = NULL;
+    (void) dt_dev_pixelpipe_cache_get(&(pipe->cache), hash, bufsize, &buf);
+    if(buf && !dt_dev_pixelpipe_diskcache_read(darktable.pixelpipe_diskcache, pipe->image.id, hash, roi_out, bpp,
+                                                buf, piece->processed_maximum))
+    {
+      for(int k=0; k<3; k++) pipe->processed_maximum[k] = piece->processed_maximum[k];
+      *output = buf;
+      dt_pthread_mutex_unlock(&pipe->busy_mutex);
+      dt_trace_instant("pipe", "disk cache hit", "\"module\":\"%s\",\"pipe\":\"%s\"",
+                       module->op, _pipe_type_to_str(pipe->type));
+      goto post_process_collect_info;
+    }
+    // no luck, don't leave a bogus cache line behind:
+    if(buf) dt_dev_pixelpipe_cache_invalidate(&(pipe->cache), buf);
+    dt_pthread_mutex_unlock(&pipe->busy_mutex);
+  }
 
   // 2) if history changed or exit event, abort processing?
   // preview pipe: abort on all but zoom events (same buffer anyways)
@@ -746,7 +795,7 @@ dt_dev_pixelpipe_process_rec(dt_dev_pixelpipe_t *pipe, dt_develop_t *dev, void *
       }
       else if(dt_dev_pixelpipe_cache_get(&(pipe->cache), hash, bufsize, output))
       {
-        memset(*output, 0, pipe->backbuf_size);
+        memset(*output, 0, bufsize);
         if(roi_in.scale == 1.0f)
         {
           // fast branch for 1:1 pixel copies.
@@ -794,6 +843,8 @@ dt_dev_pixelpipe_process_rec(dt_dev_pixelpipe_t *pipe, dt_develop_t *dev, void *
       }
     }
     dt_show_times(&start, "[dev_pixelpipe]", "initing base buffer [%s]", _pipe_type_to_str(pipe->type));
+    dt_trace_complete("pipe", "input", start.clock, "\"pipe\":\"%s\",\"width\":%d,\"height\":%d,\"scale\":%g",
+                      _pipe_type_to_str(pipe->type), roi_out->width, roi_out->height, roi_out->scale);
     dt_pthread_mutex_unlock(&pipe->busy_mutex);
   }
   else
@@ -822,6 +873,10 @@ dt_dev_pixelpipe_process_rec(dt_dev_pixelpipe_t *pipe, dt_develop_t *dev, void *
       dt_pthread_mutex_unlock(&pipe->busy_mutex);
       return 1;
     }
+    // everything up to here is unchanged since the last run, keep it no matter how
+    // many buffers the modules after us need, so the next run can restart here.
+    // the downscaled input of a coarse pass would only replace the full one.
+    if(pos == pipe->resume_pos && !pipe->coarse_pass) dt_dev_pixelpipe_cache_pin(&(pipe->cache), input);
     if(!strcmp(module->op, "gamma"))
       (void) dt_dev_pixelpipe_cache_get_important(&(pipe->cache), hash, bufsize, output);
     else
@@ -919,6 +974,11 @@ dt_dev_pixelpipe_process_rec(dt_dev_pixelpipe_t *pipe, dt_develop_t *dev, void *
       /* if input is on gpu memory only, remember this fact to later take appropriate action */
       int valid_input_on_gpu_only = (cl_mem_input != NULL);
 
+      /* the pinned input of the node we resume from is only useful with valid contents on the host */
+      if(valid_input_on_gpu_only && pos == pipe->resume_pos && !pipe->coarse_pass &&
+         dt_opencl_copy_device_to_host(pipe->devid, input, cl_mem_input, roi_in.width, roi_in.height, in_bpp) == CL_SUCCESS)
+        valid_input_on_gpu_only = FALSE;
+
       /* general remark: in case of opencl errors within modules or out-of-memory on GPU, we transparently
          fall back to the respective cpu module and continue in pixelpipe. If we encounter errors we set
          pipe->opencl_error=1, return this function with value 1, and leave appropriate action to the calling
@@ -1628,6 +1688,15 @@ dt_dev_pixelpipe_process_rec(dt_dev_pixelpipe_t *pipe, dt_develop_t *dev, void *
                   pixelpipe_flow & PIXELPIPE_FLOW_BLENDED_ON_GPU ? "GPU" : pixelpipe_flow & PIXELPIPE_FLOW_BLENDED_ON_CPU ? "CPU" : "",
                   _pipe_type_to_str(pipe->type));
     g_free(module_label);
+    if(dt_trace_enabled())
+      dt_trace_complete("pipe", module->op, start.clock,
+                        "\"pipe\":\"%s\",\"device\":\"%s\",\"tiling\":%d,\"blend\":\"%s\","
+                        "\"width\":%d,\"height\":%d,\"scale\":%g",
+                        _pipe_type_to_str(pipe->type),
+                        pixelpipe_flow & PIXELPIPE_FLOW_PROCESSED_ON_GPU ? "GPU" : "CPU",
+                        (pixelpipe_flow & PIXELPIPE_FLOW_PROCESSED_WITH_TILING) ? 1 : 0,
+                        pixelpipe_flow & PIXELPIPE_FLOW_BLENDED_ON_GPU ? "GPU" : "CPU",
+                        roi_out->width, roi_out->height, roi_out->scale);
     // in case we get this buffer from the cache, also get the processed max:
     for(int k=0; k<3; k++) piece->processed_maximum[k] = pipe->processed_maximum[k];
     dt_pthread_mutex_unlock(&pipe->busy_mutex);
@@ -1682,6 +1751,24 @@ dt_dev_pixelpipe_process_rec(dt_dev_pixelpipe_t *pipe, dt_develop_t *dev, void *
       dt_pthread_mutex_unlock(&pipe->busy_mutex);
     }
 
+    // spill selected intermediates to the second tier cache:
+    if(dt_dev_pixelpipe_diskcache_wants(darktable.pixelpipe_diskcache, pipe, module))
+    {
+      dt_pthread_mutex_lock(&pipe->busy_mutex);
+      if(pipe->shutdown)
+      {
+        dt_pthread_mutex_unlock(&pipe->busy_mutex);
+        return 1;
+      }
+#ifdef HAVE_OPENCL
+      if(*cl_mem_output != NULL)
+        dt_opencl_copy_device_to_host(pipe->devid, *output, *cl_mem_output, roi_out->width, roi_out->height, bpp);
+#endif
+      dt_dev_pixelpipe_diskcache_write(darktable.pixelpipe_diskcache, pipe->image.id, hash, roi_out, bpp,
+                                       *output, piece->processed_maximum);
+      dt_pthread_mutex_unlock(&pipe->busy_mutex);
+    }
+
 post_process_collect_info:
 
     dt_pthread_mutex_lock(&pipe->busy_mutex);
@@ -2181,6 +2268,25 @@ dt_dev_pixelpipe_process_rec_and_backcopy(dt_dev_pixelpipe_t *pipe, dt_develop_t
 }
 
 
+// find the first node whose params changed since the last complete run. the following
+// runs will restart from its input, until some earlier node changes.
+static void _pixelpipe_update_resume_pos(dt_dev_pixelpipe_t *pipe, dt_develop_t *dev)
+{
+  int pos = 1, changed = 0;
+  for(GList *nodes = pipe->nodes; nodes; nodes = g_list_next(nodes), pos++)
+  {
+    dt_dev_pixelpipe_iop_t *piece = (dt_dev_pixelpipe_iop_t *)nodes->data;
+    changed |= piece->hash != piece->last_hash;
+    // a node which is skipped has no input buffer of its own, move on to the next one processed:
+    if(changed && piece->enabled &&
+       !(dev->gui_module && dev->gui_module->operation_tags_filter() & piece->module->operation_tags()))
+    {
+      pipe->resume_pos = pos;
+      return;
+    }
+  }
+}
+
 int dt_dev_pixelpipe_process(dt_dev_pixelpipe_t *pipe, dt_develop_t *dev, int x, int y, int width, int height, float scale)
 {
   pipe->processing = 1;
@@ -2205,6 +2311,10 @@ int dt_dev_pixelpipe_process(dt_dev_pixelpipe_t *pipe, dt_develop_t *dev, int x,
   if(darktable.unmuted & DT_DEBUG_DEV)
     dt_dev_pixelpipe_cache_print(&pipe->cache);
 
+  dt_pthread_mutex_lock(&pipe->busy_mutex);
+  _pixelpipe_update_resume_pos(pipe, dev);
+  dt_pthread_mutex_unlock(&pipe->busy_mutex);
+
   //  go through list of modules from the end:
   guint pos = g_list_length(dev->iop);
   GList *modules = g_list_last(dev->iop);
@@ -2274,12 +2384,22 @@ restart:
     return 1;
   }
 
+  // remember what this run was based on:
+  dt_pthread_mutex_lock(&pipe->busy_mutex);
+  for(GList *nodes = pipe->nodes; nodes; nodes = g_list_next(nodes))
+  {
+    dt_dev_pixelpipe_iop_t *piece = (dt_dev_pixelpipe_iop_t *)nodes->data;
+    piece->last_hash = piece->hash;
+  }
+  dt_pthread_mutex_unlock(&pipe->busy_mutex);
+
   // terminate
   dt_pthread_mutex_lock(&pipe->backbuf_mutex);
   pipe->backbuf_hash = dt_dev_pixelpipe_cache_hash(pipe->image.id, &roi, pipe, 0);
   pipe->backbuf = buf;
   pipe->backbuf_width  = width;
   pipe->backbuf_height = height;
+  pipe->backbuf_scale  = scale;
   dt_pthread_mutex_unlock(&pipe->backbuf_mutex);
 
   // printf("pixelpipe homebrew process end\n");
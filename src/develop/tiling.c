@@ -99,6 +99,28 @@ _print_roi(const dt_iop_roi_t *roi, const char *label)
 }
 
 
+/* upper bound for the number of tiles processed at the same time. modules need to flag
+   that their process() can run concurrently on the same piece. */
+static int
+_parallel_tiles(struct dt_iop_module_t *self)
+{
+  if(!(self->flags() & IOP_FLAGS_TILING_PARALLEL) || !dt_conf_get_bool("parallel_tiling")) return 1;
+  return dt_get_num_threads();
+}
+
+/* number of tiles actually processed at the same time: one per thread, as long as all of them
+   (and the full input and output buffers next to them) fit into host memory */
+static int
+_concurrent_tiles(struct dt_iop_module_t *self, const int tiles, const int width, const int height, const int bpp,
+                  const float factor, const size_t overhead, const size_t fullbuffers)
+{
+  int threads = _min(_parallel_tiles(self), tiles);
+  while(threads > 1 && !dt_tiling_piece_fits_host_memory(width, (size_t)height*threads, bpp, factor, threads*overhead + fullbuffers))
+    threads--;
+  return threads;
+}
+
+
 #if 0
 static void
 _nm_constraints(double x[], int n)
@@ -630,7 +652,8 @@ _default_process_tiling_ptp (struct dt_iop_module_t *self, struct dt_dev_pixelpi
   singlebuffer = fmax(singlebuffer, 2.0f*1024.0f*1024.0f);
   float factor = fmax(tiling.factor, 1.0f);
   float maxbuf = fmax(tiling.maxbuf, 1.0f);
-  singlebuffer = fmax(available / factor, singlebuffer);
+  /* tiles processed in parallel share the memory */
+  singlebuffer = fmax(available / factor / _parallel_tiles(self), singlebuffer);
 
   int width = roi_in->width;
   int height = roi_in->height;
@@ -696,17 +719,22 @@ _default_process_tiling_ptp (struct dt_iop_module_t *self, struct dt_dev_pixelpi
   }
 
 
+  const int threads = _concurrent_tiles(self, tiles_x*tiles_y, width, height, max_bpp, factor, tiling.overhead,
+                                       (size_t)roi_in->width*roi_in->height*in_bpp + (size_t)roi_out->width*roi_out->height*out_bpp);
+
   dt_print(DT_DEBUG_DEV, "[default_process_tiling_ptp] use tiling on module '%s' for image with full size %d x %d\n", self->op, roi_in->width, roi_in->height);
-  dt_print(DT_DEBUG_DEV, "[default_process_tiling_ptp] (%d x %d) tiles with max dimensions %d x %d and overlap %d\n", tiles_x, tiles_y, width, height, overlap);
+  dt_print(DT_DEBUG_DEV, "[default_process_tiling_ptp] (%d x %d) tiles with max dimensions %d x %d and overlap %d, %d at a time\n", tiles_x, tiles_y, width, height, overlap, threads);
 
-  /* reserve input and output buffers for tiles */
-  input = dt_alloc_align(64, (size_t)width*height*in_bpp);
+  /* reserve input and output buffers for tiles, one pair per thread */
+  const size_t istride = ((size_t)width*height*in_bpp + 63) & ~(size_t)63;
+  const size_t ostride = ((size_t)width*height*out_bpp + 63) & ~(size_t)63;
+  input = dt_alloc_align(64, threads*istride);
   if(input == NULL)
   {
     dt_print(DT_DEBUG_DEV, "[default_process_tiling_ptp] could not alloc input buffer for module '%s'\n", self->op);
     goto error;
   }
-  output = dt_alloc_align(64, (size_t)width*height*out_bpp);
+  output = dt_alloc_align(64, threads*ostride);
   if(output == NULL)
   {
     dt_print(DT_DEBUG_DEV, "[default_process_tiling_ptp] could not alloc output buffer for module '%s'\n", self->op);
@@ -719,51 +747,64 @@ _default_process_tiling_ptp (struct dt_iop_module_t *self, struct dt_dev_pixelpi
   for(int k=0; k<3; k++)
     processed_maximum_saved[k] = piece->pipe->processed_maximum[k];
 
+  piece->pipe->tiling = 1;
 
-  /* iterate over tiles */
-  for(size_t tx=0; tx<tiles_x; tx++)
-    for(size_t ty=0; ty<tiles_y; ty++)
-    {
-      piece->pipe->tiling = 1;
+  /* iterate over tiles. several threads each take their own tiles if the module allows it, the
+     module's own parallelization then has a single thread per tile, also with nested parallelism. */
+#ifdef _OPENMP
+  #pragma omp parallel for default(none) shared(self,piece,ivoid,ovoid,roi_in,roi_out,input,output,width,height,processed_maximum_saved,processed_maximum_new) num_threads(threads) if(threads > 1) schedule(dynamic)
+#endif
+  for(int t=0; t<tiles_x*tiles_y; t++)
+  {
+#ifdef _OPENMP
+    // only this task's setting: with nested parallelism (export) the module would spawn a full team per tile
+    if(threads > 1) omp_set_num_threads(1);
+#endif
+    const size_t tx = t / tiles_y, ty = t % tiles_y;
+    void *tinput = (char *)input + dt_get_thread_num()*istride;
+    void *toutput = (char *)output + dt_get_thread_num()*ostride;
 
-      size_t wd = tx * tile_wd + width > roi_in->width  ? roi_in->width - tx * tile_wd : width;
-      size_t ht = ty * tile_ht + height > roi_in->height ? roi_in->height- ty * tile_ht : height;
+    size_t wd = tx * tile_wd + width > roi_in->width  ? roi_in->width - tx * tile_wd : width;
+    size_t ht = ty * tile_ht + height > roi_in->height ? roi_in->height- ty * tile_ht : height;
 
-      /* no need to process end-tiles that are smaller than overlap */
-      if((wd <= overlap && tx > 0) || (ht <= overlap && ty > 0)) continue;
+    /* no need to process end-tiles that are smaller than overlap */
+    if((wd <= overlap && tx > 0) || (ht <= overlap && ty > 0)) continue;
 
-      /* origin and region of effective part of tile, which we want to store later */
-      size_t origin[] = { 0, 0, 0 };
-      size_t region[] = { wd, ht, 1 };
+    /* origin and region of effective part of tile, which we want to store later */
+    size_t origin[] = { 0, 0, 0 };
+    size_t region[] = { wd, ht, 1 };
 
-      /* roi_in and roi_out for process_cl on subbuffer */
-      dt_iop_roi_t iroi = { roi_in->x+tx*tile_wd, roi_in->y+ty*tile_ht, wd, ht, roi_in->scale };
-      dt_iop_roi_t oroi = { roi_out->x+tx*tile_wd, roi_out->y+ty*tile_ht, wd, ht, roi_out->scale };
+    /* roi_in and roi_out for process_cl on subbuffer */
+    dt_iop_roi_t iroi = { roi_in->x+tx*tile_wd, roi_in->y+ty*tile_ht, wd, ht, roi_in->scale };
+    dt_iop_roi_t oroi = { roi_out->x+tx*tile_wd, roi_out->y+ty*tile_ht, wd, ht, roi_out->scale };
 
-      /* offsets of tile into ivoid and ovoid */
-      size_t ioffs = (ty * tile_ht)*ipitch + (tx * tile_wd)*in_bpp;
-      size_t ooffs = (ty * tile_ht)*opitch + (tx * tile_wd)*out_bpp;
+    /* offsets of tile into ivoid and ovoid */
+    size_t ioffs = (ty * tile_ht)*ipitch + (tx * tile_wd)*in_bpp;
+    size_t ooffs = (ty * tile_ht)*opitch + (tx * tile_wd)*out_bpp;
 
 
-      dt_print(DT_DEBUG_DEV, "[default_process_tiling_ptp] tile (%d, %d) with %d x %d at origin [%d, %d]\n", tx, ty, wd, ht, tx*tile_wd, ty*tile_ht);
+    dt_print(DT_DEBUG_DEV, "[default_process_tiling_ptp] tile (%d, %d) with %d x %d at origin [%d, %d]\n", tx, ty, wd, ht, tx*tile_wd, ty*tile_ht);
 
-      /* prepare input tile buffer */
+    /* prepare input tile buffer */
 #ifdef _OPENMP
-      #pragma omp parallel for default(none) shared(input,width,ivoid,ioffs,wd,ht) schedule(static)
+    #pragma omp parallel for default(none) shared(tinput,width,ivoid,ioffs,wd,ht) schedule(static)
 #endif
-      for(size_t j=0; j<ht; j++)
-        memcpy((char *)input+j*wd*in_bpp, (char *)ivoid+ioffs+j*ipitch, (size_t)wd*in_bpp);
+    for(size_t j=0; j<ht; j++)
+      memcpy((char *)tinput+j*wd*in_bpp, (char *)ivoid+ioffs+j*ipitch, (size_t)wd*in_bpp);
 
-      /* take original processed_maximum as starting point */
+    /* take original processed_maximum as starting point. modules processing
+       tiles in parallel only read it, and all tiles start from the same one. */
+    if(threads == 1)
       for(int k=0; k<3; k++)
         piece->pipe->processed_maximum[k] = processed_maximum_saved[k];
 
-      /* call process() of module */
-      self->process(self, piece, input, output, &iroi, &oroi);
+    /* call process() of module */
+    self->process(self, piece, tinput, toutput, &iroi, &oroi);
 
-      /* aggregate resulting processed_maximum */
-      /* TODO: check if there really can be differences between tiles and take
-               appropriate action (calculate minimum, maximum, average, ...?) */
+    /* aggregate resulting processed_maximum */
+    /* TODO: check if there really can be differences between tiles and take
+             appropriate action (calculate minimum, maximum, average, ...?) */
+    if(threads == 1)
       for(int k=0; k<3; k++)
       {
         if(tx+ty > 0 && fabs(processed_maximum_new[k] - piece->pipe->processed_maximum[k]) > 1.0e-6f)
@@ -771,28 +812,32 @@ _default_process_tiling_ptp (struct dt_iop_module_t *self, struct dt_dev_pixelpi
         processed_maximum_new[k] = piece->pipe->processed_maximum[k];
       }
 
-      /* correct origin and region of tile for overlap.
-         make sure that we only copy back the "good" part. */
-      if(tx > 0)
-      {
-        origin[0] += overlap;
-        region[0] -= overlap;
-        ooffs += overlap*out_bpp;
-      }
-      if(ty > 0)
-      {
-        origin[1] += overlap;
-        region[1] -= overlap;
-        ooffs += overlap*opitch;
-      }
+    /* correct origin and region of tile for overlap.
+       make sure that we only copy back the "good" part. */
+    if(tx > 0)
+    {
+      origin[0] += overlap;
+      region[0] -= overlap;
+      ooffs += overlap*out_bpp;
+    }
+    if(ty > 0)
+    {
+      origin[1] += overlap;
+      region[1] -= overlap;
+      ooffs += overlap*opitch;
+    }
 
-      /* copy "good" part of tile to output buffer */
+    /* copy "good" part of tile to output buffer */
 #ifdef _OPENMP
-      #pragma omp parallel for default(none) shared(ovoid,ooffs,output,width,origin,region,wd) schedule(static)
+    #pragma omp parallel for default(none) shared(ovoid,ooffs,toutput,width,origin,region,wd) schedule(static)
 #endif
-      for(size_t j=0; j<region[1]; j++)
-        memcpy((char *)ovoid+ooffs+j*opitch, (char *)output+((j+origin[1])*wd+origin[0])*out_bpp, (size_t)region[0]*out_bpp);
-    }
+    for(size_t j=0; j<region[1]; j++)
+      memcpy((char *)ovoid+ooffs+j*opitch, (char *)toutput+((j+origin[1])*wd+origin[0])*out_bpp, (size_t)region[0]*out_bpp);
+  }
+
+  if(threads > 1)
+    for(int k=0; k<3; k++)
+      processed_maximum_new[k] = piece->pipe->processed_maximum[k];
 
   /* copy back final processed_maximum */
   for(int k=0; k<3; k++)
@@ -824,8 +869,7 @@ fallback:
 static void
 _default_process_tiling_roi (struct dt_iop_module_t *self, struct dt_dev_pixelpipe_iop_t *piece, void *ivoid, void *ovoid, const dt_iop_roi_t *roi_in, const dt_iop_roi_t *roi_out, const int in_bpp)
 {
-  void *input = NULL;
-  void *output = NULL;
+  dt_iop_roi_t *rois = NULL;
 
   //_print_roi(roi_in, "module roi_in");
   //_print_roi(roi_out, "module roi_out");
@@ -869,7 +913,8 @@ _default_process_tiling_roi (struct dt_iop_module_t *self, struct dt_dev_pixelpi
   singlebuffer = fmax(singlebuffer, 2.0f*1024.0f*1024.0f);
   float factor = fmax(tiling.factor, 1.0f);
   float maxbuf = fmax(tiling.maxbuf, 1.0f);
-  singlebuffer = fmax(available / factor, singlebuffer);
+  /* tiles processed in parallel share the memory */
+  singlebuffer = fmax(available / factor / _parallel_tiles(self), singlebuffer);
 
   int width = _max(roi_in->width, roi_out->width);
   int height = _max(roi_in->height, roi_out->height);
@@ -953,12 +998,20 @@ _default_process_tiling_roi (struct dt_iop_module_t *self, struct dt_dev_pixelpi
   for(int k=0; k<3; k++)
     processed_maximum_saved[k] = piece->pipe->processed_maximum[k];
 
-  /* iterate over tiles */
+  /* roi of the good part of the output, and full input and output roi of each tile */
+  rois = (dt_iop_roi_t *)malloc(sizeof(dt_iop_roi_t)*3*tiles_x*tiles_y);
+  if(rois == NULL)
+  {
+    dt_print(DT_DEBUG_DEV, "[default_process_tiling_roi] could not alloc tile list for module '%s'\n", self->op);
+    goto error;
+  }
+
+  piece->pipe->tiling = 1;
+
+  /* first find all the tiles, which needs module callbacks which can fail */
   for(size_t tx=0; tx<tiles_x; tx++)
     for(size_t ty=0; ty<tiles_y; ty++)
     {
-      piece->pipe->tiling = 1;
-
       /* the output dimensions of the good part of this specific tile */
       size_t wd = (tx + 1) * tile_wd > roi_out->width  ? roi_out->width - tx * tile_wd : tile_wd;
       size_t ht = (ty + 1) * tile_ht > roi_out->height ? roi_out->height- ty * tile_ht : tile_ht;
@@ -1034,43 +1087,79 @@ _default_process_tiling_roi (struct dt_iop_module_t *self, struct dt_dev_pixelpi
       //_print_roi(&iroi_full, "tile iroi_full final");
       //_print_roi(&oroi_full, "tile oroi_full final");
 
-      /* offsets of tile into ivoid and ovoid */
-      size_t ioffs = ((size_t)iroi_full.y - roi_in->y)*ipitch + ((size_t)iroi_full.x - roi_in->x)*in_bpp;
-      size_t ooffs = ((size_t)oroi_good.y - roi_out->y)*opitch + ((size_t)oroi_good.x - roi_out->x)*out_bpp;
+      dt_iop_roi_t *r = rois + 3*(tx*tiles_y + ty);
+      r[0] = oroi_good;
+      r[1] = iroi_full;
+      r[2] = oroi_full;
+    }
+
+  /* the largest tile decides how many fit into memory at the same time */
+  int tile_width = 1, tile_height = 1;
+  for(int t=0; t<tiles_x*tiles_y; t++)
+  {
+    tile_width = _max(tile_width, _max(rois[3*t+1].width, rois[3*t+2].width));
+    tile_height = _max(tile_height, _max(rois[3*t+1].height, rois[3*t+2].height));
+  }
+  const int threads = _concurrent_tiles(self, tiles_x*tiles_y, tile_width, tile_height, max_bpp, factor, tiling.overhead,
+                                       (size_t)roi_in->width*roi_in->height*in_bpp + (size_t)roi_out->width*roi_out->height*out_bpp);
+  dt_print(DT_DEBUG_DEV, "[default_process_tiling_roi] processing %d tiles at a time\n", threads);
+
+  /* then process them. several threads each take their own tiles if the module allows it, the
+     module's own parallelization then has a single thread per tile, also with nested parallelism. */
+  int failed = 0;
+#ifdef _OPENMP
+  #pragma omp parallel for default(none) shared(self,piece,ivoid,ovoid,roi_in,roi_out,rois,failed,tiles_x,tiles_y,processed_maximum_saved,processed_maximum_new) num_threads(threads) if(threads > 1) schedule(dynamic)
+#endif
+  for(int t=0; t<tiles_x*tiles_y; t++)
+  {
+#ifdef _OPENMP
+    // only this task's setting: with nested parallelism (export) the module would spawn a full team per tile
+    if(threads > 1) omp_set_num_threads(1);
+#endif
+    if(failed) continue;
+    const size_t tx = t / tiles_y, ty = t % tiles_y;
+    const dt_iop_roi_t oroi_good = rois[3*t];
+    dt_iop_roi_t iroi_full = rois[3*t+1];
+    dt_iop_roi_t oroi_full = rois[3*t+2];
 
-      dt_print(DT_DEBUG_DEV, "[default_process_tiling_roi] tile (%d, %d) with %d x %d at origin [%d, %d]\n", tx, ty, iroi_full.width, iroi_full.height, iroi_full.x, iroi_full.y);
+    /* offsets of tile into ivoid and ovoid */
+    size_t ioffs = ((size_t)iroi_full.y - roi_in->y)*ipitch + ((size_t)iroi_full.x - roi_in->x)*in_bpp;
+    size_t ooffs = ((size_t)oroi_good.y - roi_out->y)*opitch + ((size_t)oroi_good.x - roi_out->x)*out_bpp;
 
+    dt_print(DT_DEBUG_DEV, "[default_process_tiling_roi] tile (%d, %d) with %d x %d at origin [%d, %d]\n", tx, ty, iroi_full.width, iroi_full.height, iroi_full.x, iroi_full.y);
 
-      /* prepare input tile buffer */
-      input = dt_alloc_align(64, (size_t)iroi_full.width*iroi_full.height*in_bpp);
-      if(input == NULL)
-      {
-        dt_print(DT_DEBUG_DEV, "[default_process_tiling_roi] could not alloc input buffer for module '%s'\n", self->op);
-        goto error;
-      }
-      output = dt_alloc_align(64, (size_t)oroi_full.width*oroi_full.height*out_bpp);
-      if(output == NULL)
-      {
-        dt_print(DT_DEBUG_DEV, "[default_process_tiling_roi] could not alloc output buffer for module '%s'\n", self->op);
-        goto error;
-      }
+
+    /* prepare input tile buffer */
+    void *tinput = dt_alloc_align(64, (size_t)iroi_full.width*iroi_full.height*in_bpp);
+    void *toutput = dt_alloc_align(64, (size_t)oroi_full.width*oroi_full.height*out_bpp);
+    if(tinput == NULL || toutput == NULL)
+    {
+      dt_print(DT_DEBUG_DEV, "[default_process_tiling_roi] could not alloc tile buffers for module '%s'\n", self->op);
+      if(tinput != NULL) dt_free_align(tinput);
+      if(toutput != NULL) dt_free_align(toutput);
+      failed = 1;
+      continue;
+    }
 
 #ifdef _OPENMP
-      #pragma omp parallel for default(none) shared(input,ivoid,ioffs,iroi_full) schedule(static)
+    #pragma omp parallel for default(none) shared(tinput,ivoid,ioffs,iroi_full) schedule(static)
 #endif
-      for(size_t j=0; j<iroi_full.height; j++)
-        memcpy((char *)input+j*iroi_full.width*in_bpp, (char *)ivoid+ioffs+j*ipitch, (size_t)iroi_full.width*in_bpp);
+    for(size_t j=0; j<iroi_full.height; j++)
+      memcpy((char *)tinput+j*iroi_full.width*in_bpp, (char *)ivoid+ioffs+j*ipitch, (size_t)iroi_full.width*in_bpp);
 
-      /* take original processed_maximum as starting point */
+    /* take original processed_maximum as starting point. modules processing
+       tiles in parallel only read it, and all tiles start from the same one. */
+    if(threads == 1)
       for(int k=0; k<3; k++)
         piece->pipe->processed_maximum[k] = processed_maximum_saved[k];
 
-      /* call process() of module */
-      self->process(self, piece, input, output, &iroi_full, &oroi_full);
+    /* call process() of module */
+    self->process(self, piece, tinput, toutput, &iroi_full, &oroi_full);
 
-      /* aggregate resulting processed_maximum */
-      /* TODO: check if there really can be differences between tiles and take
-               appropriate action (calculate minimum, maximum, average, ...?) */
+    /* aggregate resulting processed_maximum */
+    /* TODO: check if there really can be differences between tiles and take
+             appropriate action (calculate minimum, maximum, average, ...?) */
+    if(threads == 1)
       for(int k=0; k<3; k++)
       {
         if(tx+ty > 0 && fabs(processed_maximum_new[k] - piece->pipe->processed_maximum[k]) > 1.0e-6f)
@@ -1078,26 +1167,30 @@ _default_process_tiling_roi (struct dt_iop_module_t *self, struct dt_dev_pixelpi
         processed_maximum_new[k] = piece->pipe->processed_maximum[k];
       }
 
-      /* copy "good" part of tile to output buffer */
-      const int origin_x = oroi_good.x - oroi_full.x;
-      const int origin_y = oroi_good.y - oroi_full.y;
+    /* copy "good" part of tile to output buffer */
+    const int origin_x = oroi_good.x - oroi_full.x;
+    const int origin_y = oroi_good.y - oroi_full.y;
 #ifdef _OPENMP
-      #pragma omp parallel for default(none) shared(ovoid,ooffs,output,oroi_good,oroi_full) schedule(static)
+    #pragma omp parallel for default(none) shared(ovoid,ooffs,toutput,oroi_good,oroi_full) schedule(static)
 #endif
-      for(size_t j=0; j<oroi_good.height; j++)
-        memcpy((char *)ovoid+ooffs+j*opitch, (char *)output+((j+origin_y)*oroi_full.width+origin_x)*out_bpp, (size_t)oroi_good.width*out_bpp);
+    for(size_t j=0; j<oroi_good.height; j++)
+      memcpy((char *)ovoid+ooffs+j*opitch, (char *)toutput+((j+origin_y)*oroi_full.width+origin_x)*out_bpp, (size_t)oroi_good.width*out_bpp);
 
-      dt_free_align(input);
-      dt_free_align(output);
-      input = output = NULL;
-    }
+    dt_free_align(tinput);
+    dt_free_align(toutput);
+  }
+
+  if(failed) goto error;
+
+  if(threads > 1)
+    for(int k=0; k<3; k++)
+      processed_maximum_new[k] = piece->pipe->processed_maximum[k];
 
   /* copy back final processed_maximum */
   for(int k=0; k<3; k++)
     piece->pipe->processed_maximum[k] = processed_maximum_new[k];
 
-  if(input != NULL) dt_free_align(input);
-  if(output != NULL) dt_free_align(output);
+  free(rois);
   piece->pipe->tiling = 0;
   return;
 
@@ -1106,8 +1199,7 @@ error:
   // fall through
 
 fallback:
-  if(input != NULL) dt_free_align(input);
-  if(output != NULL) dt_free_align(output);
+  free(rois);
   piece->pipe->tiling = 0;
   dt_print(DT_DEBUG_DEV, "[default_process_tiling_roi] fall back to standard processing for module '%s'\n", self->op);
   self->process(self, piece, ivoid, ovoid, roi_in, roi_out);
@@ -46,6 +46,8 @@ typedef struct dt_imageio_png_t
   FILE *f;
   png_structp png_ptr;
   png_infop info_ptr;
+  void *exif;
+  int exif_len;
 }
 dt_imageio_png_t;
 
@@ -125,61 +127,69 @@ static void PNGwriteRawProfile(png_struct *ping,
 }
 
 int
-write_image (dt_imageio_module_data_t *p_tmp, const char *filename, const void *in_void, void *exif, int exif_len, int imgid)
+write_image_begin (dt_imageio_module_data_t *p_tmp, const char *filename, void *exif, int exif_len, int imgid)
 {
   dt_imageio_png_t*p=(dt_imageio_png_t*)p_tmp;
   const int width = p->width, height = p->height;
-  const uint8_t *in = (uint8_t *)in_void;
-  FILE *f = fopen(filename, "wb");
-  if (!f) return 1;
-
-  png_structp png_ptr;
-  png_infop info_ptr;
-
-  png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
-  if (!png_ptr)
+  p->exif = exif;
+  p->exif_len = exif_len;
+  p->png_ptr = NULL;
+  p->info_ptr = NULL;
+  p->f = fopen(filename, "wb");
+  if (!p->f) return 1;
+
+  p->png_ptr = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+  if (!p->png_ptr)
   {
-    fclose(f);
+    fclose(p->f);
+    p->f = NULL;
     return 1;
   }
 
-  info_ptr = png_create_info_struct(png_ptr);
-  if (!info_ptr)
+  p->info_ptr = png_create_info_struct(p->png_ptr);
+  if (!p->info_ptr)
   {
-    fclose(f);
-    png_destroy_write_struct(&png_ptr, NULL);
+    write_image_end(p_tmp, 1);
     return 1;
   }
 
-  if (setjmp(png_jmpbuf(png_ptr)))
+  if (setjmp(png_jmpbuf(p->png_ptr)))
   {
-    fclose(f);
-    png_destroy_write_struct(&png_ptr, NULL);
+    write_image_end(p_tmp, 1);
     return 1;
   }
 
-  png_init_io(png_ptr, f);
+  png_init_io(p->png_ptr, p->f);
 
-  png_set_compression_level(png_ptr, Z_BEST_COMPRESSION);
-  png_set_compression_mem_level(png_ptr, 8);
-  png_set_compression_strategy(png_ptr, Z_DEFAULT_STRATEGY);
-  png_set_compression_window_bits(png_ptr, 15);
-  png_set_compression_method(png_ptr, 8);
-  png_set_compression_buffer_size(png_ptr, 8192);
+  png_set_compression_level(p->png_ptr, Z_BEST_COMPRESSION);
+  png_set_compression_mem_level(p->png_ptr, 8);
+  png_set_compression_strategy(p->png_ptr, Z_DEFAULT_STRATEGY);
+  png_set_compression_window_bits(p->png_ptr, 15);
+  png_set_compression_method(p->png_ptr, 8);
+  png_set_compression_buffer_size(p->png_ptr, 8192);
 
-  png_set_IHDR(png_ptr, info_ptr, width, height,
+  png_set_IHDR(p->png_ptr, p->info_ptr, width, height,
                p->bpp, PNG_COLOR_TYPE_RGB, PNG_INTERLACE_NONE,
                PNG_COMPRESSION_TYPE_DEFAULT, PNG_FILTER_TYPE_DEFAULT);
 
-  png_write_info(png_ptr, info_ptr);
+  png_write_info(p->png_ptr, p->info_ptr);
+  return 0;
+}
+
+int
+write_image_rows (dt_imageio_module_data_t *p_tmp, const void *in_void, int rows)
+{
+  dt_imageio_png_t*p=(dt_imageio_png_t*)p_tmp;
+  const int width = p->width;
+  const uint8_t *in = (uint8_t *)in_void;
+
+  if (setjmp(png_jmpbuf(p->png_ptr))) return 1;
 
-  // png_bytep row_pointer = (png_bytep) in;
   png_byte row[6*width];
-  // unsigned long rowbytes = png_get_rowbytes(png_ptr, info_ptr);
 
   if(p->bpp > 8)
   {
-    for (int y = 0; y < height; y++)
+    for (int y = 0; y < rows; y++)
     {
       for(int x=0; x<width; x++) for(int k=0; k<3; k++)
         {
@@ -187,26 +197,50 @@ write_image (dt_imageio_module_data_t *p_tmp, const char *filename, const void *
           uint16_t swapped = (0xff00 & (pix<<8)) | (pix>>8);
           ((uint16_t *)row)[3*x+k] = swapped;
         }
-      png_write_row(png_ptr, row);
+      png_write_row(p->png_ptr, row);
     }
   }
   else
   {
-    for (int y = 0; y < height; y++)
+    for (int y = 0; y < rows; y++)
     {
       for(int x=0; x<width; x++) for(int k=0; k<3; k++) row[3*x+k] = in[(size_t)4*width*y + 4*x + k];
-      png_write_row(png_ptr, row);
+      png_write_row(p->png_ptr, row);
     }
   }
+  return 0;
+}
 
-  PNGwriteRawProfile(png_ptr, info_ptr, "exif", exif, exif_len);
+int
+write_image_end (dt_imageio_module_data_t *p_tmp, int error)
+{
+  dt_imageio_png_t*p=(dt_imageio_png_t*)p_tmp;
+  if (!error)
+  {
+    if (setjmp(png_jmpbuf(p->png_ptr)))
+      error = 1;
+    else
+    {
+      PNGwriteRawProfile(p->png_ptr, p->info_ptr, "exif", p->exif, p->exif_len);
 
-  // TODO: embed icc profile!
+      // TODO: embed icc profile!
 
-  png_write_end(png_ptr, info_ptr);
-  png_destroy_write_struct(&png_ptr, &info_ptr);
-  fclose(f);
-  return 0;
+      png_write_end(p->png_ptr, p->info_ptr);
+    }
+  }
+  png_destroy_write_struct(&p->png_ptr, &p->info_ptr);
+  fclose(p->f);
+  p->f = NULL;
+  p->exif = NULL;
+  return error;
+}
+
+int
+write_image (dt_imageio_module_data_t *p_tmp, const char *filename, const void *in_void, void *exif, int exif_len, int imgid)
+{
+  if (write_image_begin(p_tmp, filename, exif, exif_len, imgid)) return 1;
+  const int err = write_image_rows(p_tmp, in_void, p_tmp->height);
+  return write_image_end(p_tmp, err);
 }
 
 int read_header(const char *filename, dt_imageio_module_data_t *p_tmp)
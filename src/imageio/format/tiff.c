@@ -39,7 +39,14 @@ typedef struct dt_imageio_tiff_t
   char style[128];
   int bpp;
   int compress;
+  // state of the writer, not part of the params:
   TIFF *handle;
+  uint8_t *profile;
+  uint8_t *rowdata;
+  uint32_t rowsize, stripe, rows;
+  gchar *filename;
+  void *exif;
+  int exif_len;
 }
 dt_imageio_tiff_t;
 
@@ -51,21 +58,20 @@ typedef struct dt_imageio_tiff_gui_t
 dt_imageio_tiff_gui_t;
 
 
-int write_image (dt_imageio_module_data_t *d_tmp, const char *filename, const void *in_void, void *exif, int exif_len, int imgid)
+int write_image_begin (dt_imageio_module_data_t *d_tmp, const char *filename, void *exif, int exif_len, int imgid)
 {
   dt_imageio_tiff_t *d=(dt_imageio_tiff_t*)d_tmp;
 
-  uint8_t* profile = NULL;
   uint32_t profile_len = 0;
 
-  TIFF* tif = NULL;
-
-  void* rowdata = NULL;
-  uint32_t rowsize = 0;
-  uint32_t stripesize = 0;
-  uint32_t stripe = 0;
-
-  int rc = 1; // default to error
+  d->handle = NULL;
+  d->profile = NULL;
+  d->rowdata = NULL;
+  d->stripe = 0;
+  d->rows = 0;
+  d->exif = exif;
+  d->exif_len = exif_len;
+  d->filename = g_strdup(filename);
 
   if(imgid > 0)
   {
@@ -73,24 +79,21 @@ int write_image (dt_imageio_module_data_t *d_tmp, const char *filename, const vo
     cmsSaveProfileToMem(out_profile, 0, &profile_len);
     if (profile_len > 0)
     {
-      profile = malloc(profile_len);
-      if (!profile)
+      d->profile = malloc(profile_len);
+      if (!d->profile)
       {
-        rc = 1;
-        goto exit;
+        dt_colorspaces_cleanup_profile(out_profile);
+        goto error;
       }
-      cmsSaveProfileToMem(out_profile, profile, &profile_len);
+      cmsSaveProfileToMem(out_profile, d->profile, &profile_len);
     }
     dt_colorspaces_cleanup_profile(out_profile);
   }
 
   // Create little endian tiff image
-  tif = TIFFOpen(filename,"wl");
-  if (!tif)
-  {
-    rc = 1;
-    goto exit;
-  }
+  d->handle = TIFFOpen(filename,"wl");
+  if (!d->handle) goto error;
+  TIFF *tif = d->handle;
 
   // http://partners.adobe.com/public/developer/en/tiff/TIFFphotoshop.pdf (dated 2002)
   // "A proprietary ZIP/Flate compression code (0x80b2) has been used by some"
@@ -126,9 +129,9 @@ int write_image (dt_imageio_module_data_t *d_tmp, const char *filename, const vo
   }
 
   TIFFSetField(tif, TIFFTAG_FILLORDER, (uint16_t)FILLORDER_MSB2LSB);
-  if (profile != NULL)
+  if (d->profile != NULL)
   {
-    TIFFSetField(tif, TIFFTAG_ICCPROFILE, (uint32_t)profile_len, profile);
+    TIFFSetField(tif, TIFFTAG_ICCPROFILE, (uint32_t)profile_len, d->profile);
   }
   TIFFSetField(tif, TIFFTAG_SAMPLESPERPIXEL, (uint16_t)3);
   TIFFSetField(tif, TIFFTAG_BITSPERSAMPLE, (uint16_t)d->bpp);
@@ -148,126 +151,96 @@ int write_image (dt_imageio_module_data_t *d_tmp, const char *filename, const vo
     TIFFSetField(tif, TIFFTAG_RESOLUTIONUNIT, (uint16_t)RESUNIT_INCH);
   }
 
-  rowsize = (d->width*3) * d->bpp / 8;
-  stripesize = rowsize * DT_TIFFIO_STRIPE;
-  stripe = 0;
+  d->rowsize = (d->width*3) * d->bpp / 8;
+  d->rowdata = malloc((size_t)d->rowsize * DT_TIFFIO_STRIPE);
+  if (!d->rowdata) goto error;
 
-  rowdata = malloc(stripesize);
-  if (!rowdata)
-  {
-    rc = 1;
-    goto exit;
-  }
-
-  if (d->bpp == 32)
-  {
-    float* in = (float*)in_void;
-    float* wdata = rowdata;
+  return 0;
 
-    for (int y = 0; y < d->height; y++)
-    {
-      for (int x = 0; x < d->width; x++)
-      {
-        wdata[0] = in[x * 4 + 0];
-        wdata[1] = in[x * 4 + 1];
-        wdata[2] = in[x * 4 + 2];
-        wdata += 3;
-      }
+error:
+  write_image_end(d_tmp, 1);
+  return 1;
+}
 
-      if ((uintptr_t)wdata - (uintptr_t)rowdata == (uintptr_t)stripesize)
-      {
-        TIFFWriteEncodedStrip(tif, stripe++, rowdata, (size_t)(rowsize * DT_TIFFIO_STRIPE));
-        wdata = rowdata;
-      }
+// collects the rows in d->rowdata and writes out every complete stripe.
+int write_image_rows (dt_imageio_module_data_t *d_tmp, const void *in_void, int rows)
+{
+  dt_imageio_tiff_t *d=(dt_imageio_tiff_t*)d_tmp;
+  const size_t stripesize = (size_t)d->rowsize * DT_TIFFIO_STRIPE;
 
-      in += d->width * 4;
-    }
-    if ((uintptr_t)wdata - (uintptr_t)rowdata != (uintptr_t)stripesize)
-    {
-      TIFFWriteEncodedStrip(tif, stripe++, rowdata, (size_t)((uintptr_t)wdata - (uintptr_t)rowdata));
-    }
-  }
-  else if (d->bpp == 16)
+  for (int y = 0; y < rows; y++)
   {
-    uint16_t* in = (uint16_t*)in_void;
-    uint16_t* wdata = rowdata;
-
-    for (int y = 0; y < d->height; y++)
+    uint8_t *wdata = d->rowdata + (size_t)d->rows * d->rowsize;
+    if (d->bpp == 32)
     {
-      for(int x=0; x<d->width; x++)
-      {
-        wdata[0] = in[4*x + 0];
-        wdata[1] = in[4*x + 1];
-        wdata[2] = in[4*x + 2];
-        wdata += 3;
-      }
-
-      if((uintptr_t)wdata - (uintptr_t)rowdata == (uintptr_t)stripesize)
-      {
-        TIFFWriteEncodedStrip(tif, stripe++, rowdata, (size_t)(rowsize * DT_TIFFIO_STRIPE));
-        wdata = rowdata;
-      }
-
-      in += d->width*4;
+      const float *in = (const float *)in_void + (size_t)4 * d->width * y;
+      float *out = (float *)wdata;
+      for (int x = 0; x < d->width; x++)
+        for (int k = 0; k < 3; k++) out[3*x + k] = in[4*x + k];
     }
-    if ((uintptr_t)wdata - (uintptr_t)rowdata != (uintptr_t)stripesize)
+    else if (d->bpp == 16)
     {
-      TIFFWriteEncodedStrip(tif, stripe, rowdata, (size_t)((uintptr_t)wdata - (uintptr_t)rowdata));
+      const uint16_t *in = (const uint16_t *)in_void + (size_t)4 * d->width * y;
+      uint16_t *out = (uint16_t *)wdata;
+      for (int x = 0; x < d->width; x++)
+        for (int k = 0; k < 3; k++) out[3*x + k] = in[4*x + k];
     }
-  }
-  else
-  {
-    uint8_t* in = (uint8_t*)in_void;
-    uint8_t* wdata = rowdata;
-
-    for (int y = 0; y < d->height; y++)
+    else
     {
-      for(int x=0; x<d->width; x++)
-      {
-        wdata[0] = in[4*x + 0];
-        wdata[1] = in[4*x + 1];
-        wdata[2] = in[4*x + 2];
-        wdata += 3;
-      }
-
-      if((uintptr_t)wdata - (uintptr_t)rowdata == (uintptr_t)stripesize)
-      {
-        TIFFWriteEncodedStrip(tif, stripe++, rowdata, (size_t)(rowsize * DT_TIFFIO_STRIPE));
-        wdata = rowdata;
-      }
-
-      in += d->width*4;
+      const uint8_t *in = (const uint8_t *)in_void + (size_t)4 * d->width * y;
+      for (int x = 0; x < d->width; x++)
+        for (int k = 0; k < 3; k++) wdata[3*x + k] = in[4*x + k];
     }
-    if((uintptr_t)wdata - (uintptr_t)rowdata != (uintptr_t)stripesize)
+
+    if (++d->rows == DT_TIFFIO_STRIPE)
     {
-      TIFFWriteEncodedStrip(tif, stripe, rowdata, (size_t)((uintptr_t)wdata - (uintptr_t)rowdata));
+      if (TIFFWriteEncodedStrip(d->handle, d->stripe++, d->rowdata, stripesize) < 0) return 1;
+      d->rows = 0;
     }
   }
+  return 0;
+}
+
+int write_image_end (dt_imageio_module_data_t *d_tmp, int error)
+{
+  dt_imageio_tiff_t *d=(dt_imageio_tiff_t*)d_tmp;
+  int rc = error;
 
-  // success
-  rc = 0;
+  // last, incomplete stripe:
+  if (!rc && d->rows > 0 &&
+      TIFFWriteEncodedStrip(d->handle, d->stripe++, d->rowdata, (size_t)d->rowsize * d->rows) < 0)
+    rc = 1;
 
-exit:
   // close the file before adding exif data
-  if (tif)
+  if (d->handle)
   {
-    TIFFClose(tif);
-    tif = NULL;
+    TIFFClose(d->handle);
+    d->handle = NULL;
   }
-  if(!rc && exif)
+  if(!rc && d->exif)
   {
-    rc = dt_exif_write_blob(exif,exif_len,filename);
+    rc = dt_exif_write_blob(d->exif,d->exif_len,d->filename);
     // Until we get symbolic error status codes, if rc is 1, return 0
     rc = (rc == 1) ? 0 : 1;
   }
-  free(profile);
-  profile = NULL;
-  free(rowdata);
-  rowdata = NULL;
+  free(d->profile);
+  d->profile = NULL;
+  free(d->rowdata);
+  d->rowdata = NULL;
+  g_free(d->filename);
+  d->filename = NULL;
+  d->exif = NULL;
 
   return rc;
 }
 
+int write_image (dt_imageio_module_data_t *d_tmp, const char *filename, const void *in_void, void *exif, int exif_len, int imgid)
+{
+  if (write_image_begin(d_tmp, filename, exif, exif_len, imgid)) return 1;
+  const int rc = write_image_rows(d_tmp, in_void, d_tmp->height);
+  return write_image_end(d_tmp, rc);
+}
+
 #if 0
 int dt_imageio_tiff_read_header(const char *filename, dt_imageio_tiff_t *tiff)
 {
@@ -290,7 +263,7 @@ int dt_imageio_tiff_read(dt_imageio_tiff_t *tiff, uint8_t *out)
 size_t
 params_size(dt_imageio_module_format_t *self)
 {
-  return sizeof(dt_imageio_tiff_t) - sizeof(TIFF*);
+  return offsetof(dt_imageio_tiff_t, handle);
 }
 
 void*
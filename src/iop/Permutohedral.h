@@ -51,7 +51,8 @@ public:
     capacity = 1 << 15;
     capacity_bits = 0x7fff;
     filled = 0;
-    entries = new Entry[capacity];
+    entries = new int[capacity];
+    for (size_t i = 0; i < capacity; i++) entries[i] = -1;
     keys = new short[KD*capacity/2];
     values = new float[VD*capacity/2];
     memset(values, 0, sizeof(float)*VD*capacity/2);
@@ -87,40 +88,42 @@ public:
    *       h: hash of the position vector.
    *  create: a flag specifying whether an entry should be created,
    *          should an entry with the given key not found.
+   * lookups with create == false never modify the table, so they
+   * can run concurrently (as done by blur()).
    */
   int lookupOffset(const short *key, size_t h, bool create = true)
   {
 
     // Double hash table size if necessary
-    if (filled >= (capacity/2)-1)
+    if (create && filled >= (capacity/2)-1)
     {
       grow();
+      h = hash(key) & capacity_bits;
     }
 
     // Find the entry with the given key
     while (1)
     {
-      Entry e = entries[h];
+      const int e = entries[h];
       // check if the cell is empty
-      if (e.keyIdx == -1)
+      if (e == -1)
       {
         if (!create) return -1; // Return not found.
         // need to create an entry. Store the given key.
         for (int i = 0; i < KD; i++)
           keys[filled*KD+i] = key[i];
-        e.keyIdx = filled*KD;
-        e.valueIdx = filled*VD;
-        entries[h] = e;
+        entries[h] = filled;
         filled++;
-        return e.valueIdx;
+        return (filled-1)*VD;
       }
 
       // check if the cell has a matching key
+      const short *k = keys + e*KD;
       bool match = true;
       for (int i = 0; i < KD && match; i++)
-        match = keys[e.keyIdx+i] == key[i];
+        match = k[i] == key[i];
       if (match)
-        return e.valueIdx;
+        return e*VD;
 
       // increment the bucket with wraparound
       h++;
@@ -173,14 +176,15 @@ private:
     delete[] keys;
     keys = newKeys;
 
-    Entry *newEntries = new Entry[capacity];
+    int *newEntries = new int[capacity];
+    for (size_t i = 0; i < capacity; i++) newEntries[i] = -1;
 
     // Migrate the table of indices.
     for (size_t i = 0; i < oldCapacity; i++)
     {
-      if (entries[i].keyIdx == -1) continue;
-      size_t h = hash(keys + entries[i].keyIdx) & capacity_bits;
-      while (newEntries[h].keyIdx != -1)
+      if (entries[i] == -1) continue;
+      size_t h = hash(keys + entries[i]*KD) & capacity_bits;
+      while (newEntries[h] != -1)
       {
         h++;
         if (h == capacity) h = 0;
@@ -191,17 +195,11 @@ private:
     entries = newEntries;
   }
 
-  // Private struct for the hash table entries.
-  struct Entry
-  {
-    Entry() : keyIdx(-1), valueIdx(-1) {}
-    int keyIdx;
-    int valueIdx;
-  };
-
+  // the table only holds the index of the vertex, -1 for empty cells.
+  // its key is at keys + index*KD, its value at values + index*VD.
   short *keys;
   float *values;
-  Entry *entries;
+  int *entries;
   size_t capacity, filled;
   unsigned long capacity_bits;
 };
@@ -230,6 +228,7 @@ public:
     int *canonicalTmp = new int[(D+1)*(D+1)];
 
     replay = new ReplayEntry[nData*(D+1)];
+    replayTable = new short[nData];
 
     // compute the coordinates of the canonical simplex, in which
     // the difference between a contained point and the zero
@@ -266,6 +265,9 @@ public:
     scaleFactor = scaleFactorTmp;
 
     hashTables = new HashTablePermutohedral<D,VD>[nThreads];
+    splatCache = new SplatCache[nThreads];
+    for (int t = 0; t < nThreads; t++)
+      for (int i = 0; i <= D; i++) splatCache[t].offset[i] = -1;
   }
 
 
@@ -273,8 +275,10 @@ public:
   {
     delete[] scaleFactor;
     delete[] replay;
+    delete[] replayTable;
     delete[] canonical;
     delete[] hashTables;
+    delete[] splatCache;
   }
 
 
@@ -368,18 +372,28 @@ public:
       for (int i = 0; i < D; i++)
         key[i] = greedy[i] + canonical[remainder*(D+1) + rank[i]];
 
-      // Retrieve pointer to the value at this vertex.
-      float * val = hashTables[thread_index].lookup(key, true);
+      // Retrieve pointer to the value at this vertex. neighbouring points mostly
+      // fall into the same simplex, so try the one of the last point first.
+      SplatCache &cache = splatCache[thread_index];
+      float *val;
+      if (cache.offset[remainder] >= 0 && !memcmp(cache.key[remainder], key, sizeof(key)))
+        val = hashTables[thread_index].getValues() + cache.offset[remainder];
+      else
+      {
+        val = hashTables[thread_index].lookup(key, true);
+        memcpy(cache.key[remainder], key, sizeof(key));
+        cache.offset[remainder] = val - hashTables[thread_index].getValues();
+      }
 
       // Accumulate values with barycentric weight.
       for (int i = 0; i < VD; i++)
         val[i] += barycentric[remainder]*value[i];
 
       // Record this interaction to use later when slicing
-      replay[replay_index*(D+1)+remainder].table = thread_index;
       replay[replay_index*(D+1)+remainder].offset = val - hashTables[thread_index].getValues();
       replay[replay_index*(D+1)+remainder].weight = barycentric[remainder];
     }
+    replayTable[replay_index] = thread_index;
   }
 
   /* Merge the multiple threads' hash tables into the totals. */
@@ -408,8 +422,11 @@ public:
 
     /* Rewrite the offsets in the replay structure from the above generated table. */
     for (int i = 0; i < nData*(D+1); i++)
-      if (replay[i].table > 0)
-        replay[i].offset = offset_remap[replay[i].table][replay[i].offset/VD];
+    {
+      const int table = replayTable[i/(D+1)];
+      if (table > 0)
+        replay[i].offset = offset_remap[table][replay[i].offset/VD];
+    }
 
     for (int i = 1; i < nThreads; i++)
       delete[] offset_remap[i];
@@ -479,7 +496,7 @@ public:
 
         // Mix values of the three vertices
         for (int k = 0; k < VD; k++)
-          newVal[k] = (0.25f*vm1[k] + 0.5f*oldVal[k] + 0.25f*vp1[k]);
+          newVal[k] = 0.5f*oldVal[k] + 0.25f*(vm1[k] + vp1[k]);
       }
       float *tmp = newValue;
       newValue = oldValue;
@@ -509,12 +526,22 @@ private:
   // slicing is done by replaying splatting (ie storing the sparse matrix)
   struct ReplayEntry
   {
-    int table;
     int offset;
     float weight;
   } *replay;
+  // the hash table each point was splatted into, until merge_splat_threads()
+  short *replayTable;
 
   HashTablePermutohedral<D,VD> *hashTables;
+
+  // the vertices of the simplex the last point of each thread was splatted into.
+  // padded so the threads don't share cache lines.
+  struct SplatCache
+  {
+    short key[D+1][D];
+    int offset[D+1];
+    char pad[64];
+  } *splatCache;
 };
 
 #endif
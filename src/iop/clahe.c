@@ -22,9 +22,11 @@
 #include "common/colorspaces.h"
 #include "develop/develop.h"
 #include "develop/imageop.h"
+#include "develop/tiling.h"
 #include "control/control.h"
 #include "dtgtk/slider.h"
 #include "dtgtk/resetlabel.h"
+#include "bauhaus/bauhaus.h"
 #include "gui/gtk.h"
 #include <gtk/gtk.h>
 #include <inttypes.h>
@@ -32,25 +34,42 @@
 #include <math.h>
 #include <assert.h>
 #include <string.h>
-
-#define CLIP(x) ((x<0)?0.0:(x>1.0)?1.0:x)
+#include <xmmintrin.h>
 
 #define ROUND_POSISTIVE(f) ((unsigned int)((f)+0.5))
 
-DT_MODULE(1)
+DT_MODULE(2)
+
+#define DT_IOP_RLCE_BINS 256
+
+typedef enum dt_iop_rlce_engine_t
+{
+  DT_IOP_RLCE_ENGINE_WINDOW = 0,  // equalize the window around every pixel, cost grows with the radius
+  DT_IOP_RLCE_ENGINE_TILES  = 1   // equalize a grid of tiles and interpolate their mappings
+}
+dt_iop_rlce_engine_t;
+
+typedef struct dt_iop_rlce_params1_t
+{
+  double radius;
+  double slope;
+}
+dt_iop_rlce_params1_t;
 
 typedef struct dt_iop_rlce_params_t
 {
   double radius;
   double slope;
+  int engine;
 }
 dt_iop_rlce_params_t;
 
 typedef struct dt_iop_rlce_gui_data_t
 {
   GtkVBox   *vbox1,  *vbox2;
-  GtkWidget  *label1,*label2;
+  GtkWidget  *label1,*label2,*label3;
   GtkDarktableSlider *scale1,*scale2;       // radie pixels, slope
+  GtkWidget *engine;
 }
 dt_iop_rlce_gui_data_t;
 
@@ -58,6 +77,7 @@ typedef struct dt_iop_rlce_data_t
 {
   double radius;
   double slope;
+  int engine;
 }
 dt_iop_rlce_data_t;
 
@@ -74,76 +94,173 @@ groups ()
 
 int flags()
 {
-  return IOP_FLAGS_INCLUDE_IN_STYLES | IOP_FLAGS_DEPRECATED;
+  return IOP_FLAGS_INCLUDE_IN_STYLES | IOP_FLAGS_DEPRECATED | IOP_FLAGS_ALLOW_TILING;
 }
 
-void process (struct dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, void *ivoid, void *ovoid, const dt_iop_roi_t *roi_in, const dt_iop_roi_t *roi_out)
+int
+legacy_params (dt_iop_module_t *self, const void *const old_params, const int old_version, void *new_params, const int new_version)
 {
-  dt_iop_rlce_data_t *data = (dt_iop_rlce_data_t *)piece->data;
-  const int ch = piece->colors;
+  if (old_version == 1 && new_version == 2)
+  {
+    const dt_iop_rlce_params1_t *old = old_params;
+    dt_iop_rlce_params_t *new = new_params;
+    new->radius = old->radius;
+    new->slope = old->slope;
+    // keep the look of old edits:
+    new->engine = DT_IOP_RLCE_ENGINE_WINDOW;
+    return 0;
+  }
+  return 1;
+}
 
-  // PASS1: Get a luminance map of image...
-  float *luminance=(float *)malloc(((size_t)roi_out->width*roi_out->height)*sizeof(float));
-  //double lsmax=0.0,lsmin=1.0;
+// radius in pixels of the current roi
+static int
+_radius(const dt_iop_rlce_data_t *d, const dt_dev_pixelpipe_iop_t *piece, const dt_iop_roi_t *roi_in)
+{
+  return d->radius*roi_in->scale/piece->iscale;
+}
+
+// edge length of the tiles of the tile engine. not smaller than that, or the mappings take more memory than the image.
+static int
+_tile_size(const int rad)
+{
+  return MAX(2*rad+1, 32);
+}
+
+void tiling_callback  (struct dt_iop_module_t *self, struct dt_dev_pixelpipe_iop_t *piece, const dt_iop_roi_t *roi_in, const dt_iop_roi_t *roi_out, struct dt_develop_tiling_t *tiling)
+{
+  dt_iop_rlce_data_t *d = (dt_iop_rlce_data_t *)piece->data;
+  const int rad = _radius(d, piece, roi_in);
+
+  tiling->factor = 2.25f; // in + out + bin indices (+ tile mappings)
+  tiling->maxbuf = 1.0f;
+  tiling->overhead = 0;
+  // the window engine needs the full window, the tile engine all tiles which are interpolated
+  // with complete tiles, which are the ones up to two tiles away.
+  tiling->overlap = d->engine == DT_IOP_RLCE_ENGINE_TILES ? 2*_tile_size(rad) : rad;
+  tiling->xalign = 1;
+  tiling->yalign = 1;
+}
+
+// clip histogram and redistribute clipped entries
+static void
+_clip_histogram(const int *hist, int *clippedhist, const int bins, const int limit)
+{
+  memcpy(clippedhist,hist,(bins+1)*sizeof(int));
+  int ce = 0, ceb=0;
+  do
+  {
+    ceb = ce;
+    ce = 0;
+    for ( int b = 0; b <= bins; b++ )
+    {
+      int d = clippedhist[ b ] - limit;
+      if ( d > 0 )
+      {
+        ce += d;
+        clippedhist[ b ] = limit;
+      }
+    }
+
+    int d = (ce / (float) ( bins + 1 ));
+    int m = ce % ( bins + 1 );
+    for ( int h = 0; h <= bins; h++)
+      clippedhist[ h ] += d;
+
+    if ( m != 0 )
+    {
+      int s = bins / (float)m;
+      for ( int h = 0; h <= bins; h += s )
+        ++clippedhist[ h ];
+    }
+  }
+  while ( ce != ceb);
+}
+
+// lightness of all pixels, as histogram bin.
+static void
+_luminance_bins(const float *const ivoid, uint16_t *const lbin, const int width, const int height, const int ch, const int bins)
+{
 #ifdef _OPENMP
-  #pragma omp parallel for default(none) schedule(static) shared(luminance,roi_in,roi_out,ivoid)
+  #pragma omp parallel for default(none) schedule(static)
 #endif
-  for(int j=0; j<roi_out->height; j++)
+  for(int j=0; j<height; j++)
   {
-    float *in=(float *)ivoid+(size_t)j*roi_out->width*ch;
-    float *lm=luminance+(size_t)j*roi_out->width;
-    for(int i=0; i<roi_out->width; i++)
+    const float *in = ivoid + (size_t)j*width*ch;
+    uint16_t *lb = lbin + (size_t)j*width;
+    const __m128 zero = _mm_setzero_ps(), one = _mm_set1_ps(1.0f), half = _mm_set_ss(0.5f);
+    const __m128 scale = _mm_set_ss((float)bins);
+    for(int i=0; i<width; i++)
     {
-      double pmax=CLIP(fmax(in[0],fmax(in[1],in[2]))); // Max value in RGB set
-      double pmin=CLIP(fmin(in[0],fmin(in[1],in[2]))); // Min value in RGB set
-      *lm=(pmax+pmin)/2.0;        // Pixel luminocity
+      // max and min value in RGB set, pixel luminocity is the mean of both:
+      const __m128 p = _mm_load_ps(in);
+      const __m128 g = _mm_shuffle_ps(p, p, _MM_SHUFFLE(1,1,1,1));
+      const __m128 b = _mm_shuffle_ps(p, p, _MM_SHUFFLE(2,2,2,2));
+      const __m128 pmax = _mm_min_ss(one, _mm_max_ss(zero, _mm_max_ss(_mm_max_ss(p, g), b)));
+      const __m128 pmin = _mm_min_ss(one, _mm_max_ss(zero, _mm_min_ss(_mm_min_ss(p, g), b)));
+      const float l = _mm_cvtss_f32(_mm_mul_ss(_mm_mul_ss(_mm_add_ss(pmax, pmin), half), scale));
+      *lb = ROUND_POSISTIVE(l);
       in+=ch;
-      lm++;
+      lb++;
     }
   }
+}
 
+// replaces the lightness of a row by the equalized one.
+static void
+_apply_row(const float *in, float *out, const float *const dest, const int width, const int ch)
+{
+  for(int r=0; r<width; r++)
+  {
+    float H, S, L;
+    rgb2hsl(in,&H,&S,&L);
+    //hsl2rgb(out,H,S,( L / dest[r] ) * (L-lsmin) + lsmin );
+    hsl2rgb(out,H,S,dest[r] );
+    out += ch;
+    in += ch;
+  }
+}
 
-  // Params
-  const int rad=data->radius*roi_in->scale/piece->iscale;
-
-  const int bins=256;
-  const float slope=data->slope;
-
-  // CLAHE
+// the original engine: equalizes the (2r+1)^2 window around every pixel, sliding the histogram along the rows.
+static void
+_process_window(const uint16_t *const lbin, const float *const ivoid, float *const ovoid, const int width,
+                const int height, const int ch, const int rad, const float slope)
+{
+  const int bins=DT_IOP_RLCE_BINS;
 #ifdef _OPENMP
-  #pragma omp parallel for default(none) schedule(static) shared(luminance,roi_in,roi_out,ivoid,ovoid)
+  #pragma omp parallel for default(none) schedule(static)
 #endif
-  for(int j=0; j<roi_out->height; j++)
+  for(int j=0; j<height; j++)
   {
     int yMin = fmax( 0, j - rad );
-    int yMax = fmin( roi_in->height, j + rad + 1 );
+    int yMax = fmin( height, j + rad + 1 );
     int h = yMax - yMin;
 
     int xMin0 = fmax( 0, 0-rad );
-    int xMax0 = fmin( roi_in->width - 1, rad );
+    int xMax0 = fmin( width - 1, rad );
 
     int hist[bins+1];
     int clippedhist[bins+1];
-    float dest[roi_out->width];
+    float dest[width];
 
     /* initially fill histogram */
     memset(hist,0,(bins+1)*sizeof(int));
     for ( int yi = yMin; yi < yMax; ++yi )
       for ( int xi = xMin0; xi < xMax0; ++xi )
-        ++hist[ ROUND_POSISTIVE(luminance[(size_t)yi*roi_in->width+xi] * (float)bins) ];
+        ++hist[ lbin[(size_t)yi*width+xi] ];
 
     // Destination row
-    memset(dest,0,roi_out->width*sizeof(float));
+    memset(dest,0,width*sizeof(float));
     float *ld=dest;
 
-    for(int i=0; i<roi_out->width; i++)
+    for(int i=0; i<width; i++)
     {
 
-      int v = ROUND_POSISTIVE(luminance[(size_t)j*roi_in->width+i] * (float)bins);
+      int v = lbin[(size_t)j*width+i];
 
       int xMin = fmax( 0, i - rad );
       int xMax = i + rad + 1;
-      int w = fmin( roi_in->width, xMax ) - xMin;
+      int w = fmin( width, xMax ) - xMin;
       int n = h * w;
 
       int limit = ( int )( slope * n /  bins + 0.5f );
@@ -153,47 +270,18 @@ void process (struct dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, void
       {
         int xMin1 = xMin - 1;
         for ( int yi = yMin; yi < yMax; ++yi )
-          --hist[  ROUND_POSISTIVE(luminance[(size_t)yi*roi_in->width+xMin1] * (float)bins) ];
+          --hist[ lbin[(size_t)yi*width+xMin1] ];
       }
 
       /* add newly included values to histogram */
-      if ( xMax <= roi_in->width )
+      if ( xMax <= width )
       {
         int xMax1 = xMax - 1;
         for ( int yi = yMin; yi < yMax; ++yi )
-          ++hist[  ROUND_POSISTIVE(luminance[(size_t)yi*roi_in->width+xMax1] * (float)bins) ];
+          ++hist[ lbin[(size_t)yi*width+xMax1] ];
       }
 
-      /* clip histogram and redistribute clipped entries */
-      memcpy(clippedhist,hist,(bins+1)*sizeof(int));
-      int ce = 0, ceb=0;
-      do
-      {
-        ceb = ce;
-        ce = 0;
-        for ( int b = 0; b <= bins; b++ )
-        {
-          int d = clippedhist[ b ] - limit;
-          if ( d > 0 )
-          {
-            ce += d;
-            clippedhist[ b ] = limit;
-          }
-        }
-
-        int d = (ce / (float) ( bins + 1 ));
-        int m = ce % ( bins + 1 );
-        for ( int h = 0; h <= bins; h++)
-          clippedhist[ h ] += d;
-
-        if ( m != 0 )
-        {
-          int s = bins / (float)m;
-          for ( int h = 0; h <= bins; h += s )
-            ++clippedhist[ h ];
-        }
-      }
-      while ( ce != ceb);
+      _clip_histogram(hist, clippedhist, bins, limit);
 
       /* build cdf of clipped histogram */
       int hMin = bins;
@@ -216,24 +304,129 @@ void process (struct dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, void
     }
 
     // Apply row
-    float *in = ((float *)ivoid) + (size_t)j*roi_out->width*ch;
-    float *out = ((float *)ovoid) + (size_t)j*roi_out->width*ch;
-    for(int r=0; r<roi_out->width; r++)
+    _apply_row(ivoid + (size_t)j*width*ch, ovoid + (size_t)j*width*ch, dest, width, ch);
+  }
+}
+
+// classic clahe: one clipped histogram per tile of (2r+1)^2 pixels, turned into a mapping of
+// all bins. pixels interpolate bilinearly between the mappings of the four closest tile centers.
+// the grid is anchored in image coordinates, so tiles of the pipe see the same grid.
+static void
+_process_tiles(const uint16_t *const lbin, const float *const ivoid, float *const ovoid, const dt_iop_roi_t *const roi,
+               const int ch, const int rad, const float slope)
+{
+  const int bins = DT_IOP_RLCE_BINS;
+  const int width = roi->width, height = roi->height;
+  const int size = _tile_size(rad);
+  // range of tiles touching the buffer:
+  const int tx0 = roi->x / size, tx1 = (roi->x + width - 1) / size;
+  const int ty0 = roi->y / size, ty1 = (roi->y + height - 1) / size;
+  const int nx = tx1 - tx0 + 1, ny = ty1 - ty0 + 1;
+
+  float *map = (float *)dt_alloc_align(64, sizeof(float)*(bins+1)*nx*ny);
+  if(!map)
+  {
+    // the window engine gets by without extra memory:
+    _process_window(lbin, ivoid, ovoid, width, height, ch, rad, slope);
+    return;
+  }
+
+#ifdef _OPENMP
+  #pragma omp parallel for default(none) schedule(dynamic) shared(map)
+#endif
+  for(int t=0; t<nx*ny; t++)
+  {
+    // part of the tile inside the buffer:
+    const int tx = t % nx, ty = t / nx;
+    const int xMin = MAX(0, (tx0 + tx)*size - roi->x), xMax = MIN(width, (tx0 + tx + 1)*size - roi->x);
+    const int yMin = MAX(0, (ty0 + ty)*size - roi->y), yMax = MIN(height, (ty0 + ty + 1)*size - roi->y);
+    int hist[bins+1];
+    int clippedhist[bins+1];
+    memset(hist,0,(bins+1)*sizeof(int));
+    for(int yi = yMin; yi < yMax; yi++)
+      for(int xi = xMin; xi < xMax; xi++)
+        ++hist[ lbin[(size_t)yi*width+xi] ];
+
+    const int n = (yMax - yMin) * (xMax - xMin);
+    const int limit = ( int )( slope * n /  bins + 0.5f );
+    _clip_histogram(hist, clippedhist, bins, limit);
+
+    // cdf of the clipped histogram, normalized the same way as the window engine does it:
+    int hMin = bins;
+    for(int h = 0; h < hMin; h++)
+      if(clippedhist[h] != 0) hMin = h;
+    int cdfMax = 0;
+    for(int h = hMin; h <= bins; h++) cdfMax += clippedhist[h];
+    const int cdfMin = clippedhist[hMin];
+    float *m = map + (size_t)t*(bins+1);
+    int cdf = 0;
+    // bins below the darkest one of the tile are only reached by interpolating from the neighbours,
+    // they map to black like hMin itself does:
+    for(int h = 0; h < hMin; h++) m[h] = 0.0f;
+    for(int h = hMin; h <= bins; h++)
     {
-      float H, S, L;
-      rgb2hsl(in,&H,&S,&L);
-      //hsl2rgb(out,H,S,( L / dest[r] ) * (L-lsmin) + lsmin );
-      hsl2rgb(out,H,S,dest[r] );
-      out += ch;
-      in += ch;
-      ld++;
+      cdf += clippedhist[h];
+      m[h] = cdfMax > cdfMin ? (cdf - cdfMin) / (float)(cdfMax - cdfMin) : 0.0f;
+    }
+  }
+
+#ifdef _OPENMP
+  #pragma omp parallel for default(none) schedule(static) shared(map)
+#endif
+  for(int j=0; j<height; j++)
+  {
+    float dest[width];
+    // position between tile centers, in tiles:
+    const float fy = (roi->y + j + 0.5f)/size - 0.5f;
+    const int y0 = floorf(fy);
+    const float wy = fy - y0;
+    const int r0 = CLAMPS(y0 - ty0, 0, ny-1), r1 = CLAMPS(y0 + 1 - ty0, 0, ny-1);
+    for(int i=0; i<width; i++)
+    {
+      const float fx = (roi->x + i + 0.5f)/size - 0.5f;
+      const int x0 = floorf(fx);
+      const float wx = fx - x0;
+      const int c0 = CLAMPS(x0 - tx0, 0, nx-1), c1 = CLAMPS(x0 + 1 - tx0, 0, nx-1);
+      const int v = lbin[(size_t)j*width+i];
+      const float m00 = map[(size_t)(r0*nx + c0)*(bins+1) + v];
+      const float m01 = map[(size_t)(r0*nx + c1)*(bins+1) + v];
+      const float m10 = map[(size_t)(r1*nx + c0)*(bins+1) + v];
+      const float m11 = map[(size_t)(r1*nx + c1)*(bins+1) + v];
+      dest[i] = (1.0f-wy)*((1.0f-wx)*m00 + wx*m01) + wy*((1.0f-wx)*m10 + wx*m11);
     }
+    _apply_row(ivoid + (size_t)j*width*ch, ovoid + (size_t)j*width*ch, dest, width, ch);
+  }
 
+  dt_free_align(map);
+}
+
+void process (struct dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, void *ivoid, void *ovoid, const dt_iop_roi_t *roi_in, const dt_iop_roi_t *roi_out)
+{
+  dt_iop_rlce_data_t *data = (dt_iop_rlce_data_t *)piece->data;
+  const int ch = piece->colors;
+
+  // PASS1: Get a luminance map of image...
+  uint16_t *lbin = (uint16_t *)dt_alloc_align(64, (size_t)roi_out->width*roi_out->height*sizeof(uint16_t));
+  if(!lbin)
+  {
+    // pass the image through unchanged
+    memcpy(ovoid, ivoid, sizeof(float)*ch*roi_out->width*roi_out->height);
+    return;
   }
+  _luminance_bins((const float *)ivoid, lbin, roi_out->width, roi_out->height, ch, DT_IOP_RLCE_BINS);
 
-  // Cleanup
-  free(luminance);
+  // Params
+  const int rad = _radius(data, piece, roi_in);
+  const float slope=data->slope;
+
+  // CLAHE
+  if(data->engine == DT_IOP_RLCE_ENGINE_TILES)
+    _process_tiles(lbin, (const float *)ivoid, (float *)ovoid, roi_in, ch, rad, slope);
+  else
+    _process_window(lbin, (const float *)ivoid, (float *)ovoid, roi_out->width, roi_out->height, ch, rad, slope);
 
+  // Cleanup
+  dt_free_align(lbin);
 }
 
 static void
@@ -256,6 +449,16 @@ slope_callback (GtkDarktableSlider *slider, gpointer user_data)
   dt_dev_add_history_item(darktable.develop, self, TRUE);
 }
 
+static void
+engine_callback (GtkWidget *widget, gpointer user_data)
+{
+  dt_iop_module_t *self = (dt_iop_module_t *)user_data;
+  if(self->dt->gui->reset) return;
+  dt_iop_rlce_params_t *p = (dt_iop_rlce_params_t *)self->params;
+  p->engine = dt_bauhaus_combobox_get(widget);
+  dt_dev_add_history_item(darktable.develop, self, TRUE);
+}
+
 
 
 void commit_params (struct dt_iop_module_t *self, dt_iop_params_t *p1, dt_dev_pixelpipe_t *pipe, dt_dev_pixelpipe_iop_t *piece)
@@ -268,6 +471,7 @@ void commit_params (struct dt_iop_module_t *self, dt_iop_params_t *p1, dt_dev_pi
   dt_iop_rlce_data_t *d = (dt_iop_rlce_data_t *)piece->data;
   d->radius = p->radius;
   d->slope = p->slope;
+  d->engine = p->engine;
 #endif
 }
 
@@ -301,6 +505,7 @@ void gui_update(struct dt_iop_module_t *self)
   dt_iop_rlce_params_t *p = (dt_iop_rlce_params_t *)module->params;
   dtgtk_slider_set_value(g->scale1, p->radius);
   dtgtk_slider_set_value(g->scale2, p->slope);
+  dt_bauhaus_combobox_set(g->engine, p->engine);
 }
 
 void init(dt_iop_module_t *module)
@@ -313,7 +518,7 @@ void init(dt_iop_module_t *module)
   module->gui_data = NULL;
   dt_iop_rlce_params_t tmp = (dt_iop_rlce_params_t)
   {
-    64,1.25
+    64,1.25,DT_IOP_RLCE_ENGINE_TILES
   };
   memcpy(module->params, &tmp, sizeof(dt_iop_rlce_params_t));
   memcpy(module->default_params, &tmp, sizeof(dt_iop_rlce_params_t));
@@ -343,6 +548,8 @@ void gui_init(struct dt_iop_module_t *self)
   gtk_box_pack_start(GTK_BOX(g->vbox1), g->label1, TRUE, TRUE, 0);
   g->label2 = dtgtk_reset_label_new(_("amount"), self, &p->slope, sizeof(float));
   gtk_box_pack_start(GTK_BOX(g->vbox1), g->label2, TRUE, TRUE, 0);
+  g->label3 = dtgtk_reset_label_new(_("method"), self, &p->engine, sizeof(int));
+  gtk_box_pack_start(GTK_BOX(g->vbox1), g->label3, TRUE, TRUE, 0);
 
   g->scale1 = DTGTK_SLIDER(dtgtk_slider_new_with_range(DARKTABLE_SLIDER_BAR,0.0, 256.0, 1.0, p->radius, 0));
   g->scale2 = DTGTK_SLIDER(dtgtk_slider_new_with_range(DARKTABLE_SLIDER_BAR,1.0, 3.0, 0.05, p->slope, 2));
@@ -350,13 +557,21 @@ void gui_init(struct dt_iop_module_t *self)
 
   gtk_box_pack_start(GTK_BOX(g->vbox2), GTK_WIDGET(g->scale1), TRUE, TRUE, 0);
   gtk_box_pack_start(GTK_BOX(g->vbox2), GTK_WIDGET(g->scale2), TRUE, TRUE, 0);
+  g->engine = dt_bauhaus_combobox_new(self);
+  dt_bauhaus_combobox_add(g->engine, _("per pixel"));
+  dt_bauhaus_combobox_add(g->engine, _("tiles"));
+  dt_bauhaus_combobox_set(g->engine, p->engine);
+  gtk_box_pack_start(GTK_BOX(g->vbox2), g->engine, TRUE, TRUE, 0);
   g_object_set(G_OBJECT(g->scale1), "tooltip-text", _("size of features to preserve"), (char *)NULL);
   g_object_set(G_OBJECT(g->scale2), "tooltip-text", _("strength of the effect"), (char *)NULL);
+  g_object_set(G_OBJECT(g->engine), "tooltip-text", _("equalize the neighbourhood of every pixel (slow for large radii),\nor tiles of the same size and blend between them (fast)"), (char *)NULL);
 
   g_signal_connect (G_OBJECT (g->scale1), "value-changed",
                     G_CALLBACK (radius_callback), self);
   g_signal_connect (G_OBJECT (g->scale2), "value-changed",
                     G_CALLBACK (slope_callback), self);
+  g_signal_connect (G_OBJECT (g->engine), "value-changed",
+                    G_CALLBACK (engine_callback), self);
 }
 
 void gui_cleanup(struct dt_iop_module_t *self)
@@ -26,6 +26,7 @@
 #include "bauhaus/bauhaus.h"
 #include "common/colorspaces.h"
 #include "common/colormatrices.c"
+#include "common/lut3d.h"
 #include "common/opencl.h"
 #include "common/image_cache.h"
 #ifdef HAVE_OPENJPEG
@@ -92,6 +93,7 @@ typedef struct dt_iop_colorin_data_t
   cmsHTRANSFORM *xform_cam_Lab;
   cmsHTRANSFORM *xform_cam_nrgb;
   cmsHTRANSFORM *xform_nrgb_Lab;
+  dt_lut3d_t clut;                    // the transforms above sampled, for lut based profiles
   float lut[3][LUT_SAMPLES];
   float cmatrix[9];
   float nmatrix[9];
@@ -454,7 +456,12 @@ process (struct dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, void *ivoi
       }
 
       // convert to (L,a/L,b/L) to be able to change L without changing saturation.
-      if(!d->nrgb)
+      if(dt_lut3d_valid(&d->clut))
+      {
+        dt_lut3d_apply(&d->clut, cam, out, roi_out->width);
+        dt_free_align(cam);
+      }
+      else if(!d->nrgb)
       {
         cmsDoTransform(d->xform_cam_Lab, cam, out, roi_out->width);
         dt_free_align(cam);
@@ -725,6 +732,21 @@ void commit_params (struct dt_iop_module_t *self, dt_iop_params_t *p1, dt_dev_pi
     }
   }
 
+  // lcms is slow for lut based profiles: sample the whole chain of transforms into a 3d lut instead
+  // (only recompiled when the profiles change).
+  if(isnan(d->cmatrix[0]) && (d->nrgb ? d->xform_cam_nrgb && d->xform_nrgb_Lab : d->xform_cam_Lab != NULL))
+  {
+    cmsHPROFILE profiles[2] = { d->input, d->nrgb };
+    const int settings[2] = { p->intent, p->normalize };
+    uint8_t key[16];
+    dt_lut3d_fingerprint(key, profiles, 2, settings, 2);
+    if(d->nrgb)
+      dt_lut3d_compile(&d->clut, DT_LUT3D_RES, DT_LUT3D_DOMAIN_RGB, key, d->xform_cam_nrgb, d->xform_nrgb_Lab);
+    else
+      dt_lut3d_compile(&d->clut, DT_LUT3D_RES, DT_LUT3D_DOMAIN_RGB, key, d->xform_cam_Lab, NULL);
+  }
+  else dt_lut3d_cleanup(&d->clut);
+
   // now try to initialize unbounded mode:
   // we do a extrapolation for input values above 1.0f.
   // unfortunately we can only do this if we got the computation
@@ -755,6 +777,7 @@ void init_pipe (struct dt_iop_module_t *self, dt_dev_pixelpipe_t *pipe, dt_dev_p
   d->xform_cam_Lab = NULL;
   d->xform_cam_nrgb = NULL;
   d->xform_nrgb_Lab = NULL;
+  memset(&d->clut, 0, sizeof(d->clut));
   d->Lab = dt_colorspaces_create_lab_profile();
   self->commit_params(self, self->default_params, pipe, piece);
 }
@@ -780,6 +803,7 @@ void cleanup_pipe (struct dt_iop_module_t *self, dt_dev_pixelpipe_t *pipe, dt_de
     cmsDeleteTransform(d->xform_nrgb_Lab);
     d->xform_nrgb_Lab = NULL;
   }
+  dt_lut3d_cleanup(&d->clut);
 
   free(piece->data);
   piece->data = NULL;
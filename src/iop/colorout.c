@@ -480,7 +480,8 @@ process (struct dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, void *ivoi
 
       if(!gamutcheck)
       {
-        cmsDoTransform(d->xform, in, out, roi_out->width);
+        if(dt_lut3d_valid(&d->clut)) dt_lut3d_apply(&d->clut, in, out, roi_out->width);
+        else cmsDoTransform(d->xform, in, out, roi_out->width);
       } else {
         void *rgb = dt_alloc_align(16, 4*sizeof(float)*roi_out->width);
         cmsDoTransform(d->xform, in, rgb, roi_out->width);
@@ -668,6 +669,20 @@ void commit_params (struct dt_iop_module_t *self, dt_iop_params_t *p1, dt_dev_pi
     }
   }
 
+  // lcms is slow for lut based profiles, sample the transform into a 3d lut instead (only recompiled
+  // when the profiles change). the gamut check needs the exact transform, as do matrix profiles in
+  // high quality mode.
+  if(d->xform && !(transformFlags & cmsFLAGS_GAMUTCHECK) &&
+     (!cmsIsMatrixShaper(d->output) || (d->softproof && !cmsIsMatrixShaper(d->softproof))))
+  {
+    cmsHPROFILE profiles[2] = { d->output, d->softproof };
+    const int settings[2] = { outintent, transformFlags };
+    uint8_t key[16];
+    dt_lut3d_fingerprint(key, profiles, 2, settings, 2);
+    dt_lut3d_compile(&d->clut, DT_LUT3D_RES, DT_LUT3D_DOMAIN_LAB, key, d->xform, NULL);
+  }
+  else dt_lut3d_cleanup(&d->clut);
+
   // now try to initialize unbounded mode:
   // we do extrapolation for input values above 1.0f.
   // unfortunately we can only do this if we got the computation
@@ -700,6 +715,7 @@ void init_pipe (struct dt_iop_module_t *self, dt_dev_pixelpipe_t *pipe, dt_dev_p
   d->softproof_enabled = 0;
   d->softproof = d->output = NULL;
   d->xform = NULL;
+  memset(&d->clut, 0, sizeof(d->clut));
   d->Lab = dt_colorspaces_create_lab_profile();
   self->commit_params(self, self->default_params, pipe, piece);
 }
@@ -714,6 +730,7 @@ void cleanup_pipe (struct dt_iop_module_t *self, dt_dev_pixelpipe_t *pipe, dt_de
     cmsDeleteTransform(d->xform);
     d->xform = NULL;
   }
+  dt_lut3d_cleanup(&d->clut);
 
   free(piece->data);
   piece->data = NULL;
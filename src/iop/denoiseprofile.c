@@ -23,6 +23,7 @@
 #include "bauhaus/bauhaus.h"
 #include "control/control.h"
 #include "common/noiseprofiles.h"
+#include "common/nlmeans_core.h"
 #include "common/opencl.h"
 #include "gui/accelerators.h"
 #include "gui/presets.h"
@@ -138,7 +139,7 @@ groups ()
 int
 flags ()
 {
-  return IOP_FLAGS_SUPPORTS_BLENDING | IOP_FLAGS_ALLOW_TILING;
+  return IOP_FLAGS_SUPPORTS_BLENDING | IOP_FLAGS_ALLOW_TILING | IOP_FLAGS_TILING_PARALLEL;
 }
 
 typedef union floatint_t
@@ -169,9 +170,11 @@ void tiling_callback  (struct dt_iop_module_t *self, struct dt_dev_pixelpipe_iop
     const int P = ceilf(d->radius * fmin(roi_in->scale, 2.0f) / fmax(piece->iscale, 1.0f)); // pixel filter size
     const int K = ceilf(7 * fmin(roi_in->scale, 2.0f) / fmax(piece->iscale, 1.0f)); // nbhood
 
+    const dt_nlmeans_param_t params = { .patch_radius = P, .search_radius = K };
+
     tiling->factor = 4.0f + 0.25f*NUM_BUCKETS; // in + out + (2 + NUM_BUCKETS * 0.25) tmp
     tiling->maxbuf = 1.0f;
-    tiling->overhead = 0;
+    tiling->overhead = dt_nlmeans_scratch_size(&params);
     tiling->overlap = P+K;
     tiling->xalign = 1;
     tiling->yalign = 1;
@@ -687,9 +690,6 @@ void process_nlmeans(
 
   // P == 0 : this will degenerate to a (fast) bilateral filter.
 
-  float *Sa = dt_alloc_align(64, (size_t)sizeof(float)*roi_out->width*dt_get_num_threads());
-  // we want to sum up weights in col[3], so need to init to 0:
-  memset(ovoid, 0x0, (size_t)sizeof(float)*roi_out->width*roi_out->height*4);
   float *in = dt_alloc_align(64, (size_t)4*sizeof(float)*roi_in->width*roi_in->height);
 
   const float wb[3] =
@@ -712,151 +712,18 @@ void process_nlmeans(
   };
   precondition((float *)ivoid, in, roi_in->width, roi_in->height, aa, bb);
 
-  // for each shift vector
-  for(int kj=-K; kj<=K; kj++)
+  const dt_nlmeans_param_t params =
   {
-    for(int ki=-K; ki<=K; ki++)
-    {
-      // TODO: adaptive K tests here!
-      // TODO: expf eval for real bilateral experience :)
-
-      int inited_slide = 0;
-      // don't construct summed area tables but use sliding window! (applies to cpu version res < 1k only, or else we will add up errors)
-      // do this in parallel with a little threading overhead. could parallelize the outer loops with a bit more memory
-#ifdef _OPENMP
-      #  pragma omp parallel for schedule(static) default(none) firstprivate(inited_slide) shared(kj, ki, roi_out, roi_in, in, ovoid, Sa)
-#endif
-      for(int j=0; j<roi_out->height; j++)
-      {
-        if(j+kj < 0 || j+kj >= roi_out->height) continue;
-        float *S = Sa + dt_get_thread_num() * roi_out->width;
-        const float *ins = in + 4l*((size_t)roi_in->width *(j+kj) + ki);
-        float *out = ((float *)ovoid) + (size_t)4*roi_out->width*j;
-
-        const int Pm = MIN(MIN(P, j+kj), j);
-        const int PM = MIN(MIN(P, roi_out->height-1-j-kj), roi_out->height-1-j);
-        // first line of every thread
-        // TODO: also every once in a while to assert numerical precision!
-        if(!inited_slide)
-        {
-          // sum up a line
-          memset(S, 0x0, sizeof(float)*roi_out->width);
-          for(int jj=-Pm; jj<=PM; jj++)
-          {
-            int i = MAX(0, -ki);
-            float *s = S + i;
-            const float *inp  = in + 4*i + (size_t)4* roi_in->width *(j+jj);
-            const float *inps = in + 4*i +  4l*((size_t)roi_in->width *(j+jj+kj) + ki);
-            const int last = roi_out->width + MIN(0, -ki);
-            for(; i<last; i++, inp+=4, inps+=4, s++)
-            {
-              for(int k=0; k<3; k++)
-                s[0] += (inp[k] - inps[k])*(inp[k] - inps[k]);
-            }
-          }
-          // only reuse this if we had a full stripe
-          if(Pm == P && PM == P) inited_slide = 1;
-        }
+    .patch_radius = P,
+    .search_radius = K,
+    .norm = { 1.0f, 1.0f, 1.0f },
+    // bring the patch distance back to a computable range:
+    .scale = .015f/(2*P+1),
+    .bias = 2.0f
+  };
+  // sums up the weighted neighbours, and the weights in out[3]:
+  dt_nlmeans_denoise(in, (float *)ovoid, roi_out->width, roi_out->height, &params);
 
-        // sliding window for this line:
-        float *s = S;
-        float slide = 0.0f;
-        // sum up the first -P..P
-        for(int i=0; i<2*P+1; i++) slide += s[i];
-        for(int i=0; i<roi_out->width; i++)
-        {
-          // FIXME: the comment above is actually relevant even for 1000 px width already.
-          // XXX    numerical precision will not forgive us:
-          if(i-P > 0 && i+P<roi_out->width)
-            slide += s[P] - s[-P-1];
-          if(i+ki >= 0 && i+ki < roi_out->width)
-          {
-            // TODO: could put that outside the loop.
-            // DEBUG XXX bring back to computable range:
-            const float norm = .015f/(2*P+1);
-            const __m128 iv = { ins[0], ins[1], ins[2], 1.0f };
-            _mm_store_ps(out, _mm_load_ps(out) + iv * _mm_set1_ps(fast_mexp2f(fmaxf(0.0f, slide*norm-2.0f))));
-            // _mm_store_ps(out, _mm_load_ps(out) + iv * _mm_set1_ps(fast_mexp2f(fmaxf(0.0f, slide*norm))));
-          }
-          s   ++;
-          ins += 4;
-          out += 4;
-        }
-        if(inited_slide && j+P+1+MAX(0,kj) < roi_out->height)
-        {
-          // sliding window in j direction:
-          int i = MAX(0, -ki);
-          float *s = S + i;
-          const float *inp  = in + 4*i + 4l* (size_t)roi_in->width *(j+P+1);
-          const float *inps = in + 4*i + 4l*((size_t)roi_in->width *(j+P+1+kj) + ki);
-          const float *inm  = in + 4*i + 4l* (size_t)roi_in->width *(j-P);
-          const float *inms = in + 4*i + 4l*((size_t)roi_in->width *(j-P+kj) + ki);
-          const int last = roi_out->width + MIN(0, -ki);
-          for(; ((intptr_t)s & 0xf) != 0 && i<last; i++, inp+=4, inps+=4, inm+=4, inms+=4, s++)
-          {
-            float stmp = s[0];
-            for(int k=0; k<3; k++)
-              stmp += ((inp[k] - inps[k])*(inp[k] - inps[k])
-                       -  (inm[k] - inms[k])*(inm[k] - inms[k]));
-            s[0] = stmp;
-          }
-          /* Process most of the line 4 pixels at a time */
-          for(; i<last-4; i+=4, inp+=16, inps+=16, inm+=16, inms+=16, s+=4)
-          {
-            __m128 sv = _mm_load_ps(s);
-            const __m128 inp1 = _mm_load_ps(inp)    - _mm_load_ps(inps);
-            const __m128 inp2 = _mm_load_ps(inp+4)  - _mm_load_ps(inps+4);
-            const __m128 inp3 = _mm_load_ps(inp+8)  - _mm_load_ps(inps+8);
-            const __m128 inp4 = _mm_load_ps(inp+12) - _mm_load_ps(inps+12);
-
-            const __m128 inp12lo = _mm_unpacklo_ps(inp1,inp2);
-            const __m128 inp34lo = _mm_unpacklo_ps(inp3,inp4);
-            const __m128 inp12hi = _mm_unpackhi_ps(inp1,inp2);
-            const __m128 inp34hi = _mm_unpackhi_ps(inp3,inp4);
-
-            const __m128 inpv0 = _mm_movelh_ps(inp12lo,inp34lo);
-            sv += inpv0*inpv0;
-
-            const __m128 inpv1 = _mm_movehl_ps(inp34lo,inp12lo);
-            sv += inpv1*inpv1;
-
-            const __m128 inpv2 = _mm_movelh_ps(inp12hi,inp34hi);
-            sv += inpv2*inpv2;
-
-            const __m128 inm1 = _mm_load_ps(inm)    - _mm_load_ps(inms);
-            const __m128 inm2 = _mm_load_ps(inm+4)  - _mm_load_ps(inms+4);
-            const __m128 inm3 = _mm_load_ps(inm+8)  - _mm_load_ps(inms+8);
-            const __m128 inm4 = _mm_load_ps(inm+12) - _mm_load_ps(inms+12);
-
-            const __m128 inm12lo = _mm_unpacklo_ps(inm1,inm2);
-            const __m128 inm34lo = _mm_unpacklo_ps(inm3,inm4);
-            const __m128 inm12hi = _mm_unpackhi_ps(inm1,inm2);
-            const __m128 inm34hi = _mm_unpackhi_ps(inm3,inm4);
-
-            const __m128 inmv0 = _mm_movelh_ps(inm12lo,inm34lo);
-            sv -= inmv0*inmv0;
-
-            const __m128 inmv1 = _mm_movehl_ps(inm34lo,inm12lo);
-            sv -= inmv1*inmv1;
-
-            const __m128 inmv2 = _mm_movelh_ps(inm12hi,inm34hi);
-            sv -= inmv2*inmv2;
-
-            _mm_store_ps(s, sv);
-          }
-          for(; i<last; i++, inp+=4, inps+=4, inm+=4, inms+=4, s++)
-          {
-            float stmp = s[0];
-            for(int k=0; k<3; k++)
-              stmp += ((inp[k] - inps[k])*(inp[k] - inps[k])
-                       -  (inm[k] - inms[k])*(inm[k] - inms[k]));
-            s[0] = stmp;
-          }
-        }
-        else inited_slide = 0;
-      }
-    }
-  }
   // normalize
 #ifdef _OPENMP
   #pragma omp parallel for default(none) schedule(static) shared(ovoid,roi_out,d)
@@ -874,7 +741,6 @@ void process_nlmeans(
     }
   }
   // free shared tmp memory:
-  dt_free_align(Sa);
   dt_free_align(in);
   backtransform((float *)ovoid, roi_in->width, roi_in->height, aa, bb);
 
@@ -115,6 +115,42 @@ typedef struct dt_iop_lensfun_gui_data_t
 }
 dt_iop_lensfun_gui_data_t;
 
+// distortion maps are cached per image size and lens settings, and shared by
+// all pipes: a batch export of a shoot with one lens computes them only once.
+#define DT_IOP_LENSFUN_MAPS 4
+// spacing in pixels of the mesh of precomputed distortion coordinates:
+#define DT_IOP_LENSFUN_MESH_STEP 8
+
+typedef struct dt_iop_lensfun_map_key_t
+{
+  char camera[128];
+  char lens[128];
+  int tca_override;
+  float tca_r, tca_b;
+  float crop;
+  float focal;
+  float aperture;
+  float distance;
+  float scale;
+  lfLensType target_geom;
+  int modify_flags;
+  int inverse;
+  float width, height;
+}
+dt_iop_lensfun_map_key_t;
+
+typedef struct dt_iop_lensfun_map_t
+{
+  dt_iop_lensfun_map_key_t key;
+  lfModifier *modifier;
+  int modflags;
+  int users;
+  dt_pthread_mutex_t lock;  // serializes building the mesh
+  float *mesh;              // 6 coordinates per node (subpixel distortion), NULL until needed
+  int mesh_width, mesh_height;
+}
+dt_iop_lensfun_map_t;
+
 typedef struct dt_iop_lensfun_global_data_t
 {
   lfDatabase *db;
@@ -123,6 +159,8 @@ typedef struct dt_iop_lensfun_global_data_t
   int kernel_lens_distort_lanczos2;
   int kernel_lens_distort_lanczos3;
   int kernel_lens_vignette;
+  dt_pthread_mutex_t maps_lock;
+  GList *maps;              // dt_iop_lensfun_map_t, most recently used first
 }
 dt_iop_lensfun_global_data_t;
 
@@ -137,9 +175,184 @@ typedef struct dt_iop_lensfun_data_t
   float aperture;
   float distance;
   lfLensType target_geom;
+  // what the lens was looked up with, identifies the distortion maps:
+  char camera[128];
+  char lens_name[128];
+  int tca_override;
+  float tca_r, tca_b;
 }
 dt_iop_lensfun_data_t;
 
+static void
+_map_free(dt_iop_lensfun_map_t *m)
+{
+  if(m->modifier) lf_modifier_destroy(m->modifier);
+  dt_free_align(m->mesh);
+  dt_pthread_mutex_destroy(&m->lock);
+  free(m);
+}
+
+static int
+_map_mesh_nodes(const float width, const float height, int *mesh_width, int *mesh_height)
+{
+  // one node beyond the last pixel, so every pixel has four around it:
+  const int w = (int)(width / DT_IOP_LENSFUN_MESH_STEP) + 2;
+  const int h = (int)(height / DT_IOP_LENSFUN_MESH_STEP) + 2;
+  if(mesh_width) *mesh_width = w;
+  if(mesh_height) *mesh_height = h;
+  return w*h;
+}
+
+// evaluates the distortion on the mesh nodes. needs m->lock.
+static void
+_map_build_mesh(dt_iop_lensfun_map_t *m)
+{
+  int mw, mh;
+  const size_t nodes = _map_mesh_nodes(m->key.width, m->key.height, &mw, &mh);
+  float *mesh = (float *)dt_alloc_align(16, nodes*2*3*sizeof(float));
+  if(!mesh) return;
+  lfModifier *modifier = m->modifier;
+#ifdef _OPENMP
+  #pragma omp parallel for default(none) shared(mesh, modifier, mw, mh) schedule(static)
+#endif
+  for(int j = 0; j < mh; j++)
+    for(int i = 0; i < mw; i++)
+      lf_modifier_apply_subpixel_geometry_distortion(
+        modifier, i*DT_IOP_LENSFUN_MESH_STEP, j*DT_IOP_LENSFUN_MESH_STEP, 1, 1, mesh + 2*3*((size_t)j*mw+i));
+  m->mesh_width = mw;
+  m->mesh_height = mh;
+  // readers which don't take the lock must not see the pointer before the contents:
+  __sync_synchronize();
+  m->mesh = mesh;
+}
+
+/** returns the (shared) modifier and distortion map for these settings and image size, with the mesh
+    built if requested. inverse is passed separately, as the point transforms flip it. release with _map_release(). */
+static dt_iop_lensfun_map_t *
+_map_acquire(dt_iop_lensfun_global_data_t *gd, const dt_iop_lensfun_data_t *d, const int inverse,
+             const float width, const float height, const int build_mesh)
+{
+  dt_iop_lensfun_map_key_t key;
+  memset(&key, 0, sizeof(key));
+  g_strlcpy(key.camera, d->camera, sizeof(key.camera));
+  g_strlcpy(key.lens, d->lens_name, sizeof(key.lens));
+  key.tca_override = d->tca_override;
+  key.tca_r = d->tca_r;
+  key.tca_b = d->tca_b;
+  key.crop = d->crop;
+  key.focal = d->focal;
+  key.aperture = d->aperture;
+  key.distance = d->distance;
+  key.scale = d->scale;
+  key.target_geom = d->target_geom;
+  key.modify_flags = d->modify_flags;
+  key.inverse = inverse;
+  key.width = width;
+  key.height = height;
+
+  dt_iop_lensfun_map_t *m = NULL;
+  dt_pthread_mutex_lock(&gd->maps_lock);
+  for(GList *l = gd->maps; l; l = g_list_next(l))
+  {
+    dt_iop_lensfun_map_t *cur = (dt_iop_lensfun_map_t *)l->data;
+    if(!memcmp(&cur->key, &key, sizeof(key)))
+    {
+      m = cur;
+      gd->maps = g_list_delete_link(gd->maps, l);
+      break;
+    }
+  }
+  if(!m)
+  {
+    m = (dt_iop_lensfun_map_t *)calloc(1, sizeof(dt_iop_lensfun_map_t));
+    m->key = key;
+    dt_pthread_mutex_init(&m->lock, NULL);
+    dt_pthread_mutex_lock(&darktable.plugin_threadsafe);
+    m->modifier = lf_modifier_new(d->lens, d->crop, width, height);
+    m->modflags = lf_modifier_initialize(
+                    m->modifier, d->lens, LF_PF_F32,
+                    d->focal, d->aperture,
+                    d->distance, d->scale,
+                    d->target_geom, d->modify_flags, inverse);
+    dt_pthread_mutex_unlock(&darktable.plugin_threadsafe);
+
+    // make room, maps still in use stay:
+    int cnt = g_list_length(gd->maps);
+    for(GList *l = g_list_last(gd->maps); l && cnt >= DT_IOP_LENSFUN_MAPS; cnt--)
+    {
+      GList *prev = g_list_previous(l);
+      dt_iop_lensfun_map_t *old = (dt_iop_lensfun_map_t *)l->data;
+      if(!old->users)
+      {
+        gd->maps = g_list_delete_link(gd->maps, l);
+        _map_free(old);
+      }
+      l = prev;
+    }
+  }
+  m->users++;
+  gd->maps = g_list_prepend(gd->maps, m);
+  dt_pthread_mutex_unlock(&gd->maps_lock);
+
+  if(build_mesh && !m->mesh &&
+     (m->modflags & (LF_MODIFY_TCA | LF_MODIFY_DISTORTION | LF_MODIFY_GEOMETRY | LF_MODIFY_SCALE)))
+  {
+    dt_pthread_mutex_lock(&m->lock);
+    if(!m->mesh) _map_build_mesh(m);
+    dt_pthread_mutex_unlock(&m->lock);
+  }
+  return m;
+}
+
+static void
+_map_release(dt_iop_lensfun_global_data_t *gd, dt_iop_lensfun_map_t *m)
+{
+  dt_pthread_mutex_lock(&gd->maps_lock);
+  m->users--;
+  dt_pthread_mutex_unlock(&gd->maps_lock);
+}
+
+/** subpixel distortion (6 floats per pixel, like lensfun) of width pixels of a row starting at x, y.
+    interpolated bilinearly on the mesh if there is one. */
+static void
+_map_distort_row(const dt_iop_lensfun_map_t *m, const float x, const float y, const int width, float *out)
+{
+  const float *mesh = m->mesh;
+  if(!mesh)
+  {
+    lf_modifier_apply_subpixel_geometry_distortion(m->modifier, x, y, width, 1, out);
+    return;
+  }
+  const int mw = m->mesh_width;
+  const float fy = y / DT_IOP_LENSFUN_MESH_STEP;
+  const int j = CLAMPS((int)floorf(fy), 0, m->mesh_height-2);
+  const float wy = fy - j;
+  const float *row0 = mesh + 2*3*(size_t)j*mw, *row1 = row0 + 2*3*mw;
+  for(int k = 0; k < width; k++, out += 6)
+  {
+    const float fx = (x + k) / DT_IOP_LENSFUN_MESH_STEP;
+    const int i = CLAMPS((int)floorf(fx), 0, mw-2);
+    const float wx = fx - i;
+    const float *t = row0 + 6*i, *b = row1 + 6*i;
+    for(int c = 0; c < 6; c++)
+    {
+      const float top = t[c] + wx*(t[c+6] - t[c]);
+      const float bottom = b[c] + wx*(b[c+6] - b[c]);
+      out[c] = top + wy*(bottom - top);
+    }
+  }
+}
+
+// single points, the mesh only knows the image area:
+static void
+_map_distort_point(const dt_iop_lensfun_map_t *m, const float x, const float y, float *out)
+{
+  if(m->mesh && x >= 0.0f && y >= 0.0f && x <= m->key.width && y <= m->key.height)
+    _map_distort_row(m, x, y, 1, out);
+  else
+    lf_modifier_apply_subpixel_geometry_distortion(m->modifier, x, y, 1, 1, out);
+}
+
 const char*
 name()
 {
@@ -315,6 +528,7 @@ void
 process (dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, const void * const ivoid, void *ovoid, const dt_iop_roi_t * const roi_in, const dt_iop_roi_t * const roi_out)
 {
   dt_iop_lensfun_data_t *d = (dt_iop_lensfun_data_t *)piece->data;
+  dt_iop_lensfun_global_data_t *gd = (dt_iop_lensfun_global_data_t *)self->data;
   dt_iop_lensfun_gui_data_t *g = (dt_iop_lensfun_gui_data_t *)self->gui_data;
 
   const int ch = piece->colors;
@@ -331,15 +545,9 @@ process (dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, const void * cons
 
   const float orig_w = roi_in->scale*piece->iwidth,
               orig_h = roi_in->scale*piece->iheight;
-  dt_pthread_mutex_lock(&darktable.plugin_threadsafe);
-  lfModifier *modifier = lf_modifier_new(d->lens, d->crop, orig_w, orig_h);
-
-  const int modflags = lf_modifier_initialize(
-                         modifier, d->lens, LF_PF_F32,
-                         d->focal, d->aperture,
-                         d->distance, d->scale,
-                         d->target_geom, d->modify_flags, d->inverse);
-  dt_pthread_mutex_unlock(&darktable.plugin_threadsafe);
+  dt_iop_lensfun_map_t *map = _map_acquire(gd, d, d->inverse, orig_w, orig_h, 1);
+  lfModifier *modifier = map->modifier;
+  const int modflags = map->modflags;
 
   const struct dt_interpolation * const interpolation = dt_interpolation_new(DT_INTERPOLATION_USERPREF);
 
@@ -354,13 +562,12 @@ process (dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, const void * cons
       void *buf = dt_alloc_align(16, bufsize*dt_get_num_threads()*sizeof(float));
 
 #ifdef _OPENMP
-      #pragma omp parallel for default(none) shared(buf, modifier, ovoid) schedule(static)
+      #pragma omp parallel for default(none) shared(buf, map, ovoid) schedule(static)
 #endif
       for (int y = 0; y < roi_out->height; y++)
       {
         float *bufptr = ((float *)buf) + (size_t)bufsize*dt_get_thread_num();
-        lf_modifier_apply_subpixel_geometry_distortion(
-          modifier, roi_out->x, roi_out->y+y, roi_out->width, 1, bufptr);
+        _map_distort_row(map, roi_out->x, roi_out->y+y, roi_out->width, bufptr);
 
         // reverse transform the global coords from lf to our buffer
         float *out = ((float *)ovoid) + (size_t)y*roi_out->width*ch;
@@ -444,13 +651,12 @@ process (dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, const void * cons
       void *buf2 = dt_alloc_align(16, buf2size*sizeof(float)*dt_get_num_threads());
 
 #ifdef _OPENMP
-      #pragma omp parallel for default(none) shared(buf2, buf, modifier, ovoid) schedule(static)
+      #pragma omp parallel for default(none) shared(buf2, buf, map, ovoid) schedule(static)
 #endif
       for (int y = 0; y < roi_out->height; y++)
       {
         float *buf2ptr = ((float *)buf2) + (size_t)buf2size*dt_get_thread_num();
-        lf_modifier_apply_subpixel_geometry_distortion (
-          modifier, roi_out->x, roi_out->y+y, roi_out->width, 1, buf2ptr);
+        _map_distort_row(map, roi_out->x, roi_out->y+y, roi_out->width, buf2ptr);
         // reverse transform the global coords from lf to our buffer
         float *out = ((float *)ovoid) + (size_t)y*roi_out->width*ch;
         for (int x = 0; x < roi_out->width; x++,buf2ptr+=6,out+=ch)
@@ -483,7 +689,7 @@ process (dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, const void * cons
       memcpy(ovoid, buf, bufsize);
     }
   }
-  lf_modifier_destroy(modifier);
+  _map_release(gd, map);
 
   if(g != NULL && self->dev->gui_attached && piece->pipe->type == DT_DEV_PIXELPIPE_PREVIEW)
   {
@@ -504,7 +710,7 @@ process_cl (struct dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, cl_mem
   cl_int err = -999;
 
   float *tmpbuf = NULL;
-  lfModifier *modifier = NULL;
+  dt_iop_lensfun_map_t *map = NULL;
 
   const int devid = piece->pipe->devid;
   const int iwidth = roi_in->width;
@@ -567,15 +773,9 @@ process_cl (struct dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, cl_mem
   dev_tmpbuf = dt_opencl_alloc_device_buffer(devid, tmpbuflen);
   if(dev_tmpbuf == NULL) goto error;
 
-  dt_pthread_mutex_lock(&darktable.plugin_threadsafe);
-  modifier = lf_modifier_new(d->lens, d->crop, orig_w, orig_h);
-
-  int modflags = lf_modifier_initialize(
-                   modifier, d->lens, LF_PF_F32,
-                   d->focal, d->aperture,
-                   d->distance, d->scale,
-                   d->target_geom, d->modify_flags, d->inverse);
-  dt_pthread_mutex_unlock(&darktable.plugin_threadsafe);
+  map = _map_acquire(gd, d, d->inverse, orig_w, orig_h, 1);
+  lfModifier *modifier = map->modifier;
+  const int modflags = map->modflags;
 
   if(d->inverse)
   {
@@ -584,13 +784,12 @@ process_cl (struct dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, cl_mem
                    LF_MODIFY_GEOMETRY | LF_MODIFY_SCALE))
     {
 #ifdef _OPENMP
-      #pragma omp parallel for default(none) shared(roi_out, roi_in, tmpbuf, d, modifier) schedule(static)
+      #pragma omp parallel for default(none) shared(roi_out, roi_in, tmpbuf, d, map) schedule(static)
 #endif
       for (int y = 0; y < roi_out->height; y++)
       {
         float *pi = tmpbuf + (size_t)y * tmpbufwidth;
-        lf_modifier_apply_subpixel_geometry_distortion (
-          modifier, roi_out->x, roi_out->y+y, roi_out->width, 1, pi);
+        _map_distort_row(map, roi_out->x, roi_out->y+y, roi_out->width, pi);
       }
 
       /* _blocking_ memory transfer: host tmpbuf buffer -> opencl dev_tmpbuf */
@@ -692,13 +891,12 @@ process_cl (struct dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, cl_mem
                    LF_MODIFY_GEOMETRY | LF_MODIFY_SCALE))
     {
 #ifdef _OPENMP
-      #pragma omp parallel for default(none) shared(roi_out, roi_in, tmpbuf, d, modifier) schedule(static)
+      #pragma omp parallel for default(none) shared(roi_out, roi_in, tmpbuf, d, map) schedule(static)
 #endif
       for (int y = 0; y < roi_out->height; y++)
       {
         float *pi = tmpbuf + (size_t)y * tmpbufwidth;
-        lf_modifier_apply_subpixel_geometry_distortion (
-          modifier, roi_out->x, roi_out->y+y, roi_out->width, 1, pi);
+        _map_distort_row(map, roi_out->x, roi_out->y+y, roi_out->width, pi);
       }
 
       /* _blocking_ memory transfer: host tmpbuf buffer -> opencl dev_tmpbuf */
@@ -733,14 +931,14 @@ process_cl (struct dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, cl_mem
   dt_opencl_release_mem_object(dev_tmpbuf);
   dt_opencl_release_mem_object(dev_tmp);
   if (tmpbuf != NULL) dt_free_align(tmpbuf);
-  if (modifier != NULL) lf_modifier_destroy(modifier);
+  if (map != NULL) _map_release(gd, map);
   return TRUE;
 
 error:
   if (dev_tmp != NULL) dt_opencl_release_mem_object(dev_tmp);
   if (dev_tmpbuf != NULL) dt_opencl_release_mem_object(dev_tmpbuf);
   if (tmpbuf != NULL) dt_free_align(tmpbuf);
-  if (modifier != NULL) lf_modifier_destroy(modifier);
+  if (map != NULL) _map_release(gd, map);
   dt_print(DT_DEBUG_OPENCL, "[opencl_lens] couldn't enqueue kernel! %d\n", err);
   return FALSE;
 }
@@ -760,59 +958,51 @@ void tiling_callback (struct dt_iop_module_t *self, struct dt_dev_pixelpipe_iop_
 int distort_transform(dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, float *points, size_t points_count)
 {
   dt_iop_lensfun_data_t *d = (dt_iop_lensfun_data_t *)piece->data;
+  dt_iop_lensfun_global_data_t *gd = (dt_iop_lensfun_global_data_t *)self->data;
 
   if(!d->lens || !d->lens->Maker || d->crop <= 0.0f) return 0;
 
   const float orig_w = piece->iwidth, orig_h = piece->iheight;
-  lfModifier *modifier = lf_modifier_new(d->lens, d->crop, orig_w, orig_h);
-
-  int modflags = lf_modifier_initialize(
-                   modifier, d->lens, LF_PF_F32,
-                   d->focal, d->aperture,
-                   d->distance, d->scale,
-                   d->target_geom, d->modify_flags, !d->inverse);
-  float *buf = malloc(2*3*sizeof(float));
+  // a few points are cheaper to compute directly than the mesh:
+  const int build_mesh = points_count >= (size_t)_map_mesh_nodes(orig_w, orig_h, NULL, NULL);
+  dt_iop_lensfun_map_t *map = _map_acquire(gd, d, !d->inverse, orig_w, orig_h, build_mesh);
+  float buf[2*3];
 
   for (size_t i=0; i<points_count*2; i+=2)
   {
-    if (modflags & (LF_MODIFY_TCA | LF_MODIFY_DISTORTION | LF_MODIFY_GEOMETRY | LF_MODIFY_SCALE))
+    if (map->modflags & (LF_MODIFY_TCA | LF_MODIFY_DISTORTION | LF_MODIFY_GEOMETRY | LF_MODIFY_SCALE))
     {
-      lf_modifier_apply_subpixel_geometry_distortion (modifier, points[i], points[i+1], 1, 1, buf);
+      _map_distort_point(map, points[i], points[i+1], buf);
       points[i] = buf[0];
       points[i+1] = buf[3];
     }
   }
-  free(buf);
-  lf_modifier_destroy(modifier);
+  _map_release(gd, map);
 
   return 1;
 }
 int distort_backtransform(dt_iop_module_t *self, dt_dev_pixelpipe_iop_t *piece, float *points, size_t points_count)
 {
   dt_iop_lensfun_data_t *d = (dt_iop_lensfun_data_t *)piece->data;
+  dt_iop_lensfun_global_data_t *gd = (dt_iop_lensfun_global_data_t *)self->data;
   if(!d->lens || !d->lens->Maker || d->crop <= 0.0f) return 0;
 
   const float orig_w = piece->iwidth, orig_h = piece->iheight;
-  lfModifier *modifier = lf_modifier_new(d->lens, d->crop, orig_w, orig_h);
-
-  int modflags = lf_modifier_initialize(
-                   modifier, d->lens, LF_PF_F32,
-                   d->focal, d->aperture,
-                   d->distance, d->scale,
-                   d->target_geom, d->modify_flags, d->inverse);
-  float *buf = malloc(2*3*sizeof(float));
+  // a few points are cheaper to compute directly than the mesh:
+  const int build_mesh = points_count >= (size_t)_map_mesh_nodes(orig_w, orig_h, NULL, NULL);
+  dt_iop_lensfun_map_t *map = _map_acquire(gd, d, d->inverse, orig_w, orig_h, build_mesh);
+  float buf[2*3];
 
   for (size_t i=0; i<points_count*2; i+=2)
   {
-    if (modflags & (LF_MODIFY_TCA | LF_MODIFY_DISTORTION | LF_MODIFY_GEOMETRY | LF_MODIFY_SCALE))
+    if (map->modflags & (LF_MODIFY_TCA | LF_MODIFY_DISTORTION | LF_MODIFY_GEOMETRY | LF_MODIFY_SCALE))
     {
-      lf_modifier_apply_subpixel_geometry_distortion (modifier, points[i], points[i+1], 1, 1, buf);
+      _map_distort_point(map, points[i], points[i+1], buf);
       points[i] = buf[0];
       points[i+1] = buf[3];
     }
   }
-  free(buf);
-  lf_modifier_destroy(modifier);
+  _map_release(gd, map);
   return 1;
 }
 
@@ -824,6 +1014,7 @@ void modify_roi_out(struct dt_iop_module_t *self, struct dt_dev_pixelpipe_iop_t
 void modify_roi_in(struct dt_iop_module_t *self, struct dt_dev_pixelpipe_iop_t *piece, const dt_iop_roi_t * const roi_out, dt_iop_roi_t *roi_in)
 {
   dt_iop_lensfun_data_t *d = (dt_iop_lensfun_data_t *)piece->data;
+  dt_iop_lensfun_global_data_t *gd = (dt_iop_lensfun_global_data_t *)self->data;
   *roi_in = *roi_out;
   // inverse transform with given params
 
@@ -831,17 +1022,12 @@ void modify_roi_in(struct dt_iop_module_t *self, struct dt_dev_pixelpipe_iop_t *
 
   const float orig_w = roi_in->scale*piece->iwidth,
               orig_h = roi_in->scale*piece->iheight;
-  lfModifier *modifier = lf_modifier_new(d->lens, d->crop, orig_w, orig_h);
+  // the same map process() will use:
+  dt_iop_lensfun_map_t *map = _map_acquire(gd, d, d->inverse, orig_w, orig_h, 1);
 
   float xm = INFINITY, xM = - INFINITY, ym = INFINITY, yM = - INFINITY;
 
-  int modflags = lf_modifier_initialize(
-                   modifier, d->lens, LF_PF_F32,
-                   d->focal, d->aperture,
-                   d->distance, d->scale,
-                   d->target_geom, d->modify_flags, d->inverse);
-
-  if(modflags & (LF_MODIFY_TCA | LF_MODIFY_DISTORTION |
+  if(map->modflags & (LF_MODIFY_TCA | LF_MODIFY_DISTORTION |
                  LF_MODIFY_GEOMETRY | LF_MODIFY_SCALE))
   {
     // acquire temp memory for distorted pixel coords
@@ -850,7 +1036,7 @@ void modify_roi_in(struct dt_iop_module_t *self, struct dt_dev_pixelpipe_iop_t *
 #if defined(_OPENMP) && __GNUC_PREREQ(4,7)
     void *buf = dt_alloc_align(16, bufsize*dt_get_num_threads()*sizeof(float));
 
-    #pragma omp parallel for default(none) shared(buf, modifier) reduction(min: xm, ym) reduction(max: xM, yM) schedule(static)
+    #pragma omp parallel for default(none) shared(buf, map) reduction(min: xm, ym) reduction(max: xM, yM) schedule(static)
 #else
     void *buf = dt_alloc_align(16, bufsize*sizeof(float));
 #endif
@@ -858,8 +1044,7 @@ void modify_roi_in(struct dt_iop_module_t *self, struct dt_dev_pixelpipe_iop_t *
     {
       float *bufptr = ((float *)buf) + (size_t)bufsize*dt_get_thread_num();
 
-      lf_modifier_apply_subpixel_geometry_distortion(
-        modifier, roi_out->x, roi_out->y+y, roi_out->width, 1, bufptr);
+      _map_distort_row(map, roi_out->x, roi_out->y+y, roi_out->width, bufptr);
 
       // reverse transform the global coords from lf to our buffer
       for (int x = 0; x < roi_out->width; x++)
@@ -881,7 +1066,7 @@ void modify_roi_in(struct dt_iop_module_t *self, struct dt_dev_pixelpipe_iop_t *
     roi_in->width = fminf(orig_w-roi_in->x, xM - roi_in->x + interpolation->width);
     roi_in->height = fminf(orig_h-roi_in->y, yM - roi_in->y + interpolation->width);
   }
-  lf_modifier_destroy(modifier);
+  _map_release(gd, map);
 }
 
 void commit_params (struct dt_iop_module_t *self, dt_iop_params_t *p1, dt_dev_pixelpipe_t *pipe, dt_dev_pixelpipe_iop_t *piece)
@@ -961,6 +1146,11 @@ void commit_params (struct dt_iop_module_t *self, dt_iop_params_t *p1, dt_dev_pi
   d->aperture     = p->aperture;
   d->distance     = p->distance;
   d->target_geom  = p->target_geom;
+  g_strlcpy(d->camera, p->camera, sizeof(d->camera));
+  g_strlcpy(d->lens_name, p->lens, sizeof(d->lens_name));
+  d->tca_override = p->tca_override;
+  d->tca_r        = p->tca_r;
+  d->tca_b        = p->tca_b;
 #endif
 }
 
@@ -1000,6 +1190,8 @@ void init_global(dt_iop_module_so_t *module)
   gd->kernel_lens_distort_lanczos2 = dt_opencl_create_kernel(program, "lens_distort_lanczos2");
   gd->kernel_lens_distort_lanczos3 = dt_opencl_create_kernel(program, "lens_distort_lanczos3");
   gd->kernel_lens_vignette = dt_opencl_create_kernel(program, "lens_vignette");
+  dt_pthread_mutex_init(&gd->maps_lock, NULL);
+  gd->maps = NULL;
 
   lfDatabase *dt_iop_lensfun_db = lf_db_new();
   gd->db = (void *)dt_iop_lensfun_db;
@@ -1110,6 +1302,8 @@ void cleanup_global(dt_iop_module_so_t *module)
   dt_opencl_free_kernel(gd->kernel_lens_distort_lanczos2);
   dt_opencl_free_kernel(gd->kernel_lens_distort_lanczos3);
   dt_opencl_free_kernel(gd->kernel_lens_vignette);
+  g_list_free_full(gd->maps, (GDestroyNotify)_map_free);
+  dt_pthread_mutex_destroy(&gd->maps_lock);
   free(module->data);
   module->data = NULL;
 }
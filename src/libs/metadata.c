@@ -199,7 +199,7 @@ static gboolean expose(GtkWidget *widget, GdkEventExpose *event, gpointer user_d
 static void clear_button_clicked(GtkButton *button, gpointer user_data)
 {
   dt_metadata_clear(-1);
-  dt_image_synch_xmp(-1);
+  dt_image_synch_xmp_deferred(-1);
   update(user_data, FALSE);
 }
 
@@ -236,7 +236,7 @@ static void write_metadata(dt_lib_module_t *self)
   g_free(creator);
   g_free(publisher);
 
-  dt_image_synch_xmp(mouse_over_id);
+  dt_image_synch_xmp_deferred(mouse_over_id);
   update(self, FALSE);
 }
 
@@ -536,7 +536,7 @@ int set_params(dt_lib_module_t *self, const void *params, int size)
   if(publisher != NULL && publisher[0] != '\0')
     dt_metadata_set(-1, "Xmp.dc.publisher", publisher);
 
-  dt_image_synch_xmp(-1);
+  dt_image_synch_xmp_deferred(-1);
   update(self, FALSE);
   return 0;
 }
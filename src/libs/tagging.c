@@ -175,7 +175,7 @@ attach_selected_tag(dt_lib_module_t *self, dt_lib_tagging_t *d)
   imgsel = dt_view_get_image_to_act_on();
 
   dt_tag_attach(tagid,imgsel);
-  dt_image_synch_xmp(imgsel);
+  dt_image_synch_xmp_deferred(imgsel);
 
   dt_control_signal_raise(darktable.signals, DT_SIGNAL_TAG_CHANGED);
 }
@@ -199,7 +199,7 @@ detach_selected_tag(dt_lib_module_t *self, dt_lib_tagging_t *d)
   imgsel = dt_view_get_image_to_act_on();
 
   dt_tag_detach(tagid,imgsel);
-  dt_image_synch_xmp(imgsel);
+  dt_image_synch_xmp_deferred(imgsel);
 
   dt_control_signal_raise(darktable.signals, DT_SIGNAL_TAG_CHANGED);
 }
@@ -248,8 +248,10 @@ new_button_clicked (GtkButton *button, gpointer user_data)
   const gchar *tag = gtk_entry_get_text(d->entry);
 
   /** attach tag to selected images  */
+  const gboolean transaction = dt_database_try_start_transaction(darktable.db);
   dt_tag_attach_string_list(tag, -1);
-  dt_image_synch_xmp(-1);
+  if(transaction) dt_database_release_transaction(darktable.db);
+  dt_image_synch_xmp_deferred(-1);
 
   update(self, 1);
   update(self, 0);
@@ -269,8 +271,10 @@ entry_activated (GtkButton *button, gpointer user_data)
   if(!tag || tag[0] == '\0') return;
 
   /** attach tag to selected images  */
+  const gboolean transaction = dt_database_try_start_transaction(darktable.db);
   dt_tag_attach_string_list(tag, -1);
-  dt_image_synch_xmp(-1);
+  if(transaction) dt_database_release_transaction(darktable.db);
+  dt_image_synch_xmp_deferred(-1);
 
   update(self, 1);
   update(self, 0);
@@ -338,16 +342,8 @@ delete_button_clicked (GtkButton *button, gpointer user_data)
 
   dt_tag_remove(tagid,TRUE);
 
-  GList *list_iter;
-  if((list_iter = g_list_first(tagged_images)) != NULL)
-  {
-    do
-    {
-      dt_image_synch_xmp(GPOINTER_TO_INT(list_iter->data));
-    }
-    while((list_iter=g_list_next(list_iter)) != NULL);
-  }
-  g_list_free(g_list_first(tagged_images));
+  dt_image_synch_xmps_deferred(tagged_images);
+  g_list_free(tagged_images);
 
   update(self, 0);
   update(self, 1);
@@ -543,23 +539,14 @@ _lib_tagging_tag_key_press(GtkWidget *entry, GdkEventKey *event, dt_lib_module_t
       if(d->floating_tag_imgid > 0) // just a single image
       {
         dt_tag_attach_string_list(tag, d->floating_tag_imgid);
-        dt_image_synch_xmp(d->floating_tag_imgid);
+        dt_image_synch_xmp_deferred(d->floating_tag_imgid);
       }
       else // all selected images
       {
-        GList *selected_images = g_list_first(dt_collection_get_selected(darktable.collection, -1));
-        if(selected_images)
-        {
-          GList *iter = selected_images;
-          do
-          {
-            int imgid = GPOINTER_TO_INT(iter->data);
-            dt_tag_attach_string_list(tag, imgid);
-            dt_image_synch_xmp(imgid);
-          }
-          while( (iter=g_list_next(iter)) !=NULL );
-        }
-        g_list_free(selected_images);
+        const gboolean transaction = dt_database_try_start_transaction(darktable.db);
+        dt_tag_attach_string_list(tag, -1);
+        if(transaction) dt_database_release_transaction(darktable.db);
+        dt_image_synch_xmp_deferred(-1);
       }
       update(self, 1);
       update(self, 0);
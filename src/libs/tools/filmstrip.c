@@ -54,6 +54,7 @@ typedef struct dt_lib_filmstrip_t
   int32_t last_selected_id;
   int32_t mouse_over_id;
   int32_t offset;
+  int32_t prefetch_offset; // offset at the last prefetch, to know the scroll direction
   int32_t collection_count;
   int32_t history_copy_imgid;
   gdouble pointerx,pointery;
@@ -332,6 +333,7 @@ void gui_init(dt_lib_module_t *self)
 {
   /* initialize ui widgets */
   dt_lib_filmstrip_t *d = (dt_lib_filmstrip_t *)calloc(1, sizeof(dt_lib_filmstrip_t));
+  d->prefetch_offset = -1;
   self->data = (void *)d;
 
   d->last_selected_id = -1;
@@ -799,6 +801,15 @@ failure:
   cairo_restore(cr);
   sqlite3_finalize(stmt);
 
+  /* generate the thumbnails the user is scrolling towards */
+  if(offset != strip->prefetch_offset)
+  {
+    const int direction = offset > strip->prefetch_offset ? 1 : -1;
+    dt_view_prefetch_thumbnails(offset - max_cols/2, max_cols, direction,
+                                dt_mipmap_cache_get_matching_size(darktable.mipmap_cache, wd, ht));
+    strip->prefetch_offset = offset;
+  }
+
   if(darktable.gui->center_tooltip == 1) // set in this round
   {
     char* tooltip = dt_history_get_items_as_string(strip->mouse_over_id);
@@ -18,10 +18,15 @@
 
 
 #define DT_UNIT_TEST
+#define _DEFAULT_SOURCE
 // define dt alloc, so we don't need to include the rest of dt:
 #define dt_alloc_align(A, B) malloc(B)
+#define dt_free_align(A) free(A)
+#define g_usleep(A) usleep(A)
 #define MAX(a, b) ((a) > (b) ? (a) : (b))
 
+#include <unistd.h>
+
 // unit test for the concurrent hopscotch hashmap and the LRU cache built on top of it.
 #include "common/cache.h"
 #include "common/cache.c"
@@ -29,6 +34,7 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <assert.h>
+#include <string.h>
 #ifdef _OPENMP
 #  include <omp.h>
 #endif
@@ -42,6 +48,60 @@ alloc_dummy(void *data, const uint32_t key, int32_t *cost, void **buf)
   return 0;
 }
 
+static double
+get_time()
+{
+#ifdef _OPENMP
+  return omp_get_wtime();
+#else
+  return 0.0;
+#endif
+}
+
+// contention benchmark: all threads hammer a small set of hot keys which are always
+// in the cache, like the thumbnails on screen in the lighttable. reports the throughput
+// of read_get/read_release pairs for an increasing number of threads.
+static void
+benchmark(const int hot, const int max_threads)
+{
+  const int rounds = 1000000;
+  dt_cache_t cache;
+  dt_cache_init(&cache, 4*hot, 16, 64, 4*hot);
+  dt_cache_set_allocate_callback(&cache, alloc_dummy, NULL);
+  for(int k=1; k<=hot; k++)
+  {
+    dt_cache_read_get(&cache, k);
+    dt_cache_read_release(&cache, k);
+  }
+
+  for(int threads=1; threads<=max_threads; threads*=2)
+  {
+    const double start = get_time();
+#ifdef _OPENMP
+    #  pragma omp parallel for default(none) schedule(static) shared(cache, threads, hot, rounds) num_threads(threads)
+#endif
+    for(int k=0; k<rounds*threads; k++)
+    {
+      // cheap per-iteration pseudo random key:
+      const uint32_t key = 1 + (((uint32_t)k * 2654435761u) >> 8) % hot;
+      const int val = (int)(long int)dt_cache_read_get(&cache, key);
+      assert(val == key);
+      (void)val;
+      dt_cache_read_release(&cache, key);
+    }
+    const double end = get_time();
+    const double mops = rounds*threads/(end - start)/1e6;
+    fprintf(stderr, "[bench] %3d hot keys %2d threads: %7.2f Mops/s total, %6.2f Mops/s per thread\n",
+            hot, threads, mops, mops/threads);
+  }
+
+  const int size = dt_cache_size(&cache);
+  assert(size == hot);
+  assert(lru_check_consistency(&cache) == size);
+  (void)size;
+  dt_cache_cleanup(&cache);
+}
+
 int main(int argc, char *arg[])
 {
   dt_cache_t cache;
@@ -124,6 +184,19 @@ int main(int argc, char *arg[])
     dt_cache_cleanup(&cache2);
   }
 
+  // only run the benchmark if asked to, it takes a while:
+  if(argc > 1 && !strcmp(arg[1], "--bench"))
+  {
+#ifdef _OPENMP
+    const int max_threads = argc > 2 ? atoi(arg[2]) : omp_get_num_procs();
+#else
+    const int max_threads = 1;
+#endif
+    benchmark(1, max_threads);
+    benchmark(64, max_threads);
+    benchmark(4096, max_threads);
+  }
+
   exit(0);
 }
 // modelines: These editor modelines have been set for all relevant files by tools/update_modelines.sh
@@ -0,0 +1,162 @@
+/*
+    This file is part of darktable,
+    copyright (c) 2026 agent.
+
+    darktable is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    darktable is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with darktable.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#define _DEFAULT_SOURCE
+#include <stdlib.h>
+#include <stdio.h>
+#include <string.h>
+#include <math.h>
+
+// compares streamed (strip by strip) and full buffer export. the pipe is a small model of the roi machinery:
+// every module asks its predecessor for the rows it needs, plus a halo if it has one. a module without
+// IOP_FLAGS_ALLOW_TILING looks at its whole input (here: auto levels), so it has to make the export fall
+// back to the full buffer, like _export_can_stream() in common/imageio.c does.
+
+#define IOP_FLAGS_ALLOW_TILING (1<<4)
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
+
+#define WD 64
+#define HT 200
+
+typedef struct module_t
+{
+  const char *name;
+  int flags;
+  int halo;
+  // processes rows [offset, offset+rows) of the input region of in_rows rows.
+  void (*process)(const float *in, float *out, const int width, const int in_rows, const int offset,
+                  const int rows);
+}
+module_t;
+
+static void blur_process(const float *in, float *out, const int width, const int in_rows, const int offset,
+                         const int rows)
+{
+  for(int j=0; j<rows; j++) for(int i=0; i<width; i++)
+  {
+    float sum = 0.0f;
+    for(int jj=-1; jj<=1; jj++) for(int ii=-1; ii<=1; ii++)
+    {
+      const int y = MIN(MAX(j + offset + jj, 0), in_rows-1);
+      const int x = MIN(MAX(i + ii, 0), width-1);
+      sum += in[width*y + x];
+    }
+    out[width*j + i] = sum/9.0f;
+  }
+}
+
+static void levels_process(const float *in, float *out, const int width, const int in_rows, const int offset,
+                           const int rows)
+{
+  float min = INFINITY, max = -INFINITY;
+  for(int k=0; k<width*in_rows; k++)
+  {
+    min = fminf(min, in[k]);
+    max = fmaxf(max, in[k]);
+  }
+  for(int k=0; k<width*rows; k++) out[k] = (in[width*offset + k] - min)/fmaxf(max - min, 1e-6f);
+}
+
+static const module_t blur = { "blur", IOP_FLAGS_ALLOW_TILING, 1, blur_process };
+static const module_t levels = { "levels", 0, 0, levels_process };
+
+// output rows [y, y+rows) of the last of the n modules.
+static void pipe_rows(const module_t **m, const int n, const float *image, const int y, const int rows,
+                      float *out)
+{
+  if(n == 0)
+  {
+    memcpy(out, image + (size_t)WD*y, sizeof(float)*WD*rows);
+    return;
+  }
+  const module_t *mod = m[n-1];
+  const int y0 = MAX(0, y - mod->halo), y1 = MIN(HT, y + rows + mod->halo);
+  float *in = malloc(sizeof(float)*WD*(y1 - y0));
+  pipe_rows(m, n-1, image, y0, y1 - y0, in);
+  mod->process(in, out, WD, y1 - y0, y - y0, rows);
+  free(in);
+}
+
+static int can_stream(const module_t **m, const int n)
+{
+  for(int k=0; k<n; k++)
+    if(!(m[k]->flags & IOP_FLAGS_ALLOW_TILING)) return 0;
+  return 1;
+}
+
+static void export_strips(const module_t **m, const int n, const float *image, const int strip, float *out)
+{
+  for(int y=0; y<HT; y+=strip)
+    pipe_rows(m, n, image, y, MIN(strip, HT - y), out + (size_t)WD*y);
+}
+
+static void export(const module_t **m, const int n, const float *image, const int strip, float *out)
+{
+  if(can_stream(m, n)) export_strips(m, n, image, strip, out);
+  else pipe_rows(m, n, image, 0, HT, out);
+}
+
+static float max_diff(const float *a, const float *b)
+{
+  float d = 0.0f;
+  for(int k=0; k<WD*HT; k++) d = fmaxf(d, fabsf(a[k] - b[k]));
+  return d;
+}
+
+static int test(const char *name, const module_t **m, const int n, const float *image)
+{
+  float *full = malloc(sizeof(float)*WD*HT);
+  float *strips = malloc(sizeof(float)*WD*HT);
+  float *exported = malloc(sizeof(float)*WD*HT);
+  pipe_rows(m, n, image, 0, HT, full);
+  export_strips(m, n, image, 16, strips);
+  export(m, n, image, 16, exported);
+  const float strip_diff = max_diff(full, strips), export_diff = max_diff(full, exported);
+  // strips of a module which needs the whole image have to differ, or this test doesn't show anything:
+  const int fail = export_diff > 0.0f || (can_stream(m, n) ? strip_diff > 0.0f : strip_diff < 1e-3f);
+  fprintf(stderr, "[%s] %s, max diff of strips %g, of export %g: %s\n", name,
+          can_stream(m, n) ? "streaming" : "full buffer", strip_diff, export_diff, fail ? "FAILED" : "ok");
+  free(full);
+  free(strips);
+  free(exported);
+  return fail;
+}
+
+int main(int argc, char *arg[])
+{
+  // a ramp from top to bottom with some noise, so every strip has different statistics:
+  float *image = malloc(sizeof(float)*WD*HT);
+  srand(42);
+  for(int j=0; j<HT; j++) for(int i=0; i<WD; i++)
+    image[WD*j + i] = j/(float)HT + 0.05f*rand()/(float)RAND_MAX;
+
+  int fail = 0;
+  const module_t *local[] = { &blur, &blur };
+  fail |= test("blur, blur", local, 2, image);
+  const module_t *global[] = { &blur, &levels, &blur };
+  fail |= test("blur, levels, blur", global, 3, image);
+
+  free(image);
+  exit(fail);
+}
+
+// modelines: These editor modelines have been set for all relevant files by tools/update_modelines.sh
+// vim: shiftwidth=2 expandtab tabstop=2 cindent
+// kate: tab-indents: off; indent-width 2; replace-tabs on; indent-mode cstyle; remove-trailing-space on;
@@ -0,0 +1,145 @@
+/*
+    This file is part of darktable,
+    copyright (c) 2026 agent.
+
+    darktable is free software: you can redistribute it and/or modify
+    it under the terms of the GNU General Public License as published by
+    the Free Software Foundation, either version 3 of the License, or
+    (at your option) any later version.
+
+    darktable is distributed in the hope that it will be useful,
+    but WITHOUT ANY WARRANTY; without even the implied warranty of
+    MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+    GNU General Public License for more details.
+
+    You should have received a copy of the GNU General Public License
+    along with darktable.  If not, see <http://www.gnu.org/licenses/>.
+*/
+
+
+#define DT_UNIT_TEST
+#define _DEFAULT_SOURCE
+#include <stdlib.h>
+// define dt alloc, so we don't need to include the rest of dt:
+static inline void *dt_alloc_align(size_t alignment, size_t size)
+{
+  void *ptr = NULL;
+  if(posix_memalign(&ptr, alignment, size)) return NULL;
+  return ptr;
+}
+#define dt_free_align(A) free(A)
+
+// accuracy test of the 3d luts of colorin/colorout against the lcms2 transforms they replace.
+#include "common/lut3d.h"
+#include "common/lut3d.c"
+
+#include <stdio.h>
+#include <math.h>
+
+#define NUM_SAMPLES 100000
+
+// compiles xform, converts random samples of the domain both ways and compares the Lab results.
+static int test(const char *name, cmsHTRANSFORM xform, const dt_lut3d_domain_t domain, const float max_mean,
+                const float max_max)
+{
+  dt_lut3d_t lut = {0};
+  uint8_t key[16] = {0};
+  if(dt_lut3d_compile(&lut, DT_LUT3D_RES, domain, key, xform, NULL))
+  {
+    fprintf(stderr, "[%s] could not compile lut\n", name);
+    return 1;
+  }
+  float *in = dt_alloc_align(16, 4*sizeof(float)*NUM_SAMPLES);
+  float *ref = dt_alloc_align(16, 4*sizeof(float)*NUM_SAMPLES);
+  float *out = dt_alloc_align(16, 4*sizeof(float)*NUM_SAMPLES);
+  srand(42);
+  for(int k=0; k<NUM_SAMPLES; k++)
+  {
+    for(int c=0; c<3; c++)
+    {
+      const float r = rand()/(float)RAND_MAX;
+      if(domain == DT_LUT3D_DOMAIN_RGB) in[4*k+c] = r;
+      else in[4*k+c] = c ? 255.0f*r - 128.0f : 100.0f*r;
+    }
+    in[4*k+3] = k;
+  }
+  cmsDoTransform(xform, in, ref, NUM_SAMPLES);
+  dt_lut3d_apply(&lut, in, out, NUM_SAMPLES);
+
+  double sum = 0.0, max = 0.0;
+  int alpha = 0;
+  for(int k=0; k<NUM_SAMPLES; k++)
+  {
+    float dE = 0.0f;
+    for(int c=0; c<3; c++) dE += (ref[4*k+c] - out[4*k+c])*(ref[4*k+c] - out[4*k+c]);
+    dE = sqrtf(dE);
+    sum += dE;
+    max = fmax(max, dE);
+    if(out[4*k+3] != in[4*k+3]) alpha++;
+  }
+  const double mean = sum/NUM_SAMPLES;
+  const int fail = !(mean <= max_mean && max <= max_max) || alpha;
+  fprintf(stderr, "[%s] mean dE %f max dE %f, %d wrong alpha values: %s\n", name, mean, max, alpha,
+          fail ? "FAILED" : "ok");
+  dt_free_align(in);
+  dt_free_align(ref);
+  dt_free_align(out);
+  dt_lut3d_cleanup(&lut);
+  return fail;
+}
+
+// NaN input has to end up at the lower end of the domain, like any other input below it.
+static int test_nan(const char *name, cmsHTRANSFORM xform, const dt_lut3d_domain_t domain)
+{
+  dt_lut3d_t lut = {0};
+  uint8_t key[16] = {0};
+  if(dt_lut3d_compile(&lut, DT_LUT3D_RES, domain, key, xform, NULL))
+  {
+    fprintf(stderr, "[%s] could not compile lut\n", name);
+    return 1;
+  }
+  float in[8] __attribute__((aligned(16))) = { NAN, NAN, NAN, 1.0f, -1e30f, -1e30f, -1e30f, 1.0f };
+  float out[8] __attribute__((aligned(16)));
+  dt_lut3d_apply(&lut, in, out, 2);
+  int fail = 0;
+  for(int c=0; c<4; c++) if(!(out[c] == out[4+c])) fail = 1;
+  fprintf(stderr, "[%s] NaN input: %s\n", name, fail ? "FAILED" : "ok");
+  dt_lut3d_cleanup(&lut);
+  return fail;
+}
+
+int main(int argc, char *arg[])
+{
+  int fail = 0;
+  cmsHPROFILE srgb = cmsCreate_sRGBProfile();
+  cmsHPROFILE lab = cmsCreateLab4Profile(NULL);
+  // a real lut based profile, as camera or printer profiles are:
+  cmsHPROFILE abstract = cmsCreateBCHSWabstractProfile(33, 5.0, 10.0, 20.0, 15.0, 0, 0);
+
+  // input profile: rgb -> Lab
+  cmsHTRANSFORM xform = cmsCreateTransform(srgb, TYPE_RGBA_FLT, lab, TYPE_LabA_FLT, INTENT_PERCEPTUAL, 0);
+  fail |= test("srgb -> Lab", xform, DT_LUT3D_DOMAIN_RGB, 0.1f, 1.0f);
+  fail |= test_nan("srgb -> Lab", xform, DT_LUT3D_DOMAIN_RGB);
+  cmsDeleteTransform(xform);
+
+  cmsHPROFILE chain[3] = { srgb, abstract, lab };
+  xform = cmsCreateMultiprofileTransform(chain, 3, TYPE_RGBA_FLT, TYPE_LabA_FLT, INTENT_PERCEPTUAL, 0);
+  fail |= test("srgb -> abstract -> Lab", xform, DT_LUT3D_DOMAIN_RGB, 0.25f, 2.0f);
+  cmsDeleteTransform(xform);
+
+  // output profile: Lab -> Lab through the clut of the abstract profile
+  cmsHPROFILE chain2[3] = { lab, abstract, lab };
+  xform = cmsCreateMultiprofileTransform(chain2, 3, TYPE_LabA_FLT, TYPE_LabA_FLT, INTENT_PERCEPTUAL, 0);
+  fail |= test("Lab -> abstract -> Lab", xform, DT_LUT3D_DOMAIN_LAB, 0.25f, 2.0f);
+  fail |= test_nan("Lab -> abstract -> Lab", xform, DT_LUT3D_DOMAIN_LAB);
+  cmsDeleteTransform(xform);
+
+  cmsCloseProfile(abstract);
+  cmsCloseProfile(lab);
+  cmsCloseProfile(srgb);
+  exit(fail);
+}
+
+// modelines: These editor modelines have been set for all relevant files by tools/update_modelines.sh
+// vim: shiftwidth=2 expandtab tabstop=2 cindent
+// kate: tab-indents: off; indent-width 2; replace-tabs on; indent-mode cstyle; remove-trailing-space on;
@@ -173,6 +173,8 @@ void expose(dt_view_t *self, cairo_t *cri, int32_t width_i, int32_t height_i, in
   }
   cairo_surface_t *surface;
   cairo_t *cr = cairo_create(image_surface);
+  // showing the coarse first pass of progressive rendering?
+  int coarse = 0;
 
   // adjust scroll bars
   {
@@ -189,11 +191,17 @@ void expose(dt_view_t *self, cairo_t *cri, int32_t width_i, int32_t height_i, in
     dt_pthread_mutex_lock(mutex);
     wd = dev->pipe->backbuf_width;
     ht = dev->pipe->backbuf_height;
+    // the coarse pass is scaled up to where the full one will be:
+    float upscale = 1.0f;
+    if(dev->pipe->backbuf_scale > 0.0f)
+      upscale = dt_dev_get_zoom_scale(dev, zoom, 1, 0) / dev->pipe->backbuf_scale;
+    coarse = upscale > 1.5f;
+    if(!coarse) upscale = 1.0f;
     stride = cairo_format_stride_for_width (CAIRO_FORMAT_RGB24, wd);
     surface = cairo_image_surface_create_for_data (dev->pipe->backbuf, CAIRO_FORMAT_RGB24, wd, ht, stride);
     cairo_set_source_rgb (cr, .2, .2, .2);
     cairo_paint(cr);
-    cairo_translate(cr, .5f*(width-wd), .5f*(height-ht));
+    cairo_translate(cr, .5f*(width-wd*upscale), .5f*(height-ht*upscale));
     if(closeup)
     {
       const float closeup_scale = 2.0;
@@ -203,13 +211,14 @@ void expose(dt_view_t *self, cairo_t *cri, int32_t width_i, int32_t height_i, in
       dt_dev_check_zoom_bounds(dev, &zx1, &zy1, zoom, 1, &boxw, &boxh);
       dt_dev_check_zoom_bounds(dev, &zxm, &zym, zoom, 1, &boxw, &boxh);
       const float fx = 1.0 - fmaxf(0.0, (zx0 - zx1)/(zx0 - zxm)), fy = 1.0 - fmaxf(0.0, (zy0 - zy1)/(zy0 - zym));
-      cairo_translate(cr, -wd/(2.0*closeup_scale) * fx, -ht/(2.0*closeup_scale) * fy);
+      cairo_translate(cr, -wd*upscale/(2.0*closeup_scale) * fx, -ht*upscale/(2.0*closeup_scale) * fy);
     }
+    cairo_scale(cr, upscale, upscale);
     cairo_rectangle(cr, 0, 0, wd, ht);
     cairo_set_source_surface (cr, surface, 0, 0);
-    cairo_pattern_set_filter(cairo_get_source(cr), CAIRO_FILTER_FAST);
+    cairo_pattern_set_filter(cairo_get_source(cr), coarse ? CAIRO_FILTER_GOOD : CAIRO_FILTER_FAST);
     cairo_fill_preserve(cr);
-    cairo_set_line_width(cr, 1.0);
+    cairo_set_line_width(cr, 1.0/upscale);
     cairo_set_source_rgb (cr, .3, .3, .3);
     cairo_stroke(cr);
     cairo_surface_destroy (surface);
@@ -254,7 +263,7 @@ void expose(dt_view_t *self, cairo_t *cri, int32_t width_i, int32_t height_i, in
   }
 
   /* check if we should create a snapshot of view */
-  if(darktable.develop->proxy.snapshot.request && !darktable.develop->image_loading)
+  if(darktable.develop->proxy.snapshot.request && !darktable.develop->image_loading && !coarse)
   {
     /* reset the request */
     darktable.develop->proxy.snapshot.request = FALSE;
@@ -86,6 +86,7 @@ typedef struct dt_library_t
   uint32_t modifiers;
   uint32_t center, pan;
   int32_t track, offset, first_visible_zoomable, first_visible_filemanager;
+  int32_t prefetch_offset; // offset at the last prefetch, to know the scroll direction
   float zoom_x, zoom_y;
   dt_view_image_over_t image_over;
   int full_preview;
@@ -791,37 +792,13 @@ after_drawing:
   /* check if offset was changed and we need to prefetch thumbs */
   if (offset_changed)
   {
-    int32_t imgids_num = 0;
-    const int prefetchrows = .5*max_rows+1;
-    int32_t imgids[prefetchrows*iir];
-
-    /* clear and reset main query */
-    DT_DEBUG_SQLITE3_CLEAR_BINDINGS(lib->statements.main_query);
-    DT_DEBUG_SQLITE3_RESET(lib->statements.main_query);
-
-    /* setup offest and row for prefetch */
-    DT_DEBUG_SQLITE3_BIND_INT(lib->statements.main_query, 1, offset + max_rows*iir);
-    DT_DEBUG_SQLITE3_BIND_INT(lib->statements.main_query, 2, prefetchrows*iir);
-
-    // prefetch jobs in inverse order: supersede previous jobs: most important last
-    while(sqlite3_step(lib->statements.main_query) == SQLITE_ROW && imgids_num < prefetchrows*iir)
-      imgids[imgids_num++] = sqlite3_column_int(lib->statements.main_query, 0);
-
     float imgwd = iir == 1 ? 0.97 : 0.8;
     dt_mipmap_size_t mip = dt_mipmap_cache_get_matching_size(
                              darktable.mipmap_cache,
                              imgwd*wd, imgwd*(iir==1?height:ht));
-    while(imgids_num > 0)
-    {
-      imgids_num --;
-      dt_mipmap_buffer_t buf;
-      dt_mipmap_cache_read_get(
-        darktable.mipmap_cache,
-        &buf,
-        imgids[imgids_num],
-        mip,
-        DT_MIPMAP_PREFETCH);
-    }
+    const int direction = offset > lib->prefetch_offset ? 1 : (offset < lib->prefetch_offset ? -1 : 0);
+    dt_view_prefetch_thumbnails(offset, max_rows*iir, direction, mip);
+    lib->prefetch_offset = offset;
   }
 
   free(query_ids);
@@ -1168,7 +1145,8 @@ void expose_full_preview(dt_view_t *self, cairo_t *cr, int32_t width, int32_t he
           &lib->full_res_thumb,
           &lib->full_res_thumb_wd,
           &lib->full_res_thumb_ht,
-          &lib->full_res_thumb_orientation))
+          &lib->full_res_thumb_orientation,
+          0, 0))
         lib->full_res_thumb_id = lib->full_preview_id;
 
       if(lib->full_res_thumb_id == lib->full_preview_id)
@@ -1400,6 +1400,51 @@ void dt_view_filmstrip_prefetch()
   sqlite3_finalize(stmt);
 }
 
+void dt_view_prefetch_thumbnails(const int offset_in, const int count_in, const int direction, const dt_mipmap_size_t mip)
+{
+  // the view may start before the first image of the collection:
+  const int offset = MAX(offset_in, 0);
+  const int count = count_in - (offset - offset_in);
+  const gchar *qin = dt_collection_get_query (darktable.collection);
+  if(!qin || count <= 0) return;
+
+  // look further ahead in scroll direction, keep a bit behind for scrolling back:
+  const int after  = direction > 0 ? 2*count : direction < 0 ? count/2 : count;
+  const int before = direction < 0 ? 2*count : direction > 0 ? count/2 : count;
+  const int first = MAX(0, offset - before);
+  const int num_before = offset - first;
+
+  uint32_t *ids = (uint32_t *)malloc(sizeof(uint32_t)*(num_before + count + after));
+  uint32_t *order = (uint32_t *)malloc(sizeof(uint32_t)*(num_before + after));
+  if(!ids || !order) goto cleanup;
+
+  sqlite3_stmt *stmt;
+  int num = 0;
+  DT_DEBUG_SQLITE3_PREPARE_V2(dt_database_get(darktable.db), qin, -1, &stmt, NULL);
+  DT_DEBUG_SQLITE3_BIND_INT(stmt, 1, first);
+  DT_DEBUG_SQLITE3_BIND_INT(stmt, 2, num_before + count + after);
+  while(sqlite3_step(stmt) == SQLITE_ROW && num < num_before + count + after)
+    ids[num++] = sqlite3_column_int(stmt, 0);
+  sqlite3_finalize(stmt);
+
+  // the visible ones are requested by the view itself. order the rest by distance
+  // to the view, in scroll direction first (or alternating if not scrolling):
+  const int num_after = MAX(0, num - num_before - count);
+  int i = 0, b = 0, a = 0;
+  while(b < num_before || a < num_after)
+  {
+    const int take_after = a < num_after &&
+                           (b >= num_before || direction > 0 || (direction == 0 && a <= b));
+    if(take_after) order[i++] = ids[num_before + count + a++];
+    else order[i++] = ids[num_before - 1 - b++];
+  }
+  dt_mipmap_cache_prefetch(darktable.mipmap_cache, order, i, mip);
+
+cleanup:
+  free(ids);
+  free(order);
+}
+
 void dt_view_manager_view_toolbox_add(dt_view_manager_t *vm,GtkWidget *tool)
 {
   if (vm->proxy.view_toolbox.module)
@@ -21,6 +21,7 @@
 #define DT_VIEW_H
 
 #include "common/image.h"
+#include "common/mipmap_cache.h"
 #ifdef HAVE_MAP
 #include "osm-gps-map-source.h"
 #endif
@@ -337,6 +338,10 @@ void dt_view_filmstrip_set_active_image(dt_view_manager_t *vm,int iid);
     TODO: move to control ?
 */
 void dt_view_filmstrip_prefetch();
+/** generate thumbnails of level mip around the visible part [offset, offset+count) of
+    the current collection ahead of display, more of them in scroll direction (-1, 0, 1).
+    replaces all requests of earlier calls. */
+void dt_view_prefetch_thumbnails(const int offset, const int count, const int direction, const dt_mipmap_size_t mip);
 
 /*
  * Map View Proxy